@@ -0,0 +1,244 @@
+// Measure the distribution of a frame to N subscribers by PiCameraManager::onFrame():
+// the publish latency on the capture thread, the wake-up latency of the readers (from
+// the start of onFrame() to the return of waitForReady()), and the copies and bytes per
+// frame. The readers do what sendMjpeg does before the send: wait, lock, and copy the
+// frame out. Synthetic frames are published at a fixed rate by PiPacer, like a replayed
+// source, so a change of the distribution layer can be compared run by run.
+//
+//  delivered  frames read / (frames * subscribers), the readers which were still busy
+//             with the previous frame missed the signal of a frame
+//  lock_tmo   PiFrame::lock(3) timed out in onFrame() or in a reader, the frame wasn't
+//             copied. The lock is held for a copy, so it is 0 unless a holder stalls.
+//  copies     copies of a frame by onFrame(): the cached latest frame and the PiFrames
+//  missed     deadlines of the pacer which onFrame() overran
+//
+//  $ bench/bench_dispatch [frames] [fps] [subscribers,...] [frame_size,...]
+//
+// Only the manager and PiFrame are linked. The sources of PiCameraSource.cc and the
+// defaults of RaspiCamControl.c, and MMAL with them, are replaced by the stubs below,
+// and the headers of the manager don't need MMAL either.
+
+#include "PiCameraManager.h"
+#include "PiFrame.h"
+#include "PiPacer.h"
+#include "PiBuffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <algorithm>
+#include <vector>
+
+// Publish times of the recent frames by the sequence, longer than a reader lags behind
+#define PUBLISH_RING 4096
+
+static int64_t gPublishedNs[PUBLISH_RING];
+static volatile bool gStop = false;
+
+static int64_t wall_nsec() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// A source which publishes nothing. The frames come from main() through onFrame().
+class IdleSource : public PiFrameSource {
+public:
+    PiCameraStats stats() const {
+        return PiCameraStats();
+    }
+};
+
+// PiCamSettings sets the defaults of the camera parameters, which a source without the camera
+// ignores. They stay zero, as PiCameraParams creates them.
+extern "C" void raspicamcontrol_set_defaults(RASPICAM_CAMERA_PARAMETERS* params) {
+}
+
+PiFrameSource* PiCameraManager::createSource(const PiCamSettings& settings, int* status) {
+    *status = 0;
+    return new IdleSource();
+}
+
+class BenchManager : public PiCameraManager {
+public:
+    BenchManager(const PiCamSettings& settings) : PiCameraManager(settings) {}
+
+    void publish(const DinamicBuffer& buffer) {
+        static_cast<PiCameraListener*>(this)->onFrame(buffer);
+    }
+};
+
+struct Reader {
+    PiFrame* frame;
+    pthread_t thread;
+    StaticBuffer out;
+    uint64_t frames;
+    uint64_t lock_failures;
+    std::vector<int64_t> wake_ns;
+};
+
+static void* read_frames(void* arg) {
+    Reader* reader = static_cast<Reader*>(arg);
+    PiFrame* frame = reader->frame;
+    uint64_t last = 0;
+    while (!gStop) {
+        if (frame->waitForReady(1) != 0 || gStop) {
+            continue;
+        }
+        const int64_t woken = wall_nsec();
+        if (frame->lock(3) != 0) {
+            reader->lock_failures++;
+            continue;
+        }
+        const uint64_t sequence = frame->sequence;
+        if (reader->out.alloc_size < frame->length && reader->out.realloc(frame->length) != 0) {
+            frame->unlock();
+            continue;
+        }
+        if (sequence != last) {
+            memcpy(reader->out.values, frame->buffer, frame->length);
+            reader->frames++;
+            reader->wake_ns.push_back(woken - __atomic_load_n(&gPublishedNs[sequence % PUBLISH_RING], __ATOMIC_ACQUIRE));
+            last = sequence;
+        }
+        frame->unlock();
+    }
+    return NULL;
+}
+
+static double percentile_us(std::vector<int64_t>& samples, double p) {
+    if (samples.empty()) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (samples.size() - 1));
+    std::nth_element(samples.begin(), samples.begin() + i, samples.end());
+    return samples[i] / 1000.0;
+}
+
+static int run(int frames, int fps, int subscribers, size_t frame_size) {
+    PiCamSettings settings;
+    settings.fps = fps;
+    BenchManager manager(settings);
+
+    std::vector<Reader> readers(subscribers);
+    for (int i = 0; i < subscribers; i++) {
+        readers[i].frame = manager.attach();
+        readers[i].frames = 0;
+        readers[i].lock_failures = 0;
+        readers[i].wake_ns.reserve(frames);
+        if (readers[i].frame == NULL) {
+            fprintf(stderr, "attach failed\n");
+            return ENOMEM;
+        }
+    }
+    gStop = false;
+    for (int i = 0; i < subscribers; i++) {
+        if (pthread_create(&readers[i].thread, NULL, read_frames, &readers[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            return EAGAIN;
+        }
+    }
+
+    // A JPEG-like payload, onFrame() doesn't parse it.
+    DinamicBuffer buffer;
+    std::vector<uint8_t> payload(frame_size);
+    for (size_t i = 0; i < frame_size; i++) {
+        payload[i] = (uint8_t)(i * 131 + 7);
+    }
+    payload[0] = 0xff; payload[1] = 0xd8;
+    payload[frame_size - 2] = 0xff; payload[frame_size - 1] = 0xd9;
+    buffer.append(&payload[0], frame_size);
+
+    std::vector<int64_t> publish_ns;
+    publish_ns.reserve(frames);
+    uint64_t copies = 0;
+    uint64_t publisher_lock_failures = 0;
+
+    PiPacer pacer;
+    pacer.start(fps);
+    for (int n = 1; n <= frames && pacer.wait(); n++) {
+        // The manager numbers the frames from 1, like this loop.
+        const int64_t start = wall_nsec();
+        __atomic_store_n(&gPublishedNs[n % PUBLISH_RING], start, __ATOMIC_RELEASE);
+        manager.publish(buffer);
+        publish_ns.push_back(wall_nsec() - start);
+
+        // The sequence of a PiFrame is written by this thread in onFrame().
+        copies++; // the latest frame
+        for (int i = 0; i < subscribers; i++) {
+            if (readers[i].frame->sequence == (uint64_t)n) {
+                copies++;
+            } else {
+                publisher_lock_failures++;
+            }
+        }
+    }
+
+    gStop = true;
+    for (int i = 0; i < subscribers; i++) {
+        readers[i].frame->sendReadySignal();
+    }
+    uint64_t read = 0;
+    uint64_t lock_failures = publisher_lock_failures;
+    std::vector<int64_t> wake_ns;
+    for (int i = 0; i < subscribers; i++) {
+        pthread_join(readers[i].thread, NULL);
+        read += readers[i].frames;
+        lock_failures += readers[i].lock_failures;
+        wake_ns.insert(wake_ns.end(), readers[i].wake_ns.begin(), readers[i].wake_ns.end());
+        manager.detach(readers[i].frame);
+    }
+
+    const PiPacerStats pacing = pacer.stats();
+    const double published = publish_ns.size();
+    const double copies_per_frame = copies / published;
+    const double reads_per_frame = read / published;
+    printf("%5d %8lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %8.1f%% %9llu %7.1f %9.2f %7llu\n",
+            subscribers, (unsigned long)frame_size,
+            percentile_us(publish_ns, 0.5), percentile_us(publish_ns, 0.99), percentile_us(publish_ns, 1.0),
+            percentile_us(wake_ns, 0.5), percentile_us(wake_ns, 0.99), percentile_us(wake_ns, 1.0),
+            100.0 * read / (published * subscribers), (unsigned long long)lock_failures,
+            copies_per_frame, (copies_per_frame + reads_per_frame) * frame_size / (1024.0 * 1024.0),
+            (unsigned long long)pacing.missed);
+    return 0;
+}
+
+static std::vector<long> parse_list(const char* arg, const char* defaults) {
+    std::vector<long> values;
+    const char* p = arg ? arg : defaults;
+    while (*p) {
+        char* end;
+        long v = strtol(p, &end, 10);
+        if (end == p || v <= 0) {
+            break;
+        }
+        values.push_back(v);
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return values;
+}
+
+int main(int argc, char** argv) {
+    int frames = (argc > 1) ? atoi(argv[1]) : 120;
+    int fps = (argc > 2) ? atoi(argv[2]) : 60;
+    if (frames <= 0) frames = 120;
+    if (fps <= 0) fps = 60;
+    std::vector<long> subscribers = parse_list(argc > 3 ? argv[3] : NULL, "1,10,50,100,500");
+    std::vector<long> sizes = parse_list(argc > 4 ? argv[4] : NULL, "16384,65536,262144");
+
+    printf("%d frames at %d fps, latencies in usec, MB copied per frame by onFrame() and the readers\n",
+            frames, fps);
+    printf("%5s %8s %9s %9s %9s %9s %9s %9s %9s %9s %7s %9s %7s\n", "subs", "bytes",
+            "pub_p50", "pub_p99", "pub_max", "wake_p50", "wake_p99", "wake_max",
+            "delivered", "lock_tmo", "copies", "MB/frame", "missed");
+    for (size_t s = 0; s < sizes.size(); s++) {
+        for (size_t i = 0; i < subscribers.size(); i++) {
+            if (run(frames, fps, subscribers[i], sizes[s]) != 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
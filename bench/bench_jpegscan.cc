@@ -0,0 +1,141 @@
+// Measure the cpu cost of PiJpegScan per frame: the 0xFF search of findMarker() against
+// the scalar loop over a whole frame, validate(), and findFrame() in a stream.
+//
+//  $ bench/bench_jpegscan [iterations]
+
+#include "PiJpegScan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <jpeglib.h>
+
+static uint64_t cpu_nsec() {
+    timespec t;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// Encode a synthetic frame which has both smooth areas and edges like a camera image.
+static int make_source(int width, int height, int quality, unsigned char** out, unsigned long* out_size) {
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+
+    *out = NULL;
+    *out_size = 0;
+    jpeg_mem_dest(&cinfo, out, out_size);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    unsigned char* row = (unsigned char*)malloc(width * 3);
+    unsigned int seed = 1;
+    while (cinfo.next_scanline < cinfo.image_height) {
+        int y = cinfo.next_scanline;
+        for (int x = 0; x < width; x++) {
+            seed = seed * 1103515245 + 12345;
+            int noise = (seed >> 16) & 0x0f;
+            bool edge = ((x / 40) + (y / 40)) & 1;
+            row[x * 3 + 0] = (unsigned char)((x * 255 / width) + noise);
+            row[x * 3 + 1] = (unsigned char)((y * 255 / height) + noise);
+            row[x * 3 + 2] = (unsigned char)(edge ? 200 : 40);
+        }
+        JSAMPROW rows[1] = { row };
+        jpeg_write_scanlines(&cinfo, rows, 1);
+    }
+    free(row);
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return 0;
+}
+
+typedef size_t (*FindFunc)(const uint8_t* data, size_t size, size_t from);
+
+// Visit every 0xFF of the frame, as validate() does in the entropy-coded data
+static size_t count_markers(FindFunc find, const uint8_t* data, size_t size) {
+    size_t count = 0;
+    for (size_t pos = find(data, size, 0); pos < size; pos = find(data, size, pos + 1)) {
+        count++;
+    }
+    return count;
+}
+
+static double us_per_frame(uint64_t nsec, int iterations) {
+    return nsec / 1000.0 / iterations;
+}
+
+int main(int argc, char** argv) {
+    int iterations = (argc > 1) ? atoi(argv[1]) : 2000;
+    if (iterations <= 0) iterations = 2000;
+
+    const int sizes[][2] = { {640, 480}, {1280, 720}, {1920, 1080} };
+
+    printf("findMarker: %s\n", PiJpegScan::implementation());
+    printf("%-10s %10s %8s %12s %12s %12s %12s\n", "source", "src_bytes", "markers",
+            "scalar_us", "simd_us", "validate_us", "stream_us");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        unsigned char* src = NULL;
+        unsigned long src_size = 0;
+        make_source(sizes[i][0], sizes[i][1], 85, &src, &src_size);
+
+        PiJpegInfo info;
+        if (PiJpegScan::validate(src, src_size, &info) != 0 || info.width != sizes[i][0] ||
+                info.height != sizes[i][1] || info.length != src_size) {
+            fprintf(stderr, "validate failed\n");
+            return 1;
+        }
+        size_t markers = count_markers(PiJpegScan::findMarkerScalar, src, src_size);
+        if (count_markers(PiJpegScan::findMarker, src, src_size) != markers) {
+            fprintf(stderr, "findMarker differs from the scalar loop\n");
+            return 1;
+        }
+
+        // A stream of a frame between garbage, ex) a dump which starts in the middle of a frame
+        std::vector<uint8_t> stream(src + src_size / 2, src + src_size);
+        stream.insert(stream.end(), src, src + src_size);
+        stream.insert(stream.end(), src, src + 1000);
+        size_t begin = 0;
+        size_t end = 0;
+        if (PiJpegScan::findFrame(&stream[0], stream.size(), &begin, &end, NULL) != 0 ||
+                end - begin != src_size) {
+            fprintf(stderr, "findFrame failed\n");
+            return 1;
+        }
+
+        volatile size_t sink = 0;
+        uint64_t t0 = cpu_nsec();
+        for (int n = 0; n < iterations; n++) {
+            sink += count_markers(PiJpegScan::findMarkerScalar, src, src_size);
+        }
+        uint64_t t1 = cpu_nsec();
+        for (int n = 0; n < iterations; n++) {
+            sink += count_markers(PiJpegScan::findMarker, src, src_size);
+        }
+        uint64_t t2 = cpu_nsec();
+        for (int n = 0; n < iterations; n++) {
+            sink += PiJpegScan::validate(src, src_size, &info);
+        }
+        uint64_t t3 = cpu_nsec();
+        for (int n = 0; n < iterations; n++) {
+            sink += PiJpegScan::findFrame(&stream[0], stream.size(), &begin, &end, NULL);
+        }
+        uint64_t t4 = cpu_nsec();
+
+        char name[32];
+        snprintf(name, sizeof(name), "%dx%d", sizes[i][0], sizes[i][1]);
+        printf("%-10s %10lu %8lu %12.2f %12.2f %12.2f %12.2f\n", name, src_size, (unsigned long)markers,
+                us_per_frame(t1 - t0, iterations), us_per_frame(t2 - t1, iterations),
+                us_per_frame(t3 - t2, iterations), us_per_frame(t4 - t3, iterations));
+        free(src);
+    }
+    return 0;
+}
@@ -0,0 +1,320 @@
+// Compare the cost of delivering frames to N clients with the thread per client
+// path (select + 2 sends per client, like sendMjpeg) and with one io_uring batch
+// per frame (like PiBroadcaster). Clients are TCP loopback sockets drained by reader threads.
+// cpu/delivery counts the sending threads only, not the io-wq workers of the kernel.
+//
+//  $ bench/bench_send [clients] [frame_size] [frames]
+
+#include "PiUring.h"
+#include "PiBuffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <vector>
+
+static uint64_t thread_cpu_nsec() {
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static uint64_t wall_nsec() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// Connect 'n' TCP loopback pairs. senders[i] is the server side of readers[i].
+static int make_connections(int n, std::vector<int>& senders, std::vector<int>& readers) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (listener < 0 || bind(listener, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+            listen(listener, n) < 0 || getsockname(listener, (sockaddr*)&addr, &len) < 0) {
+        perror("listener");
+        return errno;
+    }
+
+    for (int i = 0; i < n; i++) {
+        int r = socket(AF_INET, SOCK_STREAM, 0);
+        if (r < 0 || connect(r, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("connect");
+            return errno;
+        }
+        int s = accept(listener, NULL, NULL);
+        if (s < 0) {
+            perror("accept");
+            return errno;
+        }
+        readers.push_back(r);
+        senders.push_back(s);
+    }
+    close(listener);
+    return 0;
+}
+
+static void* run_reader(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    static const size_t SIZE = 256 * 1024;
+    char* buf = (char*)malloc(SIZE);
+    while (read(fd, buf, SIZE) > 0) {
+    }
+    free(buf);
+    return NULL;
+}
+
+struct Shared {
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    pthread_cond_t done;
+    uint64_t sequence;
+    int remaining;
+    bool stop;
+    const uint8_t* frame;
+    size_t frame_size;
+    uint64_t syscalls;
+    uint64_t cpu_nsec;
+};
+
+struct Sender {
+    Shared* shared;
+    int socket;
+};
+
+// Same steps as sendMjpeg(): wake up, copy the frame, select, send header, send body.
+static void* run_sender(void* arg) {
+    Sender* self = static_cast<Sender*>(arg);
+    Shared* shared = self->shared;
+    StaticBuffer tmp;
+    tmp.realloc(shared->frame_size);
+    uint64_t seen = 0;
+    uint64_t syscalls = 0;
+    uint64_t start = thread_cpu_nsec();
+
+    for (;;) {
+        pthread_mutex_lock(&shared->mutex);
+        while (!shared->stop && shared->sequence == seen) {
+            pthread_cond_wait(&shared->ready, &shared->mutex);
+        }
+        if (shared->stop) {
+            pthread_mutex_unlock(&shared->mutex);
+            break;
+        }
+        seen = shared->sequence;
+        pthread_mutex_unlock(&shared->mutex);
+
+        memcpy(tmp.values, shared->frame, shared->frame_size);
+
+        char header[128];
+        int header_length = snprintf(header, sizeof(header),
+                "\r\n--boundary\r\nContent-Type: image/jpeg\r\nContent-Length: %lu\r\n\r\n",
+                (unsigned long)shared->frame_size);
+
+        fd_set writefds;
+        FD_ZERO(&writefds);
+        FD_SET(self->socket, &writefds);
+        timeval t = { 10, 0 };
+        select(self->socket + 1, NULL, &writefds, NULL, &t);
+        send(self->socket, header, header_length, 0);
+        send(self->socket, tmp.values, shared->frame_size, 0);
+        syscalls += 3;
+
+        pthread_mutex_lock(&shared->mutex);
+        if (--shared->remaining == 0) {
+            pthread_cond_signal(&shared->done);
+        }
+        pthread_mutex_unlock(&shared->mutex);
+    }
+
+    pthread_mutex_lock(&shared->mutex);
+    shared->syscalls += syscalls;
+    shared->cpu_nsec += thread_cpu_nsec() - start;
+    pthread_mutex_unlock(&shared->mutex);
+    return NULL;
+}
+
+static void report(const char* mode, int clients, int frames, uint64_t syscalls, uint64_t cpu_nsec, uint64_t wall) {
+    uint64_t deliveries = (uint64_t)clients * frames;
+    printf("%-7s clients=%3d syscalls/frame=%7.1f cpu/delivery=%6.1fus wall/frame=%7.1fus\n",
+            mode, clients, (double)syscalls / frames, (double)cpu_nsec / deliveries / 1000.0,
+            (double)wall / frames / 1000.0);
+}
+
+static int bench_thread(const std::vector<int>& sockets, const uint8_t* frame, size_t frame_size, int frames) {
+    Shared shared;
+    pthread_mutex_init(&shared.mutex, NULL);
+    pthread_cond_init(&shared.ready, NULL);
+    pthread_cond_init(&shared.done, NULL);
+    shared.sequence = 0;
+    shared.remaining = 0;
+    shared.stop = false;
+    shared.frame = frame;
+    shared.frame_size = frame_size;
+    shared.syscalls = 0;
+    shared.cpu_nsec = 0;
+
+    const int n = sockets.size();
+    std::vector<Sender> senders(n);
+    std::vector<pthread_t> threads(n);
+    for (int i = 0; i < n; i++) {
+        senders[i].shared = &shared;
+        senders[i].socket = sockets[i];
+        pthread_create(&threads[i], NULL, run_sender, &senders[i]);
+    }
+
+    uint64_t start = wall_nsec();
+    uint64_t cpu_start = thread_cpu_nsec();
+    for (int f = 0; f < frames; f++) {
+        // One broadcast per frame, like PiFrame::sendReadySignal() for every client
+        pthread_mutex_lock(&shared.mutex);
+        shared.remaining = n;
+        shared.sequence++;
+        pthread_cond_broadcast(&shared.ready);
+        while (shared.remaining > 0) {
+            pthread_cond_wait(&shared.done, &shared.mutex);
+        }
+        pthread_mutex_unlock(&shared.mutex);
+    }
+    uint64_t publisher_cpu = thread_cpu_nsec() - cpu_start;
+    uint64_t wall = wall_nsec() - start;
+
+    pthread_mutex_lock(&shared.mutex);
+    shared.stop = true;
+    pthread_cond_broadcast(&shared.ready);
+    pthread_mutex_unlock(&shared.mutex);
+    for (int i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    report("thread", n, frames, shared.syscalls, shared.cpu_nsec + publisher_cpu, wall);
+    return 0;
+}
+
+static int bench_uring(const std::vector<int>& sockets, const uint8_t* frame, size_t frame_size, int frames) {
+    const int n = sockets.size();
+    int status;
+    PiUring uring(n < 16 ? 16 : n, &status);
+    if (status) {
+        fprintf(stderr, "io_uring is not available err=%d\n", status);
+        return status;
+    }
+
+    StaticBuffer slot;
+    slot.realloc(128 + frame_size);
+    iovec iov = { slot.values, slot.alloc_size };
+    bool fixed = (uring.registerBuffers(&iov, 1) == 0);
+
+    std::vector<size_t> offsets(n);
+    std::vector<PiUring::Completion> completions;
+    uint64_t start = wall_nsec();
+    uint64_t cpu_start = thread_cpu_nsec();
+
+    for (int f = 0; f < frames; f++) {
+        // Copy once for all clients, with the multipart header in front
+        int header_length = snprintf((char*)slot.values, 128,
+                "\r\n--boundary\r\nContent-Type: image/jpeg\r\nContent-Length: %lu\r\n\r\n",
+                (unsigned long)frame_size);
+        memcpy(slot.values + header_length, frame, frame_size);
+        size_t length = header_length + frame_size;
+
+        for (int i = 0; i < n; i++) {
+            offsets[i] = 0;
+            if (fixed) {
+                uring.prepareWriteFixed(sockets[i], slot.values, length, 0, i);
+            } else {
+                uring.prepareSend(sockets[i], slot.values, length, i);
+            }
+        }
+
+        int remaining = n;
+        uring.submit(0);
+        while (remaining > 0) {
+            uring.submit(1);
+            completions.clear();
+            uring.reap(completions);
+            for (size_t c = 0; c < completions.size(); c++) {
+                int i = (int)completions[c].user_data;
+                if (completions[c].result <= 0) {
+                    fprintf(stderr, "send failed err=%d\n", -completions[c].result);
+                    return EIO;
+                }
+                offsets[i] += completions[c].result;
+                if (offsets[i] < length) {
+                    // Short write, same as the reaper of PiBroadcaster
+                    if (fixed) {
+                        uring.prepareWriteFixed(sockets[i], slot.values + offsets[i], length - offsets[i], 0, i);
+                    } else {
+                        uring.prepareSend(sockets[i], slot.values + offsets[i], length - offsets[i], i);
+                    }
+                } else {
+                    remaining--;
+                }
+            }
+        }
+    }
+
+    uint64_t cpu = thread_cpu_nsec() - cpu_start;
+    uint64_t wall = wall_nsec() - start;
+    report(fixed ? "uring" : "uring*", n, frames, uring.stats().enter_calls, cpu, wall);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int clients = (argc > 1) ? atoi(argv[1]) : 50;
+    size_t frame_size = (argc > 2) ? atoi(argv[2]) : 100 * 1024;
+    int frames = (argc > 3) ? atoi(argv[3]) : 300;
+    if (clients <= 0 || frame_size == 0 || frames <= 0) {
+        fprintf(stderr, "usage: %s [clients] [frame_size] [frames]\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    uint8_t* frame = (uint8_t*)malloc(frame_size);
+    for (size_t i = 0; i < frame_size; i++) {
+        frame[i] = (uint8_t)(i * 31);
+    }
+
+    printf("frame size %lu bytes, %d frames (uring* = without registered buffers)\n",
+            (unsigned long)frame_size, frames);
+
+    int counts[] = { 1, 10, clients };
+    for (int c = 0; c < 3; c++) {
+        if (c > 0 && counts[c] <= counts[c - 1]) continue;
+
+        std::vector<int> senders, readers;
+        if (make_connections(counts[c], senders, readers) != 0) {
+            return 1;
+        }
+        std::vector<pthread_t> threads(readers.size());
+        for (size_t i = 0; i < readers.size(); i++) {
+            pthread_create(&threads[i], NULL, run_reader, (void*)(intptr_t)readers[i]);
+        }
+
+        bench_thread(senders, frame, frame_size, frames);
+        bench_uring(senders, frame, frame_size, frames);
+
+        for (size_t i = 0; i < senders.size(); i++) {
+            close(senders[i]);
+        }
+        for (size_t i = 0; i < threads.size(); i++) {
+            pthread_join(threads[i], NULL);
+            close(readers[i]);
+        }
+    }
+
+    free(frame);
+    return 0;
+}
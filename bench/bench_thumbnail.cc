@@ -0,0 +1,97 @@
+// Measure the cpu cost of PiThumbnailer::transcode() per source frame.
+//
+//  $ bench/bench_thumbnail [iterations]
+
+#include "PiThumbnailer.h"
+#include "PiBuffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <jpeglib.h>
+
+static uint64_t cpu_nsec() {
+    timespec t;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// Encode a synthetic frame which has both smooth areas and edges like a camera image.
+static int make_source(int width, int height, int quality, unsigned char** out, unsigned long* out_size) {
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+
+    *out = NULL;
+    *out_size = 0;
+    jpeg_mem_dest(&cinfo, out, out_size);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    unsigned char* row = (unsigned char*)malloc(width * 3);
+    unsigned int seed = 1;
+    while (cinfo.next_scanline < cinfo.image_height) {
+        int y = cinfo.next_scanline;
+        for (int x = 0; x < width; x++) {
+            seed = seed * 1103515245 + 12345;
+            int noise = (seed >> 16) & 0x0f;
+            bool edge = ((x / 40) + (y / 40)) & 1;
+            row[x * 3 + 0] = (unsigned char)((x * 255 / width) + noise);
+            row[x * 3 + 1] = (unsigned char)((y * 255 / height) + noise);
+            row[x * 3 + 2] = (unsigned char)(edge ? 200 : 40);
+        }
+        JSAMPROW rows[1] = { row };
+        jpeg_write_scanlines(&cinfo, rows, 1);
+    }
+    free(row);
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int iterations = (argc > 1) ? atoi(argv[1]) : 50;
+    if (iterations <= 0) iterations = 50;
+
+    const int sizes[][2] = { {640, 480}, {1280, 720}, {1920, 1080} };
+    const int scales[] = { 2, 4, 8 };
+
+    printf("%-10s %6s %10s %10s %12s\n", "source", "scale", "src_bytes", "dst_bytes", "cpu_us/frame");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        unsigned char* src = NULL;
+        unsigned long src_size = 0;
+        make_source(sizes[i][0], sizes[i][1], 85, &src, &src_size);
+
+        for (size_t j = 0; j < sizeof(scales) / sizeof(scales[0]); j++) {
+            StaticBuffer dst;
+            size_t dst_length = 0;
+
+            // warm up
+            if (PiThumbnailer::transcode(src, src_size, scales[j], 70, dst, &dst_length) != 0) {
+                fprintf(stderr, "transcode failed\n");
+                return 1;
+            }
+
+            uint64_t start = cpu_nsec();
+            for (int n = 0; n < iterations; n++) {
+                PiThumbnailer::transcode(src, src_size, scales[j], 70, dst, &dst_length);
+            }
+            uint64_t elapsed = cpu_nsec() - start;
+
+            char name[32];
+            snprintf(name, sizeof(name), "%dx%d", sizes[i][0], sizes[i][1]);
+            printf("%-10s %4s%-2d %10lu %10lu %12.1f\n", name, "1/", scales[j],
+                    src_size, (unsigned long)dst_length, (double)elapsed / iterations / 1000.0);
+        }
+        free(src);
+    }
+    return 0;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "PiBuffer.h"
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+class PiCameraManager;
+class PiUring;
+struct PiCamSettings;
+
+struct PiBroadcastStats {
+    uint64_t frames;      // published frames
+    uint64_t deliveries;  // frames completely sent to a client
+    uint64_t dropped;     // frames skipped for a client which was still sending the previous one
+    uint64_t no_slot;     // frames skipped because every slot was still in flight
+    uint64_t cpu_nsec;    // cpu time of the publisher and the reaper threads
+
+    PiBroadcastStats() : frames(0), deliveries(0), dropped(0), no_slot(0), cpu_nsec(0) {}
+};
+
+/**
+ * Send the multipart stream to all full-rate clients with io_uring.
+ * Each published frame is copied once into a registered buffer together with its
+ * multipart header, and one batch of sends for all idle clients is submitted with
+ * a single syscall. Completions are reaped on a second thread, which resubmits
+ * short writes. The threads only run while clients exist.
+ */
+class PiBroadcaster {
+public:
+    // 'status' is non-zero if io_uring is not available.
+    PiBroadcaster(PiCameraManager& manager, const PiCamSettings& settings, const std::string& boundary,
+            const timeval& timeout_sending, int* status);
+    ~PiBroadcaster();
+
+    // Send frames to 'socket' until the client fails or stop() is called. The caller has
+    // already sent the response header, and keeps the socket open until this returns.
+    int serve(int socket);
+
+    // Finish all the clients, serve() returns ESHUTDOWN afterward.
+    void stop();
+
+    PiBroadcastStats stats();
+
+private:
+    static const int NUM_SLOTS = 3;
+
+    struct Slot {
+        StaticBuffer buffer;
+        size_t length;
+        int refs; // clients sending this slot
+    };
+
+    struct Client {
+        int socket;
+        int slot;            // slot being sent, or -1 if idle
+        size_t offset;       // sent bytes of the slot
+        timespec busy_since;
+        bool done;
+        int status;
+    };
+
+    static void* run_publisher(void* arg);
+    static void* run_reaper(void* arg);
+    void publish();
+    void reap();
+
+    int startWorkers();
+    void stopWorkers();
+    int prepareSend(Client* client);
+    void finish(Client* client, int status);
+
+    PiCameraManager& mManager;
+    const std::string mBoundary;
+    const int64_t mTimeoutNs;
+    PiUring* mUring;
+    bool mFixedBuffers;
+
+    pthread_mutex_t mMutex;
+    pthread_cond_t mCond;
+    pthread_t mPublisher;
+    pthread_t mReaper;
+    bool mRunning;
+    bool mStopRequested;
+    bool mShutdown;
+
+    std::vector<Client*> mClients;
+    Slot mSlots[NUM_SLOTS];
+
+    PiBroadcastStats mStats;
+};
@@ -24,6 +24,7 @@ public:
     ~DinamicBuffer();
 
     int append(void* data, size_t size);
+    int reserve(size_t size); // make 'size' bytes writable at values + offset
     void resetOffset();
 };
 
@@ -1,36 +1,42 @@
 #pragma once
-#include "PiBuffer.h"
+#include "PiFrameSource.h"
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
 #include <mmal/mmal.h>
 #include <mmal/util/mmal_util.h>
 #include <mmal/util/mmal_default_components.h>
 #include <mmal/util/mmal_connection.h>
 #include <mmal/util/mmal_util_params.h>
 
-struct PiCamSettings {
-    int width;
-    int height;
-    int fps;
-    int quality;
-    long timeout_writing_frame; // ex) 100000000 = 100ms
-    int rotation;
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include "RaspiCamControl.h"
+#ifdef __cplusplus
+}
+#endif
 
-    PiCamSettings() : width(640), height(480), fps(15), quality(85),
-            timeout_writing_frame(100000000), rotation(180) {}
-};
-
-class PiCameraListener {
-public:
-    virtual ~PiCameraListener() {}
-    virtual void onFrame(const DinamicBuffer& buffer) = 0;
-};
-
-class PiCamera {
+class PiCamera : public PiFrameSource {
 public:
     PiCamera(const PiCamSettings& settings, PiCameraListener* listener, int* status);
     ~PiCamera();
 
+    PiCameraStats stats() const;
+    int setAnnotate(const PiAnnotate& annotate);
+
 private:
+    MMAL_BUFFER_HEADER_T* getBuffer();
+    int applyAnnotate();
+    void growPool();
+    MMAL_STATUS_T createSplitter();
+    static void* control_loop(void* arg);
+
     static void encoder_buffer_callback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer);
+    static void raw_buffer_callback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer);
     static void camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
 
     MMAL_COMPONENT_T* mCamera;
@@ -43,12 +49,34 @@ private:
     MMAL_COMPONENT_T* mEncoder;
     MMAL_PORT_T* mEncoderInput;
     MMAL_PORT_T* mEncoderOutput;
-    MMAL_POOL_T* mPool;
+    std::vector<MMAL_POOL_T*> mPools; // the first one is created at start, others by growPool()
+    pthread_mutex_t mPoolsMutex;      // mPools, taken by the callback and growPool()
     MMAL_CONNECTION_T* mEncoderConnection;
+    MMAL_COMPONENT_T* mSplitter;              // NULL unless raw_decimation is set
+    MMAL_CONNECTION_T* mSplitterConnection;   // camera video port to the splitter
+    MMAL_PORT_T* mRawPort;                    // splitter output of the I420 frames
+    MMAL_POOL_T* mRawPool;                    // its buffers, recycled after each onRawFrame()
+    uint64_t mRawCount;                       // frames of mRawPort, for the decimation
     PiCameraListener* mListener;
     DinamicBuffer* mBuffer;
     const PiCamSettings mSettings;
     int last_encode_error;
+    timespec mStartTime;   // when the constructor started
+    bool mFirstFrame;      // waiting for the first frame since mStartTime
+    PiCameraStats mStats;  // updated by the callback thread with atomic operations
+    int mStarvedSinceGrow;
+
+    // Work kept off the callback thread, which waits for VideoCore: growing the pool and
+    // formatting the clock of the annotation
+    pthread_t mControlThread;
+    bool mControlStarted;
+    pthread_mutex_t mControlMutex;
+    pthread_cond_t mControlCond;
+    bool mControlStop;
+    bool mGrowRequested;            // the callback asks growPool() of the control thread
+    PiAnnotate mAnnotate;
+    time_t mAnnotateTime;           // when the time and the date of mAnnotate were formatted
+    pthread_mutex_t mAnnotateMutex; // mAnnotate, taken by the control requests and the control thread
 };
 
 
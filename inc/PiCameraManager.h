@@ -1,24 +1,99 @@
 #pragma once
 
-#include "PiCamera.h"
+#include "PiFrameSource.h"
+#include <pthread.h>
+#include <time.h>
 #include <sys/time.h>
+#include <stdint.h>
+#include <map>
 #include <vector>
 
 class PiFrame;
+class PiSharedFrame;
+class PiThumbnailer;
+
+/** Receiver of every frame, called on the capture thread, ex) the shared memory export */
+class PiFrameSink {
+public:
+    virtual ~PiFrameSink() {};
+    virtual void onFrame(const DinamicBuffer& buffer, uint64_t sequence, int64_t timestamp_us) = 0;
+
+    // The I420 frames of the splitter, while raw_decimation is set
+    virtual void onRawFrame(const PiRawFrame& frame) {};
+};
+
 class PiCameraManager : public PiCameraListener {
 public:
     PiCameraManager(const PiCamSettings& settings);
     ~PiCameraManager();
 
-    PiFrame* attach();
+    // 'initial_credits' >= 0 enables the credit based flow control of the PiFrame.
+    PiFrame* attach(int max_fps = 0, int scale_denom = 1, int initial_credits = -1);
     void detach(PiFrame*& );
 
+    // A sink is a subscriber like a PiFrame, the source runs while any is added.
+    int addSink(PiFrameSink* sink);
+    void removeSink(PiFrameSink* sink);
+
+    // Grant credits to the stream, and return the current credits (-ENOENT if not found,
+    // -EINVAL if the stream isn't in credit mode).
+    int grantCredits(uint32_t stream_id, int credits);
+
+    // Encoder buffer counters of the running camera (zeros if it is stopped)
+    PiCameraStats cameraStats();
+
+    // Copy the most recent frame: the next one while the source runs (or after starting it with
+    // 'start'), waiting up to 'timeout_sec', or the cached one. Return ENOENT if there is none.
+    int captureFrame(std::vector<uint8_t>* jpeg, uint64_t* sequence, int64_t* timestamp_us, int timeout_sec,
+            bool start = false);
+
+    // Bytes to allocate for a frame of 1/scale_denom before its size is known: the most recent
+    // frame with a margin, or an estimate from the resolution. The buffers grow for a larger frame.
+    size_t frameSizeHint(int scale_denom = 1);
+
+    // Seed the most recent frame, ex) with the one handed over by the previous process
+    void setLatestFrame(const std::vector<uint8_t>& jpeg, uint64_t sequence, int64_t timestamp_us);
+
+    // Annotation of the camera, kept for the next one while it is stopped.
+    // Return ENOTSUP for a relay.
+    int setAnnotate(const PiAnnotate& annotate);
+    PiAnnotate annotate();
+
+protected:
+    // The camera, the relay or the replay of the settings, in PiCameraSource.cc. A subclass
+    // may supply another source, and a program which doesn't link that file defines this
+    // itself, ex) bench/bench_dispatch, which publishes its own frames through onFrame().
+    virtual PiFrameSource* createSource(const PiCamSettings& settings, int* status);
+
 private:
     void onFrame(const DinamicBuffer& buffer);
+    void onRawFrame(const PiRawFrame& frame);
+    int lockFrames();
+    int startSource();
+    void deleteSource(PiFrameSource* source);
+    PiThumbnailer* thumbnailer(int scale_denom);
+    size_t numSubscribers();
 
     const PiCamSettings& mSettings;
-    PiCamera* mCamera;
+    PiFrameSource* mSource; // the camera or the relay, NULL while nobody subscribes
     std::vector<PiFrame*> mFrames;
+    std::vector<PiThumbnailer*> mThumbnailers;
+    std::vector<PiFrameSink*> mSinks;
+    uint64_t mSequence;
+    std::map<uint32_t, PiFrame*> mStreams;
+    uint32_t mNextStreamId;
+    int mEncoderBuffers; // encoder pool size grown by the last camera, reused by the next one
+    PiAnnotate mAnnotate; // changed by the control requests, given to the next camera
     pthread_mutex_t mFramesMutex;
-    timespec mFramesMutexTimeout;
+    timespec mFramesMutexTimeout; // relative, see lockFrames()
+    bool mStopping;               // a source taken out is being deleted, under mFramesMutex
+    pthread_cond_t mStoppedCond;  // signaled with mFramesMutex when it is deleted
+
+    // The most recent frame shared with the streams, or the one handed over, kept while the
+    // camera is stopped. Only the reference is taken on the capture thread, never a copy.
+    PiSharedFrame* mLatest;
+    size_t mLatestSize;       // of the most recent frame, for frameSizeHint()
+    uint64_t mLatestSequence;
+    int64_t mLatestTimestamp; // usec since epoch
+    pthread_mutex_t mLatestMutex;
 };
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+/** Conversions of the clocks to nsec in 64 bits, which a long of 32 bits doesn't hold */
+class PiClock {
+public:
+    // cpu time of the calling thread
+    static inline uint64_t threadCpuNsec() {
+        timespec t;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+        return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+    }
+
+    // Negative if 'to' is before 'from'
+    static inline int64_t elapsedNsec(const timespec& from, const timespec& to) {
+        return (int64_t)(to.tv_sec - from.tv_sec) * 1000000000LL + (to.tv_nsec - from.tv_nsec);
+    }
+
+    static inline int64_t toNsec(const timeval& t) {
+        return (int64_t)t.tv_sec * 1000000000LL + (int64_t)t.tv_usec * 1000;
+    }
+};
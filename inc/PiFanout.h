@@ -0,0 +1,106 @@
+#pragma once
+
+#include "PiBuffer.h"
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+class PiCameraManager;
+
+struct PiFanoutStats {
+    uint64_t frames;      // published frames
+    uint64_t deliveries;  // frames completely sent to a client
+    uint64_t dropped;     // frames skipped for a client which was still sending the previous one
+    uint64_t wakeups;     // wakeups of the worker threads
+    uint64_t syscalls;    // send() and poll() calls of the worker threads
+    uint64_t cpu_nsec;    // cpu time of the publisher and the worker threads
+
+    PiFanoutStats() : frames(0), deliveries(0), dropped(0), wakeups(0), syscalls(0), cpu_nsec(0) {}
+};
+
+/**
+ * Send the multipart stream to all full-rate clients from a few worker threads.
+ * Each published frame is copied once into a slot together with its multipart header.
+ * The clients are partitioned across the workers by connection id, and each worker is
+ * woken up once per frame to write the slot to its clients with non-blocking sends in
+ * a single pass. Clients which can't take the whole frame at once are finished by poll().
+ */
+class PiFanout {
+public:
+    PiFanout(PiCameraManager& manager, int num_workers, const std::string& boundary,
+            const timeval& timeout_sending, int* status);
+    ~PiFanout();
+
+    // Send frames to 'socket' until the client fails or stop() is called. The caller has
+    // already sent the response header, and keeps the socket open until this returns.
+    int serve(int socket);
+
+    // Finish all the clients, serve() returns ESHUTDOWN afterward.
+    void stop();
+
+    PiFanoutStats stats();
+
+private:
+    static const int NUM_SLOTS = 3;
+
+    struct Slot {
+        StaticBuffer buffer;
+        size_t length;
+        int refs; // workers and clients using this slot, updated atomically
+    };
+
+    struct Client {
+        int socket;
+        int slot;            // slot being sent, or -1 if idle
+        size_t offset;       // sent bytes of the slot
+        timespec busy_since;
+        bool done;
+        bool removed;        // the worker doesn't refer to this anymore
+        int status;
+    };
+
+    struct Worker {
+        PiFanout* owner;
+        pthread_t thread;
+        bool started;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;  // signaled when a client is removed
+        int event_fd;         // wakes the worker up
+        std::vector<Client*> clients;
+        int pending;          // slot published for the clients, or -1
+        PiFanoutStats stats;
+    };
+
+    static void* run_publisher(void* arg);
+    static void* run_worker(void* arg);
+    void publish();
+    void work(Worker& worker);
+
+    int startPublisher();
+    void stopPublisher();
+    void wake(Worker& worker);
+    void sendSome(Worker& worker, Client* client);
+    void release(Client* client);
+    void finish(Worker& worker, Client* client, int status);
+
+    PiCameraManager& mManager;
+    const std::string mBoundary;
+    const int64_t mTimeoutNs;
+
+    // Protects the fields below. Client fields are protected by the mutex of their worker.
+    pthread_mutex_t mMutex;
+    pthread_t mPublisher;
+    bool mRunning;
+    bool mStopRequested;
+    bool mShutdown;
+    bool mWorkersStopRequested;
+    int mNumClients;
+    uint32_t mNextId;
+    uint64_t mFrames;
+    uint64_t mPublisherCpuNs;
+
+    std::vector<Worker*> mWorkers;
+    Slot mSlots[NUM_SLOTS];
+};
@@ -2,6 +2,32 @@
 
 #include <stdint.h>
 #include <pthread.h>
+#include <time.h>
+
+/**
+ * A JPEG which the PiFrames of several clients refer to instead of a copy each, so it
+ * can be sent from its own pages (MSG_ZEROCOPY) while newer frames are published.
+ * It isn't changed after create(), and the last release() frees it.
+ */
+class PiSharedFrame {
+public:
+    // A copy of 'src' with one reference, NULL if out of memory
+    static PiSharedFrame* create(const uint8_t* src, size_t length);
+
+    void retain();
+    void release();
+
+    uint8_t* const values;
+    const size_t length;
+
+private:
+    PiSharedFrame(uint8_t* values, size_t length);
+    ~PiSharedFrame();
+    PiSharedFrame(const PiSharedFrame&);
+    PiSharedFrame& operator=(const PiSharedFrame&);
+
+    volatile int mRefs;
+};
 
 class PiFrame {
 public:
@@ -10,10 +36,37 @@ public:
 
     // sync functions
     int waitForReady(int sec = 0, long nsec = 0);
+    // Wait for a frame signaled after 'seen', which is updated. It doesn't miss the
+    // frames signaled while the caller was busy, unlike the one above.
+    int waitForReady(uint64_t* seen, int sec, long nsec = 0);
     void sendReadySignal();
+
+    // Also signal an eventfd, for a thread which polls a socket and many frames, -1 for none
+    inline void setReadyFd(int fd) { mReadyFd = fd; }
     int lock(int sec = 0, long nsec = 0);
+    // EBUSY while the frame is being written or read, for a thread which polls many frames
+    int tryLock();
     void unlock();
 
+    // rate limiting functions
+    void setMaxFps(int fps);
+    bool isDue(const timespec& now, long slack_nsec);
+
+    // credit based flow control functions
+    void enableCredits(int initial_credits);
+    int addCredits(int credits);
+    bool hasCredit();
+    bool takeCredit();
+    inline bool isCreditMode() const { return mCreditMode; }
+
+    // shared frame functions, call with the lock. A sharing PiFrame gets a reference
+    // to the frame by share() instead of a copy by write(), and has no buffer of its own.
+    void enableSharing();
+    inline bool isSharing() const { return mSharing; }
+    size_t share(PiSharedFrame* shared);
+    // The reference to the last shared frame, which the caller releases. NULL if none is new.
+    PiSharedFrame* takeShared();
+
    // getter functions
     size_t requiredMemSize() const;
     size_t write(void* src_buffer, size_t length);
@@ -21,10 +74,31 @@ public:
     uint8_t* buffer;
     size_t length;
 
+    // metadata of the frame in buffer
+    uint64_t sequence;
+    int64_t timestamp_us; // usec since epoch
+
+    // id to grant credits from another connection (set by PiCameraManager)
+    uint32_t stream_id;
+
 private:
     size_t mAllocatedSize;
-    
+
+    // Minimum interval between delivered frames (0 = every frame)
+    int64_t mIntervalNs;
+    int64_t mNextDueNs;
+
+    // Number of frames the client is willing to receive (only in credit mode)
+    bool mCreditMode;
+    volatile int mCredits;
+
+    volatile int mReadyFd;
+
+    bool mSharing;
+    PiSharedFrame* mShared;
+
     pthread_mutex_t mMemMutex;
+    uint64_t mSignaled;     // frames signaled, under mSignalMutex
     pthread_mutex_t mSignalMutex;
     pthread_cond_t mSignalCond;
 };
@@ -0,0 +1,126 @@
+#pragma once
+#include "PiBuffer.h"
+#include "PiPacer.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string>
+
+// Camera parameters of RaspiCamControl.h, complete only with MMAL, see PiCamera.h
+struct RASPICAM_CAMERA_PARAMETERS;
+
+enum PiPreviewMode {
+    PREVIEW_NULL_SINK = 0, // preview frames go to a null sink, which keeps AE/AWB running
+    PREVIEW_NONE,          // the preview port isn't connected
+    PREVIEW_RENDERER       // fullscreen video renderer on the display (needs a display)
+};
+
+/**
+ * RASPICAM_CAMERA_PARAMETERS owned by the settings and copied with them, so this header
+ * and the ones of the manager don't need MMAL. It starts with raspicamcontrol_set_defaults().
+ */
+class PiCameraParams {
+public:
+    PiCameraParams();
+    PiCameraParams(const PiCameraParams& other);
+    PiCameraParams& operator=(const PiCameraParams& other);
+    ~PiCameraParams();
+
+    RASPICAM_CAMERA_PARAMETERS& operator*() { return *mParams; }
+    const RASPICAM_CAMERA_PARAMETERS& operator*() const { return *mParams; }
+    RASPICAM_CAMERA_PARAMETERS* operator->() { return mParams; }
+    const RASPICAM_CAMERA_PARAMETERS* operator->() const { return mParams; }
+
+private:
+    RASPICAM_CAMERA_PARAMETERS* mParams;
+};
+
+struct PiCamSettings {
+    int width;
+    int height;
+    int fps;
+    int quality;
+    long timeout_writing_frame; // ex) 100000000 = 100ms
+    int rotation;
+    int thumbnail_quality;
+    int preview_mode; // def: PREVIEW_NULL_SINK
+    int video_buffers; // buffers of the camera video port, def: 3
+    int encoder_buffers; // buffers of the encoder output, def: 0 (recommended by the encoder)
+    int encoder_buffers_max; // grow the encoder buffers up to this on starvation, def: 0 (fixed)
+    int camera_num; // camera of a board with several, ex) a compute module, def: 0
+    int raw_decimation; // deliver every Nth I420 frame of a splitter to onRawFrame(), def: 0 (no splitter)
+    std::string relay_url; // frames are pulled from this MJPEG stream instead of the camera, def: empty
+    std::string replay_path; // frames of this JPEG or MJPEG file are replayed at 'fps' instead of the camera, def: empty
+    PiCameraParams camera_params; // image parameters (rotation is overridden by 'rotation')
+
+    PiCamSettings() : width(640), height(480), fps(15), quality(85),
+            timeout_writing_frame(100000000), rotation(180), thumbnail_quality(70),
+            preview_mode(PREVIEW_NULL_SINK), video_buffers(3), encoder_buffers(0), encoder_buffers_max(0),
+            camera_num(0), raw_decimation(0) {}
+};
+
+struct PiCameraStats {
+    uint64_t buffers;       // encoder output buffers returned to the callback
+    uint64_t starvations;   // the encoder had no buffer queued when one was returned
+    uint64_t resend_errors; // a buffer couldn't be sent back to the encoder
+    int in_flight;          // buffers queued to the encoder output port
+    int min_in_flight;      // lowest in_flight after the start
+    int pool_size;          // encoder output buffers
+    int grows;              // times the pool was grown by starvation
+    uint64_t raw_frames;    // I420 frames delivered to onRawFrame()
+    uint64_t invalid_frames; // frames dropped because they weren't a complete JPEG
+    PiPacerStats pacing;    // frame clock of a replayed source, zero for the camera and a relay
+
+    PiCameraStats() : buffers(0), starvations(0), resend_errors(0), in_flight(0), min_in_flight(0),
+            pool_size(0), grows(0), raw_frames(0), invalid_frames(0) {}
+};
+
+/** An I420 frame of the splitter, valid only during onRawFrame() */
+struct PiRawFrame {
+    const uint8_t* data;
+    size_t size;
+    int width;
+    int height;
+    int stride;             // of the Y plane, the U and V planes have the half
+    int slice_height;       // rows of the Y plane including the padding
+    uint64_t sequence;      // counts the delivered raw frames
+    int64_t timestamp_us;   // usec since epoch
+};
+
+class PiCameraListener {
+public:
+    virtual ~PiCameraListener() {}
+    virtual void onFrame(const DinamicBuffer& buffer) = 0;
+
+    // Called from the splitter thread when raw_decimation is set
+    virtual void onRawFrame(const PiRawFrame& frame) {};
+};
+
+/** Text drawn over the frames by the firmware, see raspicamcontrol_set_annotate() */
+struct PiAnnotate {
+    int flags;              // ANNOTATE_*, 0 = disabled
+    std::string text;       // for ANNOTATE_USER_TEXT, strftime conversions with the time or the date
+    int text_size;          // 6-80, 0 = firmware default
+    int text_colour;        // 0xVVUUYY, -1 = firmware default
+    int bg_colour;          // 0xVVUUYY, -1 = firmware default
+
+    PiAnnotate() : flags(0), text_size(0), text_colour(-1), bg_colour(-1) {}
+    explicit PiAnnotate(const RASPICAM_CAMERA_PARAMETERS& params);
+
+    // The time or the date has to be formatted again every second.
+    bool hasClock() const;
+};
+
+/**
+ * Producer of the JPEG frames of PiCameraManager. It runs while it exists, and
+ * calls PiCameraListener::onFrame() with each complete frame from its own thread.
+ */
+class PiFrameSource {
+public:
+    virtual ~PiFrameSource() {}
+    virtual PiCameraStats stats() const = 0;
+
+    // Change the annotation of a running source. ENOTSUP unless it is a camera.
+    virtual int setAnnotate(const PiAnnotate& annotate) {
+        return ENOTSUP;
+    }
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+typedef std::pair<std::string, std::string> PiHeaderField;
+
+/**
+ * Header compression of HTTP/2 (RFC 7541). The decoder keeps the dynamic table of
+ * one connection. The encoder writes the few response headers of the server as
+ * literals without indexing, which needs no table, and refers to the static table
+ * for the names and the common values like ":status 200".
+ */
+class PiHpack {
+public:
+    // SETTINGS_HEADER_TABLE_SIZE of the server, the default of the protocol
+    static const size_t DEFAULT_TABLE_SIZE = 4096;
+
+    // Limit of the decoded fields of a header block, names and values plus 32 bytes per field
+    static const size_t MAX_HEADER_LIST_SIZE = 16384;
+
+    PiHpack();
+
+    // Decode a complete header block. Return EPROTO on a compression error, which
+    // breaks the connection because the dynamic table is out of sync.
+    int decode(const uint8_t* data, size_t size, std::vector<PiHeaderField>* fields);
+
+    // Append a field to a header block. 'name' is lower case.
+    static void encode(const std::string& name, const std::string& value, std::string* out);
+
+    // Decode an integer with a prefix of 'prefix_bits' at data[*pos], and advance *pos
+    static int decodeInteger(const uint8_t* data, size_t size, int prefix_bits, size_t* pos, uint32_t* value);
+
+    // Decode a string of the Huffman code of the RFC
+    static int decodeHuffman(const uint8_t* data, size_t size, std::string* out);
+
+private:
+    int decodeString(const uint8_t* data, size_t size, size_t* pos, std::string* out);
+    int lookup(uint32_t index, PiHeaderField* field) const;
+    void insert(const PiHeaderField& field);
+    void evict(size_t max_size);
+
+    std::deque<PiHeaderField> mTable; // the dynamic table, the newest first
+    size_t mTableSize;                // sum of the entry sizes
+    size_t mMaxTableSize;             // limit set by the encoder, up to DEFAULT_TABLE_SIZE
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "PiHpack.h"
+#include "PiBuffer.h"
+#include <sys/time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <string>
+#include <vector>
+
+class PiCameraManager;
+class PiFrame;
+class PiHttpdInterpreter;
+class PiMemoryAccount;
+
+/** What a PiHttp2Session asks of the server */
+class PiHttp2Handler {
+public:
+    virtual ~PiHttp2Handler() {};
+
+    // The source of a path, ex) the one named "front" and "/bin-cgi/stream" for
+    // "/cam/front/stream". NULL if there is none.
+    virtual PiCameraManager* route(const std::string& path, std::string* doc) = 0;
+
+    // Reserve the frame buffer and the send buffer ('extra' bytes larger) of a stream in
+    // the memory budget, which may lower the resolution. Return ENOMEM if they don't fit.
+    virtual int admit(PiCameraManager& manager, int* scale_denom, size_t extra) = 0;
+
+    // False while the server drains its clients
+    virtual bool isRunning() = 0;
+};
+
+/**
+ * One HTTP/2 connection in cleartext (h2c), with the prior knowledge or upgraded from
+ * HTTP/1.1. Each stream request is an HTTP/2 stream with its own PiFrame, so one
+ * connection carries the streams of many tiles of a page. The frames are sent within
+ * the flow control windows of the streams and of the connection: a stream whose window
+ * is exhausted gets the newest frame when the client opens it again, and the frames in
+ * between are skipped for that stream only. Only the streams are served over HTTP/2,
+ * other documents are 403 like the unknown ones of HTTP/1.
+ *
+ * A session runs on the thread of its connection, and polls the socket and an eventfd
+ * the PiFrames of its streams signal.
+ */
+class PiHttp2Session {
+public:
+    // "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+    static const size_t PREFACE_LENGTH = 24;
+
+    PiHttp2Session(int socket, PiHttp2Handler& handler, PiMemoryAccount& memory, const std::string& server_name,
+            const timeval& timeout_sending, const timeval& timeout_recving, int* status);
+    ~PiHttp2Session();
+
+    // Whether the bytes received first begin with the preface of the prior knowledge
+    static bool isPreface(const char* data, size_t size);
+
+    // Serve the request of an HTTP/1.1 "Upgrade: h2c" as the stream 1, after the 101
+    // response. 'settings' is the HTTP2-Settings header. Call before run().
+    int upgrade(const PiHttpdInterpreter& intr, const std::string& settings);
+
+    // Serve the connection until it is closed. 'received' is what is already read from
+    // the socket, which begins with the preface.
+    int run(const std::string& received);
+
+    // Connections, streams, and the frames sent and skipped in the text exposition format of Prometheus
+    static std::string metrics();
+
+private:
+    struct Stream {
+        uint32_t id;
+        PiCameraManager* manager;
+        PiFrame* frame;         // NULL once the response is complete
+        bool closing;           // the closing boundary is next, the server is draining
+        bool headers_sent;
+        int64_t window;         // send window, negative if SETTINGS have shrunk it
+        StaticBuffer buffer;    // the part header and the frame being sent
+        size_t length;
+        size_t offset;          // bytes of 'buffer' already sent
+        bool end;               // END_STREAM after 'buffer'
+        bool stalled;           // 'buffer' has waited for a WINDOW_UPDATE
+        uint64_t sequence;      // of the frame in 'buffer'
+        uint64_t skipped_seen;  // newest frame counted as skipped
+        size_t frame_bytes;     // accounted in the memory budget
+        size_t send_bytes;
+    };
+
+    int startRequest(uint32_t id, const std::vector<PiHeaderField>& fields);
+    int openStream(uint32_t id, const PiHttpdInterpreter& intr);
+    void closeStream(std::map<uint32_t, Stream*>::iterator it);
+    void refresh(Stream* stream);
+    int takeFrame(Stream* stream);
+    void schedule();
+    void finishStreams();
+    void account();
+
+    int process();
+    int processFrame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t* payload, size_t length);
+    int processHeaders(uint32_t id, const uint8_t* payload, size_t length, uint8_t flags);
+    int endHeaders();
+    int applySettings(const uint8_t* payload, size_t length);
+    int flush();
+
+    void writeFrame(uint8_t type, uint8_t flags, uint32_t id, const void* payload, size_t length);
+    void writeHeaders(uint32_t id, int status, const std::vector<PiHeaderField>& fields, bool end_stream);
+    void writeWindowUpdate(uint32_t id, uint32_t increment);
+    void writeRstStream(uint32_t id, uint32_t error);
+    void goAway(uint32_t error);
+
+    int mSocket;
+    PiHttp2Handler& mHandler;
+    PiMemoryAccount& mMemory;
+    const std::string mServerName;
+    const long mTimeoutSendingMs;
+    const long mTimeoutRecvingMs;
+    int mEventFd;               // signaled by the PiFrames of the streams
+
+    PiHpack mDecoder;
+    std::string mIn;            // received bytes not processed yet
+    std::string mOut;           // frames to send from mOutOffset
+    size_t mOutOffset;
+    bool mPrefaceReceived;
+
+    std::map<uint32_t, Stream*> mStreams;
+    uint32_t mLastStreamId;     // largest stream id opened by the client
+    std::string mHeaderBlock;   // HEADERS and CONTINUATION of mHeaderStream
+    uint32_t mHeaderStream;     // stream of an unfinished header block, 0 if none
+
+    int64_t mWindow;            // send window of the connection
+    int64_t mInitialWindow;     // SETTINGS_INITIAL_WINDOW_SIZE of the client
+    size_t mMaxFrameSize;       // SETTINGS_MAX_FRAME_SIZE of the client
+    bool mGoingAway;            // GOAWAY sent, no new streams
+    bool mPeerGone;             // GOAWAY received or the connection closed
+
+    // Request of the upgrade, served as the stream 1 by run()
+    PiHttpdInterpreter* mUpgrade;
+};
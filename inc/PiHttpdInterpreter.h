@@ -32,6 +32,9 @@ public:
     const std::string* param(const std::string& key) const;
     const Strings& header(const std::string& key) const;
 
+    // Decode %XX and '+' of a query value, ex) "10%3A00+UTC" is "10:00 UTC"
+    static std::string decode(const std::string& value);
+
 private:
     void doInit(const char* str, size_t len);
     void parseRequestLine(const std::string& line);
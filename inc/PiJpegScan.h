@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct PiJpegInfo {
+    int width;
+    int height;
+    int components;
+    size_t length;  // bytes from the SOI to the end of the EOI
+
+    PiJpegInfo() : width(0), height(0), components(0), length(0) {}
+};
+
+/**
+ * Scanner of the markers of baseline and progressive JPEG. The entropy-coded data,
+ * which is most of a frame, is searched for 0xFF 16 bytes at a time with SSE2 or
+ * NEON, and byte by byte on other cpus.
+ */
+class PiJpegScan {
+public:
+    // Offset of the first 0xFF in data[from, size), or 'size' if there is none
+    static size_t findMarker(const uint8_t* data, size_t size, size_t from);
+
+    // Same as findMarker() without SIMD, for the comparison
+    static size_t findMarkerScalar(const uint8_t* data, size_t size, size_t from);
+
+    // Check that 'data' is a complete JPEG: SOI, a SOF with the dimensions, a SOS, and
+    // the EOI. Bytes after the EOI are allowed, see info->length.
+    // Return EPROTO if it is malformed, ENODATA if it is truncated.
+    static int validate(const uint8_t* data, size_t size, PiJpegInfo* info);
+
+    // Find the first complete JPEG in a byte stream, ex) a dump or a relayed stream
+    // without Content-Length, and return [*begin, *end). Return ENODATA if the frame
+    // after *begin hasn't ended yet, ENOENT if there is no SOI.
+    static int findFrame(const uint8_t* data, size_t size, size_t* begin, size_t* end, PiJpegInfo* info);
+
+    // Whether findMarker() uses SIMD on this build
+    static const char* implementation();
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+enum PiLogLevel {
+    PILOG_ERROR = 0,
+    PILOG_WARN,
+    PILOG_INFO,
+    PILOG_DEBUG
+};
+
+enum PiLogSink {
+    LOG_SINK_STDERR = 0,
+    LOG_SINK_FILE,
+    LOG_SINK_SYSLOG // journald picks it up
+};
+
+/**
+ * A call site of PI_LOG(). A static instance per site holds the format and the
+ * state of its rate limit. Every argument of the format is a long (%ld, %lu or %lx).
+ */
+struct PiLogSite {
+    const char* file;
+    int line;
+    int level;
+    const char* format;
+    uint32_t window;      // second of the current rate limit window
+    uint32_t count;       // records in the window
+    uint32_t suppressed;  // records dropped by the rate limit since the last accepted one
+};
+
+struct PiLogStats {
+    uint64_t written;     // records written to the sink
+    uint64_t suppressed;  // records dropped by the rate limit of their site
+    uint64_t overflowed;  // records dropped because the ring was full
+
+    PiLogStats() : written(0), suppressed(0), overflowed(0) {}
+};
+
+/**
+ * Logging for the capture and send paths. write() stores a binary record in a
+ * lock-free ring and returns without touching stdio, and a background thread
+ * formats the records and writes them to the sink. A full ring drops records
+ * instead of blocking. Before start() and after stop(), records go straight to stderr.
+ */
+class PiLog {
+public:
+    // Records accepted per call site per second
+    static const uint32_t MAX_PER_SEC = 10;
+
+    static int start(int sink, const std::string& path);
+
+    // Write the remaining records, and stop the drain thread
+    static void stop();
+
+    static void write(PiLogSite* site, int code);
+    static void write(PiLogSite* site, int code, long a0);
+    static void write(PiLogSite* site, int code, long a0, long a1);
+    static void write(PiLogSite* site, int code, long a0, long a1, long a2);
+    static void write(PiLogSite* site, int code, long a0, long a1, long a2, long a3);
+
+    static PiLogStats stats();
+
+private:
+    static void push(PiLogSite* site, int code, long a0, long a1, long a2, long a3);
+};
+
+// ex) PI_LOG(PILOG_ERROR, ret, "lock failed sec=%ld", (long)sec);
+#define PI_LOG(level, code, format, ...) do { \
+        static PiLogSite pi_log_site_ = { __FILE__, __LINE__, (level), format, 0, 0, 0 }; \
+        PiLog::write(&pi_log_site_, (code), ##__VA_ARGS__); \
+    } while (0)
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+enum PiMemoryKind {
+    MEMORY_STACK = 0,   // stacks of the client threads
+    MEMORY_FRAME,       // PiFrame buffers of the clients
+    MEMORY_SEND,        // buffers the client threads copy the frames to
+    NUM_MEMORY_KINDS
+};
+
+/**
+ * Bytes held by one connection. The global totals of PiMemory are the sum of the
+ * accounts, and an account releases what it holds when it is destroyed.
+ */
+class PiMemoryAccount {
+public:
+    PiMemoryAccount();
+    ~PiMemoryAccount();
+
+    // Add 'bytes' if the total stays within the budget. Return ENOMEM otherwise.
+    int reserve(PiMemoryKind kind, size_t bytes);
+
+    // Set the bytes of 'kind' to the size of a buffer which has grown or shrunk.
+    // A stream already admitted may exceed the budget this way.
+    void update(PiMemoryKind kind, size_t bytes);
+
+    // Give back 'bytes' of a reserve() which isn't used, the rest of 'kind' is kept
+    void unreserve(PiMemoryKind kind, size_t bytes);
+
+    void release(PiMemoryKind kind);
+    size_t total() const;
+
+private:
+    PiMemoryAccount(const PiMemoryAccount&);
+    PiMemoryAccount& operator=(const PiMemoryAccount&);
+
+    size_t mBytes[NUM_MEMORY_KINDS];
+};
+
+/** Memory of the connections, and the budget new connections are admitted within */
+class PiMemory {
+public:
+    // 0 is unlimited. Call before accepting the clients.
+    static void setBudget(size_t bytes);
+    static size_t budget();
+    static size_t used();
+
+    // A client was refused, or served at a lower resolution, for the budget
+    static void countRejected();
+    static void countDegraded();
+
+    // Totals per kind and the budget in the text exposition format of Prometheus
+    static std::string metrics();
+
+private:
+    friend class PiMemoryAccount;
+    static int reserve(PiMemoryKind kind, size_t bytes);
+    static void charge(PiMemoryKind kind, size_t bytes);
+    static void release(PiMemoryKind kind, size_t bytes);
+};
@@ -1,22 +1,57 @@
 #pragma once
 
 #include "PiCameraManager.h"
+#include "PiThreads.h"
+#include "PiLog.h"
+#include "PiUpgrade.h"
 #include <sys/time.h>
 #include <stdint.h>
 #include <string>
+#include <vector>
+#include <map>
+
+enum PiSendBackend {
+    SEND_BACKEND_THREAD = 0, // each client thread sends its frames
+    SEND_BACKEND_URING,      // full-rate clients are sent by PiBroadcaster with io_uring
+    SEND_BACKEND_FANOUT      // full-rate clients are sent by the worker threads of PiFanout
+};
+
+/** A source served at /cam/<name>/..., which is a camera or a relay */
+struct PiSourceSettings {
+    std::string name; // ex) "front" of /cam/front/stream
+    PiCamSettings cam_settings; // camera_num or relay_url, the rest is copied from the default source
+};
 
 struct PiServerSettings {
     uint32_t ip_addr; // def: 0
     uint32_t port_number; // def: 8080
     timeval timeout_sending; // def: 10sec
     timeval timeout_recving;  // def: 10sec
+    timeval timeout_draining; // clients still streaming after this are closed at shutdown, def: 5sec
     uint32_t max_connections; // def: 5
     std::string server_name; // test
+    int send_backend; // def: SEND_BACKEND_THREAD
+    int fanout_workers; // worker threads of SEND_BACKEND_FANOUT, def: 2
+    size_t zerocopy_threshold; // frames from this size are sent with MSG_ZEROCOPY, def: 0 (off)
+    size_t memory_budget; // bytes of the connections, see PiMemory, def: 0 (unlimited)
+    PiThreadPolicy thread_policies[NUM_THREAD_ROLES]; // def: not pinned, default scheduling
+    int log_sink; // def: LOG_SINK_STDERR
+    std::string log_file; // path of LOG_SINK_FILE
+    bool trace; // record the trace spans from the start, def: false
+    std::string trace_file; // written on SIGUSR2, def: /tmp/pimjpg_srv.trace.json
+    std::string upgrade_socket; // Unix socket path for the hot upgrade, def: empty (off)
+    std::string export_socket; // Unix socket announcing the shared memory frames, def: empty (off)
+    int export_slots; // frames kept in the shared memory, def: 4
+    bool export_raw; // also export the I420 frames of cam_settings.raw_decimation, def: false
     PiCamSettings cam_settings;
+    std::vector<PiSourceSettings> sources; // named sources besides the default one, def: none
 
     PiServerSettings();
 };
 
+class PiBroadcaster;
+class PiFanout;
+class PiShmExport;
 struct SrvSockInfo;
 struct ClientSockInfo;
 class PiMjpgServer {
@@ -31,15 +66,24 @@ private:
 
     int openServerSocket(SrvSockInfo& srv);
     int wait(SrvSockInfo& srv, ClientSockInfo& client);
+    void drain();
 
 private:
     void removeClient(ClientSockInfo* client);
+    int waitClients(const timespec& deadline);
 
     PiServerSettings mSettings;
+    PiUpgrade mUpgrade; // destroyed after mManager, so the next process sees the camera released
     PiCameraManager mManager;
+    std::map<std::string, PiCameraManager*> mSources; // named sources, with the settings of mManager otherwise
+    PiBroadcaster* mBroadcaster; // NULL unless SEND_BACKEND_URING is available
+    PiFanout* mFanout; // NULL unless SEND_BACKEND_FANOUT
+    PiShmExport* mExport; // NULL unless export_socket is set
     pthread_mutex_t mMutex;
+    pthread_cond_t mClientsCond; // signaled when mClients gets empty, on CLOCK_MONOTONIC
 
     volatile bool mIsRunning;
+    int mWakeFds[2]; // self-pipe, the signal handler writes to wake up the accept loop
 
     SrvSockInfo* mSrv;
     std::vector<ClientSockInfo*> mClients;
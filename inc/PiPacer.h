@@ -0,0 +1,58 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+struct PiPacerStats {
+    uint64_t ticks;         // deadlines waited for
+    uint64_t missed;        // deadlines skipped because a wake-up was a whole interval late
+    int64_t late_mean_ns;   // lateness of the wake-ups after their deadlines
+    int64_t late_stddev_ns; // the jitter
+    int64_t late_max_ns;
+
+    PiPacerStats() : ticks(0), missed(0), late_mean_ns(0), late_stddev_ns(0), late_max_ns(0) {}
+};
+
+/**
+ * Frame clock of the sources without a camera, which has its own. The deadlines are
+ * absolute on CLOCK_MONOTONIC, start + n / fps in integer nanoseconds, and wait() sleeps
+ * with clock_nanosleep(TIMER_ABSTIME) until the next one. A late wake-up or a slow
+ * frame delays only its own tick, the following deadlines stay on the grid. When a whole
+ * interval has passed, the deadlines in between are counted as missed and skipped
+ * rather than sent in a burst, like PiFrame drops the frames of a slow client.
+ */
+class PiPacer {
+public:
+    PiPacer();
+    ~PiPacer();
+
+    // Start the deadlines now, 'fps' per second. Call on the thread which waits, whose
+    // timer slack is lowered for it.
+    void start(int fps);
+
+    // Sleep until the next deadline. Return false once stop() is called.
+    bool wait();
+
+    // Stop wait() from another thread, within STOP_CHECK_NSEC
+    void stop();
+
+    PiPacerStats stats() const;
+
+    // Longest sleep between the checks of stop()
+    static const int64_t STOP_CHECK_NSEC = 100000000;
+
+private:
+    int64_t deadline(int64_t tick) const;
+
+    int mFps;
+    int64_t mStart;         // nsec of the tick 0, advanced by a second every mFps ticks
+    int64_t mTick;          // last deadline waited for
+    volatile bool mStop;
+
+    mutable pthread_mutex_t mMutex; // guards the statistics below
+    uint64_t mTicks;
+    uint64_t mMissed;
+    double mLateMean;       // Welford's running mean and sum of squares
+    double mLateM2;
+    int64_t mLateMax;
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "PiFrameSource.h"
+#include "PiBuffer.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+
+/**
+ * Incremental parser of a multipart/x-mixed-replace body. The reader writes the
+ * received bytes to writePointer(). While a part has a Content-Length, that is the
+ * frame buffer itself, so the body of a part is never copied before onFrame().
+ * Only the part headers go through a small scratch buffer.
+ */
+class PiMultipartParser {
+public:
+    static const size_t MAX_HEADER_SIZE = 4096;
+    static const size_t MAX_FRAME_SIZE = 16 * 1024 * 1024;
+
+    PiMultipartParser();
+
+    // Start a stream with the boundary of the Content-Type, without the leading "--"
+    int reset(const char* boundary, size_t length);
+
+    // Where the next received bytes go, and how many bytes fit. NULL if out of memory.
+    uint8_t* writePointer(size_t* available);
+
+    // Parse 'size' bytes written at writePointer(), and pass the complete parts to 'listener'.
+    // Return EPROTO on a malformed stream, ECONNRESET at the closing boundary.
+    int commit(size_t size, PiCameraListener* listener);
+
+    // Copy 'size' bytes through writePointer() and commit()
+    int feed(const uint8_t* data, size_t size, PiCameraListener* listener);
+
+    uint64_t frames() const {
+        return mFrames;
+    }
+
+    // Parts which weren't a complete JPEG, not passed to the listener
+    uint64_t invalidFrames() const {
+        return mInvalidFrames;
+    }
+
+private:
+    enum State {
+        STATE_HEADER,   // reading the delimiter and the part headers into mHeader
+        STATE_BODY,     // reading mLength bytes into mFrame
+        STATE_SCAN,     // reading into mFrame until the next delimiter (no Content-Length)
+    };
+
+    int parse(size_t size, const uint8_t** rest, size_t* rest_length, PiCameraListener* listener);
+    int parseHeader(const uint8_t** rest, size_t* rest_length);
+    int scanBody(const uint8_t** rest, size_t* rest_length, PiCameraListener* listener);
+    void publishFrame(PiCameraListener* listener);
+
+    State mState;
+    std::string mDelimiter;         // "\r\n--" + boundary
+    char mHeader[MAX_HEADER_SIZE];
+    size_t mHeaderLength;
+    DinamicBuffer mFrame;
+    size_t mLength;                 // Content-Length of the current part
+    size_t mScanned;                // bytes of mFrame searched for the delimiter
+    StaticBuffer mRest;             // bytes read after the end of a header or a part
+    uint64_t mFrames;
+    uint64_t mInvalidFrames;
+};
+
+/**
+ * Frame source which pulls an MJPEG stream of another server, ex) a Pi running
+ * pimjpg_srv, and publishes its frames like the camera. It reconnects with a backoff
+ * while it exists.
+ */
+class PiRelaySource : public PiFrameSource {
+public:
+    // 'url' is http://host[:port]/path
+    PiRelaySource(const std::string& url, PiCameraListener* listener, int* status);
+    ~PiRelaySource();
+
+    PiCameraStats stats() const;
+
+    // Split an http:// URL. Return EINVAL if it isn't supported.
+    static int parseUrl(const std::string& url, std::string* host, std::string* port, std::string* path);
+
+private:
+    static void* run(void* arg);
+    void loop();
+    int connectUpstream();
+    int readResponse(int fd, PiMultipartParser* parser);
+    bool sleepBackoff(int msec);
+
+    PiCameraListener* mListener;
+    std::string mHost;
+    std::string mPort;
+    std::string mPath;
+    pthread_t mThread;
+    pthread_mutex_t mMutex;
+    pthread_cond_t mCond;
+    bool mStop;
+    int mSocket;            // shut down by the destructor to stop a blocking recv()
+    uint64_t mFrames;       // frames published
+    uint64_t mInvalidFrames;
+    uint64_t mConnects;     // connections to the upstream
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "PiFrameSource.h"
+#include "PiPacer.h"
+#include "PiBuffer.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * Frame source which replays the JPEG frames of a file in a loop, ex) a dump of a
+ * stream for a reproducible load, or a single JPEG as a test pattern. The frames are
+ * loaded once and published at the fps of the settings by a PiPacer, so the clients
+ * see the cadence of a camera without one.
+ */
+class PiReplaySource : public PiFrameSource {
+public:
+    PiReplaySource(const std::string& path, int fps, PiCameraListener* listener, int* status);
+    ~PiReplaySource();
+
+    PiCameraStats stats() const;
+
+    // Split the JPEG frames of a file. Return ENOENT if there are none.
+    static int load(const std::string& path, std::vector<DinamicBuffer*>* frames);
+
+private:
+    static void* run(void* arg);
+    void loop();
+
+    PiCameraListener* mListener;
+    const int mFps;
+    std::vector<DinamicBuffer*> mFrames;
+    PiPacer mPacer;
+    pthread_t mThread;
+    uint64_t mPublished;    // frames published
+};
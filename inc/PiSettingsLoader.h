@@ -0,0 +1,39 @@
+#pragma once
+
+#include "PiMjpgServer.h"
+
+/**
+ * Fill PiServerSettings from the command line and a config file.
+ * The server options are listed in the table of PiSettingsLoader.cc, and any
+ * other option is passed to the camera parameters (cmdline_commands of RaspiCamControl.c).
+ *
+ * Command line: pimjpg_srv -c pimjpg_srv.conf --port 8081 --fps 30 -sh 20 -vs
+ * Config file:  one "name = value" per line, '#' starts a comment, flags take 1/0.
+ */
+class PiSettingsLoader {
+public:
+    // Returned by parseArgs() when the help was displayed
+    static const int HELP_REQUESTED = -1;
+
+    PiSettingsLoader(PiServerSettings& settings);
+
+    // Apply the command line. The config file is loaded first, the other arguments override it.
+    int parseArgs(int argc, char** argv);
+
+    // Apply a config file
+    int loadFile(const char* path);
+
+    // Check the combination of the settings. Return non-zero if the server can't start with them.
+    int validate() const;
+
+    // Print the effective settings to stderr
+    void dump() const;
+
+    static void displayHelp(const char* program);
+
+private:
+    int set(const char* name, const char* value, int* used);
+    int setFromFile(const std::string& name, const std::string& value);
+
+    PiServerSettings& mSettings;
+};
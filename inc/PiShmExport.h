@@ -0,0 +1,116 @@
+#pragma once
+
+#include "PiCameraManager.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define PISHM_MAGIC 0x5053484d // "PSHM"
+#define PISHM_VERSION 1
+
+enum PiShmFormat {
+    PISHM_FORMAT_JPEG = 0,
+    PISHM_FORMAT_I420 = 1
+};
+
+/**
+ * Layout of the shared memory, for the consumers too. The header is followed by
+ * 'slot_count' slots of 'slot_stride' bytes, and the data of a slot starts at
+ * PISHM_SLOT_DATA_OFFSET in it. A slot is a seqlock: 'lock' is odd while the slot
+ * is written. A consumer reads 'lock', uses the slot in place, and discards what it
+ * has read if 'lock' has changed after that.
+ */
+struct PiShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_stride;
+    uint32_t slot_size;         // max bytes of the data of a slot
+    uint32_t header_size;       // offset of the first slot
+    uint64_t sequence;          // newest published frame
+};
+
+struct PiShmSlot {
+    uint64_t lock;
+    uint64_t sequence;
+    int64_t timestamp_us;       // usec since epoch
+    uint32_t format;            // PiShmFormat
+    uint32_t size;
+    uint32_t width;             // of PISHM_FORMAT_I420, 0 for JPEG
+    uint32_t height;
+    uint32_t stride;            // bytes per row of the Y plane, the U and V planes have the half
+    uint32_t slice_height;      // rows of the Y plane including the padding
+};
+
+#define PISHM_SLOT_DATA_OFFSET 64
+
+/**
+ * Sent on the Unix socket (SOCK_SEQPACKET). The first message is a PiShmHeader
+ * with the memfd (SCM_RIGHTS), then one notice per published frame. A consumer
+ * which doesn't read its notices misses some, but never blocks the camera.
+ */
+struct PiShmNotice {
+    uint64_t sequence;
+    int64_t timestamp_us;
+    uint32_t slot;
+    uint32_t format;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+struct PiShmExportStats {
+    uint64_t frames;            // frames written to the slots
+    uint64_t too_large;         // frames larger than slot_size, not exported
+    uint64_t notices_dropped;   // notices not sent because a consumer's socket was full
+    int consumers;
+
+    PiShmExportStats() : frames(0), too_large(0), notices_dropped(0), consumers(0) {}
+};
+
+/**
+ * Export of the frames to local processes through a memfd ring, announced on a
+ * Unix socket. The frames are copied once into the ring by the capture (or the
+ * splitter) thread, and consumers map the ring and read them without any further
+ * copy. The camera runs while a consumer is connected, like while an HTTP client
+ * streams.
+ */
+class PiShmExport : public PiFrameSink {
+public:
+    // 'raw' also exports the I420 frames of the splitter
+    PiShmExport(PiCameraManager& manager, const std::string& path, int slot_count, size_t slot_size, bool raw,
+            int* status);
+    ~PiShmExport();
+
+    // PiFrameSink
+    void onFrame(const DinamicBuffer& buffer, uint64_t sequence, int64_t timestamp_us);
+    void onRawFrame(const PiRawFrame& frame);
+
+    // Write a frame described by 'info' (except 'lock') to the next slot, and notify the consumers
+    void publish(const PiShmSlot& info, const uint8_t* data);
+
+    PiShmExportStats stats();
+
+private:
+    static void* run(void* arg);
+    void loop();
+    void accept();
+    void removeConsumer(int fd);
+
+    PiCameraManager& mManager;
+    std::string mPath;
+    int mMemFd;
+    int mReadOnlyFd;                // reopened read-only, sent to the consumers
+    uint8_t* mMap;
+    size_t mMapSize;
+    PiShmHeader* mHeader;
+    uint32_t mNextSlot;
+    bool mRaw;
+    int mListenFd;
+    int mWakeFds[2];                // self-pipe to stop the thread
+    pthread_t mThread;
+    pthread_mutex_t mMutex;         // mConsumers and mStats, the capture thread also takes it
+    std::vector<int> mConsumers;
+    bool mSinkAdded;
+    PiShmExportStats mStats;
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <sched.h>
+#include <pthread.h>
+#include <string>
+
+enum PiThreadRole {
+    THREAD_CAPTURE = 0, // MMAL encoder callback, which also copies the frame to the clients
+    THREAD_DISPATCH,    // publishers of the send backends and the thumbnail worker
+    THREAD_NETWORK,     // accept loop, client threads and the send workers
+    NUM_THREAD_ROLES
+};
+
+struct PiThreadPolicy {
+    std::string cpus;  // cpu list such as "2" or "0,2-3", empty if not pinned
+    int rt_priority;   // SCHED_FIFO priority 1-99, 0 for the default scheduling
+
+    PiThreadPolicy() : rt_priority(0) {}
+};
+
+/**
+ * Scheduling of the threads of the server, and the registry of them for metrics.
+ * A thread calls enter() when it starts, which applies the policy of its role,
+ * and leave() before it exits. The cpu time of the threads which have left is
+ * kept per role, so short-lived client threads are still accounted.
+ */
+class PiThreads {
+public:
+    // Set the policies of the roles. Call before starting the threads, from a thread
+    // which isn't pinned: its affinity is given to the roles without cpus.
+    static void configure(const PiThreadPolicy* policies);
+
+    // Register the calling thread, and apply the policy of 'role'.
+    // Does nothing if the thread is already registered, so it can be called on every callback.
+    static int enter(PiThreadRole role, const char* name);
+
+    // Unregister the calling thread
+    static void leave();
+
+    // Per thread and per role cpu usage in the text exposition format of Prometheus
+    static std::string metrics();
+
+    // Parse a cpu list like "0,2-3". Return non-zero if it is invalid.
+    static int parseCpuList(const char* list, cpu_set_t* set);
+
+    static const char* roleName(PiThreadRole role);
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "PiBuffer.h"
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <vector>
+
+class PiFrame;
+
+struct PiThumbnailStats {
+    uint64_t transcoded;     // number of transcoded source frames
+    uint64_t dropped;        // source frames replaced before the worker picked them up
+    uint64_t cpu_nsec;       // total cpu time of the worker spent in transcode()
+    uint64_t out_bytes;      // total size of the produced thumbnails
+
+    PiThumbnailStats() : transcoded(0), dropped(0), cpu_nsec(0), out_bytes(0) {}
+};
+
+/**
+ * Produce a downscaled copy of the JPEG stream.
+ * The source JPEG is decoded at 1/2, 1/4 or 1/8 scale inside the IDCT of libjpeg
+ * and encoded again on a worker thread which runs from the first subscriber until
+ * the thumbnailer is deleted.
+ * Each source frame is transcoded once and shared by all subscribers.
+ */
+class PiThumbnailer {
+public:
+    PiThumbnailer(int scale_denom, int quality, int* status);
+    ~PiThumbnailer();
+
+    int attach(PiFrame* frame);
+    bool detach(PiFrame* frame);
+    size_t numSubscribers();
+
+    // Called from PiCameraManager::onFrame
+    void submit(const DinamicBuffer& buffer, uint64_t sequence, int64_t timestamp_us,
+            const timespec& now, long slack_nsec);
+
+    PiThumbnailStats stats();
+    inline int scaleDenom() const { return mScaleDenom; }
+
+    // Decode 'src' at 1/scale_denom and encode it to 'dst'
+    static int transcode(const uint8_t* src, size_t length, int scale_denom, int quality, StaticBuffer& dst, size_t* dst_length);
+
+    static bool isSupportedScale(int scale_denom);
+
+private:
+    static void* run_worker(void* arg);
+    void doWork();
+    void stopWorker();
+
+    const int mScaleDenom;
+    const int mQuality;
+    bool mInitialized;      // mMutex and mCond, false if the constructor has failed
+
+    pthread_mutex_t mMutex;
+    pthread_cond_t mCond;
+    pthread_t mThread;
+    bool mThreadRunning;
+    bool mStopRequested;
+
+    std::vector<PiFrame*> mSubscribers;
+
+    // Latest source frame waiting for the worker
+    StaticBuffer mPending;
+    size_t mPendingLength;
+    uint64_t mPendingSequence;
+    int64_t mPendingTimestamp;
+    std::vector<PiFrame*> mPendingTargets;
+    bool mHasPending;
+
+    // Transcoded output of the source frame mCachedSequence
+    StaticBuffer mCached;
+    size_t mCachedLength;
+    uint64_t mCachedSequence;
+    int64_t mCachedTimestamp;
+
+    PiThumbnailStats mStats;
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/**
+ * Spans of the frame path, exported in the trace event format of Chrome, which
+ * chrome://tracing and ui.perfetto.dev open. Each thread records its spans into
+ * its own ring, so recording takes no lock. While disabled, a span costs a load
+ * of a flag. The ring of an exited thread is given to the next new thread.
+ */
+class PiTrace {
+public:
+    // Spans kept per thread, the older ones are overwritten. Must be a power of 2.
+    static const uint32_t EVENTS_PER_THREAD = 2048;
+
+    static void enable(bool enabled);
+
+    static bool isEnabled() {
+        return __atomic_load_n(&sEnabled, __ATOMIC_RELAXED);
+    }
+
+    // CLOCK_MONOTONIC in nsec
+    static uint64_t now();
+
+    // Record a span of the calling thread. 'name' must be a string literal.
+    static void record(const char* name, uint64_t begin_ns, uint64_t end_ns, long arg);
+
+    // {"traceEvents":[...]} of the spans in the rings
+    static std::string dumpJson();
+
+    static int dumpToFile(const std::string& path);
+
+    // Dump to 'path' whenever the process gets 'signum'. Call from the main thread before
+    // any other thread starts, because the signal is blocked in the threads created after.
+    static int dumpOnSignal(int signum, const std::string& path);
+
+private:
+    static bool sEnabled;
+};
+
+/** Record the lifetime of the scope as a span, ex) PI_TRACE("send", size) */
+class PiTraceScope {
+public:
+    PiTraceScope(const char* name, long arg) : mName(NULL), mBegin(0), mArg(arg) {
+        if (PiTrace::isEnabled()) {
+            mName = name;
+            mBegin = PiTrace::now();
+        }
+    }
+
+    ~PiTraceScope() {
+        if (mName) {
+            PiTrace::record(mName, mBegin, PiTrace::now(), mArg);
+        }
+    }
+
+    // Replace the argument, ex) with a size known at the end of the span
+    void setArg(long arg) {
+        mArg = arg;
+    }
+
+private:
+    const char* mName; // NULL if it was disabled at the beginning
+    uint64_t mBegin;
+    long mArg;
+};
+
+#define PI_TRACE_CONCAT2(a, b) a##b
+#define PI_TRACE_CONCAT(a, b) PI_TRACE_CONCAT2(a, b)
+#define PI_TRACE(name, arg) PiTraceScope PI_TRACE_CONCAT(pi_trace_scope_, __LINE__)((name), (long)(arg))
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct PiUpgradeFrame {
+    std::vector<uint8_t> jpeg; // empty if the previous process had no frame
+    uint64_t sequence;
+    int64_t timestamp_us;
+
+    PiUpgradeFrame() : sequence(0), timestamp_us(0) {}
+};
+
+/**
+ * Hot upgrade over a Unix socket. The running process listens on 'path'. A new
+ * process connects to it, and receives the listening TCP socket (SCM_RIGHTS) and
+ * the most recent frame. The old process then stops accepting and drains its
+ * clients, while the new one keeps accepting on the same socket, so no connection
+ * is refused. The new process opens the camera after the old one has exited.
+ */
+class PiUpgrade {
+public:
+    PiUpgrade();
+    ~PiUpgrade();
+
+    // Take over the listening socket from the process running on 'path'.
+    // Return ENOENT or ECONNREFUSED if there is none.
+    int takeOver(const std::string& path, int* listen_fd, PiUpgradeFrame* frame);
+
+    // Wait until the previous process exits, which releases the camera.
+    int waitPrevious(int timeout_ms);
+
+    // Listen on 'path' for the next process
+    int listen(const std::string& path);
+
+    // Listening Unix socket to poll, -1 if not listening
+    int fd() const {
+        return mListenFd;
+    }
+
+    // Accept the next process, and hand 'listen_fd' and 'frame' over to it.
+    // The connection is kept until this object is deleted, which tells the next
+    // process that the camera is released.
+    int handOver(int listen_fd, const PiUpgradeFrame& frame);
+
+private:
+    void closeListener(bool unlink_path);
+
+    std::string mPath;
+    int mListenFd;
+    int mPeerFd; // connection to the previous or the next process
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <vector>
+
+struct PiUringStats {
+    uint64_t enter_calls;  // number of io_uring_enter syscalls
+    uint64_t submitted;    // number of submitted SQEs
+    uint64_t completed;    // number of reaped CQEs
+
+    PiUringStats() : enter_calls(0), submitted(0), completed(0) {}
+};
+
+/**
+ * Minimal io_uring on the raw syscalls, only with the operations to send frames.
+ * Not thread safe, the owner serializes the calls except waitCompletions().
+ */
+class PiUring {
+public:
+    struct Completion {
+        uint64_t user_data;
+        int32_t result; // sent bytes, or -errno
+    };
+
+    PiUring(unsigned entries, int* status);
+    ~PiUring();
+
+    // Register the buffers for prepareWriteFixed(). Call while nothing is in flight.
+    int registerBuffers(const iovec* buffers, unsigned num);
+
+    // Queue a send. Return ENOSPC if the submission queue is full.
+    int prepareWriteFixed(int fd, const void* buf, size_t length, int buf_index, uint64_t user_data);
+    int prepareSend(int fd, const void* buf, size_t length, uint64_t user_data);
+    int prepareNop(uint64_t user_data);
+
+    // Submit the queued SQEs with one syscall, and wait for 'wait_nr' completions.
+    int submit(unsigned wait_nr);
+
+    // Block until a completion arrives, without submitting. Can run in parallel with submit().
+    int waitCompletions();
+
+    // Append the available completions to 'completions', and return the number of them.
+    size_t reap(std::vector<Completion>& completions);
+
+    inline const PiUringStats& stats() const { return mStats; }
+
+private:
+    void* getSqe();
+
+    int mFd;
+    void* mRing;
+    size_t mRingSize;
+    void* mSqes;
+    size_t mSqesSize;
+
+    unsigned* mSqHead;
+    unsigned* mSqTail;
+    unsigned mSqMask;
+    unsigned mSqEntries;
+    unsigned* mSqArray;
+    unsigned* mCqHead;
+    unsigned* mCqTail;
+    unsigned mCqMask;
+    void* mCqes;
+
+    unsigned mToSubmit;
+    PiUringStats mStats;
+};
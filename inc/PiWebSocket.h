@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/**
+ * Minimal WebSocket (RFC 6455) support for streaming frames to browsers.
+ * The server only sends unfragmented binary messages, and reads the short
+ * control/ack messages that browsers send back.
+ */
+class PiWebSocket {
+public:
+    enum Opcode {
+        OP_CONTINUATION = 0x0,
+        OP_TEXT = 0x1,
+        OP_BINARY = 0x2,
+        OP_CLOSE = 0x8,
+        OP_PING = 0x9,
+        OP_PONG = 0xA
+    };
+
+    // Size of the metadata put before each JPEG in a binary message:
+    // uint64 sequence, int64 timestamp (usec since epoch), both big endian.
+    static const size_t METADATA_SIZE = 16;
+
+    // Max size of the header written by makeHeader()
+    static const size_t MAX_HEADER_SIZE = 10;
+
+    // Largest message accepted from a client
+    static const size_t MAX_MESSAGE_SIZE = 4096;
+
+    struct Message {
+        Opcode opcode;
+        std::string payload;
+    };
+
+    PiWebSocket();
+
+    // Value of Sec-WebSocket-Accept for the Sec-WebSocket-Key of a client
+    static std::string acceptKey(const std::string& key);
+
+    // Write the frame header of an unmasked server message, and return its size.
+    static size_t makeHeader(Opcode opcode, uint64_t payload_length, uint8_t* out);
+
+    // Write the metadata prefix of a frame message
+    static void makeMetadata(uint64_t sequence, int64_t timestamp_us, uint8_t* out);
+
+    // Parse the bytes received from a client. Complete messages are appended to 'messages'.
+    // Return non-zero if the stream is broken (protocol error or too large message).
+    int feed(const uint8_t* data, size_t length, std::vector<Message>& messages);
+
+private:
+    std::vector<uint8_t> mPending;
+    std::string mFragments;
+    Opcode mFragmentOpcode;     // of the fragmented message, OP_CONTINUATION if none is in progress
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct PiZeroCopyStats {
+    uint64_t sends;     // send() calls with MSG_ZEROCOPY
+    uint64_t copied;    // of them, completed by a copy in the kernel
+    uint64_t waits;     // send() had to wait for a completion
+
+    PiZeroCopyStats() : sends(0), copied(0), waits(0) {}
+};
+
+class PiSharedFrame;
+
+/**
+ * MSG_ZEROCOPY sends for a client socket.
+ * The kernel keeps referring to the pages of a sent frame until the completion is
+ * read from the error queue of the socket. The frames are sent from the PiSharedFrame
+ * of the publisher, which is pinned by a reference until all of its sends have
+ * completed, so a client has no copy of its own. Up to two frames are in flight.
+ */
+class PiZeroCopy {
+public:
+    // Zerocopy is disabled if 'threshold' is 0 or the socket doesn't support it.
+    PiZeroCopy(int socket, size_t threshold);
+    ~PiZeroCopy();
+
+    inline bool enabled() const { return mEnabled; }
+    inline bool useFor(size_t length) const { return mEnabled && length >= mThreshold; }
+
+    // Send 'frame', and take over its reference, which is released after the completions.
+    // Wait up to 'timeout_ms' if the kernel still holds the frames of the previous sends.
+    int send(PiSharedFrame* frame, int timeout_ms);
+
+    inline const PiZeroCopyStats& stats() const { return mStats; }
+
+private:
+    static const int MAX_IN_FLIGHT = 2;
+
+    struct InFlight {
+        PiSharedFrame* frame; // NULL if the entry is free
+        uint32_t first_id;    // notification id of the first send of the frame
+        uint32_t count;       // number of sends
+        uint32_t completed;   // number of completed sends
+    };
+
+    int readCompletions(int timeout_ms);
+    void complete(uint32_t lo, uint32_t hi, bool copied);
+
+    const int mSocket;
+    const size_t mThreshold;
+    bool mEnabled;
+    InFlight mInFlight[MAX_IN_FLIGHT];
+    int mCurrent;
+    uint32_t mNextId;
+    int mCopiedInRow;
+    PiZeroCopyStats mStats;
+};
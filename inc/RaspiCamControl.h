@@ -127,7 +127,7 @@ typedef struct
 } PARAM_FLOAT_RECT_T;
 
 /// struct contain camera settings
-typedef struct
+typedef struct RASPICAM_CAMERA_PARAMETERS
 {
    int sharpness;             /// -100 to 100
    int contrast;              /// -100 to 100
@@ -0,0 +1,438 @@
+#include "PiBroadcaster.h"
+#include "PiCameraManager.h"
+#include "PiFrame.h"
+#include "PiUring.h"
+#include "PiThreads.h"
+#include "PiException.h"
+#include "PiLog.h"
+#include "PiTrace.h"
+#include "PiClock.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <algorithm>
+
+// Submission queue size, which is also the max number of clients sent in one batch
+#define URING_ENTRIES 256
+
+// Room for the multipart header in front of the JPEG in each slot
+#define HEADER_RESERVE 128
+
+#define PUBLISHER_WAIT_SEC 1
+
+/** Constructor */
+PiBroadcaster::PiBroadcaster(PiCameraManager& manager, const PiCamSettings& settings,
+        const std::string& boundary, const timeval& timeout_sending, int* status)
+        : mManager(manager), mBoundary(boundary),
+        mTimeoutNs(PiClock::toNsec(timeout_sending)),
+        mUring(NULL), mFixedBuffers(false), mPublisher(0), mReaper(0),
+        mRunning(false), mStopRequested(false), mShutdown(false) {
+
+    if (status) *status = 0;
+
+    int ret = pthread_mutex_init(&mMutex, NULL);
+    if (ret == 0) ret = pthread_cond_init(&mCond, NULL);
+    if (ret) {
+        fprintf(stderr, "PiBroadcaster() mutex/cond init err=%d\n", ret);
+        if (status) *status = ret;
+        return;
+    }
+
+    mUring = new PiUring(URING_ENTRIES, &ret);
+    if (mUring == NULL || ret != 0) {
+        if (status) *status = mUring ? ret : ENOMEM;
+        delete mUring; mUring = NULL;
+        return;
+    }
+
+    // Same initial size as the tmp_buffer of a client thread
+    iovec iov[NUM_SLOTS];
+    for (int i = 0; i < NUM_SLOTS; i++) {
+        mSlots[i].length = 0;
+        mSlots[i].refs = 0;
+        if ((ret = mSlots[i].buffer.realloc(HEADER_RESERVE + settings.width * settings.height * 3)) != 0) {
+            if (status) *status = ret;
+            return;
+        }
+        iov[i].iov_base = mSlots[i].buffer.values;
+        iov[i].iov_len = mSlots[i].buffer.alloc_size;
+    }
+
+    // Pinning may fail under a small RLIMIT_MEMLOCK, then plain sends are used.
+    ret = mUring->registerBuffers(iov, NUM_SLOTS);
+    mFixedBuffers = (ret == 0);
+    if (!mFixedBuffers) {
+        fprintf(stderr, "PiBroadcaster: couldn't register buffers err=%d, use IORING_OP_SEND\n", ret);
+    }
+}
+
+/** Destructor */
+PiBroadcaster::~PiBroadcaster() {
+    stop();
+    stopWorkers();
+
+    delete mUring;
+    pthread_cond_destroy(&mCond);
+    pthread_mutex_destroy(&mMutex);
+}
+
+int PiBroadcaster::serve(int socket) {
+    Client client;
+    client.socket = socket;
+    client.slot = -1;
+    client.offset = 0;
+    client.done = false;
+    client.status = 0;
+
+    pthread_mutex_lock(&mMutex);
+    if (mShutdown) {
+        pthread_mutex_unlock(&mMutex);
+        return ESHUTDOWN;
+    }
+
+    TRAP1(catched, msg, mClients.push_back(&client););
+    if (catched) {
+        pthread_mutex_unlock(&mMutex);
+        fprintf(stderr, "Error in mClients.push_back msg=%s\n", msg.c_str());
+        return ENOMEM;
+    }
+
+    int status = mRunning ? 0 : startWorkers();
+    if (status) {
+        finish(&client, status);
+    }
+
+    // The completion of the last send refers to 'client', so wait for it too.
+    while (!client.done || client.slot >= 0) {
+        pthread_cond_wait(&mCond, &mMutex);
+    }
+
+    mClients.erase(std::find(mClients.begin(), mClients.end(), &client));
+    bool last = mClients.empty();
+    pthread_mutex_unlock(&mMutex);
+
+    if (last) {
+        stopWorkers();
+    }
+    return client.status;
+}
+
+void PiBroadcaster::stop() {
+    pthread_mutex_lock(&mMutex);
+    mShutdown = true;
+    std::vector<Client*>::iterator it = mClients.begin();
+    for (; it != mClients.end(); it++) {
+        finish(*it, ESHUTDOWN);
+    }
+    pthread_mutex_unlock(&mMutex);
+}
+
+PiBroadcastStats PiBroadcaster::stats() {
+    pthread_mutex_lock(&mMutex);
+    PiBroadcastStats s = mStats;
+    pthread_mutex_unlock(&mMutex);
+    return s;
+}
+
+/** Mark the client as finished, and abort its send in flight. Call with mMutex. */
+void PiBroadcaster::finish(Client* client, int status) {
+    if (!client->done) {
+        client->done = true;
+        client->status = status;
+    }
+    if (client->slot >= 0) {
+        // The pending send fails, and its completion releases the slot.
+        shutdown(client->socket, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&mCond);
+}
+
+/** Start the threads. Call with mMutex. */
+int PiBroadcaster::startWorkers() {
+    mStopRequested = false;
+
+    int status = pthread_create(&mReaper, NULL, run_reaper, this);
+    if (status) {
+        fprintf(stderr, "Failed to create the reaper thread status=%d\n", status);
+        return status;
+    }
+
+    status = pthread_create(&mPublisher, NULL, run_publisher, this);
+    if (status) {
+        fprintf(stderr, "Failed to create the publisher thread status=%d\n", status);
+        mStopRequested = true;
+        mUring->prepareNop(0);
+        mUring->submit(0);
+        pthread_mutex_unlock(&mMutex);
+        pthread_join(mReaper, NULL);
+        pthread_mutex_lock(&mMutex);
+        return status;
+    }
+
+    mRunning = true;
+    return 0;
+}
+
+/** Stop the threads if no client is left */
+void PiBroadcaster::stopWorkers() {
+    pthread_mutex_lock(&mMutex);
+    if (!mRunning || !mClients.empty()) {
+        pthread_mutex_unlock(&mMutex);
+        return;
+    }
+    mStopRequested = true;
+    // Wake the reaper up by a completion
+    mUring->prepareNop(0);
+    mUring->submit(0);
+    pthread_mutex_unlock(&mMutex);
+
+    pthread_join(mPublisher, NULL);
+    pthread_join(mReaper, NULL);
+
+    pthread_mutex_lock(&mMutex);
+    mRunning = false;
+    PiBroadcastStats s = mStats;
+    PiUringStats u = mUring->stats();
+
+    // A client may have come while stopping.
+    if (!mClients.empty()) {
+        int status = startWorkers();
+        if (status) {
+            std::vector<Client*>::iterator it = mClients.begin();
+            for (; it != mClients.end(); it++) {
+                finish(*it, status);
+            }
+        }
+    }
+    pthread_mutex_unlock(&mMutex);
+
+    if (s.frames) {
+        PI_LOG(PILOG_INFO, 0, "broadcast: frames=%lu deliveries=%lu dropped=%lu syscalls/1000 frames=%lu",
+                (long)s.frames, (long)s.deliveries, (long)s.dropped, (long)(u.enter_calls * 1000 / s.frames));
+    }
+}
+
+/** Queue the rest of the slot of the client. Call with mMutex. */
+int PiBroadcaster::prepareSend(Client* client) {
+    const Slot& slot = mSlots[client->slot];
+    const uint8_t* data = slot.buffer.values + client->offset;
+    size_t length = slot.length - client->offset;
+    uint64_t user_data = (uint64_t)(uintptr_t)client;
+
+    if (mFixedBuffers) {
+        return mUring->prepareWriteFixed(client->socket, data, length, client->slot, user_data);
+    }
+    return mUring->prepareSend(client->socket, data, length, user_data);
+}
+
+void* PiBroadcaster::run_publisher(void* arg) {
+    PiBroadcaster* self = static_cast<PiBroadcaster*>(arg);
+    PiThreads::enter(THREAD_DISPATCH, "broadcast-publisher");
+    uint64_t start = PiClock::threadCpuNsec();
+    TRAP_LOG(self->publish(););
+    PiThreads::leave();
+
+    pthread_mutex_lock(&self->mMutex);
+    self->mStats.cpu_nsec += PiClock::threadCpuNsec() - start;
+    pthread_mutex_unlock(&self->mMutex);
+    return NULL;
+}
+
+void* PiBroadcaster::run_reaper(void* arg) {
+    PiBroadcaster* self = static_cast<PiBroadcaster*>(arg);
+    PiThreads::enter(THREAD_NETWORK, "broadcast-reaper");
+    uint64_t start = PiClock::threadCpuNsec();
+    TRAP_LOG(self->reap(););
+    PiThreads::leave();
+
+    pthread_mutex_lock(&self->mMutex);
+    self->mStats.cpu_nsec += PiClock::threadCpuNsec() - start;
+    pthread_mutex_unlock(&self->mMutex);
+    return NULL;
+}
+
+void PiBroadcaster::publish() {
+    PiFrame* frame = NULL;
+
+    while (!mStopRequested) {
+        if (frame == NULL) {
+            frame = mManager.attach();
+            if (frame == NULL) {
+                // The camera isn't available, so let the clients go.
+                pthread_mutex_lock(&mMutex);
+                std::vector<Client*>::iterator it = mClients.begin();
+                for (; it != mClients.end(); it++) {
+                    finish(*it, ENODEV);
+                }
+                pthread_mutex_unlock(&mMutex);
+                sleep(PUBLISHER_WAIT_SEC);
+                continue;
+            }
+        }
+
+        int status = frame->waitForReady(PUBLISHER_WAIT_SEC);
+        if (status == ETIMEDOUT) {
+            continue;
+        } else if (status) {
+            PI_LOG(PILOG_ERROR, status, "PiBroadcaster: error in waitForReady");
+            break;
+        }
+
+        // Find a slot which no client is sending.
+        pthread_mutex_lock(&mMutex);
+        int index = -1;
+        for (int i = 0; i < NUM_SLOTS && index < 0; i++) {
+            if (mSlots[i].refs == 0) index = i;
+        }
+        if (index < 0) {
+            mStats.no_slot++;
+        }
+        pthread_mutex_unlock(&mMutex);
+        if (index < 0) {
+            continue;
+        }
+
+        // The slot is only written here, and no send refers to it.
+        Slot& slot = mSlots[index];
+        if ((status = frame->lock(3)) != 0) {
+            PI_LOG(PILOG_ERROR, status, "PiBroadcaster: error in PiFrame#lock");
+            continue;
+        }
+
+        size_t frame_size = frame->length;
+        char header[HEADER_RESERVE];
+        int header_length = snprintf(header, sizeof(header),
+                "\r\n"
+                "--%s\r\n"
+                "Content-Type: image/jpeg\r\n"
+                "Content-Length: %lu\r\n"
+                "\r\n",
+                mBoundary.c_str(), (unsigned long)frame_size);
+
+        bool fits = header_length > 0 && header_length < (int)sizeof(header)
+                && header_length + frame_size <= slot.buffer.alloc_size;
+        if (fits) {
+            memcpy(slot.buffer.values, header, header_length);
+            memcpy(slot.buffer.values + header_length, frame->buffer, frame_size);
+            slot.length = header_length + frame_size;
+        }
+        frame->unlock();
+
+        if (!fits) {
+            // Registered buffers can't grow while others are in flight.
+            PI_LOG(PILOG_ERROR, 0, "PiBroadcaster: frame is too large size=%lu", (long)frame_size);
+            continue;
+        }
+
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        pthread_mutex_lock(&mMutex);
+        mStats.frames++;
+        std::vector<Client*>::iterator it = mClients.begin();
+        for (; it != mClients.end(); it++) {
+            Client* client = *it;
+            if (client->done) {
+                continue;
+            }
+
+            if (client->slot >= 0) {
+                // Still sending an older frame, this one is skipped for the client.
+                mStats.dropped++;
+                if (PiClock::elapsedNsec(client->busy_since, now) > mTimeoutNs) {
+                    PI_LOG(PILOG_WARN, ETIMEDOUT, "PiBroadcaster: send timeout socket=%ld", (long)client->socket);
+                    finish(client, ETIMEDOUT);
+                }
+                continue;
+            }
+
+            client->slot = index;
+            client->offset = 0;
+            client->busy_since = now;
+            if (prepareSend(client) != 0) {
+                client->slot = -1;
+                mStats.dropped++;
+                continue;
+            }
+            slot.refs++;
+        }
+
+        // One syscall for the whole batch
+        {
+            PI_TRACE("io_uring_enter", 0);
+            status = mUring->submit(0);
+        }
+        if (status != 0) {
+            PI_LOG(PILOG_ERROR, status, "PiBroadcaster: io_uring_enter");
+        }
+        pthread_mutex_unlock(&mMutex);
+    }
+
+    if (frame) {
+        mManager.detach(frame);
+    }
+}
+
+void PiBroadcaster::reap() {
+    std::vector<PiUring::Completion> completions;
+    bool stop = false;
+
+    while (!stop) {
+        int status = mUring->waitCompletions();
+        if (status && status != EINTR) {
+            PI_LOG(PILOG_ERROR, status, "PiBroadcaster: wait completions");
+        }
+
+        pthread_mutex_lock(&mMutex);
+        completions.clear();
+        mUring->reap(completions);
+
+        bool resubmit = false;
+        std::vector<PiUring::Completion>::iterator it = completions.begin();
+        for (; it != completions.end(); it++) {
+            Client* client = (Client*)(uintptr_t)it->user_data;
+            if (client == NULL) {
+                stop = mStopRequested; // nop of stopWorkers()
+                continue;
+            }
+
+            Slot& slot = mSlots[client->slot];
+            int result = it->result;
+            if (result > 0) {
+                client->offset += result;
+                if (client->offset >= slot.length) {
+                    mStats.deliveries++;
+                } else if (!client->done) {
+                    // Short write, send the rest right away
+                    if (prepareSend(client) == 0) {
+                        resubmit = true;
+                        continue;
+                    }
+                    finish(client, ENOSPC);
+                }
+            } else if ((result == -EAGAIN || result == -EINTR) && !client->done) {
+                if (prepareSend(client) == 0) {
+                    resubmit = true;
+                    continue;
+                }
+                finish(client, ENOSPC);
+            } else if (result <= 0) {
+                finish(client, result < 0 ? -result : EPIPE);
+            }
+
+            // The slot is free for this client
+            slot.refs--;
+            client->slot = -1;
+            if (client->done) {
+                pthread_cond_broadcast(&mCond);
+            }
+        }
+
+        if (resubmit) {
+            mUring->submit(0);
+        }
+        pthread_mutex_unlock(&mMutex);
+    }
+}
@@ -1,4 +1,5 @@
 #include "PiBuffer.h"
+#include "PiTrace.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -38,6 +39,7 @@ DinamicBuffer::~DinamicBuffer() {
 }
 
 int DinamicBuffer::append(void* data, size_t size) {
+        PI_TRACE("append", size);
         size_t remaining = alloc_size - offset;
         if (remaining < size) {
             size_t new_size = alloc_size + (size * 2); // allocate two fragments once.
@@ -55,6 +57,21 @@ int DinamicBuffer::append(void* data, size_t size) {
         return 0;
     }
 
+// Grow the buffer, so that a reader can write into values + offset directly
+int DinamicBuffer::reserve(size_t size) {
+        if (alloc_size - offset >= size) {
+            return 0;
+        }
+        size_t new_size = offset + size * 2;
+        uint8_t* tmp = (uint8_t*)realloc(values, new_size);
+        if (tmp == NULL) {
+            return ENOMEM;
+        }
+        values = tmp;
+        alloc_size = new_size;
+        return 0;
+    }
+
 // Reset the offset for writing the next fragment
 void DinamicBuffer::resetOffset() {
     offset = 0;
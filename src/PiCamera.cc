@@ -1,7 +1,13 @@
 #include "PiBuffer.h"
 #include "PiCamera.h"
 #include "PiFrame.h"
+#include "PiJpegScan.h"
+#include "PiThreads.h"
+#include "PiException.h"
+#include "PiLog.h"
+#include "PiTrace.h"
 #include <stdio.h>
+#include <time.h>
 #include <bcm_host.h>
 #include <interface/vcos/vcos.h>
 #include <mmal/mmal.h>
@@ -13,6 +19,7 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+#include <interface/vmcs_host/vc_vchi_gencmd.h>
 #include "RaspiCamControl.h"
 #ifdef __cplusplus
 }
@@ -27,13 +34,47 @@ extern "C" {
 #define STILLS_FRAME_RATE_DEN 1
 /// Video render needs at least 2 buffers.
 #define VIDEO_OUTPUT_BUFFERS_NUM 3
+
+// Buffers of the raw output of the splitter
+#define RAW_BUFFERS_NUM 3
+// Starvations which make the encoder pool grow, and buffers added at a time
+#define POOL_GROW_STARVATIONS 3
+#define POOL_GROW_STEP 1
 // Layer that preview window should be displayed on
 #define PREVIEW_LAYER      2
 // Frames rates of 0 implies variable, but denominator needs to be 1 to prevent div by 0
 #define PREVIEW_FRAME_RATE_NUM 0
 #define PREVIEW_FRAME_RATE_DEN 1
 
-#define DBG
+#define DBG(...) PI_LOG(PILOG_WARN, 0, __VA_ARGS__)
+
+namespace {
+
+long elapsed_msec(const timespec& from) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from.tv_sec) * 1000 + (now.tv_nsec - from.tv_nsec) / 1000000;
+}
+
+/** Free memory of the relocatable heap of the GPU in MB, or -1 if unknown */
+int gpu_free_reloc_mb() {
+    char response[80] = "";
+    int reloc = -1;
+    if (vc_gencmd(response, sizeof response, "get_mem reloc") == 0) {
+        vc_gencmd_number_property(response, "reloc", &reloc);
+    }
+    return reloc;
+}
+
+const char* preview_name(int mode) {
+    switch (mode) {
+    case PREVIEW_NONE:     return "none";
+    case PREVIEW_RENDERER: return "renderer";
+    default:               return "null";
+    }
+}
+
+} // namespace
 
 static MMAL_STATUS_T connect_ports(MMAL_PORT_T* output_port, MMAL_PORT_T* input_port,
         MMAL_CONNECTION_T** connection) {
@@ -63,8 +104,21 @@ PiCamera::PiCamera(const PiCamSettings& settings, PiCameraListener* listener, in
         mCamera(NULL), mPreview(NULL), mCameraPreviewPort(NULL),
         mCameraVideoPort(NULL), mCameraStillPort(NULL), mPreviewInputPort(NULL),
         mCameraPreviewConnection(NULL), mEncoder(NULL), mEncoderInput(NULL),
-        mEncoderOutput(NULL), mPool(NULL), mEncoderConnection(NULL),
-        mListener(listener), mBuffer(NULL), mSettings(settings), last_encode_error(0) {
+        mEncoderOutput(NULL), mEncoderConnection(NULL),
+        mSplitter(NULL), mSplitterConnection(NULL), mRawPort(NULL), mRawPool(NULL), mRawCount(0),
+        mListener(listener), mBuffer(NULL), mSettings(settings), last_encode_error(0), mFirstFrame(true), mStarvedSinceGrow(0),
+        mControlThread(0), mControlStarted(false), mControlStop(false), mGrowRequested(false),
+        mAnnotate(*settings.camera_params), mAnnotateTime(0) {
+
+    clock_gettime(CLOCK_MONOTONIC, &mStartTime);
+    pthread_mutex_init(&mAnnotateMutex, NULL);
+    pthread_mutex_init(&mPoolsMutex, NULL);
+    pthread_mutex_init(&mControlMutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mControlCond, &attr);
+    pthread_condattr_destroy(&attr);
 
     // initialize a return code
     if (ret_status) *ret_status = MMAL_SUCCESS;
@@ -81,9 +135,8 @@ PiCamera::PiCamera(const PiCamSettings& settings, PiCameraListener* listener, in
         return;
     }
 
-    RASPICAM_CAMERA_PARAMETERS c_params;
-    // Get default settings
-    raspicamcontrol_set_defaults(&c_params);
+    // Get the settings given by the command line or the config file
+    RASPICAM_CAMERA_PARAMETERS c_params = *settings.camera_params;
     // Set camera parameters
     c_params.rotation = settings.rotation;
     // Dump parameters
@@ -91,7 +144,10 @@ PiCamera::PiCamera(const PiCamSettings& settings, PiCameraListener* listener, in
 
     // initialize gpu
     bcm_host_init();
-    
+
+    // To log how much GPU memory the pipeline takes
+    const int reloc_before = gpu_free_reloc_mb();
+
     int status = 0;
     status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &mCamera);
     if (status != MMAL_SUCCESS) {
@@ -106,6 +162,14 @@ PiCamera::PiCamera(const PiCamSettings& settings, PiCameraListener* listener, in
         return;
     }
 
+    // Select the camera before the control port is enabled
+    status = mmal_port_parameter_set_int32(mCamera->control, MMAL_PARAMETER_CAMERA_NUM, settings.camera_num);
+    if (status != MMAL_SUCCESS) {
+        fprintf(stderr, "Could not select camera %d\n", settings.camera_num);
+        if (ret_status) *ret_status = status;
+        return;
+    }
+
     mCameraPreviewPort = mCamera->output[MMAL_CAMERA_PREVIEW_PORT];
     mCameraVideoPort     = mCamera->output[MMAL_CAMERA_VIDEO_PORT];
     mCameraStillPort        = mCamera->output[MMAL_CAMERA_CAPTURE_PORT];
@@ -143,6 +207,7 @@ PiCamera::PiCamera(const PiCamSettings& settings, PiCameraListener* listener, in
         if (ret_status) *ret_status = status;
         return;
     }
+    mAnnotateTime = time(NULL);
 
     MMAL_ES_FORMAT_T *format;
 
@@ -165,40 +230,47 @@ PiCamera::PiCamera(const PiCamSettings& settings, PiCameraListener* listener, in
         return;
     }
 
-    // Create preview component
-    status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_RENDERER, &mPreview);
-    if (status != MMAL_SUCCESS) {
-        fprintf(stderr, "Unable to create preview component\n");
-        if (ret_status) *ret_status = status;
-        return;
-    }
+    // Create preview component. The renderer takes display layers and GPU memory,
+    // so headless servers use the null sink (or nothing).
+    if (settings.preview_mode != PREVIEW_NONE) {
+        const bool renderer = (settings.preview_mode == PREVIEW_RENDERER);
+        status = mmal_component_create(renderer ? MMAL_COMPONENT_DEFAULT_VIDEO_RENDERER
+                : MMAL_COMPONENT_DEFAULT_NULL_SINK, &mPreview);
+        if (status != MMAL_SUCCESS) {
+            fprintf(stderr, "Unable to create preview component\n");
+            if (ret_status) *ret_status = status;
+            return;
+        }
 
-    if (!mPreview->input_num) {
-        fprintf(stderr, "No input ports found on preview component\n");
-        if (ret_status) *ret_status = MMAL_EIO;
-        return;
-    }
+        if (!mPreview->input_num) {
+            fprintf(stderr, "No input ports found on preview component\n");
+            if (ret_status) *ret_status = MMAL_EIO;
+            return;
+        }
 
-    mPreviewInputPort = mPreview->input[0];
+        mPreviewInputPort = mPreview->input[0];
 
-    MMAL_DISPLAYREGION_T param;
-    param.hdr.id = MMAL_PARAMETER_DISPLAYREGION;
-    param.hdr.size = sizeof(MMAL_DISPLAYREGION_T);
+        if (renderer) {
+            MMAL_DISPLAYREGION_T param;
+            param.hdr.id = MMAL_PARAMETER_DISPLAYREGION;
+            param.hdr.size = sizeof(MMAL_DISPLAYREGION_T);
 
-    param.set = MMAL_DISPLAY_SET_LAYER;
-    param.layer = PREVIEW_LAYER;
+            param.set = MMAL_DISPLAY_SET_LAYER;
+            param.layer = PREVIEW_LAYER;
 
-    param.set |= MMAL_DISPLAY_SET_ALPHA;
-    param.alpha = 255;
+            param.set |= MMAL_DISPLAY_SET_ALPHA;
+            param.alpha = 255;
 
-    param.set |= MMAL_DISPLAY_SET_FULLSCREEN;
-    param.fullscreen = 1;
+            param.set |= MMAL_DISPLAY_SET_FULLSCREEN;
+            param.fullscreen = 1;
 
-    status = mmal_port_parameter_set(mPreviewInputPort, &param.hdr);
-    if (status != MMAL_SUCCESS) {
-        fprintf(stderr, "Unable to set preview port parameters\n");
-        if (ret_status) *ret_status = status;
-        return;
+            status = mmal_port_parameter_set(mPreviewInputPort, &param.hdr);
+            if (status != MMAL_SUCCESS) {
+                fprintf(stderr, "Unable to set preview port parameters\n");
+                if (ret_status) *ret_status = status;
+                return;
+            }
+        }
     }
 
     // Set encode format on the video port
@@ -221,8 +293,9 @@ PiCamera::PiCamera(const PiCamSettings& settings, PiCameraListener* listener, in
     }
 
     // Ensure there are enough buffers to avoid dropping frames
+    mCameraVideoPort->buffer_num = settings.video_buffers;
     if (mCameraVideoPort->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM) {
-        mCameraVideoPort->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM;
+        mCameraVideoPort->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
     }
 
     // Set our stills format on the stills (for encoder) port
@@ -257,12 +330,21 @@ PiCamera::PiCamera(const PiCamSettings& settings, PiCameraListener* listener, in
         return;
     }
 
-    // Enable component
-    status = mmal_component_enable(mPreview);
-    if (status != MMAL_SUCCESS) {
-        fprintf(stderr, "Unable to enable preview/null sink component\n");
-        if (ret_status) *ret_status = status;
-        return;
+    if (mPreview) {
+        // Enable component
+        status = mmal_component_enable(mPreview);
+        if (status != MMAL_SUCCESS) {
+            fprintf(stderr, "Unable to enable preview/null sink component\n");
+            if (ret_status) *ret_status = status;
+            return;
+        }
+
+        status = connect_ports(mCameraPreviewPort, mPreviewInputPort, &mCameraPreviewConnection);
+        if (status != MMAL_SUCCESS) {
+            fprintf(stderr, "Unable to connect the preview port\n");
+            if (ret_status) *ret_status = status;
+            return;
+        }
     }
 
     // Create Encoder
@@ -297,6 +379,9 @@ PiCamera::PiCamera(const PiCamSettings& settings, PiCameraListener* listener, in
     printf("Encoder Buffer Size %i\n", mEncoderOutput->buffer_size);
 
     mEncoderOutput->buffer_num = mEncoderOutput->buffer_num_recommended;
+    if (settings.encoder_buffers > 0) {
+        mEncoderOutput->buffer_num = settings.encoder_buffers;
+    }
 
     if (mEncoderOutput->buffer_num < mEncoderOutput->buffer_num_min) {
         mEncoderOutput->buffer_num = mEncoderOutput->buffer_num_min;
@@ -327,16 +412,31 @@ PiCamera::PiCamera(const PiCamSettings& settings, PiCameraListener* listener, in
         return;
     }
 
+    printf("Encoder Buffer Num %i, video port Buffer Num %i\n", mEncoderOutput->buffer_num, mCameraVideoPort->buffer_num);
+
     // Create pool of buffer headers for the output port to consume
-    mPool = mmal_port_pool_create(mEncoderOutput, mEncoderOutput->buffer_num, mEncoderOutput->buffer_size);
-    if (!mPool) {
+    MMAL_POOL_T* pool = mmal_port_pool_create(mEncoderOutput, mEncoderOutput->buffer_num, mEncoderOutput->buffer_size);
+    if (!pool) {
         fprintf(stderr, "Failed to create buffer header pool for encoder output port\n");
         if (ret_status) *ret_status = MMAL_ENOMEM;
         return;
     }
+    mPools.push_back(pool);
+    mStats.pool_size = mEncoderOutput->buffer_num;
+
+    // The splitter goes between the camera and the encoder if raw frames are tapped.
+    MMAL_PORT_T* encoder_source = mCameraVideoPort;
+    if (settings.raw_decimation > 0) {
+        status = createSplitter();
+        if (status != MMAL_SUCCESS) {
+            if (ret_status) *ret_status = status;
+            return;
+        }
+        encoder_source = mSplitter->output[0];
+    }
 
     // Now connect the camera to the encoder
-    status = connect_ports(mCameraVideoPort, mEncoder->input[0], &mEncoderConnection);
+    status = connect_ports(encoder_source, mEncoder->input[0], &mEncoderConnection);
     if (status != MMAL_SUCCESS) {
         fprintf(stderr, "Unable to connect components\n");
         if (ret_status) *ret_status = status;
@@ -354,9 +454,9 @@ PiCamera::PiCamera(const PiCamSettings& settings, PiCameraListener* listener, in
         return;
     }
 
-    int num = mmal_queue_length(mPool->queue);
+    int num = mmal_queue_length(pool->queue);
     for (int q = 0; q < num; q++) {
-        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(mPool->queue);
+        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(pool->queue);
         if (!buffer) {
             fprintf(stderr, "Unable to get a required buffer from pool queue\n");
             if (ret_status) *ret_status = MMAL_ENOMEM;
@@ -369,7 +469,9 @@ PiCamera::PiCamera(const PiCamSettings& settings, PiCameraListener* listener, in
             if (ret_status) *ret_status = status;
             return;
         }
+        mStats.in_flight++;
     }
+    mStats.min_in_flight = mStats.in_flight;
 
     status = mmal_port_parameter_set_boolean(mCameraVideoPort, MMAL_PARAMETER_CAPTURE, 1);
     if (status != MMAL_SUCCESS) {
@@ -378,41 +480,177 @@ PiCamera::PiCamera(const PiCamSettings& settings, PiCameraListener* listener, in
         return;
     }
 
-    printf("Starting capture\n");
+    if (pthread_create(&mControlThread, NULL, control_loop, this) == 0) {
+        mControlStarted = true;
+    } else {
+        fprintf(stderr, "Failed to create the camera control thread, the pool and the annotation are fixed\n");
+    }
+
+    const int reloc_after = gpu_free_reloc_mb();
+    printf("Starting capture: preview=%s, setup %ldms, GPU reloc heap used %dMB (free %dMB)\n",
+            preview_name(settings.preview_mode), elapsed_msec(mStartTime),
+            (reloc_before >= 0 && reloc_after >= 0) ? reloc_before - reloc_after : -1, reloc_after);
 }
 
 /** Destructor */
 PiCamera::~PiCamera() {
     printf("will cleanup components\n");
 
+    if (mControlStarted) {
+        pthread_mutex_lock(&mControlMutex);
+        mControlStop = true;
+        pthread_cond_signal(&mControlCond);
+        pthread_mutex_unlock(&mControlMutex);
+        pthread_join(mControlThread, NULL);
+    }
+
     if (mCameraVideoPort && mCameraVideoPort->is_enabled) mmal_port_disable(mCameraVideoPort);
     if (mCameraStillPort && mCameraStillPort->is_enabled) mmal_port_disable(mCameraStillPort);
     if (mCameraPreviewConnection) mmal_connection_destroy(mCameraPreviewConnection);
     if (mEncoder && mEncoder->output[0] && mEncoder->output[0]->is_enabled) mmal_port_disable(mEncoder->output[0]);
     if (mEncoderConnection) mmal_connection_destroy(mEncoderConnection);
+    if (mRawPort && mRawPort->is_enabled) mmal_port_disable(mRawPort);
+    if (mSplitterConnection) mmal_connection_destroy(mSplitterConnection);
     
     // Disable components
+    if (mSplitter) mmal_component_disable(mSplitter);
     if (mEncoder) mmal_component_disable(mEncoder);
     if (mPreview) mmal_component_disable(mPreview);
     if (mCamera) mmal_component_disable(mCamera);
 
     // Disable encoder component
     // Get rid of any port buffers first
-    if (mPool) mmal_port_pool_destroy(mEncoder->output[0], mPool);
+    for (size_t i = 0; i < mPools.size(); i++) {
+        mmal_port_pool_destroy(mEncoder->output[0], mPools[i]);
+    }
+
+    if (mRawPool) mmal_port_pool_destroy(mRawPort, mRawPool);
 
     // Destroy components
+    if (mSplitter) mmal_component_destroy(mSplitter);
     if (mEncoder) mmal_component_destroy(mEncoder);
     if (mPreview) mmal_component_destroy(mPreview);
     if (mCamera) mmal_component_destroy(mCamera);
 
     delete mBuffer;
 
+    if (mStats.starvations || mStats.resend_errors) {
+        printf("encoder buffers: starvations=%llu resend_errors=%llu min_in_flight=%d pool=%d grows=%d\n",
+                (unsigned long long)mStats.starvations, (unsigned long long)mStats.resend_errors,
+                mStats.min_in_flight, mStats.pool_size, mStats.grows);
+    }
+    pthread_cond_destroy(&mControlCond);
+    pthread_mutex_destroy(&mControlMutex);
+    pthread_mutex_destroy(&mPoolsMutex);
+    pthread_mutex_destroy(&mAnnotateMutex);
     printf("finished\n");
 }
 
+/** Replace the annotation. Called from the control requests. */
+int PiCamera::setAnnotate(const PiAnnotate& annotate) {
+    pthread_mutex_lock(&mAnnotateMutex);
+    mAnnotate = annotate;
+    int status = applyAnnotate();
+    pthread_mutex_unlock(&mAnnotateMutex);
+    return status;
+}
+
+/** Send mAnnotate to the camera. Call with mAnnotateMutex. */
+int PiCamera::applyAnnotate() {
+    mAnnotateTime = time(NULL);
+    if (mCamera == NULL) {
+        return ENODEV;
+    }
+    int status = raspicamcontrol_set_annotate(mCamera, mAnnotate.flags, mAnnotate.text.c_str(),
+            mAnnotate.text_size, mAnnotate.text_colour, mAnnotate.bg_colour);
+    return status ? EIO : 0;
+}
+
+PiCameraStats PiCamera::stats() const {
+    PiCameraStats s;
+    PiCameraStats& m = const_cast<PiCameraStats&>(mStats);
+    s.buffers = __sync_fetch_and_add(&m.buffers, 0);
+    s.starvations = __sync_fetch_and_add(&m.starvations, 0);
+    s.resend_errors = __sync_fetch_and_add(&m.resend_errors, 0);
+    s.in_flight = __sync_fetch_and_add(&m.in_flight, 0);
+    s.min_in_flight = __sync_fetch_and_add(&m.min_in_flight, 0);
+    s.pool_size = __sync_fetch_and_add(&m.pool_size, 0);
+    s.grows = __sync_fetch_and_add(&m.grows, 0);
+    s.raw_frames = __sync_fetch_and_add(&m.raw_frames, 0);
+    s.invalid_frames = __sync_fetch_and_add(&m.invalid_frames, 0);
+    return s;
+}
+
+/** Get a free buffer header from the pools. Called from the callback. */
+MMAL_BUFFER_HEADER_T* PiCamera::getBuffer() {
+    MMAL_BUFFER_HEADER_T* buffer = NULL;
+    pthread_mutex_lock(&mPoolsMutex);
+    for (size_t i = 0; i < mPools.size() && buffer == NULL; i++) {
+        buffer = mmal_queue_get(mPools[i]->queue);
+    }
+    pthread_mutex_unlock(&mPoolsMutex);
+    return buffer;
+}
+
+/**
+ * Add buffers to the encoder output while it runs. A pool can't be resized while its
+ * buffers are in flight, so another pool is created. Called from the control thread,
+ * the callback only holds mPoolsMutex while the new pool is added.
+ */
+void PiCamera::growPool() {
+    MMAL_POOL_T* pool = mmal_port_pool_create(mEncoderOutput, POOL_GROW_STEP, mEncoderOutput->buffer_size);
+    if (!pool) {
+        PI_LOG(PILOG_ERROR, 0, "Failed to grow the encoder output pool");
+        return;
+    }
+    pthread_mutex_lock(&mPoolsMutex);
+    TRAP1(catched, msg, mPools.push_back(pool););
+    pthread_mutex_unlock(&mPoolsMutex);
+    if (catched) {
+        mmal_port_pool_destroy(mEncoderOutput, pool);
+        return;
+    }
+    __sync_add_and_fetch(&mStats.pool_size, POOL_GROW_STEP);
+    __sync_add_and_fetch(&mStats.grows, 1);
+    PI_LOG(PILOG_INFO, 0, "Grew the encoder output pool to %ld buffers", (long)__sync_fetch_and_add(&mStats.pool_size, 0));
+
+    MMAL_BUFFER_HEADER_T* buffer;
+    while ((buffer = mmal_queue_get(pool->queue)) != NULL) {
+        if (mmal_port_send_buffer(mEncoderOutput, buffer) != MMAL_SUCCESS) {
+            mmal_buffer_header_release(buffer);
+            __sync_add_and_fetch(&mStats.resend_errors, 1);
+            break;
+        }
+        __sync_add_and_fetch(&mStats.in_flight, 1);
+    }
+}
+
 void PiCamera::encoder_buffer_callback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer) {
     PiCamera* self = (PiCamera*)port->userdata;
 
+    // MMAL creates this thread, so it is registered on its first callback.
+    PiThreads::enter(THREAD_CAPTURE, "capture");
+    PI_TRACE("encoder_callback", buffer->length);
+
+    if (self) {
+        // The encoder had nothing to write the next data to until this buffer is sent back.
+        int in_flight = __sync_sub_and_fetch(&self->mStats.in_flight, 1);
+        __sync_add_and_fetch(&self->mStats.buffers, 1);
+        // The callbacks of the pools may run at once, so the minimum is kept by a CAS loop.
+        int min_in_flight = __sync_fetch_and_add(&self->mStats.min_in_flight, 0);
+        while (in_flight < min_in_flight) {
+            int previous = __sync_val_compare_and_swap(&self->mStats.min_in_flight, min_in_flight, in_flight);
+            if (previous == min_in_flight) {
+                break;
+            }
+            min_in_flight = previous;
+        }
+        if (in_flight <= 0 && port->is_enabled) {
+            __sync_add_and_fetch(&self->mStats.starvations, 1);
+            self->mStarvedSinceGrow++;
+        }
+    }
+
     if (self) {
         // If error have occured, ignore to write JPEG-frame to the tmp buffer
         if (!self->last_encode_error) {
@@ -432,8 +670,21 @@ void PiCamera::encoder_buffer_callback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T*
         }
 
         if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) {
+            if (self->mFirstFrame) {
+                self->mFirstFrame = false;
+                printf("First frame %ldms after the camera was opened\n", elapsed_msec(self->mStartTime));
+            }
+
+            // FRAME_END doesn't mean the frame is complete, ex) after the encoder ran out of a buffer.
+            int invalid = self->last_encode_error ? 0 :
+                    PiJpegScan::validate(self->mBuffer->values, self->mBuffer->offset, NULL);
+
             if (self->last_encode_error) {
-                fprintf(stderr, "Ignore to send signal, for error occured. last err=%d\n", self->last_encode_error);
+                PI_LOG(PILOG_WARN, self->last_encode_error, "Ignore to send signal, for error occured");
+            } else if (invalid) {
+                __sync_add_and_fetch(&self->mStats.invalid_frames, 1);
+                PI_LOG(PILOG_WARN, invalid, "Drop an incomplete JPEG frame of %lu bytes",
+                        (unsigned long)self->mBuffer->offset);
             } else {
                 self->mListener->onFrame(*self->mBuffer);
             }
@@ -443,7 +694,7 @@ void PiCamera::encoder_buffer_callback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T*
             self->last_encode_error = 0;
 
         } else if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED) {
-            fprintf(stderr, "MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED ...\n");
+            PI_LOG(PILOG_ERROR, 0, "MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED");
             // To Ignore until the next frame is started, set a error code.
             self->last_encode_error = -1;
 
@@ -454,24 +705,201 @@ void PiCamera::encoder_buffer_callback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T*
 
     mmal_buffer_header_release(buffer);
 
-    if (port->is_enabled) {
+    if (self && port->is_enabled) {
+        // Auto mode: add a buffer when the encoder keeps running dry
+        if (self->mStarvedSinceGrow >= POOL_GROW_STARVATIONS &&
+                self->mStats.pool_size < self->mSettings.encoder_buffers_max && self->mControlStarted) {
+            self->mStarvedSinceGrow = 0;
+            pthread_mutex_lock(&self->mControlMutex);
+            self->mGrowRequested = true;
+            pthread_cond_signal(&self->mControlCond);
+            pthread_mutex_unlock(&self->mControlMutex);
+        }
+
         MMAL_STATUS_T status;
         MMAL_BUFFER_HEADER_T *new_buffer;
-        new_buffer = mmal_queue_get(self->mPool->queue);
+        new_buffer = self->getBuffer();
 
         if (new_buffer) {
             status = mmal_port_send_buffer(port, new_buffer);
             if (status != MMAL_SUCCESS) {
-                DBG("Failed returning a buffer to the encoder port\n");
+                __sync_add_and_fetch(&self->mStats.resend_errors, 1);
+                DBG("Failed returning a buffer to the encoder port");
+            } else {
+                __sync_add_and_fetch(&self->mStats.in_flight, 1);
             }
          } else {
-            DBG("Unable to return a buffer to the encoder port\n");
+            __sync_add_and_fetch(&self->mStats.resend_errors, 1);
+            DBG("Unable to return a buffer to the encoder port");
          }
     }
 }
 
+/**
+ * Run the requests of the callback which would stall it, and refresh the clock of the
+ * annotation every second, until the destructor stops it
+ */
+void* PiCamera::control_loop(void* arg) {
+    PiCamera* self = static_cast<PiCamera*>(arg);
+    PiThreads::enter(THREAD_DISPATCH, "camera-ctl");
+
+    pthread_mutex_lock(&self->mControlMutex);
+    while (!self->mControlStop) {
+        // Wake up when the second of the wall clock changes, for the clock of the annotation
+        timespec wall, deadline;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += 1000000000L - wall.tv_nsec;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (!self->mGrowRequested) {
+            pthread_cond_timedwait(&self->mControlCond, &self->mControlMutex, &deadline);
+        }
+        const bool grow = self->mGrowRequested;
+        self->mGrowRequested = false;
+        pthread_mutex_unlock(&self->mControlMutex);
+
+        if (grow && self->mStats.pool_size < self->mSettings.encoder_buffers_max) {
+            self->growPool();
+        }
+
+        // The firmware draws the text as it is, so the time and the date are formatted
+        // again every second. It is a synchronous parameter set, kept off the callback.
+        pthread_mutex_lock(&self->mAnnotateMutex);
+        if (self->mAnnotate.hasClock() && time(NULL) != self->mAnnotateTime) {
+            self->applyAnnotate();
+        }
+        pthread_mutex_unlock(&self->mAnnotateMutex);
+
+        pthread_mutex_lock(&self->mControlMutex);
+    }
+    pthread_mutex_unlock(&self->mControlMutex);
+
+    PiThreads::leave();
+    return NULL;
+}
+
+/**
+ * Create the splitter of the camera video port. Its output 0 goes to the encoder,
+ * and the I420 frames of output 1 come to raw_buffer_callback() in a pool of
+ * RAW_BUFFERS_NUM buffers, which are sent back as soon as the listener returns.
+ */
+MMAL_STATUS_T PiCamera::createSplitter() {
+    MMAL_STATUS_T status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_SPLITTER, &mSplitter);
+    if (status != MMAL_SUCCESS) {
+        fprintf(stderr, "Error create the splitter\n");
+        return status;
+    }
+    if (mSplitter->output_num < 2) {
+        fprintf(stderr, "Splitter doesn't have enough output ports\n");
+        return MMAL_ENOSYS;
+    }
+
+    mmal_format_copy(mSplitter->input[0]->format, mCameraVideoPort->format);
+    mSplitter->input[0]->buffer_num = mCameraVideoPort->buffer_num;
+    status = mmal_port_format_commit(mSplitter->input[0]);
+    if (status != MMAL_SUCCESS) {
+        fprintf(stderr, "Splitter input format couldn't be set\n");
+        return status;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        MMAL_ES_FORMAT_T* format = mSplitter->output[i]->format;
+        mmal_format_copy(format, mSplitter->input[0]->format);
+        format->encoding = MMAL_ENCODING_I420;
+        format->encoding_variant = MMAL_ENCODING_I420;
+        status = mmal_port_format_commit(mSplitter->output[i]);
+        if (status != MMAL_SUCCESS) {
+            fprintf(stderr, "Splitter output %d format couldn't be set\n", i);
+            return status;
+        }
+    }
+
+    mRawPort = mSplitter->output[1];
+    mRawPort->buffer_num = RAW_BUFFERS_NUM;
+    mRawPort->buffer_size = mRawPort->buffer_size_recommended;
+
+    status = mmal_component_enable(mSplitter);
+    if (status != MMAL_SUCCESS) {
+        fprintf(stderr, "Unable to enable the splitter\n");
+        return status;
+    }
+
+    status = connect_ports(mCameraVideoPort, mSplitter->input[0], &mSplitterConnection);
+    if (status != MMAL_SUCCESS) {
+        fprintf(stderr, "Unable to connect the camera to the splitter\n");
+        return status;
+    }
+
+    mRawPool = mmal_port_pool_create(mRawPort, mRawPort->buffer_num, mRawPort->buffer_size);
+    if (!mRawPool) {
+        fprintf(stderr, "Failed to create buffer header pool for the raw port\n");
+        return MMAL_ENOMEM;
+    }
+
+    mRawPort->userdata = (MMAL_PORT_USERDATA_T *)this;
+    status = mmal_port_enable(mRawPort, raw_buffer_callback);
+    if (status != MMAL_SUCCESS) {
+        fprintf(stderr, "Unable to enable the raw port\n");
+        return status;
+    }
+
+    MMAL_BUFFER_HEADER_T* buffer;
+    while ((buffer = mmal_queue_get(mRawPool->queue)) != NULL) {
+        status = mmal_port_send_buffer(mRawPort, buffer);
+        if (status != MMAL_SUCCESS) {
+            fprintf(stderr, "Unable to send a buffer to the raw port\n");
+            return status;
+        }
+    }
+
+    printf("Raw I420 tap: every %d frames, %d buffers of %u bytes\n", mSettings.raw_decimation,
+            mRawPort->buffer_num, mRawPort->buffer_size);
+    return MMAL_SUCCESS;
+}
+
+void PiCamera::raw_buffer_callback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer) {
+    PiCamera* self = (PiCamera*)port->userdata;
+
+    PiThreads::enter(THREAD_CAPTURE, "capture_raw");
+
+    // The frames between the decimated ones go back to the splitter untouched.
+    if (self && buffer->length > 0 && (++self->mRawCount % self->mSettings.raw_decimation) == 0) {
+        PI_TRACE("raw_callback", buffer->length);
+
+        timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+
+        mmal_buffer_header_mem_lock(buffer);
+        const MMAL_VIDEO_FORMAT_T& video = port->format->es->video;
+        PiRawFrame frame;
+        frame.data = buffer->data + buffer->offset;
+        frame.size = buffer->length;
+        frame.width = self->mSettings.width;
+        frame.height = self->mSettings.height;
+        // The planes of MMAL are padded to 32 columns and 16 rows.
+        frame.stride = VCOS_ALIGN_UP(video.width, 32);
+        frame.slice_height = VCOS_ALIGN_UP(video.height, 16);
+        frame.sequence = __sync_add_and_fetch(&self->mStats.raw_frames, 1);
+        frame.timestamp_us = (int64_t)wall.tv_sec * 1000000LL + wall.tv_nsec / 1000;
+        self->mListener->onRawFrame(frame);
+        mmal_buffer_header_mem_unlock(buffer);
+    }
+
+    mmal_buffer_header_release(buffer);
+
+    if (self && port->is_enabled) {
+        MMAL_BUFFER_HEADER_T* new_buffer = mmal_queue_get(self->mRawPool->queue);
+        if (new_buffer == NULL || mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS) {
+            DBG("Unable to return a buffer to the raw port");
+        }
+    }
+}
+
 void PiCamera::camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
-    DBG("Received a camera event %d\n", buffer->cmd);
+    DBG("Received a camera event %lx", (long)buffer->cmd);
     mmal_buffer_header_release(buffer);
 }
 
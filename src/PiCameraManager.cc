@@ -1,21 +1,34 @@
 #include "PiCameraManager.h"
+#include "PiCamera.h"
 #include "PiFrame.h"
+#include "PiThumbnailer.h"
 #include "PiException.h"
+#include "PiLog.h"
+#include "PiTrace.h"
 #include <stdio.h>
+#include <errno.h>
 #include <pthread.h>
+#include <time.h>
 #include <algorithm>
 
 #define MUTEX_TIMEOUT_SEC 3
 
+// Smallest buffer of a frame, for thumbnails
+#define MIN_FRAME_BUFFER_SIZE 4096
+
 PiCameraManager::PiCameraManager(const PiCamSettings& settings)
-        : mSettings(settings), mCamera(NULL) {
+        : mSettings(settings), mSource(NULL), mSequence(0), mNextStreamId(0), mEncoderBuffers(0),
+          mAnnotate(*settings.camera_params), mStopping(false),
+          mLatest(NULL), mLatestSize(0), mLatestSequence(0), mLatestTimestamp(0) {
     mFramesMutexTimeout.tv_sec = MUTEX_TIMEOUT_SEC;
     mFramesMutexTimeout.tv_nsec = 0;
     pthread_mutex_init(&mFramesMutex, NULL);
+    pthread_cond_init(&mStoppedCond, NULL);
+    pthread_mutex_init(&mLatestMutex, NULL);
 }
 
 PiCameraManager::~PiCameraManager() {
-    delete mCamera;
+    delete mSource;
 
     if (mFrames.size()) {
         fprintf(stderr, "warn: mFrames has values when called Destructor. size=%d\n", mFrames.size());
@@ -26,42 +39,82 @@ PiCameraManager::~PiCameraManager() {
         PiFrame* frame = *it;
         delete frame;
     }
+
+    std::vector<PiThumbnailer*>::iterator th = mThumbnailers.begin();
+    for (; th != mThumbnailers.end(); th++) {
+        delete *th;
+    }
+    if (mLatest) {
+        mLatest->release();
+    }
+    pthread_mutex_destroy(&mLatestMutex);
+    pthread_cond_destroy(&mStoppedCond);
 }
 
-PiFrame* PiCameraManager::attach() {
+PiFrame* PiCameraManager::attach(int max_fps, int scale_denom, int initial_credits) {
      int status = ENOMEM;
 
-     // Initialize PiFrame
-     PiFrame* frame = new PiFrame(mSettings.height * mSettings.width * 3, &status);
+     if (scale_denom != 1 && !PiThumbnailer::isSupportedScale(scale_denom)) {
+         fprintf(stderr, "Unsupported thumbnail scale 1/%d\n", scale_denom);
+         return NULL;
+     }
+
+     // Initialize PiFrame, which grows if a frame is larger
+     size_t frame_size = frameSizeHint(scale_denom);
+     PiFrame* frame = new PiFrame(frame_size, &status);
      if (frame == NULL || status != 0) {
          fprintf(stderr, "Faild to initialize PiFrame status=%d\n", status);
          delete frame;
          return NULL;
      }
 
+     // Full rate is the default, so a limit at or above the camera fps is ignored.
+     if (max_fps > 0 && max_fps < mSettings.fps) {
+         frame->setMaxFps(max_fps);
+     }
+     if (initial_credits >= 0) {
+         frame->enableCredits(initial_credits);
+     }
+
     // Lock
-    status = pthread_mutex_timedlock(&mFramesMutex,  &mFramesMutexTimeout);
+    status = lockFrames();
     if (status == 0) {
 
-        // Initialize PiCamera If not constructed.
-        if (mCamera == NULL) {
-            mCamera = new PiCamera(mSettings, this, &status);
-            if (mCamera == NULL || status != 0) {
-                fprintf(stderr, "Faild to initialize PiCamera status=%d\n", status);
-                delete mCamera; mCamera = NULL;
-                delete frame; frame = NULL;
-            }
+        // Start the camera (or the relay) If not constructed.
+        if (mSource == NULL && startSource() != 0) {
+            delete frame; frame = NULL;
         }
 
-        if (frame) {
+        if (frame && scale_denom != 1) {
+            // Thumbnail subscribers are fed by the worker of PiThumbnailer
+            PiThumbnailer* th = thumbnailer(scale_denom);
+            if (th == NULL || th->attach(frame) != 0) {
+                fprintf(stderr, "Failed to attach to the thumbnailer 1/%d\n", scale_denom);
+                if (numSubscribers() == 0) {
+                    delete mSource; mSource = NULL;
+                }
+                delete frame; frame = NULL;
+            }
+        } else if (frame) {
             TRAP1(catched, msg, mFrames.push_back(frame););
              if (catched) {
                 fprintf(stderr, "Error in mFrames.push_back msg=%s\n", msg.c_str());
-                delete mCamera; mCamera = NULL;
+                if (numSubscribers() == 0) {
+                    delete mSource; mSource = NULL;
+                }
                 delete frame; frame = NULL;
              }
          }
 
+        if (frame) {
+            // Register the stream to grant credits from another connection
+            frame->stream_id = ++mNextStreamId;
+            TRAP1(catched, msg, mStreams[frame->stream_id] = frame;);
+            if (catched) {
+                fprintf(stderr, "Error in mStreams.insert msg=%s\n", msg.c_str());
+            }
+        }
+
         // Unlock
         status = pthread_mutex_unlock(&mFramesMutex);
         if (status) fprintf(stderr, "Failed to unlock mFramesMutex status=%d\n", status);
@@ -74,11 +127,29 @@ PiFrame* PiCameraManager::attach() {
     return frame;
 }
 
+/**
+ * Lock mFramesMutex, waiting up to mFramesMutexTimeout. pthread_mutex_timedlock() takes
+ * a deadline of CLOCK_REALTIME, the timeout alone fails at once while a source publishes.
+ */
+int PiCameraManager::lockFrames() {
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += mFramesMutexTimeout.tv_sec;
+    deadline.tv_nsec += mFramesMutexTimeout.tv_nsec;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return pthread_mutex_timedlock(&mFramesMutex, &deadline);
+}
+
 void PiCameraManager::detach(PiFrame*& frame) {
     if (frame != NULL) {
 
         bool removed = false;
         size_t numFrames = -1;
+        PiFrameSource* source = NULL;
+        PiThumbnailer* idle = NULL;
 
         // Lock
         int status = pthread_mutex_lock(&mFramesMutex);
@@ -87,10 +158,38 @@ void PiCameraManager::detach(PiFrame*& frame) {
             if (it != mFrames.end()) {
                 mFrames.erase(it);
                 removed = true;
+            } else {
+                std::vector<PiThumbnailer*>::iterator th = mThumbnailers.begin();
+                for (; th != mThumbnailers.end(); th++) {
+                    if ((*th)->detach(frame)) {
+                        removed = true;
+                        break;
+                    }
+                }
+
+                // The last subscriber of a thumbnailer is gone. Its worker is joined after
+                // unlocking, not to stall onFrame() for a transcode, and the next subscriber
+                // of the scale gets a new one.
+                if (removed && (*th)->numSubscribers() == 0) {
+                    idle = *th;
+                    mThumbnailers.erase(th);
+                }
+            }
+
+            if (removed) {
+                mStreams.erase(frame->stream_id);
             }
 
             // Get num of frames.
-            numFrames = mFrames.size();
+            numFrames = numSubscribers();
+
+            // Take the source out under the lock, so cameraStats() never sees a deleted one.
+            // It is deleted after unlocking, because its callback waits for mFramesMutex.
+            if (numFrames == 0 && mSource) {
+                source = mSource;
+                mSource = NULL;
+                mStopping = true;
+            }
 
             status = pthread_mutex_unlock(&mFramesMutex);
         }
@@ -107,35 +206,300 @@ void PiCameraManager::detach(PiFrame*& frame) {
         }
        frame = NULL;
 
-        if (numFrames == 0) {
-            delete mCamera;
-            mCamera = NULL;
+        delete idle;
+        deleteSource(source);
+    }
+}
+
+int PiCameraManager::addSink(PiFrameSink* sink) {
+    int status = lockFrames();
+    if (status) {
+        fprintf(stderr, "Failed to lock mFramesMutex status=%d\n", status);
+        return status;
+    }
+
+    if (mSource == NULL) {
+        status = startSource();
+    }
+    if (status == 0) {
+        TRAP1(catched, msg, mSinks.push_back(sink););
+        if (catched) {
+            fprintf(stderr, "Error in mSinks.push_back msg=%s\n", msg.c_str());
+            status = ENOMEM;
+            if (numSubscribers() == 0) {
+                delete mSource; mSource = NULL;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&mFramesMutex);
+    return status;
+}
+
+void PiCameraManager::removeSink(PiFrameSink* sink) {
+    PiFrameSource* source = NULL;
+
+    int status = pthread_mutex_lock(&mFramesMutex);
+    if (status == 0) {
+        std::vector<PiFrameSink*>::iterator it = std::find(mSinks.begin(), mSinks.end(), sink);
+        if (it != mSinks.end()) {
+            mSinks.erase(it);
+            // Deleted after unlocking like detach()
+            if (numSubscribers() == 0 && mSource) {
+                source = mSource;
+                mSource = NULL;
+                mStopping = true;
+            }
+        }
+        pthread_mutex_unlock(&mFramesMutex);
+    } else {
+        fprintf(stderr, "Erro in mFramesMutex status=%d\n", status);
+    }
+
+    deleteSource(source);
+}
+
+/** Start the camera or the relay. Call with mFramesMutex. */
+int PiCameraManager::startSource() {
+    // The camera being deleted by deleteSource() still holds MMAL.
+    while (mStopping) {
+        pthread_cond_wait(&mStoppedCond, &mFramesMutex);
+    }
+    if (mSource) {
+        return 0; // started by another attach() while waiting
+    }
+
+    // Start with the pool size which the last camera has grown to.
+    PiCamSettings settings(mSettings);
+    if (mEncoderBuffers > settings.encoder_buffers) {
+        settings.encoder_buffers = mEncoderBuffers;
+    }
+
+    // and the annotation of the last control request
+    RASPICAM_CAMERA_PARAMETERS& params = *settings.camera_params;
+    params.enable_annotate = mAnnotate.flags;
+    snprintf(params.annotate_string, sizeof(params.annotate_string), "%s", mAnnotate.text.c_str());
+    params.annotate_text_size = mAnnotate.text_size;
+    params.annotate_text_colour = mAnnotate.text_colour;
+    params.annotate_bg_colour = mAnnotate.bg_colour;
+
+    int status = 0;
+    mSource = createSource(settings, &status);
+    if (mSource == NULL || status != 0) {
+        fprintf(stderr, "Faild to initialize the frame source status=%d\n", status);
+        delete mSource; mSource = NULL;
+        return status ? status : ENOMEM;
+    }
+    return 0;
+}
+
+/**
+ * Delete the source taken out of mSource. Call without mFramesMutex. The next source is
+ * started after this, so two cameras never hold MMAL at once.
+ */
+void PiCameraManager::deleteSource(PiFrameSource* source) {
+    if (source == NULL) {
+        return;
+    }
+    const PiCameraStats stats = source->stats();
+    delete source;
+
+    pthread_mutex_lock(&mFramesMutex);
+    if (stats.grows > 0) {
+        mEncoderBuffers = stats.pool_size;
+    }
+    mStopping = false;
+    pthread_cond_broadcast(&mStoppedCond);
+    pthread_mutex_unlock(&mFramesMutex);
+}
+
+int PiCameraManager::setAnnotate(const PiAnnotate& annotate) {
+    if (!mSettings.relay_url.empty() || !mSettings.replay_path.empty()) {
+        return ENOTSUP;
+    }
+
+    int status = lockFrames();
+    if (status) {
+        fprintf(stderr, "Failed to lock mFramesMutex status=%d\n", status);
+        return status;
+    }
+    TRAP1(catched, msg, mAnnotate = annotate;);
+    if (catched) {
+        fprintf(stderr, "Error in setAnnotate msg=%s\n", msg.c_str());
+        status = ENOMEM;
+    } else if (mSource) {
+        status = mSource->setAnnotate(annotate);
+    }
+    pthread_mutex_unlock(&mFramesMutex);
+    return status;
+}
+
+PiAnnotate PiCameraManager::annotate() {
+    PiAnnotate annotate;
+    if (lockFrames() == 0) {
+        annotate = mAnnotate;
+        pthread_mutex_unlock(&mFramesMutex);
+    }
+    return annotate;
+}
+
+PiCameraStats PiCameraManager::cameraStats() {
+    PiCameraStats stats;
+    if (lockFrames() == 0) {
+        if (mSource) {
+            stats = mSource->stats();
+        }
+        pthread_mutex_unlock(&mFramesMutex);
+    }
+    return stats;
+}
+
+/**
+ * Copy the frame of a PiFrame attached for it, or the cached one if the source isn't running
+ * or can't be opened, ex) while the previous process of a hot upgrade holds the camera.
+ */
+int PiCameraManager::captureFrame(std::vector<uint8_t>* jpeg, uint64_t* sequence, int64_t* timestamp_us, int timeout_sec,
+        bool start) {
+    // Not to open the camera without 'start', ex) just before a hand-over
+    bool running = start;
+    if (!running && lockFrames() == 0) {
+        running = (mSource != NULL);
+        pthread_mutex_unlock(&mFramesMutex);
+    }
+
+    int status = ENOENT;
+    PiFrame* frame = running ? attach() : NULL;
+    if (frame) {
+        uint64_t seen = 0;
+        if (frame->waitForReady(&seen, timeout_sec) == 0 && frame->lock(3) == 0) {
+            TRAP1(catched, msg, jpeg->assign(frame->buffer, frame->buffer + frame->length););
+            status = catched ? ENOMEM : 0;
+            *sequence = frame->sequence;
+            *timestamp_us = frame->timestamp_us;
+            frame->unlock();
         }
+        detach(frame);
+    }
+    if (status != ENOENT) {
+        return status;
+    }
+
+    // The copy is made outside the lock, the reference keeps the frame.
+    pthread_mutex_lock(&mLatestMutex);
+    PiSharedFrame* latest = mLatest;
+    if (latest) {
+        latest->retain();
+        *sequence = mLatestSequence;
+        *timestamp_us = mLatestTimestamp;
+    }
+    pthread_mutex_unlock(&mLatestMutex);
+
+    if (latest) {
+        TRAP1(catched, msg, jpeg->assign(latest->values, latest->values + latest->length););
+        status = catched ? ENOMEM : 0;
+        latest->release();
+    }
+    return status;
+}
+
+size_t PiCameraManager::frameSizeHint(int scale_denom) {
+    size_t size = __atomic_load_n(&mLatestSize, __ATOMIC_RELAXED);
+
+    if (size) {
+        size += size / 2;
+    } else {
+        // 4 bits per pixel, enough for a JPEG of the camera at the usual qualities
+        size = (size_t)mSettings.width * mSettings.height / 2;
+    }
+    size /= scale_denom * scale_denom;
+    return size < MIN_FRAME_BUFFER_SIZE ? MIN_FRAME_BUFFER_SIZE : size;
+}
+
+void PiCameraManager::setLatestFrame(const std::vector<uint8_t>& jpeg, uint64_t sequence, int64_t timestamp_us) {
+    PiSharedFrame* seed = jpeg.empty() ? NULL : PiSharedFrame::create(&jpeg[0], jpeg.size());
+    pthread_mutex_lock(&mLatestMutex);
+    PiSharedFrame* previous = mLatest;
+    mLatest = seed;
+    mLatestSequence = sequence;
+    mLatestTimestamp = timestamp_us;
+    pthread_mutex_unlock(&mLatestMutex);
+    __atomic_store_n(&mLatestSize, jpeg.size(), __ATOMIC_RELAXED);
+    if (previous) {
+        previous->release();
+    }
+
+    // Sequence numbers continue from the previous process.
+    pthread_mutex_lock(&mFramesMutex);
+    if (mSequence < sequence) {
+        mSequence = sequence;
     }
+    pthread_mutex_unlock(&mFramesMutex);
 }
 
 void PiCameraManager::onFrame(const DinamicBuffer& buffer) {
+    PI_TRACE("onFrame", buffer.offset);
+
     // Lock
-    int status = pthread_mutex_timedlock(&mFramesMutex,  &mFramesMutexTimeout);
+    int status = lockFrames();
     if (status == 0) {
 
-        // Copy buffer to each mFrames
+        // Half of the camera frame period is tolerated as jitter by the rate limiter.
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const long slack_nsec = (mSettings.fps > 0) ? (500000000L / mSettings.fps) : 0;
+        const uint64_t sequence = ++mSequence;
+
+        timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        const int64_t timestamp_us = (int64_t)wall.tv_sec * 1000000LL + wall.tv_nsec / 1000;
+
+        __atomic_store_n(&mLatestSize, buffer.offset, __ATOMIC_RELAXED);
+
+        // Thumbnails are transcoded once per frame on their own workers.
+        std::vector<PiThumbnailer*>::iterator th = mThumbnailers.begin();
+        for (; th != mThumbnailers.end(); th++) {
+            (*th)->submit(buffer, sequence, timestamp_us, now, slack_nsec);
+        }
+
+        std::vector<PiFrameSink*>::iterator sink = mSinks.begin();
+        for (; sink != mSinks.end(); sink++) {
+            (*sink)->onFrame(buffer, sequence, timestamp_us);
+        }
+
+        // Copy buffer to each mFrames, or share one copy with the frames which send from it
+        PiSharedFrame* shared = NULL;
         std::vector<PiFrame*>::iterator it = mFrames.begin();
         for (; it != mFrames.end(); it++) {
 
             PiFrame* frame = *it;
 
+            // Skip the rate-limited frames before any copy or signal.
+            if (!frame->isDue(now, slack_nsec)) {
+                continue;
+            }
+
             // Lock
             status = frame->lock(3);
             if (status == 0) {
 
                 size_t buf_length = buffer.offset;
                 size_t wrote_size = 0;
+                bool catched;
+                std::string msg;
 
-                TRAP1(catched, msg, wrote_size = frame->write(buffer.values, buf_length););
-                if (catched) {
-                    fprintf(stderr, "Exception in PiFrame#write %s\n", msg.c_str());
+                if (frame->isSharing()) {
+                    if (shared == NULL) {
+                        shared = PiSharedFrame::create(buffer.values, buf_length);
+                    }
+                    wrote_size = frame->share(shared);
+                } else {
+                    TRAP2(catched, msg, wrote_size = frame->write(buffer.values, buf_length););
+                    if (catched) {
+                        fprintf(stderr, "Exception in PiFrame#write %s\n", msg.c_str());
+                    }
                 }
+                frame->sequence = sequence;
+                frame->timestamp_us = timestamp_us;
 
                 // Unlock
                 frame->unlock();
@@ -147,16 +511,99 @@ void PiCameraManager::onFrame(const DinamicBuffer& buffer) {
                     }
 
                 } else {
-                    fprintf(stderr, "Failed to write JPEG-frame to PiFrame buf_len=%d, wrote_size=%d\n",
-                            buf_length, wrote_size);
+                    PI_LOG(PILOG_ERROR, 0, "Failed to write JPEG-frame to PiFrame buf_len=%lu, wrote_size=%lu",
+                            (long)buf_length, (long)wrote_size);
                 }
             }
         }
 
+        // The frame shared with the streams is also the latest one, by its reference.
+        PiSharedFrame* previous = NULL;
+        if (shared) {
+            pthread_mutex_lock(&mLatestMutex);
+            previous = mLatest;
+            mLatest = shared; // the reference of create()
+            mLatestSequence = sequence;
+            mLatestTimestamp = timestamp_us;
+            pthread_mutex_unlock(&mLatestMutex);
+        }
+
         // Unlock
         status = pthread_mutex_unlock(&mFramesMutex);
+        if (previous) {
+            previous->release();
+        }
+    } else {
+        PI_LOG(PILOG_ERROR, status, "onFrame: mFrameMutex lock");
+    }
+}
+
+void PiCameraManager::onRawFrame(const PiRawFrame& frame) {
+    PI_TRACE("onRawFrame", frame.size);
+
+    int status = lockFrames();
+    if (status == 0) {
+        std::vector<PiFrameSink*>::iterator sink = mSinks.begin();
+        for (; sink != mSinks.end(); sink++) {
+            (*sink)->onRawFrame(frame);
+        }
+        pthread_mutex_unlock(&mFramesMutex);
     } else {
-        fprintf(stderr, "onFrame: mFrameMutex lock err=%d\n", status);
+        PI_LOG(PILOG_ERROR, status, "onRawFrame: mFrameMutex lock");
     }
 }
 
+/** Get the thumbnailer for the scale, create it if it doesn't exist. Call with mFramesMutex. */
+PiThumbnailer* PiCameraManager::thumbnailer(int scale_denom) {
+    std::vector<PiThumbnailer*>::iterator it = mThumbnailers.begin();
+    for (; it != mThumbnailers.end(); it++) {
+        if ((*it)->scaleDenom() == scale_denom) {
+            return *it;
+        }
+    }
+
+    int status = 0;
+    PiThumbnailer* th = new PiThumbnailer(scale_denom, mSettings.thumbnail_quality, &status);
+    if (th == NULL || status != 0) {
+        fprintf(stderr, "Faild to initialize PiThumbnailer status=%d\n", status);
+        delete th;
+        return NULL;
+    }
+
+    TRAP1(catched, msg, mThumbnailers.push_back(th););
+    if (catched) {
+        fprintf(stderr, "Error in mThumbnailers.push_back msg=%s\n", msg.c_str());
+        delete th;
+        return NULL;
+    }
+    return th;
+}
+
+/** Number of full and thumbnail subscribers and sinks. Call with mFramesMutex. */
+size_t PiCameraManager::numSubscribers() {
+    size_t n = mFrames.size() + mSinks.size();
+    std::vector<PiThumbnailer*>::iterator it = mThumbnailers.begin();
+    for (; it != mThumbnailers.end(); it++) {
+        n += (*it)->numSubscribers();
+    }
+    return n;
+}
+
+/** Grant credits to the stream 'stream_id', -ENOENT if not found, -EINVAL if it isn't in credit mode */
+int PiCameraManager::grantCredits(uint32_t stream_id, int credits) {
+    int result = -ENOENT;
+
+    int status = lockFrames();
+    if (status == 0) {
+        std::map<uint32_t, PiFrame*>::iterator it = mStreams.find(stream_id);
+        if (it != mStreams.end()) {
+            result = it->second->isCreditMode() ? it->second->addCredits(credits) : -EINVAL;
+        }
+
+        status = pthread_mutex_unlock(&mFramesMutex);
+        if (status) fprintf(stderr, "Failed to unlock mFramesMutex status=%d\n", status);
+    } else {
+        fprintf(stderr, "grantCredits: mFramesMutex lock err=%d\n", status);
+    }
+    return result;
+}
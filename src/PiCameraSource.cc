@@ -0,0 +1,17 @@
+#include "PiCameraManager.h"
+#include "PiCamera.h"
+#include "PiRelaySource.h"
+#include "PiReplaySource.h"
+
+// The sources a manager opens, apart from the rest of it, so a program without the
+// camera (ex: bench/bench_dispatch) links its own instead of MMAL.
+
+PiFrameSource* PiCameraManager::createSource(const PiCamSettings& settings, int* status) {
+    if (!settings.replay_path.empty()) {
+        return new PiReplaySource(settings.replay_path, settings.fps, this, status);
+    }
+    if (!settings.relay_url.empty()) {
+        return new PiRelaySource(settings.relay_url, this, status);
+    }
+    return new PiCamera(settings, this, status);
+}
@@ -0,0 +1,500 @@
+#include "PiFanout.h"
+#include "PiCameraManager.h"
+#include "PiFrame.h"
+#include "PiThreads.h"
+#include "PiException.h"
+#include "PiLog.h"
+#include "PiTrace.h"
+#include "PiClock.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+// Room for the multipart header in front of the JPEG in each slot
+#define HEADER_RESERVE 128
+
+#define PUBLISHER_WAIT_SEC 1
+
+// Interval of the send timeout checks while some client is busy
+#define POLL_MSEC 100
+
+/** Constructor */
+PiFanout::PiFanout(PiCameraManager& manager, int num_workers, const std::string& boundary,
+        const timeval& timeout_sending, int* status)
+        : mManager(manager), mBoundary(boundary),
+        mTimeoutNs(PiClock::toNsec(timeout_sending)),
+        mPublisher(0), mRunning(false), mStopRequested(false), mShutdown(false),
+        mWorkersStopRequested(false), mNumClients(0), mNextId(0), mFrames(0), mPublisherCpuNs(0) {
+
+    if (status) *status = 0;
+
+    for (int i = 0; i < NUM_SLOTS; i++) {
+        mSlots[i].length = 0;
+        mSlots[i].refs = 0;
+    }
+
+    int ret = pthread_mutex_init(&mMutex, NULL);
+    if (ret) {
+        fprintf(stderr, "PiFanout() mutex init err=%d\n", ret);
+        if (status) *status = ret;
+        return;
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        Worker* worker = new Worker();
+        worker->owner = this;
+        worker->started = false;
+        worker->pending = -1;
+        worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        mWorkers.push_back(worker);
+
+        if (worker->event_fd < 0) {
+            ret = errno;
+        } else if ((ret = pthread_mutex_init(&worker->mutex, NULL)) == 0 &&
+                (ret = pthread_cond_init(&worker->cond, NULL)) == 0) {
+            ret = pthread_create(&worker->thread, NULL, run_worker, worker);
+            worker->started = (ret == 0);
+        }
+        if (ret) {
+            fprintf(stderr, "PiFanout() failed to create a worker err=%d\n", ret);
+            if (status) *status = ret;
+            return;
+        }
+    }
+}
+
+/** Destructor */
+PiFanout::~PiFanout() {
+    stop();
+    stopPublisher();
+
+    mWorkersStopRequested = true;
+    std::vector<Worker*>::iterator it = mWorkers.begin();
+    for (; it != mWorkers.end(); it++) {
+        Worker* worker = *it;
+        if (worker->started) {
+            wake(*worker);
+            pthread_join(worker->thread, NULL);
+            pthread_cond_destroy(&worker->cond);
+            pthread_mutex_destroy(&worker->mutex);
+        }
+        if (worker->event_fd >= 0) {
+            close(worker->event_fd);
+        }
+        delete worker;
+    }
+    pthread_mutex_destroy(&mMutex);
+}
+
+int PiFanout::serve(int socket) {
+    Client client;
+    client.socket = socket;
+    client.slot = -1;
+    client.offset = 0;
+    client.done = false;
+    client.removed = false;
+    client.status = 0;
+
+    pthread_mutex_lock(&mMutex);
+    if (mShutdown || mWorkers.empty()) {
+        pthread_mutex_unlock(&mMutex);
+        return ESHUTDOWN;
+    }
+
+    // Partition by connection id
+    Worker& worker = *mWorkers[mNextId++ % mWorkers.size()];
+    int status = mRunning ? 0 : startPublisher();
+    mNumClients++;
+
+    // Added under mMutex, so stop() can't miss the client.
+    pthread_mutex_lock(&worker.mutex);
+    TRAP1(catched, msg, worker.clients.push_back(&client););
+    pthread_mutex_unlock(&mMutex);
+
+    if (catched) {
+        fprintf(stderr, "Error in clients.push_back msg=%s\n", msg.c_str());
+        client.status = ENOMEM;
+    } else {
+        if (status) {
+            finish(worker, &client, status);
+        }
+        // The worker may be sending to the client until it removes it.
+        while (!client.removed) {
+            pthread_cond_wait(&worker.cond, &worker.mutex);
+        }
+    }
+    pthread_mutex_unlock(&worker.mutex);
+
+    pthread_mutex_lock(&mMutex);
+    bool last = (--mNumClients == 0);
+    pthread_mutex_unlock(&mMutex);
+
+    if (last) {
+        stopPublisher();
+    }
+    return client.status;
+}
+
+void PiFanout::stop() {
+    pthread_mutex_lock(&mMutex);
+    mShutdown = true;
+    std::vector<Worker*>::iterator it = mWorkers.begin();
+    for (; it != mWorkers.end(); it++) {
+        Worker& worker = **it;
+        if (!worker.started) continue;
+        pthread_mutex_lock(&worker.mutex);
+        for (size_t i = 0; i < worker.clients.size(); i++) {
+            finish(worker, worker.clients[i], ESHUTDOWN);
+        }
+        pthread_mutex_unlock(&worker.mutex);
+    }
+    pthread_mutex_unlock(&mMutex);
+}
+
+PiFanoutStats PiFanout::stats() {
+    PiFanoutStats s;
+    pthread_mutex_lock(&mMutex);
+    s.frames = mFrames;
+    s.cpu_nsec = mPublisherCpuNs;
+    std::vector<Worker*>::iterator it = mWorkers.begin();
+    for (; it != mWorkers.end(); it++) {
+        Worker& worker = **it;
+        if (!worker.started) continue;
+        pthread_mutex_lock(&worker.mutex);
+        s.deliveries += worker.stats.deliveries;
+        s.dropped += worker.stats.dropped;
+        s.wakeups += worker.stats.wakeups;
+        s.syscalls += worker.stats.syscalls;
+        pthread_mutex_unlock(&worker.mutex);
+
+        // The workers never exit while serving, so read their clocks directly.
+        clockid_t cid;
+        timespec t;
+        if (pthread_getcpuclockid(worker.thread, &cid) == 0 && clock_gettime(cid, &t) == 0) {
+            s.cpu_nsec += (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+        }
+    }
+    pthread_mutex_unlock(&mMutex);
+    return s;
+}
+
+/** Wake the worker up */
+void PiFanout::wake(Worker& worker) {
+    uint64_t one = 1;
+    if (write(worker.event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        PI_LOG(PILOG_ERROR, errno, "PiFanout: failed to wake a worker");
+    }
+}
+
+/** The client doesn't use its slot anymore. Call with the mutex of the worker. */
+void PiFanout::release(Client* client) {
+    __sync_sub_and_fetch(&mSlots[client->slot].refs, 1);
+    client->slot = -1;
+}
+
+/** Mark the client as finished. The worker removes it. Call with the mutex of the worker. */
+void PiFanout::finish(Worker& worker, Client* client, int status) {
+    if (!client->done) {
+        client->done = true;
+        client->status = status;
+    }
+    if (client->slot >= 0) {
+        // Sends are non-blocking, so nothing refers to the slot after this.
+        release(client);
+    }
+    wake(worker);
+}
+
+/** Send the rest of the slot until the socket is full. Call with the mutex of the worker. */
+void PiFanout::sendSome(Worker& worker, Client* client) {
+    const Slot& slot = mSlots[client->slot];
+    PI_TRACE("send", slot.length - client->offset);
+
+    while (client->offset < slot.length) {
+        ssize_t ret = send(client->socket, slot.buffer.values + client->offset,
+                slot.length - client->offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+        worker.stats.syscalls++;
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                finish(worker, client, errno);
+            }
+            return; // the rest is sent when poll() reports the socket writable
+        }
+        client->offset += ret;
+    }
+
+    worker.stats.deliveries++;
+    release(client);
+}
+
+/** Start the publisher thread. Call with mMutex. */
+int PiFanout::startPublisher() {
+    mStopRequested = false;
+
+    int status = pthread_create(&mPublisher, NULL, run_publisher, this);
+    if (status) {
+        fprintf(stderr, "Failed to create the publisher thread status=%d\n", status);
+        return status;
+    }
+
+    mRunning = true;
+    return 0;
+}
+
+/** Stop the publisher thread if no client is left */
+void PiFanout::stopPublisher() {
+    pthread_mutex_lock(&mMutex);
+    if (!mRunning || mNumClients > 0) {
+        pthread_mutex_unlock(&mMutex);
+        return;
+    }
+    mStopRequested = true;
+    pthread_mutex_unlock(&mMutex);
+
+    pthread_join(mPublisher, NULL);
+
+    pthread_mutex_lock(&mMutex);
+    mRunning = false;
+
+    // A client may have come while stopping.
+    int status = (mNumClients > 0) ? startPublisher() : 0;
+    if (status) {
+        std::vector<Worker*>::iterator it = mWorkers.begin();
+        for (; it != mWorkers.end(); it++) {
+            pthread_mutex_lock(&(*it)->mutex);
+            for (size_t i = 0; i < (*it)->clients.size(); i++) {
+                finish(**it, (*it)->clients[i], status);
+            }
+            pthread_mutex_unlock(&(*it)->mutex);
+        }
+    }
+    pthread_mutex_unlock(&mMutex);
+
+    PiFanoutStats s = stats();
+    if (s.frames) {
+        PI_LOG(PILOG_INFO, 0, "fanout: frames=%lu deliveries=%lu dropped=%lu wakeups/1000 frames=%lu",
+                (long)s.frames, (long)s.deliveries, (long)s.dropped, (long)(s.wakeups * 1000 / s.frames));
+    }
+}
+
+void* PiFanout::run_publisher(void* arg) {
+    PiFanout* self = static_cast<PiFanout*>(arg);
+    PiThreads::enter(THREAD_DISPATCH, "fanout-publisher");
+    uint64_t start = PiClock::threadCpuNsec();
+    TRAP_LOG(self->publish(););
+    PiThreads::leave();
+
+    pthread_mutex_lock(&self->mMutex);
+    self->mPublisherCpuNs += PiClock::threadCpuNsec() - start;
+    pthread_mutex_unlock(&self->mMutex);
+    return NULL;
+}
+
+void* PiFanout::run_worker(void* arg) {
+    Worker* worker = static_cast<Worker*>(arg);
+    PiThreads::enter(THREAD_NETWORK, "fanout-worker");
+    TRAP_LOG(worker->owner->work(*worker););
+    PiThreads::leave();
+    return NULL;
+}
+
+void PiFanout::publish() {
+    PiFrame* frame = NULL;
+
+    while (!mStopRequested) {
+        if (frame == NULL) {
+            frame = mManager.attach();
+            if (frame == NULL) {
+                // The camera isn't available, so let the clients go.
+                std::vector<Worker*>::iterator it = mWorkers.begin();
+                for (; it != mWorkers.end(); it++) {
+                    pthread_mutex_lock(&(*it)->mutex);
+                    for (size_t i = 0; i < (*it)->clients.size(); i++) {
+                        finish(**it, (*it)->clients[i], ENODEV);
+                    }
+                    pthread_mutex_unlock(&(*it)->mutex);
+                }
+                sleep(PUBLISHER_WAIT_SEC);
+                continue;
+            }
+        }
+
+        int status = frame->waitForReady(PUBLISHER_WAIT_SEC);
+        if (status == ETIMEDOUT) {
+            continue;
+        } else if (status) {
+            PI_LOG(PILOG_ERROR, status, "PiFanout: error in waitForReady");
+            break;
+        }
+
+        // Find a slot which no worker or client is using. Only this thread takes new refs.
+        int index = -1;
+        for (int i = 0; i < NUM_SLOTS && index < 0; i++) {
+            if (__sync_fetch_and_add(&mSlots[i].refs, 0) == 0) index = i;
+        }
+        if (index < 0) {
+            continue;
+        }
+
+        Slot& slot = mSlots[index];
+        if ((status = frame->lock(3)) != 0) {
+            PI_LOG(PILOG_ERROR, status, "PiFanout: error in PiFrame#lock");
+            continue;
+        }
+
+        size_t frame_size = frame->length;
+        char header[HEADER_RESERVE];
+        int header_length = snprintf(header, sizeof(header),
+                "\r\n"
+                "--%s\r\n"
+                "Content-Type: image/jpeg\r\n"
+                "Content-Length: %lu\r\n"
+                "\r\n",
+                mBoundary.c_str(), (unsigned long)frame_size);
+
+        status = (header_length > 0 && header_length < (int)sizeof(header)) ? 0 : EINVAL;
+        if (status == 0 && slot.buffer.alloc_size < header_length + frame_size) {
+            status = slot.buffer.realloc(header_length + frame_size);
+        }
+        if (status == 0) {
+            memcpy(slot.buffer.values, header, header_length);
+            memcpy(slot.buffer.values + header_length, frame->buffer, frame_size);
+            slot.length = header_length + frame_size;
+        }
+        frame->unlock();
+
+        if (status) {
+            PI_LOG(PILOG_ERROR, status, "PiFanout: failed to copy the frame");
+            continue;
+        }
+
+        // One wakeup per worker, instead of one per client
+        std::vector<Worker*>::iterator it = mWorkers.begin();
+        for (; it != mWorkers.end(); it++) {
+            Worker& worker = **it;
+            pthread_mutex_lock(&worker.mutex);
+            if (worker.clients.empty()) {
+                pthread_mutex_unlock(&worker.mutex);
+                continue;
+            }
+            if (worker.pending >= 0) {
+                // The worker hasn't picked up the previous frame yet.
+                __sync_sub_and_fetch(&mSlots[worker.pending].refs, 1);
+                worker.stats.dropped += worker.clients.size();
+            }
+            __sync_add_and_fetch(&slot.refs, 1);
+            worker.pending = index;
+            pthread_mutex_unlock(&worker.mutex);
+            wake(worker);
+        }
+
+        pthread_mutex_lock(&mMutex);
+        mFrames++;
+        pthread_mutex_unlock(&mMutex);
+    }
+
+    if (frame) {
+        mManager.detach(frame);
+    }
+}
+
+void PiFanout::work(Worker& worker) {
+    std::vector<pollfd> fds;
+    std::vector<Client*> polled;
+
+    pthread_mutex_lock(&worker.mutex);
+    while (!mWorkersStopRequested) {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        // Write the new frame to all the idle clients in one pass.
+        if (worker.pending >= 0) {
+            int index = worker.pending;
+            worker.pending = -1;
+
+            for (size_t i = 0; i < worker.clients.size(); i++) {
+                Client* client = worker.clients[i];
+                if (client->done) {
+                    continue;
+                } else if (client->slot >= 0) {
+                    // Still sending an older frame, this one is skipped for the client.
+                    worker.stats.dropped++;
+                    continue;
+                }
+                client->slot = index;
+                client->offset = 0;
+                client->busy_since = now;
+                __sync_add_and_fetch(&mSlots[index].refs, 1);
+                sendSome(worker, client);
+            }
+            __sync_sub_and_fetch(&mSlots[index].refs, 1);
+        }
+
+        // Remove the finished clients, and collect the busy ones.
+        fds.clear();
+        polled.clear();
+        pollfd pfd;
+        pfd.fd = worker.event_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        fds.push_back(pfd);
+
+        std::vector<Client*>::iterator it = worker.clients.begin();
+        while (it != worker.clients.end()) {
+            Client* client = *it;
+            if (client->slot >= 0 && PiClock::elapsedNsec(client->busy_since, now) > mTimeoutNs) {
+                PI_LOG(PILOG_WARN, ETIMEDOUT, "PiFanout: send timeout socket=%ld", (long)client->socket);
+                finish(worker, client, ETIMEDOUT);
+            }
+            if (client->done && client->slot < 0) {
+                client->removed = true;
+                it = worker.clients.erase(it);
+                pthread_cond_broadcast(&worker.cond);
+                continue;
+            }
+            if (client->slot >= 0) {
+                pfd.fd = client->socket;
+                pfd.events = POLLOUT;
+                fds.push_back(pfd);
+                polled.push_back(client);
+            }
+            it++;
+        }
+
+        // Only this thread removes clients, so 'polled' stays valid while unlocked.
+        pthread_mutex_unlock(&worker.mutex);
+        int ret = poll(&fds[0], fds.size(), polled.empty() ? -1 : POLL_MSEC);
+        int err = errno;
+        pthread_mutex_lock(&worker.mutex);
+        worker.stats.syscalls++;
+        worker.stats.wakeups++;
+
+        if (ret < 0) {
+            if (err != EINTR) {
+                PI_LOG(PILOG_ERROR, err, "PiFanout: poll");
+            }
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint64_t value;
+            if (read(worker.event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                PI_LOG(PILOG_ERROR, errno, "PiFanout: read eventfd");
+            }
+        }
+
+        for (size_t i = 0; i < polled.size(); i++) {
+            Client* client = polled[i];
+            if (fds[i + 1].revents && client->slot >= 0 && !client->done) {
+                sendSome(worker, client);
+            }
+        }
+    }
+    pthread_mutex_unlock(&worker.mutex);
+}
@@ -2,29 +2,73 @@
 
 #include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <time.h>
 #include <sys/time.h>
-#include <bcm_host.h>
-#include <interface/vcos/vcos.h>
-#include <mmal/mmal.h>
-#include <mmal/util/mmal_util.h>
-#include <mmal/util/mmal_default_components.h>
-#include <mmal/util/mmal_connection.h>
-#include <mmal/util/mmal_util_params.h>
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-#include "RaspiCamControl.h"
-#ifdef __cplusplus
-}
-#endif
-
+#include <unistd.h>
 #include "PiFrame.h"
+#include "PiLog.h"
+#include "PiTrace.h"
+#include "PiException.h"
+
+#define MAX_CREDITS (1 << 20)
+
+namespace {
+
+/** The waits of pthread take a deadline of CLOCK_REALTIME, not a timeout */
+void deadline_after(int sec, long nsec, timespec* t) {
+    clock_gettime(CLOCK_REALTIME, t);
+    t->tv_sec += sec + nsec / 1000000000L;
+    t->tv_nsec += nsec % 1000000000L;
+    if (t->tv_nsec >= 1000000000L) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000L;
+    }
+}
+
+} // namespace
+
+/** Copy 'src' into a new shared frame */
+PiSharedFrame* PiSharedFrame::create(const uint8_t* src, size_t length) {
+    uint8_t* values = (uint8_t*)malloc(length);
+    if (values == NULL) {
+        return NULL;
+    }
+    memcpy(values, src, length);
+
+    PiSharedFrame* shared = NULL;
+    TRAP1(catched, msg, shared = new PiSharedFrame(values, length););
+    if (catched) {
+        free(values);
+        return NULL;
+    }
+    return shared;
+}
+
+PiSharedFrame::PiSharedFrame(uint8_t* values, size_t length) : values(values), length(length), mRefs(1) {
+}
+
+PiSharedFrame::~PiSharedFrame() {
+    free(values);
+}
+
+void PiSharedFrame::retain() {
+    __sync_add_and_fetch(&mRefs, 1);
+}
+
+void PiSharedFrame::release() {
+    if (__sync_sub_and_fetch(&mRefs, 1) == 0) {
+        delete this;
+    }
+}
 
 /** Constructor */
 PiFrame::PiFrame(size_t initial_mem_size, int* status)
-        : buffer(NULL), length(0), mAllocatedSize(0) {
+        : buffer(NULL), length(0), sequence(0), timestamp_us(0), stream_id(0),
+        mAllocatedSize(0), mIntervalNs(0), mNextDueNs(0), mCreditMode(false), mCredits(0), mReadyFd(-1),
+        mSharing(false), mShared(NULL), mSignaled(0) {
 
     if (status) *status = 0;
 
@@ -78,17 +122,21 @@ PiFrame::~PiFrame() {
     ret = pthread_mutex_destroy(&mMemMutex);
     if (ret) fprintf(stderr, "~PiFrame() mem mutex destroy err=%d\n", ret);
 
+    if (mShared) {
+        mShared->release();
+    }
     free(buffer);
 }
 
 /** Wait until called sendReadySignal() */
 int PiFrame::waitForReady(int sec, long nsec) {
+    PI_TRACE("waitForReady", sec);
     int ret = 0;
 
     // Lock the mutex
     ret = pthread_mutex_lock(&mSignalMutex);
     if (ret) {
-        fprintf(stderr, "PiFrame::waitForReady() lock mMemMutex err=%d\n", ret);
+        PI_LOG(PILOG_ERROR, ret, "PiFrame::waitForReady() lock mSignalMutex");
 
         // If error occured, finish immediately.
         return ret;
@@ -100,14 +148,13 @@ int PiFrame::waitForReady(int sec, long nsec) {
         ret = pthread_cond_wait(&mSignalCond, &mSignalMutex);
     } else {
         timespec t;
-        t.tv_sec = time(NULL) + sec;
-        t.tv_nsec = nsec;
+        deadline_after(sec, nsec, &t);
         ret = pthread_cond_timedwait(&mSignalCond, &mSignalMutex, &t);
     }
 
     // Check whether pthread_cond_timedwait() was success.
     if (ret != 0 && ret != ETIMEDOUT) {
-        fprintf(stderr, "PiFrame::waitForReady() cond timed err=%d\n", ret);
+        PI_LOG(PILOG_ERROR, ret, "PiFrame::waitForReady() cond timed");
 
         // If error occured, finish without confirmation whether pthread_mutex_unlock() is success
         pthread_mutex_unlock(&mSignalMutex);
@@ -120,18 +167,56 @@ int PiFrame::waitForReady(int sec, long nsec) {
     // Unlock the mutex
     ret = pthread_mutex_unlock(&mSignalMutex);
     if (ret) {
-        fprintf(stderr, "PiFrame::waitForReady() unlock mMemMutex err=%d\n", ret);
+        PI_LOG(PILOG_ERROR, ret, "PiFrame::waitForReady() unlock mSignalMutex");
         return ret;
     }
 
     return isTimeout? ETIMEDOUT : 0;
 }
 
+/**
+ * Wait until a frame is signaled after the one counted in 'seen', and update it.
+ * A frame signaled while the caller was busy returns at once, so no signal is lost.
+ */
+int PiFrame::waitForReady(uint64_t* seen, int sec, long nsec) {
+    PI_TRACE("waitForReady", sec);
+    int ret = pthread_mutex_lock(&mSignalMutex);
+    if (ret) {
+        PI_LOG(PILOG_ERROR, ret, "PiFrame::waitForReady() lock mSignalMutex");
+        return ret;
+    }
+
+    timespec t;
+    deadline_after(sec, nsec, &t);
+    while (ret == 0 && mSignaled == *seen) {
+        ret = pthread_cond_timedwait(&mSignalCond, &mSignalMutex, &t);
+    }
+    if (ret == 0) {
+        *seen = mSignaled;
+    } else if (ret != ETIMEDOUT) {
+        PI_LOG(PILOG_ERROR, ret, "PiFrame::waitForReady() cond timed");
+    }
+
+    pthread_mutex_unlock(&mSignalMutex);
+    return ret;
+}
+
 /** Send signals for wakeup waiting threads */
 void PiFrame::sendReadySignal() {
     int ret = 0;
+    ret = pthread_mutex_lock(&mSignalMutex);
+    if (ret) PI_LOG(PILOG_ERROR, ret, "PiFrame::sendReadySignal() lock mSignalMutex");
+    mSignaled++;
     ret = pthread_cond_broadcast(&mSignalCond);
-    if (ret) fprintf(stderr, "PiFrame::sendReadySignal() cond broadcast err=%d\n", ret);
+    if (ret) PI_LOG(PILOG_ERROR, ret, "PiFrame::sendReadySignal() cond broadcast");
+    pthread_mutex_unlock(&mSignalMutex);
+
+    const int fd = mReadyFd;
+    if (fd != -1) {
+        uint64_t one = 1;
+        ssize_t wrote = ::write(fd, &one, sizeof(one)); // fails only if the counter is saturated
+        (void)wrote;
+    }
 }
 
 /** Before call write() or read(), lock the memory stored jpeg-image */
@@ -143,33 +228,143 @@ int PiFrame::lock(int sec, long nsec) {
     } else if (sec > 0 || nsec > 0) {
         // Wait until timeout
         timespec t;
-        t.tv_sec = sec; t.tv_nsec = nsec;
+        deadline_after(sec, nsec, &t);
         ret = pthread_mutex_timedlock(&mMemMutex,  &t);
         if (ret == ETIMEDOUT) {
             // Semi-normal case: occured timeout
         } else if (ret != 0) {
             // Error case: unknown error
-            fprintf(stderr, "PiFrame::lockMemory s:%d n:%d err=%d\n", sec, nsec, ret);
+            PI_LOG(PILOG_ERROR, ret, "PiFrame::lockMemory s:%ld n:%ld", (long)sec, nsec);
         }
     }  else {
         // wait infinitely
         ret = pthread_mutex_lock(&mMemMutex);
         if (ret != 0) {
             // Error case: unknown error
-            fprintf(stderr, "PiFrame::lockMemory err=%d\n", ret);
+            PI_LOG(PILOG_ERROR, ret, "PiFrame::lockMemory");
         }
     }
 
     return ret;
 }
 
+/** Lock the memory if nobody holds it, without waiting */
+int PiFrame::tryLock() {
+    return pthread_mutex_trylock(&mMemMutex);
+}
+
 /** Unlock the memory */
 void PiFrame::unlock() {
         int ret = pthread_mutex_unlock(&mMemMutex);
         if (ret != 0) {
             // Error case: unknown error
-            fprintf(stderr, "PiFrame::unlockMemory err=%d\n", ret);
+            PI_LOG(PILOG_ERROR, ret, "PiFrame::unlockMemory");
+        }
+}
+
+/** Limit the rate of frames delivered to this PiFrame (0 = unlimited) */
+void PiFrame::setMaxFps(int fps) {
+    mIntervalNs = (fps > 0) ? (1000000000LL / fps) : 0;
+    mNextDueNs = 0;
+}
+
+/**
+ * Check whether a frame published at 'now' should be delivered to this PiFrame.
+ * This is called before the frame is locked or copied, so skipped frames cost nothing.
+ * 'slack_nsec' absorbs the jitter of the camera frame period. A credit isn't taken
+ * here, the client takes it by takeCredit() when it takes the frame out.
+ */
+bool PiFrame::isDue(const timespec& now, long slack_nsec) {
+    // Without credits the client gets nothing, not even a stale frame later.
+    if (!hasCredit()) {
+        return false;
+    }
+
+    if (mIntervalNs > 0) {
+        int64_t now_ns = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+        if (now_ns + slack_nsec < mNextDueNs) {
+            return false; // Skip this frame
+        }
+
+        // Keep the cadence, but don't try to catch up after a long stall.
+        mNextDueNs += mIntervalNs;
+        if (mNextDueNs <= now_ns) {
+            mNextDueNs = now_ns + mIntervalNs;
+        }
+    }
+    return true;
+}
+
+/** Whether a frame may be delivered now, always true out of credit mode */
+bool PiFrame::hasCredit() {
+    return !mCreditMode || __sync_fetch_and_add(&mCredits, 0) > 0;
+}
+
+/**
+ * Take a credit for a frame which the client sends. A frame written before the last
+ * credit was taken isn't sent, so return false if none is left.
+ */
+bool PiFrame::takeCredit() {
+    if (!mCreditMode) {
+        return true;
+    }
+    int current = __sync_fetch_and_add(&mCredits, 0);
+    while (current > 0) {
+        int previous = __sync_val_compare_and_swap(&mCredits, current, current - 1);
+        if (previous == current) {
+            return true;
         }
+        current = previous;
+    }
+    return false;
+}
+
+/** Deliver only the frames granted by the client. Call before the PiFrame is attached. */
+void PiFrame::enableCredits(int initial_credits) {
+    mCredits = (initial_credits > 0) ? initial_credits : 0;
+    mCreditMode = true;
+}
+
+/** Grant more frames, and return the number of frames the client may receive now */
+int PiFrame::addCredits(int credits) {
+    if (credits <= 0) {
+        return __sync_fetch_and_add(&mCredits, 0);
+    }
+
+    // Clamp so a broken client can't overflow the counter.
+    int current = __sync_fetch_and_add(&mCredits, 0);
+    if (current > MAX_CREDITS - credits) {
+        credits = MAX_CREDITS - current;
+    }
+    return __sync_add_and_fetch(&mCredits, credits);
+}
+
+/** Take the frames by reference from now on. The buffer of the copies is freed. */
+void PiFrame::enableSharing() {
+    mSharing = true;
+    free(buffer);
+    buffer = NULL;
+    mAllocatedSize = 0;
+}
+
+/** Refer to 'shared' instead of the previous frame, and return its length (0 for NULL) */
+size_t PiFrame::share(PiSharedFrame* shared) {
+    if (shared == NULL) {
+        return 0;
+    }
+    shared->retain();
+    if (mShared) {
+        mShared->release(); // The client didn't take it in time
+    }
+    mShared = shared;
+    length = shared->length;
+    return shared->length;
+}
+
+PiSharedFrame* PiFrame::takeShared() {
+    PiSharedFrame* shared = mShared;
+    mShared = NULL;
+    return shared;
 }
 
 /** Return the size needs to read the memory */
@@ -0,0 +1,25 @@
+#include "PiCamera.h"
+
+PiCameraParams::PiCameraParams() : mParams(new RASPICAM_CAMERA_PARAMETERS()) {
+    raspicamcontrol_set_defaults(mParams);
+}
+
+PiCameraParams::PiCameraParams(const PiCameraParams& other)
+        : mParams(new RASPICAM_CAMERA_PARAMETERS(*other.mParams)) {}
+
+PiCameraParams& PiCameraParams::operator=(const PiCameraParams& other) {
+    *mParams = *other.mParams;
+    return *this;
+}
+
+PiCameraParams::~PiCameraParams() {
+    delete mParams;
+}
+
+PiAnnotate::PiAnnotate(const RASPICAM_CAMERA_PARAMETERS& params)
+        : flags(params.enable_annotate), text(params.annotate_string), text_size(params.annotate_text_size),
+          text_colour(params.annotate_text_colour), bg_colour(params.annotate_bg_colour) {}
+
+bool PiAnnotate::hasClock() const {
+    return (flags & (ANNOTATE_TIME_TEXT | ANNOTATE_DATE_TEXT)) != 0;
+}
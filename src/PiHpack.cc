@@ -0,0 +1,351 @@
+#include "PiHpack.h"
+#include <string.h>
+#include <errno.h>
+
+#define NUM_STATIC_ENTRIES 61
+#define ENTRY_OVERHEAD 32
+#define EOS 256
+#define MAX_CODE_LENGTH 30
+
+namespace {
+
+struct StaticEntry {
+    const char* name;
+    const char* value;
+};
+
+// Appendix A of RFC 7541, the index is the position + 1
+const StaticEntry STATIC_TABLE[NUM_STATIC_ENTRIES] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// Code lengths of the Huffman code of Appendix B, the symbols 0-255 and EOS. The code
+// is canonical, so the codes themselves follow from the lengths.
+const uint8_t HUFFMAN_LENGTHS[EOS + 1] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+/** Decoding table of the canonical code, the symbols ordered by the length and the value */
+struct HuffmanTable {
+    uint32_t first[MAX_CODE_LENGTH + 1];    // first code of each length
+    uint16_t count[MAX_CODE_LENGTH + 1];    // codes of each length
+    uint16_t offset[MAX_CODE_LENGTH + 1];   // index of the first symbol of each length in 'symbols'
+    uint16_t symbols[EOS + 1];
+
+    HuffmanTable() {
+        memset(count, 0, sizeof(count));
+        for (int s = 0; s <= EOS; s++) {
+            count[HUFFMAN_LENGTHS[s]]++;
+        }
+        uint32_t code = 0;
+        uint16_t index = 0;
+        for (int length = 1; length <= MAX_CODE_LENGTH; length++) {
+            first[length] = code;
+            offset[length] = index;
+            for (int s = 0; s <= EOS; s++) {
+                if (HUFFMAN_LENGTHS[s] == length) {
+                    symbols[index++] = s;
+                }
+            }
+            code = (code + count[length]) << 1;
+        }
+    }
+};
+
+const HuffmanTable gHuffman;
+
+void encode_integer(uint32_t value, int prefix_bits, uint8_t flags, std::string* out) {
+    const uint32_t max_prefix = (1u << prefix_bits) - 1;
+    if (value < max_prefix) {
+        *out += (char)(flags | value);
+        return;
+    }
+    *out += (char)(flags | max_prefix);
+    value -= max_prefix;
+    while (value >= 0x80) {
+        *out += (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    *out += (char)value;
+}
+
+// A string literal without the Huffman code
+void encode_string(const std::string& value, std::string* out) {
+    encode_integer(value.length(), 7, 0x00, out);
+    *out += value;
+}
+
+inline size_t entry_size(const PiHeaderField& field) {
+    return field.first.length() + field.second.length() + ENTRY_OVERHEAD;
+}
+
+} // namespace
+
+PiHpack::PiHpack() : mTableSize(0), mMaxTableSize(DEFAULT_TABLE_SIZE) {
+}
+
+int PiHpack::decodeInteger(const uint8_t* data, size_t size, int prefix_bits, size_t* pos, uint32_t* value) {
+    if (*pos >= size) {
+        return EPROTO;
+    }
+    const uint32_t max_prefix = (1u << prefix_bits) - 1;
+    uint64_t v = data[(*pos)++] & max_prefix;
+    if (v == max_prefix) {
+        for (int shift = 0; ; shift += 7) {
+            if (*pos >= size || shift > 28) {
+                return EPROTO;
+            }
+            const uint8_t b = data[(*pos)++];
+            v += (uint64_t)(b & 0x7f) << shift;
+            if (v > 0x7fffffff) {
+                return EPROTO;
+            }
+            if (!(b & 0x80)) {
+                break;
+            }
+        }
+    }
+    *value = (uint32_t)v;
+    return 0;
+}
+
+int PiHpack::decodeHuffman(const uint8_t* data, size_t size, std::string* out) {
+    uint32_t code = 0;
+    int length = 0;
+    for (size_t i = 0; i < size; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            code = (code << 1) | ((data[i] >> bit) & 1);
+            if (++length > MAX_CODE_LENGTH) {
+                return EPROTO;
+            }
+            // The codes of a length are consecutive from first[length].
+            const uint32_t index = code - gHuffman.first[length];
+            if (code >= gHuffman.first[length] && index < gHuffman.count[length]) {
+                const uint16_t symbol = gHuffman.symbols[gHuffman.offset[length] + index];
+                if (symbol == EOS) {
+                    return EPROTO;
+                }
+                *out += (char)symbol;
+                code = 0;
+                length = 0;
+            }
+        }
+    }
+    // The padding is shorter than 8 bits and is the most significant bits of EOS, all ones.
+    if (length > 7 || code != (1u << length) - 1) {
+        return EPROTO;
+    }
+    return 0;
+}
+
+int PiHpack::decodeString(const uint8_t* data, size_t size, size_t* pos, std::string* out) {
+    if (*pos >= size) {
+        return EPROTO;
+    }
+    const bool huffman = (data[*pos] & 0x80) != 0;
+    uint32_t length = 0;
+    int status = decodeInteger(data, size, 7, pos, &length);
+    if (status) {
+        return status;
+    }
+    if (length > size - *pos || length > MAX_HEADER_LIST_SIZE) {
+        return EPROTO;
+    }
+    out->clear();
+    if (huffman) {
+        status = decodeHuffman(data + *pos, length, out);
+    } else {
+        out->assign((const char*)data + *pos, length);
+    }
+    *pos += length;
+    return status;
+}
+
+int PiHpack::lookup(uint32_t index, PiHeaderField* field) const {
+    if (index == 0) {
+        return EPROTO;
+    } else if (index <= NUM_STATIC_ENTRIES) {
+        field->first = STATIC_TABLE[index - 1].name;
+        field->second = STATIC_TABLE[index - 1].value;
+        return 0;
+    } else if (index - NUM_STATIC_ENTRIES - 1 < mTable.size()) {
+        *field = mTable[index - NUM_STATIC_ENTRIES - 1];
+        return 0;
+    }
+    return EPROTO;
+}
+
+void PiHpack::evict(size_t max_size) {
+    while (mTableSize > max_size && !mTable.empty()) {
+        mTableSize -= entry_size(mTable.back());
+        mTable.pop_back();
+    }
+}
+
+void PiHpack::insert(const PiHeaderField& field) {
+    // An entry larger than the table empties it, and isn't added.
+    const size_t size = entry_size(field);
+    if (size > mMaxTableSize) {
+        evict(0);
+        return;
+    }
+    evict(mMaxTableSize - size);
+    mTable.push_front(field);
+    mTableSize += size;
+}
+
+int PiHpack::decode(const uint8_t* data, size_t size, std::vector<PiHeaderField>* fields) {
+    size_t list_size = 0;
+    bool first = true;
+    size_t pos = 0;
+    while (pos < size) {
+        const uint8_t b = data[pos];
+        uint32_t index = 0;
+        PiHeaderField field;
+        int status;
+
+        if (b & 0x80) {
+            // Indexed header field
+            if ((status = decodeInteger(data, size, 7, &pos, &index)) != 0 ||
+                    (status = lookup(index, &field)) != 0) {
+                return status;
+            }
+        } else if ((b & 0xe0) == 0x20) {
+            // Dynamic table size update, only at the beginning of a block
+            if ((status = decodeInteger(data, size, 5, &pos, &index)) != 0) {
+                return status;
+            }
+            if (!first || index > DEFAULT_TABLE_SIZE) {
+                return EPROTO;
+            }
+            mMaxTableSize = index;
+            evict(mMaxTableSize);
+            continue;
+        } else {
+            // Literal with incremental indexing (01), without indexing (0000) or never indexed (0001)
+            const bool indexing = (b & 0x40) != 0;
+            if ((status = decodeInteger(data, size, indexing ? 6 : 4, &pos, &index)) != 0) {
+                return status;
+            }
+            if (index) {
+                if ((status = lookup(index, &field)) != 0) {
+                    return status;
+                }
+            } else if ((status = decodeString(data, size, &pos, &field.first)) != 0) {
+                return status;
+            }
+            if ((status = decodeString(data, size, &pos, &field.second)) != 0) {
+                return status;
+            }
+            if (indexing) {
+                insert(field);
+            }
+        }
+
+        first = false;
+        list_size += entry_size(field);
+        if (list_size > MAX_HEADER_LIST_SIZE) {
+            return EPROTO;
+        }
+        fields->push_back(field);
+    }
+    return 0;
+}
+
+void PiHpack::encode(const std::string& name, const std::string& value, std::string* out) {
+    uint32_t name_index = 0;
+    for (uint32_t i = 0; i < NUM_STATIC_ENTRIES; i++) {
+        if (name == STATIC_TABLE[i].name) {
+            if (value == STATIC_TABLE[i].value) {
+                encode_integer(i + 1, 7, 0x80, out); // indexed
+                return;
+            }
+            if (name_index == 0) {
+                name_index = i + 1;
+            }
+        }
+    }
+
+    // Literal without indexing, with an indexed name if there is one
+    encode_integer(name_index, 4, 0x00, out);
+    if (name_index == 0) {
+        encode_string(name, out);
+    }
+    encode_string(value, out);
+}
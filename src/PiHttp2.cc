@@ -0,0 +1,940 @@
+#include "PiHttp2.h"
+#include "PiHttpdInterpreter.h"
+#include "PiCameraManager.h"
+#include "PiFrame.h"
+#include "PiMemory.h"
+#include "PiException.h"
+#include "PiLog.h"
+#include "PiTrace.h"
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+// Frame types and flags of RFC 9113
+#define TYPE_DATA 0x0
+#define TYPE_HEADERS 0x1
+#define TYPE_PRIORITY 0x2
+#define TYPE_RST_STREAM 0x3
+#define TYPE_SETTINGS 0x4
+#define TYPE_PUSH_PROMISE 0x5
+#define TYPE_PING 0x6
+#define TYPE_GOAWAY 0x7
+#define TYPE_WINDOW_UPDATE 0x8
+#define TYPE_CONTINUATION 0x9
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+
+#define ERROR_NO_ERROR 0x0
+#define ERROR_PROTOCOL 0x1
+#define ERROR_INTERNAL 0x2
+#define ERROR_FLOW_CONTROL 0x3
+#define ERROR_STREAM_CLOSED 0x5
+#define ERROR_FRAME_SIZE 0x6
+#define ERROR_REFUSED_STREAM 0x7
+#define ERROR_COMPRESSION 0x9
+
+#define FRAME_HEADER_SIZE 9
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffffLL
+#define DEFAULT_FRAME_SIZE 16384
+#define MAX_FRAME_SIZE_LIMIT 16777215
+
+// DATA frames are at most this large even if the client accepts larger ones
+#define MAX_DATA_FRAME_SIZE 65536
+
+// Streams of a connection, enough for a page of tiles
+#define MAX_STREAMS 32
+
+// Limit of a header block with its CONTINUATION frames
+#define MAX_HEADER_BLOCK_SIZE 65536
+
+// Frames queued before the socket takes them. More DATA is written only below this,
+// so a slow connection doesn't hold every frame of every stream.
+#define OUT_HIGH_WATER 65536
+
+// Interval to check whether the server is draining
+#define POLL_MSEC 1000
+
+// Same as the multipart streams of HTTP/1
+#define BOUNDARY "boundary"
+#define PART_HEADER_SIZE 128
+
+// Asked of the streams refused for the memory budget
+#define RETRY_AFTER_SEC "5"
+
+static const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+namespace {
+
+int gConnections = 0;
+int gStreams = 0;
+uint64_t gFrames = 0;
+uint64_t gSkipped = 0;
+uint64_t gStalls = 0;
+uint64_t gRefused = 0;
+
+inline uint32_t be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+inline void put32(uint32_t value, uint8_t* p) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+long elapsed_ms(const timespec& since) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since.tv_sec) * 1000 + (now.tv_nsec - since.tv_nsec) / 1000000;
+}
+
+// HTTP2-Settings is base64url without padding. Return EINVAL on other characters.
+int base64url_decode(const std::string& in, std::string* out) {
+    uint32_t bits = 0;
+    int num_bits = 0;
+    for (size_t i = 0; i < in.length(); i++) {
+        const char c = in[i];
+        int v;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '-') v = 62;
+        else if (c == '_') v = 63;
+        else if (c == '=') break;
+        else return EINVAL;
+        bits = (bits << 6) | v;
+        num_bits += 6;
+        if (num_bits >= 8) {
+            num_bits -= 8;
+            *out += (char)((bits >> num_bits) & 0xff);
+        }
+    }
+    return 0;
+}
+
+} // namespace
+
+PiHttp2Session::PiHttp2Session(int socket, PiHttp2Handler& handler, PiMemoryAccount& memory,
+        const std::string& server_name, const timeval& timeout_sending, const timeval& timeout_recving, int* status)
+        : mSocket(socket), mHandler(handler), mMemory(memory), mServerName(server_name),
+          mTimeoutSendingMs(timeout_sending.tv_sec * 1000 + timeout_sending.tv_usec / 1000),
+          mTimeoutRecvingMs(timeout_recving.tv_sec * 1000 + timeout_recving.tv_usec / 1000),
+          mEventFd(-1), mOutOffset(0), mPrefaceReceived(false), mLastStreamId(0), mHeaderStream(0),
+          mWindow(DEFAULT_WINDOW), mInitialWindow(DEFAULT_WINDOW), mMaxFrameSize(DEFAULT_FRAME_SIZE),
+          mGoingAway(false), mPeerGone(false), mUpgrade(NULL) {
+    *status = 0;
+    mEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mEventFd < 0) {
+        *status = errno;
+        PI_LOG(PILOG_ERROR, errno, "Failed to create the eventfd of an HTTP/2 session");
+    }
+}
+
+PiHttp2Session::~PiHttp2Session() {
+    while (!mStreams.empty()) {
+        closeStream(mStreams.begin());
+    }
+    delete mUpgrade;
+    if (mEventFd != -1) {
+        close(mEventFd);
+    }
+}
+
+bool PiHttp2Session::isPreface(const char* data, size_t size) {
+    if (size == 0) {
+        return false;
+    }
+    return memcmp(data, PREFACE, size < PREFACE_LENGTH ? size : PREFACE_LENGTH) == 0;
+}
+
+int PiHttp2Session::upgrade(const PiHttpdInterpreter& intr, const std::string& settings) {
+    std::string payload;
+    if (base64url_decode(settings, &payload) != 0 || payload.length() % 6 != 0) {
+        return EINVAL;
+    }
+    if (applySettings((const uint8_t*)payload.data(), payload.length()) != ERROR_NO_ERROR) {
+        return EINVAL;
+    }
+    delete mUpgrade;
+    mUpgrade = new PiHttpdInterpreter(intr);
+    mLastStreamId = 1;
+    return 0;
+}
+
+int PiHttp2Session::run(const std::string& received) {
+    mIn = received;
+    __sync_add_and_fetch(&gConnections, 1);
+
+    // The server preface
+    uint8_t settings[6];
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(MAX_STREAMS, settings + 2);
+    writeFrame(TYPE_SETTINGS, 0, 0, settings, sizeof(settings));
+
+    int status = 0;
+    if (mUpgrade) {
+        status = openStream(1, *mUpgrade);
+    }
+
+    timespec last_recv, last_send;
+    clock_gettime(CLOCK_MONOTONIC, &last_recv);
+    last_send = last_recv;
+
+    while (status == 0) {
+        if ((status = process()) != 0) {
+            break;
+        }
+
+        if (!mHandler.isRunning() && !mGoingAway) {
+            goAway(ERROR_NO_ERROR);
+            finishStreams();
+        }
+
+        std::map<uint32_t, Stream*>::iterator it = mStreams.begin();
+        while (it != mStreams.end()) {
+            Stream* stream = it->second;
+            it++; // refresh() may close the stream
+            refresh(stream);
+        }
+        schedule();
+
+        const size_t pending = mOut.size() - mOutOffset;
+        if ((status = flush()) != 0) {
+            break;
+        }
+        if (mOut.size() - mOutOffset < pending || mOut.empty()) {
+            clock_gettime(CLOCK_MONOTONIC, &last_send);
+        } else if (elapsed_ms(last_send) > mTimeoutSendingMs) {
+            PI_LOG(PILOG_WARN, ETIMEDOUT, "HTTP/2 connection doesn't take its frames");
+            status = ETIMEDOUT;
+            break;
+        }
+
+        if (mStreams.empty() && mOut.empty()) {
+            if (mGoingAway || mPeerGone) {
+                break;
+            }
+            if (elapsed_ms(last_recv) > mTimeoutRecvingMs) {
+                goAway(ERROR_NO_ERROR); // idle
+                flush();
+                break;
+            }
+        }
+
+        pollfd fds[2];
+        fds[0].fd = mSocket;
+        fds[0].events = POLLIN | (mOut.empty() ? 0 : POLLOUT);
+        fds[0].revents = 0;
+        fds[1].fd = mEventFd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        if (poll(fds, 2, POLL_MSEC) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            status = errno;
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            ssize_t ret = read(mEventFd, &count, sizeof(count));
+            (void)ret;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            char buf[16384];
+            ssize_t n = recv(mSocket, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n > 0) {
+                mIn.append(buf, n);
+                clock_gettime(CLOCK_MONOTONIC, &last_recv);
+            } else if (n == 0) {
+                mPeerGone = true;
+                break;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                status = errno;
+                break;
+            }
+        }
+    }
+
+    flush(); // a GOAWAY, if the socket takes it
+    while (!mStreams.empty()) {
+        closeStream(mStreams.begin());
+    }
+    __sync_sub_and_fetch(&gConnections, 1);
+    printf("finish HTTP/2 connection status=%d\n", status);
+    return status == EPROTO ? 0 : status; // a protocol error has been sent in a GOAWAY
+}
+
+int PiHttp2Session::process() {
+    if (!mPrefaceReceived) {
+        if (mIn.empty()) {
+            return 0; // an upgraded connection before the client has sent anything
+        }
+        if (!isPreface(mIn.data(), mIn.length())) {
+            goAway(ERROR_PROTOCOL);
+            return EPROTO;
+        }
+        if (mIn.length() < PREFACE_LENGTH) {
+            return 0;
+        }
+        mIn.erase(0, PREFACE_LENGTH);
+        mPrefaceReceived = true;
+    }
+
+    size_t pos = 0;
+    int status = 0;
+    while (status == 0 && mIn.length() - pos >= FRAME_HEADER_SIZE) {
+        const uint8_t* header = (const uint8_t*)mIn.data() + pos;
+        const size_t length = ((size_t)header[0] << 16) | (header[1] << 8) | header[2];
+        if (length > DEFAULT_FRAME_SIZE) {
+            goAway(ERROR_FRAME_SIZE);
+            return EPROTO;
+        }
+        if (mIn.length() - pos - FRAME_HEADER_SIZE < length) {
+            break;
+        }
+        status = processFrame(header[3], header[4], be32(header + 5) & 0x7fffffff,
+                header + FRAME_HEADER_SIZE, length);
+        pos += FRAME_HEADER_SIZE + length;
+    }
+    mIn.erase(0, pos);
+    return status;
+}
+
+int PiHttp2Session::processFrame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t* payload, size_t length) {
+    // A header block is contiguous.
+    if (mHeaderStream && (type != TYPE_CONTINUATION || id != mHeaderStream)) {
+        goAway(ERROR_PROTOCOL);
+        return EPROTO;
+    }
+
+    std::map<uint32_t, Stream*>::iterator it = mStreams.find(id);
+    switch (type) {
+    case TYPE_DATA:
+        // A request body isn't used, its bytes are given back to the windows of the client.
+        if (id == 0 || id > mLastStreamId) {
+            goAway(ERROR_PROTOCOL);
+            return EPROTO;
+        }
+        if (length > 0) {
+            writeWindowUpdate(0, length);
+            if (it != mStreams.end()) {
+                writeWindowUpdate(id, length);
+            }
+        }
+        return 0;
+
+    case TYPE_HEADERS:
+        if (id == 0 || !(id & 1)) {
+            goAway(ERROR_PROTOCOL);
+            return EPROTO;
+        }
+        return processHeaders(id, payload, length, flags);
+
+    case TYPE_CONTINUATION:
+        if (mHeaderStream == 0) {
+            goAway(ERROR_PROTOCOL);
+            return EPROTO;
+        }
+        if (mHeaderBlock.length() + length > MAX_HEADER_BLOCK_SIZE) {
+            goAway(ERROR_PROTOCOL);
+            return EPROTO;
+        }
+        mHeaderBlock.append((const char*)payload, length);
+        return (flags & FLAG_END_HEADERS) ? endHeaders() : 0;
+
+    case TYPE_RST_STREAM:
+        if (id == 0 || length != 4) {
+            goAway(id == 0 ? ERROR_PROTOCOL : ERROR_FRAME_SIZE);
+            return EPROTO;
+        }
+        if (it != mStreams.end()) {
+            closeStream(it);
+        }
+        return 0;
+
+    case TYPE_SETTINGS: {
+        if (id != 0) {
+            goAway(ERROR_PROTOCOL);
+            return EPROTO;
+        }
+        if ((flags & FLAG_ACK) ? length != 0 : length % 6 != 0) {
+            goAway(ERROR_FRAME_SIZE);
+            return EPROTO;
+        }
+        if (flags & FLAG_ACK) {
+            return 0;
+        }
+        int error = applySettings(payload, length);
+        if (error != ERROR_NO_ERROR) {
+            goAway(error);
+            return EPROTO;
+        }
+        writeFrame(TYPE_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        return 0;
+    }
+
+    case TYPE_PUSH_PROMISE:
+        goAway(ERROR_PROTOCOL); // only a server pushes
+        return EPROTO;
+
+    case TYPE_PING:
+        if (id != 0 || length != 8) {
+            goAway(id != 0 ? ERROR_PROTOCOL : ERROR_FRAME_SIZE);
+            return EPROTO;
+        }
+        if (!(flags & FLAG_ACK)) {
+            writeFrame(TYPE_PING, FLAG_ACK, 0, payload, length);
+        }
+        return 0;
+
+    case TYPE_GOAWAY:
+        // The client opens no more streams, the open ones are served until they end.
+        if (id != 0 || length < 8) {
+            goAway(ERROR_PROTOCOL);
+            return EPROTO;
+        }
+        mPeerGone = true;
+        return 0;
+
+    case TYPE_WINDOW_UPDATE: {
+        if (length != 4) {
+            goAway(ERROR_FRAME_SIZE);
+            return EPROTO;
+        }
+        const uint32_t increment = be32(payload) & 0x7fffffff;
+        if (id == 0) {
+            if (increment == 0 || mWindow + increment > MAX_WINDOW) {
+                goAway(increment == 0 ? ERROR_PROTOCOL : ERROR_FLOW_CONTROL);
+                return EPROTO;
+            }
+            mWindow += increment;
+        } else if (it != mStreams.end()) {
+            Stream* stream = it->second;
+            if (increment == 0 || stream->window + increment > MAX_WINDOW) {
+                writeRstStream(id, increment == 0 ? ERROR_PROTOCOL : ERROR_FLOW_CONTROL);
+                closeStream(it);
+                return 0;
+            }
+            stream->window += increment;
+        }
+        return 0;
+    }
+
+    default:
+        return 0; // PRIORITY and the unknown types are ignored
+    }
+}
+
+int PiHttp2Session::processHeaders(uint32_t id, const uint8_t* payload, size_t length, uint8_t flags) {
+    // Padding and the priority are around the block.
+    size_t pos = 0;
+    size_t padding = 0;
+    if (flags & FLAG_PADDED) {
+        if (length < 1) {
+            goAway(ERROR_FRAME_SIZE);
+            return EPROTO;
+        }
+        padding = payload[pos++];
+    }
+    if (flags & FLAG_PRIORITY) {
+        pos += 5;
+    }
+    if (pos + padding > length) {
+        goAway(ERROR_PROTOCOL);
+        return EPROTO;
+    }
+
+    // A stream id not greater than the last one is a trailer of an open stream, or a closed stream.
+    if (id <= mLastStreamId && mStreams.find(id) == mStreams.end()) {
+        goAway(ERROR_STREAM_CLOSED);
+        return EPROTO;
+    }
+
+    mHeaderBlock.assign((const char*)payload + pos, length - pos - padding);
+    mHeaderStream = id;
+    return (flags & FLAG_END_HEADERS) ? endHeaders() : 0;
+}
+
+int PiHttp2Session::endHeaders() {
+    const uint32_t id = mHeaderStream;
+    mHeaderStream = 0;
+
+    // Decoded even if the stream is refused, the dynamic table must follow the client.
+    std::vector<PiHeaderField> fields;
+    int status = mDecoder.decode((const uint8_t*)mHeaderBlock.data(), mHeaderBlock.length(), &fields);
+    mHeaderBlock.clear();
+    if (status != 0) {
+        goAway(ERROR_COMPRESSION);
+        return EPROTO;
+    }
+
+    if (id <= mLastStreamId) {
+        return 0; // trailers
+    }
+    mLastStreamId = id;
+
+    if (mGoingAway || mPeerGone || mStreams.size() >= MAX_STREAMS) {
+        __sync_add_and_fetch(&gRefused, 1);
+        writeRstStream(id, ERROR_REFUSED_STREAM);
+        return 0;
+    }
+    return startRequest(id, fields);
+}
+
+int PiHttp2Session::applySettings(const uint8_t* payload, size_t length) {
+    for (size_t pos = 0; pos + 6 <= length; pos += 6) {
+        const unsigned id = (payload[pos] << 8) | payload[pos + 1];
+        const uint32_t value = be32(payload + pos + 2);
+        switch (id) {
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1) return ERROR_PROTOCOL;
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE: {
+            if (value > MAX_WINDOW) return ERROR_FLOW_CONTROL;
+            // The open streams change by the difference, which may make their windows negative.
+            const int64_t delta = (int64_t)value - mInitialWindow;
+            std::map<uint32_t, Stream*>::iterator it = mStreams.begin();
+            for (; it != mStreams.end(); it++) {
+                if (it->second->window + delta > MAX_WINDOW) return ERROR_FLOW_CONTROL;
+                it->second->window += delta;
+            }
+            mInitialWindow = value;
+            break;
+        }
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < DEFAULT_FRAME_SIZE || value > MAX_FRAME_SIZE_LIMIT) return ERROR_PROTOCOL;
+            mMaxFrameSize = value < MAX_DATA_FRAME_SIZE ? value : MAX_DATA_FRAME_SIZE;
+            break;
+        default:
+            break; // the encoder doesn't use the dynamic table, the rest doesn't matter to a server
+        }
+    }
+    return ERROR_NO_ERROR;
+}
+
+int PiHttp2Session::startRequest(uint32_t id, const std::vector<PiHeaderField>& fields) {
+    std::string method;
+    std::string path;
+    std::vector<PiHeaderField>::const_iterator it = fields.begin();
+    for (; it != fields.end(); it++) {
+        if (it->first == ":method") {
+            method = it->second;
+        } else if (it->first == ":path") {
+            path = it->second;
+        }
+    }
+    if (method.empty() || path.empty() || path.find_first_of(" \r\n") != std::string::npos) {
+        writeRstStream(id, ERROR_PROTOCOL);
+        return 0;
+    }
+
+    // The request line of HTTP/1 has the same method and path.
+    PiHttpdInterpreter intr;
+    const std::string request = method + " " + path + " HTTP/2\r\n\r\n";
+    if (intr.init(request.data(), request.length()) != 0) {
+        writeRstStream(id, ERROR_PROTOCOL);
+        return 0;
+    }
+    return openStream(id, intr);
+}
+
+int PiHttp2Session::openStream(uint32_t id, const PiHttpdInterpreter& intr) {
+    std::vector<PiHeaderField> fields;
+    std::string doc;
+    PiCameraManager* manager = (intr.method() == PiHttpdInterpreter::MT_GET) ? mHandler.route(intr.doc(), &doc) : NULL;
+    if (manager == NULL || doc.compare("/bin-cgi/stream")) {
+        writeHeaders(id, 403, fields, true);
+        return 0;
+    }
+
+    // ex) /bin-cgi/stream?fps=2&scale=4, the credits of HTTP/1 are replaced by the flow control
+    int max_fps = 0;
+    int scale_denom = 1;
+    const std::string* fps = intr.param("fps");
+    if (fps) {
+        max_fps = atoi(fps->c_str());
+        if (max_fps < 0) max_fps = 0;
+    }
+    const std::string* scale = intr.param("scale");
+    if (scale) {
+        scale_denom = atoi(scale->c_str());
+        if (scale_denom <= 0) scale_denom = 1;
+    }
+
+    if (mHandler.admit(*manager, &scale_denom, PART_HEADER_SIZE) != 0) {
+        PiMemory::countRejected();
+        fields.push_back(PiHeaderField("retry-after", RETRY_AFTER_SEC));
+        writeHeaders(id, 503, fields, true);
+        return 0;
+    }
+
+    Stream* stream = new Stream();
+    stream->id = id;
+    stream->manager = manager;
+    stream->frame = NULL;
+    stream->closing = false;
+    stream->headers_sent = false;
+    stream->window = mInitialWindow;
+    stream->length = 0;
+    stream->offset = 0;
+    stream->end = false;
+    stream->stalled = false;
+    stream->sequence = 0;
+    stream->skipped_seen = 0;
+    stream->frame_bytes = manager->frameSizeHint(scale_denom);
+    stream->send_bytes = stream->frame_bytes + PART_HEADER_SIZE;
+    TRAP1(catched, msg, mStreams[id] = stream;);
+    if (catched) {
+        delete stream;
+        account();
+        writeRstStream(id, ERROR_INTERNAL);
+        return 0;
+    }
+    __sync_add_and_fetch(&gStreams, 1);
+
+    stream->frame = manager->attach(max_fps, scale_denom);
+    if (stream->frame == NULL) {
+        writeHeaders(id, 503, fields, true);
+        closeStream(mStreams.find(id));
+        return 0;
+    }
+    stream->frame->setReadyFd(mEventFd);
+
+    fields.push_back(PiHeaderField("content-type", "multipart/x-mixed-replace;boundary=" BOUNDARY));
+    fields.push_back(PiHeaderField("cache-control", "no-store, no-cache, must-revalidate, max-age=0"));
+    writeHeaders(id, 200, fields, false);
+    stream->headers_sent = true;
+    return 0;
+}
+
+void PiHttp2Session::closeStream(std::map<uint32_t, Stream*>::iterator it) {
+    Stream* stream = it->second;
+    if (stream->frame) {
+        stream->manager->detach(stream->frame);
+    }
+    delete stream;
+    mStreams.erase(it);
+    __sync_sub_and_fetch(&gStreams, 1);
+    account();
+}
+
+/** Take the newest frame of a stream whose buffer is sent or not started yet */
+void PiHttp2Session::refresh(Stream* stream) {
+    if (stream->frame == NULL) {
+        return;
+    }
+
+    if (stream->closing && (stream->offset == stream->length || stream->offset == 0)) {
+        stream->manager->detach(stream->frame);
+        static const char closing[] = "\r\n--" BOUNDARY "--\r\n";
+        if (stream->buffer.alloc_size < sizeof(closing) - 1) {
+            stream->buffer.realloc(sizeof(closing) - 1);
+        }
+        memcpy(stream->buffer.values, closing, sizeof(closing) - 1);
+        stream->length = sizeof(closing) - 1;
+        stream->offset = 0;
+        stream->end = true;
+        return;
+    }
+
+    if (takeFrame(stream) != 0) {
+        writeRstStream(stream->id, ERROR_INTERNAL);
+        closeStream(mStreams.find(stream->id));
+    }
+}
+
+/**
+ * Copy a new frame of the stream into its buffer. The session doesn't wait for the lock
+ * of a frame being written: the publisher signals the eventfd after it unlocks, so the
+ * frame is taken on that wakeup. Return an error only if the stream can't go on.
+ */
+int PiHttp2Session::takeFrame(Stream* stream) {
+    PiFrame* frame = stream->frame;
+
+    // Hints without the lock, checked again after it
+    if (__atomic_load_n(&frame->sequence, __ATOMIC_RELAXED) == stream->sequence) {
+        return 0;
+    }
+    // The buffer is grown before the lock, which only covers the copy
+    int status;
+    const size_t hint = PART_HEADER_SIZE + __atomic_load_n(&frame->length, __ATOMIC_RELAXED);
+    if (stream->buffer.alloc_size < hint && (status = stream->buffer.realloc(hint)) != 0) {
+        return status;
+    }
+    status = frame->tryLock();
+    if (status == EBUSY) {
+        return 0;
+    } else if (status) {
+        return status;
+    }
+    if (frame->sequence == stream->sequence || frame->length == 0) {
+        frame->unlock();
+        return 0;
+    }
+
+    // The frame being sent is finished first, newer ones are skipped until then.
+    if (stream->offset > 0 && stream->offset < stream->length) {
+        if (frame->sequence != stream->skipped_seen) {
+            stream->skipped_seen = frame->sequence;
+            __sync_add_and_fetch(&gSkipped, 1);
+        }
+        frame->unlock();
+        return 0;
+    }
+    if (stream->offset == 0 && stream->length > 0) {
+        __sync_add_and_fetch(&gSkipped, 1); // replaced before any of it was sent
+    }
+
+    char header[PART_HEADER_SIZE];
+    const size_t header_length = snprintf(header, sizeof(header),
+            "\r\n" // empty line
+            "--" BOUNDARY "\r\n"
+            "Content-Type: image/jpeg\r\n"
+            "Content-Length: %lu\r\n"
+            "\r\n",
+            (unsigned long)frame->length);
+    const size_t length = header_length + frame->length;
+    if (stream->buffer.alloc_size < length && (status = stream->buffer.realloc(length)) != 0) {
+        frame->unlock();
+        return status;
+    }
+    memcpy(stream->buffer.values, header, header_length);
+    memcpy(stream->buffer.values + header_length, frame->buffer, frame->length);
+    stream->length = length;
+    stream->offset = 0;
+    stream->stalled = false;
+    stream->sequence = frame->sequence;
+    const size_t frame_bytes = frame->requiredMemSize();
+    frame->unlock();
+    __sync_add_and_fetch(&gFrames, 1);
+
+    if (frame_bytes != stream->frame_bytes || stream->buffer.alloc_size > stream->send_bytes) {
+        stream->frame_bytes = frame_bytes;
+        if (stream->buffer.alloc_size > stream->send_bytes) {
+            stream->send_bytes = stream->buffer.alloc_size;
+        }
+        account();
+    }
+
+    return 0;
+}
+
+/**
+ * Write DATA frames of the streams in turn, one frame of each at a time, within the
+ * windows, until OUT_HIGH_WATER bytes are queued.
+ */
+void PiHttp2Session::schedule() {
+    // After an upgrade, a client may not take much more than the 101 response before it
+    // has sent its preface, ex) curl.
+    if (!mPrefaceReceived) {
+        return;
+    }
+
+    std::vector<uint32_t> finished;
+    bool progress = true;
+    while (progress && mWindow > 0 && mOut.length() - mOutOffset < OUT_HIGH_WATER) {
+        progress = false;
+        std::map<uint32_t, Stream*>::iterator it = mStreams.begin();
+        for (; it != mStreams.end() && mWindow > 0; it++) {
+            Stream* stream = it->second;
+            if (stream->offset >= stream->length || !stream->headers_sent) {
+                continue;
+            }
+            if (stream->window <= 0) {
+                if (!stream->stalled) {
+                    stream->stalled = true;
+                    __sync_add_and_fetch(&gStalls, 1);
+                }
+                continue;
+            }
+
+            size_t chunk = stream->length - stream->offset;
+            if ((int64_t)chunk > stream->window) chunk = stream->window;
+            if ((int64_t)chunk > mWindow) chunk = mWindow;
+            if (chunk > mMaxFrameSize) chunk = mMaxFrameSize;
+
+            const bool last = stream->end && stream->offset + chunk == stream->length;
+            PI_TRACE("h2_data", chunk);
+            writeFrame(TYPE_DATA, last ? FLAG_END_STREAM : 0, stream->id, stream->buffer.values + stream->offset, chunk);
+            stream->offset += chunk;
+            stream->window -= chunk;
+            mWindow -= chunk;
+            progress = true;
+            if (last) {
+                TRAP_IGN(finished.push_back(stream->id););
+                stream->length = 0; // nothing more to send
+                stream->offset = 0;
+            }
+        }
+    }
+    if (mWindow <= 0) {
+        std::map<uint32_t, Stream*>::iterator it = mStreams.begin();
+        for (; it != mStreams.end(); it++) {
+            Stream* stream = it->second;
+            if (stream->offset < stream->length && !stream->stalled) {
+                stream->stalled = true;
+                __sync_add_and_fetch(&gStalls, 1);
+            }
+        }
+    }
+
+    std::vector<uint32_t>::iterator id = finished.begin();
+    for (; id != finished.end(); id++) {
+        std::map<uint32_t, Stream*>::iterator it = mStreams.find(*id);
+        if (it != mStreams.end()) {
+            closeStream(it);
+        }
+    }
+}
+
+/** End the streams with the closing boundary */
+void PiHttp2Session::finishStreams() {
+    std::map<uint32_t, Stream*>::iterator it = mStreams.begin();
+    for (; it != mStreams.end(); it++) {
+        it->second->closing = true;
+    }
+}
+
+void PiHttp2Session::account() {
+    size_t frame_bytes = 0;
+    size_t send_bytes = 0;
+    std::map<uint32_t, Stream*>::const_iterator it = mStreams.begin();
+    for (; it != mStreams.end(); it++) {
+        frame_bytes += it->second->frame_bytes;
+        send_bytes += it->second->send_bytes;
+    }
+    mMemory.update(MEMORY_FRAME, frame_bytes);
+    mMemory.update(MEMORY_SEND, send_bytes);
+}
+
+int PiHttp2Session::flush() {
+    while (mOutOffset < mOut.length()) {
+        ssize_t n = send(mSocket, mOut.data() + mOutOffset, mOut.length() - mOutOffset, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            PI_LOG(PILOG_ERROR, errno, "Error in send() of an HTTP/2 connection");
+            return errno;
+        }
+        mOutOffset += n;
+    }
+
+    if (mOutOffset == mOut.length()) {
+        mOut.clear();
+        mOutOffset = 0;
+    } else if (mOutOffset >= OUT_HIGH_WATER) {
+        mOut.erase(0, mOutOffset);
+        mOutOffset = 0;
+    }
+    return 0;
+}
+
+void PiHttp2Session::writeFrame(uint8_t type, uint8_t flags, uint32_t id, const void* payload, size_t length) {
+    uint8_t header[FRAME_HEADER_SIZE];
+    header[0] = (uint8_t)(length >> 16);
+    header[1] = (uint8_t)(length >> 8);
+    header[2] = (uint8_t)length;
+    header[3] = type;
+    header[4] = flags;
+    put32(id, header + 5);
+    mOut.append((const char*)header, sizeof(header));
+    if (length > 0) {
+        mOut.append((const char*)payload, length);
+    }
+}
+
+void PiHttp2Session::writeHeaders(uint32_t id, int status, const std::vector<PiHeaderField>& fields, bool end_stream) {
+    char value[16];
+    snprintf(value, sizeof(value), "%d", status);
+    std::string block;
+    PiHpack::encode(":status", value, &block);
+    PiHpack::encode("server", mServerName, &block);
+    PiHpack::encode("access-control-allow-origin", "*", &block);
+    std::vector<PiHeaderField>::const_iterator it = fields.begin();
+    for (; it != fields.end(); it++) {
+        PiHpack::encode(it->first, it->second, &block);
+    }
+
+    // Split into CONTINUATION frames if the block is larger than a frame
+    size_t pos = 0;
+    uint8_t type = TYPE_HEADERS;
+    do {
+        size_t length = block.length() - pos;
+        if (length > mMaxFrameSize) length = mMaxFrameSize;
+        uint8_t flags = (pos + length == block.length()) ? FLAG_END_HEADERS : 0;
+        if (type == TYPE_HEADERS && end_stream) flags |= FLAG_END_STREAM;
+        writeFrame(type, flags, id, block.data() + pos, length);
+        pos += length;
+        type = TYPE_CONTINUATION;
+    } while (pos < block.length());
+}
+
+void PiHttp2Session::writeWindowUpdate(uint32_t id, uint32_t increment) {
+    uint8_t payload[4];
+    put32(increment, payload);
+    writeFrame(TYPE_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+void PiHttp2Session::writeRstStream(uint32_t id, uint32_t error) {
+    uint8_t payload[4];
+    put32(error, payload);
+    writeFrame(TYPE_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+void PiHttp2Session::goAway(uint32_t error) {
+    uint8_t payload[8];
+    put32(mLastStreamId, payload);
+    put32(error, payload + 4);
+    writeFrame(TYPE_GOAWAY, 0, 0, payload, sizeof(payload));
+    mGoingAway = true;
+    if (error != ERROR_NO_ERROR) {
+        PI_LOG(PILOG_WARN, EPROTO, "HTTP/2 connection error=%lu", (unsigned long)error);
+    }
+}
+
+std::string PiHttp2Session::metrics() {
+    char body[1024];
+    snprintf(body, sizeof(body),
+            "# TYPE pimjpg_http2_connections gauge\n"
+            "pimjpg_http2_connections %d\n"
+            "# TYPE pimjpg_http2_streams gauge\n"
+            "pimjpg_http2_streams %d\n"
+            "# TYPE pimjpg_http2_frames_total counter\n"
+            "pimjpg_http2_frames_total %llu\n"
+            "# TYPE pimjpg_http2_frames_skipped_total counter\n"
+            "pimjpg_http2_frames_skipped_total %llu\n"
+            "# TYPE pimjpg_http2_window_stalls_total counter\n"
+            "pimjpg_http2_window_stalls_total %llu\n"
+            "# TYPE pimjpg_http2_refused_streams_total counter\n"
+            "pimjpg_http2_refused_streams_total %llu\n",
+            __sync_fetch_and_add(&gConnections, 0), __sync_fetch_and_add(&gStreams, 0),
+            (unsigned long long)__sync_fetch_and_add(&gFrames, 0),
+            (unsigned long long)__sync_fetch_and_add(&gSkipped, 0),
+            (unsigned long long)__sync_fetch_and_add(&gStalls, 0),
+            (unsigned long long)__sync_fetch_and_add(&gRefused, 0));
+    return body;
+}
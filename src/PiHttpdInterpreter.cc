@@ -1,6 +1,8 @@
 #include "PiHttpdInterpreter.h"
 #include "PiException.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <sstream>
 #include <vector>
 #include <map>
@@ -164,6 +166,24 @@ void PiHttpdInterpreter::parsePathParameter(const std::string& path) {
     }
 }
 
+std::string PiHttpdInterpreter::decode(const std::string& value) {
+    std::string decoded;
+    decoded.reserve(value.length());
+    for (std::string::size_type i = 0; i < value.length(); i++) {
+        char c = value[i];
+        if (c == '+') {
+            decoded += ' ';
+        } else if (c == '%' && i + 2 < value.length() && isxdigit((unsigned char)value[i + 1]) &&
+                isxdigit((unsigned char)value[i + 2])) {
+            decoded += (char)strtol(value.substr(i + 1, 2).c_str(), NULL, 16);
+            i += 2;
+        } else {
+            decoded += c;
+        }
+    }
+    return decoded;
+}
+
 std::string::size_type PiHttpdInterpreter::find2(
             const std::string& d1, const std::string& d2,
             const std::string& s,
@@ -0,0 +1,240 @@
+#include "PiJpegScan.h"
+#include <string.h>
+#include <errno.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PI_JPEG_SCAN_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PI_JPEG_SCAN_NEON 1
+#endif
+
+// Markers without a length
+#define M_SOI 0xd8
+#define M_EOI 0xd9
+#define M_SOS 0xda
+#define M_TEM 0x01
+#define IS_RST(m) ((m) >= 0xd0 && (m) <= 0xd7)
+
+// SOF0-SOF15 except DHT (C4), JPG (C8) and DAC (CC)
+#define IS_SOF(m) ((m) >= 0xc0 && (m) <= 0xcf && (m) != 0xc4 && (m) != 0xc8 && (m) != 0xcc)
+
+namespace {
+
+inline unsigned be16(const uint8_t* p) {
+    return (p[0] << 8) | p[1];
+}
+
+/**
+ * Walk the segments from 'pos' (just after the SOI) to the EOI.
+ * Return the offset after the EOI, or 0 with *error.
+ */
+size_t scan_segments(const uint8_t* data, size_t size, size_t pos, PiJpegInfo* info, int* error) {
+    bool has_sof = false;
+    bool has_sos = false;
+
+    for (;;) {
+        // Markers may be preceded by fill bytes of 0xFF.
+        if (pos >= size) {
+            *error = ENODATA;
+            return 0;
+        }
+        if (data[pos] != 0xff) {
+            *error = EPROTO;
+            return 0;
+        }
+        while (pos < size && data[pos] == 0xff) pos++;
+        if (pos >= size) {
+            *error = ENODATA;
+            return 0;
+        }
+
+        const uint8_t marker = data[pos++];
+        if (marker == M_EOI) {
+            if (!has_sof || !has_sos) {
+                *error = EPROTO;
+                return 0;
+            }
+            return pos;
+        } else if (marker == M_SOI || marker == 0x00) {
+            *error = EPROTO;
+            return 0;
+        } else if (IS_RST(marker) || marker == M_TEM) {
+            continue;
+        }
+
+        if (pos + 2 > size) {
+            *error = ENODATA;
+            return 0;
+        }
+        const unsigned length = be16(data + pos);
+        if (length < 2) {
+            *error = EPROTO;
+            return 0;
+        }
+        if (pos + length > size) {
+            *error = ENODATA;
+            return 0;
+        }
+
+        if (IS_SOF(marker)) {
+            // P, Y, X, Nf
+            if (length < 8) {
+                *error = EPROTO;
+                return 0;
+            }
+            info->height = be16(data + pos + 3);
+            info->width = be16(data + pos + 5);
+            info->components = data[pos + 7];
+            has_sof = true;
+        }
+        pos += length;
+
+        if (marker != M_SOS) {
+            continue;
+        }
+        has_sos = true;
+
+        // The entropy-coded data ends at a marker other than a stuffed 0x00 or a RST.
+        for (;;) {
+            pos = PiJpegScan::findMarker(data, size, pos);
+            if (pos + 1 >= size) {
+                *error = ENODATA;
+                return 0;
+            }
+            const uint8_t next = data[pos + 1];
+            if (next == 0x00 || IS_RST(next)) {
+                pos += 2;
+            } else if (next == 0xff) {
+                pos += 1; // fill
+            } else {
+                break; // the next segment at 'pos'
+            }
+        }
+    }
+}
+
+} // namespace
+
+size_t PiJpegScan::findMarkerScalar(const uint8_t* data, size_t size, size_t from) {
+    for (size_t i = from; i < size; i++) {
+        if (data[i] == 0xff) {
+            return i;
+        }
+    }
+    return size;
+}
+
+#if defined(PI_JPEG_SCAN_SSE2)
+
+size_t PiJpegScan::findMarker(const uint8_t* data, size_t size, size_t from) {
+    size_t i = from;
+    const __m128i ff = _mm_set1_epi8((char)0xff);
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, ff));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return findMarkerScalar(data, size, i);
+}
+
+const char* PiJpegScan::implementation() {
+    return "sse2";
+}
+
+#elif defined(PI_JPEG_SCAN_NEON)
+
+size_t PiJpegScan::findMarker(const uint8_t* data, size_t size, size_t from) {
+    size_t i = from;
+    const uint8x16_t ff = vdupq_n_u8(0xff);
+    for (; i + 16 <= size; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(data + i), ff);
+        // Narrow each byte to 4 bits, which makes a 64 bit mask of the 16 lanes.
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if (mask) {
+            return i + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+    return findMarkerScalar(data, size, i);
+}
+
+const char* PiJpegScan::implementation() {
+    return "neon";
+}
+
+#else
+
+size_t PiJpegScan::findMarker(const uint8_t* data, size_t size, size_t from) {
+    // memchr is vectorized by most C libraries.
+    if (from >= size) {
+        return size;
+    }
+    const void* p = memchr(data + from, 0xff, size - from);
+    return p ? static_cast<const uint8_t*>(p) - data : size;
+}
+
+const char* PiJpegScan::implementation() {
+    return "memchr";
+}
+
+#endif
+
+int PiJpegScan::validate(const uint8_t* data, size_t size, PiJpegInfo* info) {
+    PiJpegInfo scratch;
+    if (info == NULL) {
+        info = &scratch;
+    }
+    *info = PiJpegInfo();
+
+    if (size < 4) {
+        return ENODATA;
+    }
+    if (data[0] != 0xff || data[1] != M_SOI) {
+        return EPROTO;
+    }
+
+    int error = 0;
+    size_t end = scan_segments(data, size, 2, info, &error);
+    if (end == 0) {
+        return error;
+    }
+    info->length = end;
+    return 0;
+}
+
+int PiJpegScan::findFrame(const uint8_t* data, size_t size, size_t* begin, size_t* end, PiJpegInfo* info) {
+    PiJpegInfo scratch;
+    if (info == NULL) {
+        info = &scratch;
+    }
+
+    size_t pos = 0;
+    for (;;) {
+        // SOI followed by the marker of the first segment
+        pos = findMarker(data, size, pos);
+        if (pos + 2 >= size) {
+            return ENOENT;
+        }
+        if (data[pos + 1] != M_SOI || data[pos + 2] != 0xff) {
+            pos++;
+            continue;
+        }
+
+        *info = PiJpegInfo();
+        int error = 0;
+        size_t frame_end = scan_segments(data, size, pos + 2, info, &error);
+        if (frame_end != 0) {
+            *begin = pos;
+            *end = frame_end;
+            info->length = frame_end - pos;
+            return 0;
+        } else if (error == ENODATA) {
+            *begin = pos;
+            return ENODATA;
+        }
+        pos++; // not a frame, ex) an SOI in a thumbnail or in garbage
+    }
+}
@@ -0,0 +1,313 @@
+#include "PiLog.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <syslog.h>
+#include <sys/syscall.h>
+
+// Must be a power of 2
+#define RING_SIZE 1024
+
+#define DRAIN_INTERVAL_MSEC 20
+
+#define MAX_LINE_LENGTH 512
+
+namespace {
+
+struct Record {
+    uint64_t time_ns;     // CLOCK_REALTIME
+    int tid;
+    PiLogSite* site;
+    int code;
+    uint32_t suppressed;  // records of the site dropped before this one
+    long args[4];
+};
+
+// Bounded queue of Dmitry Vyukov. A cell is free for the writer at 'pos' when its
+// sequence is 'pos', and holds a record for the reader at 'pos' when it is 'pos + 1'.
+struct Cell {
+    uint32_t sequence;
+    Record record;
+};
+
+Cell gCells[RING_SIZE];
+uint32_t gEnqueuePos = 0;
+uint32_t gDequeuePos = 0;
+
+bool gStarted = false;
+bool gStopRequested = false;
+uint32_t gProducers = 0;    // threads in push() which saw gStarted, stop() waits for them
+pthread_t gThread;
+int gSink = LOG_SINK_STDERR;
+int gFd = STDERR_FILENO;
+
+uint64_t gWritten = 0;
+uint64_t gSuppressed = 0;
+uint64_t gOverflowed = 0;
+
+__thread int tTid = 0;
+
+const char LEVELS[] = "EWID";
+
+uint32_t now_sec() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+    return (uint32_t)t.tv_sec;
+}
+
+bool enqueue(const Record& record) {
+    uint32_t pos = __atomic_load_n(&gEnqueuePos, __ATOMIC_RELAXED);
+    Cell* cell;
+    for (;;) {
+        cell = &gCells[pos & (RING_SIZE - 1)];
+        uint32_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&gEnqueuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false; // full
+        } else {
+            pos = __atomic_load_n(&gEnqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->record = record;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/** Only the drain thread reads. */
+bool dequeue(Record* record) {
+    uint32_t pos = gDequeuePos;
+    Cell* cell = &gCells[pos & (RING_SIZE - 1)];
+    uint32_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    if ((int32_t)(seq - (pos + 1)) < 0) {
+        return false; // empty
+    }
+    *record = cell->record;
+    gDequeuePos = pos + 1;
+    __atomic_store_n(&cell->sequence, pos + RING_SIZE, __ATOMIC_RELEASE);
+    return true;
+}
+
+void format(const Record& r, char* line, size_t size, bool with_time) {
+    const PiLogSite* site = r.site;
+    const char* file = strrchr(site->file, '/');
+    file = file ? file + 1 : site->file;
+
+    size_t n = 0;
+    if (with_time) {
+        time_t sec = (time_t)(r.time_ns / 1000000000ULL);
+        tm t;
+        localtime_r(&sec, &t);
+        n += strftime(line, size, "%Y-%m-%d %H:%M:%S", &t);
+        n += snprintf(line + n, size - n, ".%03d ", (int)(r.time_ns / 1000000 % 1000));
+    }
+    if (n < size) {
+        n += snprintf(line + n, size - n, "%c [%d] %s:%d code=%d: ",
+                LEVELS[site->level & 3], r.tid, file, site->line, r.code);
+    }
+    if (n < size) {
+        n += snprintf(line + n, size - n, site->format, r.args[0], r.args[1], r.args[2], r.args[3]);
+    }
+    if (r.suppressed && n < size) {
+        n += snprintf(line + n, size - n, " (%u suppressed)", r.suppressed);
+    }
+    if (n >= size - 1) {
+        n = size - 2;
+    }
+    line[n++] = '\n';
+    line[n] = '\0';
+}
+
+void output(const Record& r) {
+    char line[MAX_LINE_LENGTH];
+    if (gSink == LOG_SINK_SYSLOG) {
+        static const int priorities[] = { LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG };
+        format(r, line, sizeof(line), false);
+        syslog(priorities[r.site->level & 3], "%s", line);
+        return;
+    }
+
+    format(r, line, sizeof(line), true);
+    // A slow pipe only stalls this thread, the ring absorbs the records meanwhile.
+    size_t length = strlen(line);
+    size_t written = 0;
+    while (written < length) {
+        ssize_t ret = ::write(gFd, line + written, length - written);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        written += ret;
+    }
+}
+
+void* run_drain(void*) {
+    Record record;
+    for (;;) {
+        bool stop = __atomic_load_n(&gStopRequested, __ATOMIC_ACQUIRE);
+        while (dequeue(&record)) {
+            output(record);
+            __sync_add_and_fetch(&gWritten, 1);
+        }
+        if (stop) {
+            break;
+        }
+        usleep(DRAIN_INTERVAL_MSEC * 1000);
+    }
+    return NULL;
+}
+
+} // namespace
+
+int PiLog::start(int sink, const std::string& path) {
+    if (gStarted) {
+        return EBUSY;
+    }
+
+    gSink = sink;
+    if (sink == LOG_SINK_FILE) {
+        gFd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (gFd < 0) {
+            int err = errno;
+            fprintf(stderr, "Failed to open the log file %s err=%d\n", path.c_str(), err);
+            gFd = STDERR_FILENO;
+            gSink = LOG_SINK_STDERR;
+            return err;
+        }
+    } else if (sink == LOG_SINK_SYSLOG) {
+        openlog("pimjpg_srv", LOG_PID, LOG_DAEMON);
+    }
+
+    for (uint32_t i = 0; i < RING_SIZE; i++) {
+        gCells[i].sequence = i;
+    }
+    gEnqueuePos = 0;
+    gDequeuePos = 0;
+    gStopRequested = false;
+
+    int status = pthread_create(&gThread, NULL, run_drain, NULL);
+    if (status) {
+        fprintf(stderr, "Failed to create the log thread status=%d\n", status);
+        return status;
+    }
+    __atomic_store_n(&gStarted, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void PiLog::stop() {
+    if (!gStarted) {
+        return;
+    }
+    __atomic_store_n(&gStopRequested, true, __ATOMIC_RELEASE);
+    pthread_join(gThread, NULL);
+    __atomic_store_n(&gStarted, false, __ATOMIC_SEQ_CST);
+
+    // A producer which saw gStarted may still be enqueueing, the later ones write to stderr.
+    while (__atomic_load_n(&gProducers, __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+
+    // Records pushed while joining
+    Record record;
+    while (dequeue(&record)) {
+        output(record);
+        gWritten++;
+    }
+
+    PiLogStats s = stats();
+    if (s.suppressed || s.overflowed) {
+        fprintf(stderr, "log: written=%llu suppressed=%llu overflowed=%llu\n",
+                (unsigned long long)s.written, (unsigned long long)s.suppressed,
+                (unsigned long long)s.overflowed);
+    }
+
+    if (gSink == LOG_SINK_FILE) {
+        close(gFd);
+        gFd = STDERR_FILENO;
+    } else if (gSink == LOG_SINK_SYSLOG) {
+        closelog();
+    }
+}
+
+void PiLog::write(PiLogSite* site, int code) {
+    push(site, code, 0, 0, 0, 0);
+}
+
+void PiLog::write(PiLogSite* site, int code, long a0) {
+    push(site, code, a0, 0, 0, 0);
+}
+
+void PiLog::write(PiLogSite* site, int code, long a0, long a1) {
+    push(site, code, a0, a1, 0, 0);
+}
+
+void PiLog::write(PiLogSite* site, int code, long a0, long a1, long a2) {
+    push(site, code, a0, a1, a2, 0);
+}
+
+void PiLog::write(PiLogSite* site, int code, long a0, long a1, long a2, long a3) {
+    push(site, code, a0, a1, a2, a3);
+}
+
+PiLogStats PiLog::stats() {
+    PiLogStats s;
+    s.written = __sync_fetch_and_add(&gWritten, 0);
+    s.suppressed = __sync_fetch_and_add(&gSuppressed, 0);
+    s.overflowed = __sync_fetch_and_add(&gOverflowed, 0);
+    return s;
+}
+
+void PiLog::push(PiLogSite* site, int code, long a0, long a1, long a2, long a3) {
+    // Rate limit per call site. Racing threads may let a few more through at a window change.
+    uint32_t sec = now_sec();
+    uint32_t window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+    if (window != sec && __atomic_compare_exchange_n(&site->window, &window, sec, false,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+    if (__sync_add_and_fetch(&site->count, 1) > MAX_PER_SEC) {
+        __sync_add_and_fetch(&site->suppressed, 1);
+        __sync_add_and_fetch(&gSuppressed, 1);
+        return;
+    }
+
+    if (tTid == 0) {
+        tTid = (int)syscall(SYS_gettid);
+    }
+
+    Record record;
+    timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    record.time_ns = (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+    record.tid = tTid;
+    record.site = site;
+    record.code = code;
+    record.suppressed = __sync_lock_test_and_set(&site->suppressed, 0);
+    record.args[0] = a0;
+    record.args[1] = a1;
+    record.args[2] = a2;
+    record.args[3] = a3;
+
+    // Counted before gStarted is checked, so stop() either waits for this record or it goes to stderr.
+    __atomic_add_fetch(&gProducers, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&gStarted, __ATOMIC_SEQ_CST)) {
+        __atomic_sub_fetch(&gProducers, 1, __ATOMIC_RELEASE);
+        char line[MAX_LINE_LENGTH];
+        format(record, line, sizeof(line), true);
+        fputs(line, stderr);
+        return;
+    }
+
+    if (!enqueue(record)) {
+        __sync_add_and_fetch(&gOverflowed, 1);
+    }
+    __atomic_sub_fetch(&gProducers, 1, __ATOMIC_RELEASE);
+}
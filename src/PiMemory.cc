@@ -0,0 +1,138 @@
+#include "PiMemory.h"
+#include <stdio.h>
+#include <errno.h>
+
+namespace {
+
+size_t gBudget = 0;
+size_t gUsed = 0;
+size_t gBytes[NUM_MEMORY_KINDS];
+uint64_t gRejected = 0;
+uint64_t gDegraded = 0;
+
+const char* kind_name(int kind) {
+    switch (kind) {
+    case MEMORY_STACK: return "stack";
+    case MEMORY_FRAME: return "frame";
+    case MEMORY_SEND: return "send";
+    default: return "unknown";
+    }
+}
+
+} // namespace
+
+PiMemoryAccount::PiMemoryAccount() {
+    for (int i = 0; i < NUM_MEMORY_KINDS; i++) {
+        mBytes[i] = 0;
+    }
+}
+
+PiMemoryAccount::~PiMemoryAccount() {
+    for (int i = 0; i < NUM_MEMORY_KINDS; i++) {
+        release((PiMemoryKind)i);
+    }
+}
+
+int PiMemoryAccount::reserve(PiMemoryKind kind, size_t bytes) {
+    int status = PiMemory::reserve(kind, bytes);
+    if (status == 0) {
+        __sync_add_and_fetch(&mBytes[kind], bytes);
+    }
+    return status;
+}
+
+void PiMemoryAccount::update(PiMemoryKind kind, size_t bytes) {
+    size_t held = __sync_fetch_and_add(&mBytes[kind], 0);
+    if (bytes > held) {
+        PiMemory::charge(kind, bytes - held);
+        __sync_add_and_fetch(&mBytes[kind], bytes - held);
+    } else if (bytes < held) {
+        PiMemory::release(kind, held - bytes);
+        __sync_sub_and_fetch(&mBytes[kind], held - bytes);
+    }
+}
+
+void PiMemoryAccount::unreserve(PiMemoryKind kind, size_t bytes) {
+    PiMemory::release(kind, bytes);
+    __sync_sub_and_fetch(&mBytes[kind], bytes);
+}
+
+void PiMemoryAccount::release(PiMemoryKind kind) {
+    update(kind, 0);
+}
+
+size_t PiMemoryAccount::total() const {
+    size_t total = 0;
+    for (int i = 0; i < NUM_MEMORY_KINDS; i++) {
+        total += __sync_fetch_and_add(const_cast<size_t*>(&mBytes[i]), 0);
+    }
+    return total;
+}
+
+void PiMemory::setBudget(size_t bytes) {
+    gBudget = bytes;
+}
+
+size_t PiMemory::budget() {
+    return gBudget;
+}
+
+size_t PiMemory::used() {
+    return __sync_fetch_and_add(&gUsed, 0);
+}
+
+int PiMemory::reserve(PiMemoryKind kind, size_t bytes) {
+    // Compare and swap, so concurrent clients never overshoot the budget together.
+    size_t used = __sync_fetch_and_add(&gUsed, 0);
+    for (;;) {
+        if (gBudget && used + bytes > gBudget) {
+            return ENOMEM;
+        }
+        size_t prev = __sync_val_compare_and_swap(&gUsed, used, used + bytes);
+        if (prev == used) {
+            break;
+        }
+        used = prev;
+    }
+    __sync_add_and_fetch(&gBytes[kind], bytes);
+    return 0;
+}
+
+void PiMemory::charge(PiMemoryKind kind, size_t bytes) {
+    __sync_add_and_fetch(&gUsed, bytes);
+    __sync_add_and_fetch(&gBytes[kind], bytes);
+}
+
+void PiMemory::release(PiMemoryKind kind, size_t bytes) {
+    __sync_sub_and_fetch(&gUsed, bytes);
+    __sync_sub_and_fetch(&gBytes[kind], bytes);
+}
+
+void PiMemory::countRejected() {
+    __sync_add_and_fetch(&gRejected, 1);
+}
+
+void PiMemory::countDegraded() {
+    __sync_add_and_fetch(&gDegraded, 1);
+}
+
+std::string PiMemory::metrics() {
+    std::string body = "# TYPE pimjpg_memory_bytes gauge\n";
+    char line[256];
+    for (int i = 0; i < NUM_MEMORY_KINDS; i++) {
+        snprintf(line, sizeof(line), "pimjpg_memory_bytes{kind=\"%s\"} %lu\n",
+                kind_name(i), (unsigned long)__sync_fetch_and_add(&gBytes[i], 0));
+        body += line;
+    }
+    snprintf(line, sizeof(line),
+            "# TYPE pimjpg_memory_budget_bytes gauge\n"
+            "pimjpg_memory_budget_bytes %lu\n"
+            "# TYPE pimjpg_memory_rejected_total counter\n"
+            "pimjpg_memory_rejected_total %llu\n"
+            "# TYPE pimjpg_memory_degraded_total counter\n"
+            "pimjpg_memory_degraded_total %llu\n",
+            (unsigned long)gBudget, (unsigned long long)__sync_fetch_and_add(&gRejected, 0),
+            (unsigned long long)__sync_fetch_and_add(&gDegraded, 0));
+    body += line;
+    return body;
+}
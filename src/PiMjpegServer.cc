@@ -1,16 +1,34 @@
 #include "PiMjpgServer.h"
+#include "PiCamera.h"
 #include "PiBuffer.h"
 #include "PiHttpdInterpreter.h"
 #include "PiFrame.h"
+#include "PiWebSocket.h"
+#include "PiHttp2.h"
+#include "PiBroadcaster.h"
+#include "PiFanout.h"
+#include "PiShmExport.h"
+#include "PiZeroCopy.h"
+#include "PiMemory.h"
+#include "PiThumbnailer.h"
+#include "PiThreads.h"
 #include "PiException.h"
+#include "PiLog.h"
+#include "PiTrace.h"
 #include <algorithm>
+#include <deque>
+#include <map>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h> 
 #include <sys/wait.h>
@@ -20,8 +38,36 @@
 
 #define BOUNDARY "boundary"
 
+// Number of unacknowledged WebSocket frames allowed per client by default
+#define WEBSOCKET_DEFAULT_WINDOW 2
+
+// Interval to check the connection of a credit mode client waiting for credits
+#define CREDIT_POLL_MSEC 1000
+
+// Time for the clients to leave after their sockets were shut down at the drain deadline,
+// the ones which haven't are reported at this interval until they do
+#define FORCE_CLOSE_WAIT_SEC 4
+
+// Wait for a frame to hand over while the camera runs, the cached one is sent after this
+#define HANDOVER_FRAME_WAIT_SEC 1
+
+// Wait for the frame of a snapshot, the cached one is sent after this
+#define SNAPSHOT_WAIT_SEC 3
+
+// Stack of a client thread, which is accounted in the memory budget
+#define CLIENT_STACK_SIZE (256 * 1024)
+
+// A stream which doesn't fit in the memory budget is served at 1/DEGRADED_SCALE if that fits
+#define DEGRADED_SCALE 4
+
+// Asked of the clients refused for the memory budget
+#define RETRY_AFTER_SEC 5
+
 static PiMjpgServer* gSelf = NULL;
 
+// Write end of the self-pipe, which is the only thing the signal handler touches
+static volatile int gWakeFd = -1;
+
 class HttpResponse {
 public:
     HttpResponse() {
@@ -31,14 +77,16 @@ public:
     }
 
     HttpResponse(const char* format, ...) {
-        va_list ap;
+        va_list ap, ap2;
         va_start(ap, format);
+        va_copy(ap2, ap); // ap is consumed by the first vsnprintf() on some ABIs
         size_t size = vsnprintf(NULL, 0, format, ap);
         char* str = (char*)alloca(size + 1);
         if (str) {
-            vsnprintf(str, size + 1, format, ap);
+            vsnprintf(str, size + 1, format, ap2);
             mHeader += std::string(str, size);
         }
+        va_end(ap2);
         va_end(ap);
     }
 
@@ -48,14 +96,16 @@ public:
     }
 
     HttpResponse& append(const char* format, ...) {
-        va_list ap;
+        va_list ap, ap2;
         va_start(ap, format);
+        va_copy(ap2, ap); // ap is consumed by the first vsnprintf() on some ABIs
         size_t size = vsnprintf(NULL, 0, format, ap);
         char* str = (char*)alloca(size + 1);
         if (str) {
-            vsnprintf(str, size + 1, format, ap);
+            vsnprintf(str, size + 1, format, ap2);
             mHeader += std::string(str, size) + "\r\n";
         }
+        va_end(ap2);
         va_end(ap);
 
         return *this;
@@ -122,7 +172,7 @@ struct SrvSockInfo {
     }
 };
 
-struct ClientSockInfo {
+struct ClientSockInfo : public PiHttp2Handler {
     // socket object
     int socket;
 
@@ -132,6 +182,9 @@ struct ClientSockInfo {
     // pthread object
     pthread_t thread;
 
+    // memory of this connection in the budget, updated by the const send functions
+    mutable PiMemoryAccount memory;
+
     ClientSockInfo() : socket(-1), thread(0) {
         // initialize sockaddr_in object
         memset(&addr, 0, sizeof(addr));
@@ -151,10 +204,72 @@ struct ClientSockInfo {
     static void* do_run_httpd(ClientSockInfo* client) {
         int status;
         PiHttpdInterpreter intr;
-        status  = client->recvRequest(gSelf->mSettings, &intr);
+        std::string received;
+        status  = client->recvRequest(gSelf->mSettings, &intr, &received);
 
-        if (!status && intr.method() == PiHttpdInterpreter::MT_GET && !intr.doc().compare("/bin-cgi/stream")) {
-            client->sendMjpeg(gSelf->mSettings);
+        // HTTP/2 with the prior knowledge, ex) curl --http2-prior-knowledge or a proxy in front
+        if (PiHttp2Session::isPreface(received.data(), received.length())) {
+            return (void*)client->serveHttp2(received, NULL);
+        }
+
+        std::string doc;
+        PiCameraManager* manager = status ? NULL : routeSource(intr.doc(), &doc);
+        if (manager == NULL) {
+            manager = &gSelf->mManager;
+            doc.clear(); // 403 as an unknown document
+        }
+
+        if (!status && intr.method() == PiHttpdInterpreter::MT_GET && isHttp2Upgrade(intr) &&
+                !doc.compare("/bin-cgi/stream")) {
+            client->serveHttp2(std::string(), &intr);
+        } else if (!status && intr.method() == PiHttpdInterpreter::MT_GET && !doc.compare("/bin-cgi/stream")) {
+            // ex) /bin-cgi/stream?fps=2&scale=4
+            int max_fps = 0;
+            const std::string* fps = intr.param("fps");
+            if (fps) {
+                max_fps = atoi(fps->c_str());
+                if (max_fps < 0) max_fps = 0;
+            }
+            int scale_denom = 1;
+            const std::string* scale = intr.param("scale");
+            if (scale) {
+                scale_denom = atoi(scale->c_str());
+                if (scale_denom <= 0) scale_denom = 1;
+            }
+            // ex) /bin-cgi/stream?credit=5 sends 5 frames, and waits for more credits.
+            int credits = -1;
+            const std::string* credit = intr.param("credit");
+            if (credit) {
+                credits = atoi(credit->c_str());
+                if (credits < 0) credits = 0;
+            }
+
+            if (isWebSocketRequest(intr)) {
+                // ex) /bin-cgi/stream?window=3 (Upgrade: websocket)
+                int window = WEBSOCKET_DEFAULT_WINDOW;
+                const std::string* w = intr.param("window");
+                if (w) {
+                    window = atoi(w->c_str());
+                    if (window <= 0) window = WEBSOCKET_DEFAULT_WINDOW;
+                }
+                client->sendWebSocket(gSelf->mSettings, intr, *manager, max_fps, scale_denom, (size_t)window, credits);
+            } else {
+                client->sendMjpeg(gSelf->mSettings, *manager, max_fps, scale_denom, credits);
+            }
+        } else if (!status && intr.method() == PiHttpdInterpreter::MT_GET && !doc.compare("/bin-cgi/credit")) {
+            // ex) /bin-cgi/credit?id=3&n=10
+            client->sendCredit(gSelf->mSettings, intr, *manager);
+        } else if (!status && intr.method() == PiHttpdInterpreter::MT_GET && !doc.compare("/bin-cgi/metrics")) {
+            client->sendMetrics(gSelf->mSettings);
+        } else if (!status && intr.method() == PiHttpdInterpreter::MT_GET && !doc.compare("/bin-cgi/snapshot")) {
+            // ex) /cam/left/snapshot
+            client->sendSnapshot(gSelf->mSettings, *manager);
+        } else if (!status && intr.method() == PiHttpdInterpreter::MT_GET && !doc.compare("/bin-cgi/control")) {
+            // ex) /bin-cgi/control?annotate=12&annotate_text=Door+%25Y-%25m-%25d&annotate_size=32
+            client->sendControl(gSelf->mSettings, intr, *manager);
+        } else if (!status && intr.method() == PiHttpdInterpreter::MT_GET && !doc.compare("/bin-cgi/trace")) {
+            // ex) /bin-cgi/trace?enable=1, then /bin-cgi/trace for the spans
+            client->sendTrace(gSelf->mSettings, intr);
         } else {
             HttpResponse response(
                 "HTTP/1.0 403 Forbidden\r\n"
@@ -173,10 +288,99 @@ struct ClientSockInfo {
         return 0;
     }
 
+    /** ex) /cam/front/stream is /bin-cgi/stream of the source "front". NULL for an unknown source. */
+    static PiCameraManager* routeSource(const std::string& path, std::string* doc) {
+        if (path.compare(0, 5, "/cam/")) {
+            *doc = path;
+            return &gSelf->mManager;
+        }
+        std::string::size_type slash = path.find('/', 5);
+        std::map<std::string, PiCameraManager*>::iterator it = (slash == std::string::npos) ?
+                gSelf->mSources.end() : gSelf->mSources.find(path.substr(5, slash - 5));
+        if (it == gSelf->mSources.end()) {
+            return NULL;
+        }
+        *doc = "/bin-cgi" + path.substr(slash);
+        return it->second;
+    }
+
+    // PiHttp2Handler
+    PiCameraManager* route(const std::string& path, std::string* doc) {
+        return routeSource(path, doc);
+    }
+
+    int admit(PiCameraManager& manager, int* scale_denom, size_t extra) {
+        return admitStream(manager, scale_denom, extra);
+    }
+
+    bool isRunning() {
+        return gSelf->mIsRunning;
+    }
+
+    static bool isHttp2Upgrade(const PiHttpdInterpreter& intr) {
+        if (intr.header("HTTP2-Settings").size() != 1) {
+            return false;
+        }
+        const PiHttpdInterpreter::Strings& upgrade = intr.header("Upgrade");
+        std::vector<std::string>::const_iterator it = upgrade.begin();
+        for (; it != upgrade.end(); it++) {
+            if (!strcmp(it->c_str(), "h2c")) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Serve the connection with HTTP/2, from the bytes 'received' with the preface, or
+    // switched from the HTTP/1.1 request 'upgrade'.
+    int serveHttp2(const std::string& received, const PiHttpdInterpreter* upgrade) {
+        int status;
+        PiHttp2Session session(socket, *this, memory, gSelf->mSettings.server_name,
+                gSelf->mSettings.timeout_sending, gSelf->mSettings.timeout_recving, &status);
+        if (status == 0 && upgrade) {
+            status = session.upgrade(*upgrade, upgrade->header("HTTP2-Settings")[0]);
+            if (status) {
+                HttpResponse response(
+                    "HTTP/1.1 400 Bad Request\r\n"
+                    "Server: %s\r\n"
+                    "Connection: close\r\n"
+                    "\r\n", // empty line
+                    gSelf->mSettings.server_name.c_str());
+                return sendString(response.toString(), gSelf->mSettings);
+            }
+
+            HttpResponse response(
+                "HTTP/1.1 101 Switching Protocols\r\n"
+                "Connection: Upgrade\r\n"
+                "Upgrade: h2c\r\n"
+                "\r\n"); // empty line
+            if ((status = sendString(response.toString(), gSelf->mSettings)) != 0) {
+                return status;
+            }
+        }
+        if (status) {
+            return status;
+        }
+        return session.run(received);
+    }
+
+    static bool isWebSocketRequest(const PiHttpdInterpreter& intr) {
+        const PiHttpdInterpreter::Strings& upgrade = intr.header("Upgrade");
+        std::vector<std::string>::const_iterator it = upgrade.begin();
+        for (; it != upgrade.end(); it++) {
+            if (!strcasecmp(it->c_str(), "websocket")) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     static void* run_httpd(void* arg) {
         void* ret = NULL;
         ClientSockInfo* client = static_cast<ClientSockInfo*>(arg);
+        PiThreads::enter(THREAD_NETWORK, "client");
         TRAP_LOG(ret = do_run_httpd(client););
+        PiThreads::leave();
         gSelf->removeClient(client);
         return ret;
     }
@@ -198,7 +402,8 @@ struct ClientSockInfo {
         return 0;
     }
 
-    int recvRequest(const PiServerSettings& settings, PiHttpdInterpreter* itr) {
+    // 'received' is the bytes of the request, which are the preface of HTTP/2 with the prior knowledge
+    int recvRequest(const PiServerSettings& settings, PiHttpdInterpreter* itr, std::string* received) {
         fd_set readfds;
         FD_ZERO(&readfds);
         FD_SET(socket, &readfds);
@@ -233,6 +438,7 @@ struct ClientSockInfo {
             return errno;
         }
 
+        received->assign(req_buf, status);
         return itr->init(req_buf, status);
     }
 
@@ -247,31 +453,32 @@ struct ClientSockInfo {
         while ((status = select(socket+1, NULL, &writefds, NULL, &t)) <= 0) {
             if (errno == ETIMEDOUT) {
                 // timeout
-                fprintf(stderr, "sendString() was timeout: str=%s", string.c_str());
+                PI_LOG(PILOG_WARN, ETIMEDOUT, "sendString() was timeout: length=%lu", (long)string.length());
                 return ETIMEDOUT;
             } else if (status == 0 && errno == 0) {
                 if (retry > 0) {
-                    fprintf(stderr, "Couldn't write values to socket, so retry select()... retry=%d\n", retry);
+                    PI_LOG(PILOG_WARN, 0, "Couldn't write values to socket, so retry select()... retry=%ld", (long)retry);
                     usleep(1000000); // 100ms
                     retry--;
                 } else {
-                    fprintf(stderr, "Although retried select(), socket couldn't enable ....\n ");
+                    PI_LOG(PILOG_WARN, ETIMEDOUT, "Although retried select(), socket couldn't enable");
                     return ETIMEDOUT;
                 }
             } else {
-                fprintf(stderr, "sendString() was failed: err=%d\n", errno);
+                PI_LOG(PILOG_ERROR, errno, "sendString() was failed");
                 return errno;
             }
         }
 
         if ((status = send(socket, string.c_str(), string.length(), 0)) < 0) {
-            fprintf(stderr, "Error in send() of sendString(): err=%d str=%s\n", status, string.c_str());
+            PI_LOG(PILOG_ERROR, errno, "Error in send() of sendString(): length=%lu", (long)string.length());
             return errno;
         }
         return 0;
     }
 
     int sendBuffer(const uint8_t* values, size_t size, const PiServerSettings& settings) const {
+        PI_TRACE("send", size);
         fd_set writefds;
         FD_ZERO(&writefds);
         FD_SET(socket, &writefds);
@@ -281,22 +488,413 @@ struct ClientSockInfo {
         if ((status = select(socket+1, NULL, &writefds, NULL, &t)) <= 0) {
             if (errno == ETIMEDOUT) {
                 // timeout
-                fprintf(stderr, "sendBuffer() was timeout\n");
+                PI_LOG(PILOG_WARN, ETIMEDOUT, "sendBuffer() was timeout");
                 return ETIMEDOUT;
             } else {
-                fprintf(stderr, "sendBuffer() was failed\n");
+                PI_LOG(PILOG_ERROR, errno, "sendBuffer() was failed");
                 return errno;
             }
         }
 
         if ((status = send(socket, values, size, 0)) < 0) {
-            fprintf(stderr, "Error in send() of sendBuffer(): err=%d\n", status);
+            PI_LOG(PILOG_ERROR, errno, "Error in send() of sendBuffer()");
             return errno;
         }
         return 0;
     }
 
-    int sendMjpeg(const PiServerSettings& settings) const {
+    // Grant credits to a stream of another connection, and reply the current credits.
+    int sendCredit(const PiServerSettings& settings, const PiHttpdInterpreter& intr, PiCameraManager& manager) const {
+        const std::string* id = intr.param("id");
+        const std::string* n = intr.param("n");
+        int credits = -ENOENT;
+        if (id && n) {
+            credits = manager.grantCredits((uint32_t)strtoul(id->c_str(), NULL, 10), atoi(n->c_str()));
+        }
+
+        // 409 for a stream which paces itself without credits
+        if (credits < 0) {
+            HttpResponse response(
+                "HTTP/1.0 %s\r\n"
+                "Server: %s\r\n"
+                "Connection: close\r\n"
+                "\r\n", // empty line
+                (credits == -EINVAL) ? "409 Conflict" : "404 Not Found", settings.server_name.c_str());
+            return sendString(response.toString(), settings);
+        }
+
+        char body[16];
+        snprintf(body, sizeof(body), "%d\n", credits);
+        HttpResponse response(
+            "HTTP/1.0 200 OK\r\n"
+            "Access-Control-Allow-Origin: *\r\n"
+            "Server: %s\r\n"
+            "Cache-Control: no-store\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %lu\r\n"
+            "Connection: close\r\n"
+            "\r\n", // empty line
+            settings.server_name.c_str(), strlen(body));
+        return sendString(response.toString() + body, settings);
+    }
+
+    // Parse the annotation of a control request over 'annotate'. Return EINVAL if a value is out of range.
+    static int parseAnnotate(const PiHttpdInterpreter& intr, PiAnnotate* annotate, bool* changed) {
+        char* end = NULL;
+        *changed = false;
+        const std::string* flags = intr.param("annotate");
+        if (flags) {
+            long value = strtol(flags->c_str(), &end, 0);
+            if (flags->empty() || *end || value < 0 || value > 0xffff) return EINVAL;
+            annotate->flags = (int)value;
+            *changed = true;
+        }
+        const std::string* text = intr.param("annotate_text");
+        if (text) {
+            std::string decoded = PiHttpdInterpreter::decode(*text);
+            if (decoded.length() >= MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V2) return EINVAL;
+            annotate->text = decoded;
+            if (!flags && !decoded.empty()) {
+                annotate->flags |= ANNOTATE_USER_TEXT;
+            }
+            *changed = true;
+        }
+        const std::string* size = intr.param("annotate_size");
+        if (size) {
+            long value = strtol(size->c_str(), &end, 10);
+            if (size->empty() || *end || (value != 0 && (value < 6 || value > 80))) return EINVAL;
+            annotate->text_size = (int)value;
+            *changed = true;
+        }
+        // Colours are 0xVVUUYY in hex, or -1 for the firmware default
+        const char* colour_names[] = { "annotate_colour", "annotate_bg" };
+        int* colours[] = { &annotate->text_colour, &annotate->bg_colour };
+        for (int i = 0; i < 2; i++) {
+            const std::string* colour = intr.param(colour_names[i]);
+            if (colour) {
+                long value = (*colour == "-1") ? -1 : strtol(colour->c_str(), &end, 16);
+                if (colour->empty() || (value != -1 && (*end || value < 0 || value > 0xffffff))) return EINVAL;
+                *colours[i] = (int)value;
+                *changed = true;
+            }
+        }
+        return 0;
+    }
+
+    // Change the annotation drawn by the firmware, and return the current one.
+    // Parameters which aren't given keep their values.
+    int sendControl(const PiServerSettings& settings, const PiHttpdInterpreter& intr, PiCameraManager& manager) const {
+        PiAnnotate annotate = manager.annotate();
+        bool changed = false;
+        int status = parseAnnotate(intr, &annotate, &changed);
+        if (status == 0 && changed) {
+            status = manager.setAnnotate(annotate);
+        }
+
+        if (status) {
+            const char* line = (status == EINVAL) ? "400 Bad Request" :
+                    (status == ENOTSUP) ? "501 Not Implemented" : "503 Service Unavailable";
+            HttpResponse response(
+                "HTTP/1.0 %s\r\n"
+                "Server: %s\r\n"
+                "Connection: close\r\n"
+                "\r\n", // empty line
+                line, settings.server_name.c_str());
+            return sendString(response.toString(), settings);
+        }
+
+        // -1 is the firmware default, not a colour
+        char text_colour[16] = "-1";
+        char bg_colour[16] = "-1";
+        if (annotate.text_colour != -1) snprintf(text_colour, sizeof(text_colour), "%06x", annotate.text_colour);
+        if (annotate.bg_colour != -1) snprintf(bg_colour, sizeof(bg_colour), "%06x", annotate.bg_colour);
+        char head[128];
+        snprintf(head, sizeof(head), "annotate=%d\nannotate_size=%d\nannotate_colour=%s\nannotate_bg=%s\n",
+                annotate.flags, annotate.text_size, text_colour, bg_colour);
+        std::string body = std::string(head) + "annotate_text=" + annotate.text + "\n";
+
+        HttpResponse response(
+            "HTTP/1.0 200 OK\r\n"
+            "Access-Control-Allow-Origin: *\r\n"
+            "Server: %s\r\n"
+            "Cache-Control: no-store\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %lu\r\n"
+            "Connection: close\r\n"
+            "\r\n", // empty line
+            settings.server_name.c_str(), body.length());
+        return sendString(response.toString() + body, settings);
+    }
+
+    // The next frame of the source, which is started for it if no stream runs it.
+    int sendSnapshot(const PiServerSettings& settings, PiCameraManager& manager) const {
+        std::vector<uint8_t> jpeg;
+        uint64_t sequence = 0;
+        int64_t timestamp_us = 0;
+        int status = manager.captureFrame(&jpeg, &sequence, &timestamp_us, SNAPSHOT_WAIT_SEC, true);
+        if (status) {
+            HttpResponse response(
+                "HTTP/1.0 503 Service Unavailable\r\n"
+                "Server: %s\r\n"
+                "Connection: close\r\n"
+                "\r\n", // empty line
+                settings.server_name.c_str());
+            return sendString(response.toString(), settings);
+        }
+
+        HttpResponse response(
+            "HTTP/1.0 200 OK\r\n"
+            "Access-Control-Allow-Origin: *\r\n"
+            "Server: %s\r\n"
+            "Cache-Control: no-store\r\n"
+            "Content-Type: image/jpeg\r\n"
+            "Content-Length: %lu\r\n"
+            "X-Frame-Sequence: %llu\r\n"
+            "X-Frame-Timestamp: %lld\r\n"
+            "Connection: close\r\n"
+            "\r\n", // empty line
+            settings.server_name.c_str(), (unsigned long)jpeg.size(),
+            (unsigned long long)sequence, (long long)timestamp_us);
+        if ((status = sendString(response.toString(), settings)) != 0) {
+            return status;
+        }
+        return sendBuffer(&jpeg[0], jpeg.size(), settings);
+    }
+
+    // Spans of the frame path in the trace event format, or switch the tracing with ?enable=0|1
+    int sendTrace(const PiServerSettings& settings, const PiHttpdInterpreter& intr) const {
+        std::string body;
+        const char* type = "application/json";
+        const std::string* enable = intr.param("enable");
+        if (enable) {
+            PiTrace::enable(atoi(enable->c_str()) != 0);
+            body = PiTrace::isEnabled() ? "tracing on\n" : "tracing off\n";
+            type = "text/plain";
+        } else {
+            body = PiTrace::dumpJson();
+        }
+
+        HttpResponse response(
+            "HTTP/1.0 200 OK\r\n"
+            "Access-Control-Allow-Origin: *\r\n"
+            "Server: %s\r\n"
+            "Cache-Control: no-store\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %lu\r\n"
+            "Connection: close\r\n"
+            "\r\n", // empty line
+            settings.server_name.c_str(), type, body.length());
+        return sendString(response.toString() + body, settings);
+    }
+
+    // Families of the encoder stats, each with the samples of all the sources together.
+    enum CameraFamily {
+        CAMERA_BUFFERS, CAMERA_STARVATIONS, CAMERA_RESEND_ERRORS, CAMERA_IN_FLIGHT, CAMERA_MIN_IN_FLIGHT,
+        CAMERA_POOL_SIZE, CAMERA_POOL_GROWS, CAMERA_RAW_FRAMES, CAMERA_INVALID_FRAMES,
+        CAMERA_PACER_TICKS, CAMERA_PACER_MISSED, CAMERA_PACER_LATE_MEAN, CAMERA_PACER_LATE_STDDEV,
+        CAMERA_PACER_LATE_MAX, NUM_CAMERA_FAMILIES
+    };
+
+    static const char* cameraFamily(int family, const char** type) {
+        static const char* const families[NUM_CAMERA_FAMILIES][2] = {
+            { "pimjpg_encoder_buffers_total", "counter" },
+            { "pimjpg_encoder_starvations_total", "counter" },
+            { "pimjpg_encoder_resend_errors_total", "counter" },
+            { "pimjpg_encoder_in_flight", "gauge" },
+            { "pimjpg_encoder_min_in_flight", "gauge" },
+            { "pimjpg_encoder_pool_size", "gauge" },
+            { "pimjpg_encoder_pool_grows", "counter" },
+            { "pimjpg_raw_frames_total", "counter" },
+            { "pimjpg_invalid_frames_total", "counter" },
+            // Frame clock of a replayed source: how late the frames are published after their deadlines
+            { "pimjpg_pacer_ticks_total", "counter" },
+            { "pimjpg_pacer_missed_total", "counter" },
+            { "pimjpg_pacer_late_mean_seconds", "gauge" },
+            { "pimjpg_pacer_late_stddev_seconds", "gauge" },
+            { "pimjpg_pacer_late_max_seconds", "gauge" },
+        };
+        *type = families[family][1];
+        return families[family][0];
+    }
+
+    // Value of a family, false if the source has none, ex) the pacer of a camera
+    static bool cameraValue(const PiCameraStats& camera, int family, char* value, size_t size) {
+        const PiPacerStats& pacing = camera.pacing;
+        if (family >= CAMERA_PACER_TICKS && pacing.ticks == 0) {
+            return false;
+        }
+        switch (family) {
+        case CAMERA_BUFFERS:        snprintf(value, size, "%llu", (unsigned long long)camera.buffers); break;
+        case CAMERA_STARVATIONS:    snprintf(value, size, "%llu", (unsigned long long)camera.starvations); break;
+        case CAMERA_RESEND_ERRORS:  snprintf(value, size, "%llu", (unsigned long long)camera.resend_errors); break;
+        case CAMERA_IN_FLIGHT:      snprintf(value, size, "%d", camera.in_flight); break;
+        case CAMERA_MIN_IN_FLIGHT:  snprintf(value, size, "%d", camera.min_in_flight); break;
+        case CAMERA_POOL_SIZE:      snprintf(value, size, "%d", camera.pool_size); break;
+        case CAMERA_POOL_GROWS:     snprintf(value, size, "%d", camera.grows); break;
+        case CAMERA_RAW_FRAMES:     snprintf(value, size, "%llu", (unsigned long long)camera.raw_frames); break;
+        case CAMERA_INVALID_FRAMES: snprintf(value, size, "%llu", (unsigned long long)camera.invalid_frames); break;
+        case CAMERA_PACER_TICKS:    snprintf(value, size, "%llu", (unsigned long long)pacing.ticks); break;
+        case CAMERA_PACER_MISSED:   snprintf(value, size, "%llu", (unsigned long long)pacing.missed); break;
+        case CAMERA_PACER_LATE_MEAN:   snprintf(value, size, "%.9f", pacing.late_mean_ns / 1e9); break;
+        case CAMERA_PACER_LATE_STDDEV: snprintf(value, size, "%.9f", pacing.late_stddev_ns / 1e9); break;
+        case CAMERA_PACER_LATE_MAX:    snprintf(value, size, "%.9f", pacing.late_max_ns / 1e9); break;
+        default:
+            return false;
+        }
+        return true;
+    }
+
+    // The stats of the sources by their labels, ex) {source="front"}, "" for the default one.
+    // The text format needs the samples of a family together, after its TYPE.
+    static void appendCameraMetrics(const std::vector<std::pair<std::string, PiCameraStats> >& cameras,
+            std::string* body) {
+        for (int family = 0; family < NUM_CAMERA_FAMILIES; family++) {
+            const char* type = NULL;
+            const char* name = cameraFamily(family, &type);
+            bool typed = false;
+            for (size_t i = 0; i < cameras.size(); i++) {
+                char value[64];
+                if (!cameraValue(cameras[i].second, family, value, sizeof(value))) {
+                    continue;
+                }
+                if (!typed) {
+                    *body += std::string("# TYPE ") + name + " " + type + "\n";
+                    typed = true;
+                }
+                *body += name + cameras[i].first + " " + value + "\n";
+            }
+        }
+    }
+
+    // Per thread cpu usage, to check the isolation of the capture path
+    int sendMetrics(const PiServerSettings& settings) const {
+        std::string body = PiThreads::metrics();
+
+        // The named sources are labeled, ex) pimjpg_encoder_buffers_total{source="front"}
+        std::vector<std::pair<std::string, PiCameraStats> > cameras;
+        cameras.push_back(std::make_pair(std::string(), gSelf->mManager.cameraStats()));
+        std::map<std::string, PiCameraManager*>::const_iterator it = gSelf->mSources.begin();
+        for (; it != gSelf->mSources.end(); it++) {
+            cameras.push_back(std::make_pair("{source=\"" + it->first + "\"}", it->second->cameraStats()));
+        }
+        appendCameraMetrics(cameras, &body);
+
+        // The budget is shared by the connections, the largest one shows a costly client.
+        size_t largest = 0;
+        pthread_mutex_lock(&gSelf->mMutex);
+        int connections = gSelf->mClients.size();
+        std::vector<ClientSockInfo*>::const_iterator client = gSelf->mClients.begin();
+        for (; client != gSelf->mClients.end(); client++) {
+            largest = std::max(largest, (*client)->memory.total());
+        }
+        pthread_mutex_unlock(&gSelf->mMutex);
+        char line[256];
+        snprintf(line, sizeof(line),
+                "# TYPE pimjpg_connections gauge\n"
+                "pimjpg_connections %d\n"
+                "# TYPE pimjpg_memory_connection_max_bytes gauge\n"
+                "pimjpg_memory_connection_max_bytes %lu\n",
+                connections, (unsigned long)largest);
+        body += line;
+        body += PiMemory::metrics();
+        body += PiHttp2Session::metrics();
+
+        if (gSelf->mExport) {
+            const PiShmExportStats exported = gSelf->mExport->stats();
+            char line[512];
+            snprintf(line, sizeof(line),
+                    "# TYPE pimjpg_export_frames_total counter\n"
+                    "pimjpg_export_frames_total %llu\n"
+                    "pimjpg_export_too_large_total %llu\n"
+                    "pimjpg_export_notices_dropped_total %llu\n"
+                    "# TYPE pimjpg_export_consumers gauge\n"
+                    "pimjpg_export_consumers %d\n",
+                    (unsigned long long)exported.frames, (unsigned long long)exported.too_large,
+                    (unsigned long long)exported.notices_dropped, exported.consumers);
+            body += line;
+        }
+
+        HttpResponse response(
+            "HTTP/1.0 200 OK\r\n"
+            "Server: %s\r\n"
+            "Cache-Control: no-store\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %lu\r\n"
+            "Connection: close\r\n"
+            "\r\n", // empty line
+            settings.server_name.c_str(), body.length());
+        return sendString(response.toString() + body, settings);
+    }
+
+    // Reserve the frame buffer and the send buffer ('extra' bytes larger) of a stream in the
+    // memory budget. If they don't fit, the stream is degraded to 1/DEGRADED_SCALE.
+    // Return ENOMEM if even that doesn't fit.
+    int admitStream(PiCameraManager& manager, int* scale_denom, size_t extra) const {
+        const int scales[] = { *scale_denom, DEGRADED_SCALE };
+        for (int i = 0; i < 2; i++) {
+            if (i > 0 && (*scale_denom >= DEGRADED_SCALE || !PiThumbnailer::isSupportedScale(DEGRADED_SCALE))) {
+                break;
+            }
+            const size_t size = manager.frameSizeHint(scales[i]);
+            if (memory.reserve(MEMORY_FRAME, size) == 0) {
+                if (memory.reserve(MEMORY_SEND, size + extra) == 0) {
+                    if (i > 0) {
+                        PiMemory::countDegraded();
+                        printf("Degraded a stream to 1/%d for the memory budget\n", scales[i]);
+                    }
+                    *scale_denom = scales[i];
+                    return 0;
+                }
+                memory.unreserve(MEMORY_FRAME, size);
+            }
+        }
+        return ENOMEM;
+    }
+
+    // Refuse the request for the memory budget
+    int sendOverBudget(const PiServerSettings& settings) const {
+        PiMemory::countRejected();
+        HttpResponse response(
+            "HTTP/1.0 503 Service Unavailable\r\n"
+            "Server: %s\r\n"
+            "Retry-After: %d\r\n"
+            "Connection: close\r\n"
+            "\r\n", // empty line
+            settings.server_name.c_str(), RETRY_AFTER_SEC);
+        return sendString(response.toString(), settings);
+    }
+
+    // Check whether the client has closed the connection, without blocking.
+    bool isPeerClosed() const {
+        pollfd pfd;
+        pfd.fd = socket;
+        pfd.events = POLLIN | POLLRDHUP;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) <= 0) {
+            return false;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP | POLLRDHUP)) {
+            return true;
+        }
+
+        char c;
+        return recv(socket, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+    }
+
+    int sendMjpeg(const PiServerSettings& settings, PiCameraManager& manager, int max_fps, int scale_denom, int credits) const {
+        // Full-rate clients of the default source share the sends of the broadcaster.
+        const bool broadcast = (gSelf->mBroadcaster || gSelf->mFanout) && &manager == &gSelf->mManager &&
+                max_fps == 0 && scale_denom == 1 && credits < 0;
+
+        // A broadcast client has no buffers of its own, it only has to come within the budget.
+        int admitted = broadcast ? memory.reserve(MEMORY_SEND, 0) : admitStream(manager, &scale_denom, 0);
+        if (admitted != 0) {
+            return sendOverBudget(settings);
+        }
+
+        // Attach first, the stream id of a credit mode stream is sent in the header.
+        PiFrame* frame = broadcast ? NULL : manager.attach(max_fps, scale_denom, credits);
+
         TimeString now;
         HttpResponse responseHeader(
                 "HTTP/1.0 200 OK\r\n"
@@ -308,54 +906,111 @@ struct ClientSockInfo {
                 "Expires: %s\r\n"
                 "Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n",
                 settings.server_name.c_str(), now.toString().c_str());
+        if (frame && frame->isCreditMode()) {
+            responseHeader.append("X-Stream-Id: %u", frame->stream_id);
+        }
         const std::string boundary_eof = "--" BOUNDARY "--";
 
         int status;
         if ((status = sendString(responseHeader.toString(), settings)) != 0) {
             fprintf(stderr, "Error in sendString() of sendMjpeg() status=%d\n", status);
+            manager.detach(frame);
             return status;
         }
 
-        const PiCamSettings& cam_settings = settings.cam_settings;
+        if (broadcast) {
+            status = gSelf->mBroadcaster ? gSelf->mBroadcaster->serve(socket) : gSelf->mFanout->serve(socket);
+            if (!gSelf->mIsRunning) {
+                status = sendString(boundary_eof, gSelf->mSettings);
+                printf("send %s status=%d\n", boundary_eof.c_str(), status);
+            }
+            printf("finish sendMjpeg()\n");
+            return status;
+        }
+
+        // With zerocopy, the frames are shared with the publisher instead of copied to
+        // the PiFrame and to tmp_buffer, and the large ones are sent from their own pages.
+        PiZeroCopy zerocopy(socket, settings.zerocopy_threshold);
+        const int timeout_ms = settings.timeout_sending.tv_sec * 1000 + settings.timeout_sending.tv_usec / 1000;
+        bool sharing = false;
+        if (frame && zerocopy.enabled() && frame->lock(3) == 0) {
+            frame->enableSharing();
+            frame->unlock();
+            sharing = true;
+            memory.update(MEMORY_FRAME, 0);
+            memory.update(MEMORY_SEND, 0);
+        }
+
+        // Grown if a frame is larger
         StaticBuffer tmp_buffer;
-        if ((status = tmp_buffer.realloc(cam_settings.width * cam_settings.height * 3)) != 0) {
-            fprintf(stderr, "failed to allocate tmp_buffer size=%d status=%d\n",
-                    (cam_settings.width * cam_settings.height * 3), status);
+        const size_t tmp_size = manager.frameSizeHint(scale_denom);
+        if (!sharing && (status = tmp_buffer.realloc(tmp_size)) != 0) {
+            fprintf(stderr, "failed to allocate tmp_buffer size=%lu status=%d\n", (unsigned long)tmp_size, status);
+            manager.detach(frame);
             return ENOMEM;
         }
 
-        PiFrame* frame = gSelf->mManager.attach();
         if (frame) {
             int i = 0;
+            uint64_t seen = 0;
             while (true) {
-                status = frame->waitForReady(3);
+                status = frame->waitForReady(&seen, 3);
+                if (status == ETIMEDOUT && frame->isCreditMode()) {
+                    // No frame is sent until the client grants credits.
+                    if (isPeerClosed() || !gSelf->mIsRunning) {
+                        status = 0;
+                        break;
+                    }
+                    continue;
+                }
                 if (status) {
                     sendString(boundary_eof, gSelf->mSettings);
-                    fprintf(stderr, "Error in waitForReady status=%d\n", status);
+                    PI_LOG(PILOG_ERROR, status, "Error in waitForReady");
                     break; // Error (or timeout)
                 }
 
                 status = frame->lock(3);
                 if (status) {
                     sendString(boundary_eof, gSelf->mSettings);
-                    fprintf(stderr, "Error in PiFrame#lock status=%d\n", status);
+                    PI_LOG(PILOG_ERROR, status, "Error in PiFrame#lock");
                     break; // Error (or timeout)
                 }
 
+                PiSharedFrame* shared = NULL;
                 size_t frame_size = frame->length;
-                if (tmp_buffer.alloc_size < frame_size) {
-                    if ((status = tmp_buffer.realloc(frame_size)) != 0) {
-                        frame->unlock();
-                        sendString(boundary_eof, gSelf->mSettings);
-                        fprintf(stderr, "tmp_buffer#realloc err=%d\n", status);
-                        break;
+                if (sharing) {
+                    shared = frame->takeShared();
+                    frame_size = shared ? shared->length : 0;
+                } else {
+                    if (tmp_buffer.alloc_size < frame_size) {
+                        if ((status = tmp_buffer.realloc(frame_size)) != 0) {
+                            frame->unlock();
+                            sendString(boundary_eof, gSelf->mSettings);
+                            fprintf(stderr, "tmp_buffer#realloc err=%d\n", status);
+                            break;
+                        }
+                        memory.update(MEMORY_SEND, tmp_buffer.alloc_size);
                     }
+                    memory.update(MEMORY_FRAME, frame->requiredMemSize());
+
+                    memcpy(tmp_buffer.values, frame->buffer, frame_size);
                 }
 
-                memcpy(tmp_buffer.values, frame->buffer, frame_size);
+                // In credit mode a frame costs a credit when it's taken here, not when written.
+                const bool taken = (sharing && shared == NULL) || frame->takeCredit();
 
                 frame->unlock();
 
+                if (sharing && shared == NULL) {
+                    continue; // taken with the previous signal
+                }
+                if (!taken) {
+                    if (shared) {
+                        shared->release();
+                    }
+                    continue; // written before the last credit was taken
+                }
+
                 HttpResponse entityHeader(
                     "\r\n" // empty line
                     "--" BOUNDARY"\r\n"
@@ -365,57 +1020,381 @@ struct ClientSockInfo {
                     frame_size);
 
                 if (gSelf->mIsRunning) {
+                    PI_TRACE("send_frame", frame_size);
                     if ((status = sendString(entityHeader.toString(), gSelf->mSettings)) != 0) {
-                        fprintf(stderr, "Error in sendString() of sendMjpeg() status=%d\n", status);
+                        PI_LOG(PILOG_ERROR, status, "Error in sendString() of sendMjpeg()");
+                        if (shared) {
+                            shared->release();
+                        }
                         break;
                     }
 
-                    if ((status = sendBuffer(tmp_buffer.values, frame_size, gSelf->mSettings)) != 0) {
-                        fprintf(stderr, "Error in sendBuffer() of sendMjpeg() status=%d\n", status);
+                    if (shared && zerocopy.useFor(frame_size)) {
+                        status = zerocopy.send(shared, timeout_ms); // released by zerocopy
+                    } else if (shared) {
+                        status = sendBuffer(shared->values, frame_size, gSelf->mSettings);
+                        shared->release();
+                    } else {
+                        status = sendBuffer(tmp_buffer.values, frame_size, gSelf->mSettings);
+                    }
+                    if (status != 0) {
+                        PI_LOG(PILOG_ERROR, status, "Error in sendBuffer() of sendMjpeg()");
                         break;
                     }
                 } else {
+                    if (shared) {
+                        shared->release();
+                    }
                     status = sendString(boundary_eof, gSelf->mSettings);
                     printf("send %s status=%d\n", boundary_eof.c_str(), status);
                     break; // finish
                 }
             }
-            gSelf->mManager.detach(frame);
+            manager.detach(frame);
         }
 
         printf("finish sendMjpeg()\n");
         return status;
     }
+
+    int sendWebSocketMessage(PiWebSocket::Opcode opcode, const std::string& payload, const PiServerSettings& settings) const {
+        uint8_t header[PiWebSocket::MAX_HEADER_SIZE];
+        size_t header_length = PiWebSocket::makeHeader(opcode, payload.length(), header);
+        int status = ENOMEM;
+        TRAP1(catched, msg, status = sendString(std::string((const char*)header, header_length) + payload, settings););
+        return status;
+    }
+
+    int sendWebSocketClose(uint16_t code, const PiServerSettings& settings) const {
+        std::string payload;
+        payload += (char)(code >> 8);
+        payload += (char)(code & 0xff);
+        return sendWebSocketMessage(PiWebSocket::OP_CLOSE, payload, settings);
+    }
+
+    // Read the messages sent by the browser without blocking.
+    // Acknowledged frames are removed from 'in_flight', and 'paced' turns on at the first ack.
+    // "credit N" text messages grant credits to 'frame' in credit mode.
+    int recvWebSocket(PiWebSocket& ws, std::deque<uint64_t>& in_flight, bool* paced, bool* closed,
+            PiFrame* frame, const PiServerSettings& settings) const {
+        uint8_t buf[512];
+        for (;;) {
+            ssize_t n = recv(socket, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    return 0;
+                }
+                return errno;
+            } else if (n == 0) {
+                *closed = true;
+                return 0;
+            }
+
+            std::vector<PiWebSocket::Message> messages;
+            if (ws.feed(buf, n, messages) != 0) {
+                fprintf(stderr, "Invalid WebSocket message from the client\n");
+                return EPROTO;
+            }
+
+            std::vector<PiWebSocket::Message>::iterator it = messages.begin();
+            for (; it != messages.end(); it++) {
+                uint64_t acked = 0;
+                bool has_ack = false;
+
+                switch (it->opcode) {
+                case PiWebSocket::OP_CLOSE:
+                    *closed = true;
+                    break;
+                case PiWebSocket::OP_PING:
+                    sendWebSocketMessage(PiWebSocket::OP_PONG, it->payload, settings);
+                    break;
+                case PiWebSocket::OP_TEXT:
+                    // ex) "ack 1234"
+                    if (!it->payload.compare(0, 4, "ack ")) {
+                        acked = strtoull(it->payload.c_str() + 4, NULL, 10);
+                        has_ack = true;
+                    } else if (!it->payload.compare(0, 7, "credit ") && frame->isCreditMode()) {
+                        frame->addCredits(atoi(it->payload.c_str() + 7));
+                    }
+                    break;
+                case PiWebSocket::OP_BINARY:
+                    // 8 bytes big endian sequence
+                    if (it->payload.length() == 8) {
+                        for (int i = 0; i < 8; i++) {
+                            acked = (acked << 8) | (uint8_t)it->payload[i];
+                        }
+                        has_ack = true;
+                    }
+                    break;
+                default:
+                    break;
+                }
+
+                if (has_ack) {
+                    *paced = true;
+                    while (!in_flight.empty() && in_flight.front() <= acked) {
+                        in_flight.pop_front();
+                    }
+                }
+            }
+
+            if (*closed) return 0;
+        }
+    }
+
+    int sendWebSocket(const PiServerSettings& settings, const PiHttpdInterpreter& intr, PiCameraManager& manager,
+            int max_fps, int scale_denom, size_t window, int credits) const {
+        const PiHttpdInterpreter::Strings& key = intr.header("Sec-WebSocket-Key");
+        if (key.size() == 0) {
+            HttpResponse response(
+                "HTTP/1.1 400 Bad Request\r\n"
+                "Server: %s\r\n"
+                "Connection: close\r\n"
+                "\r\n", // empty line
+                settings.server_name.c_str());
+            return sendString(response.toString(), settings);
+        }
+
+        const size_t prefix_size = PiWebSocket::MAX_HEADER_SIZE + PiWebSocket::METADATA_SIZE;
+        if (admitStream(manager, &scale_denom, prefix_size) != 0) {
+            return sendOverBudget(settings);
+        }
+
+        HttpResponse responseHeader(
+                "HTTP/1.1 101 Switching Protocols\r\n"
+                "Upgrade: websocket\r\n"
+                "Connection: Upgrade\r\n"
+                "Server: %s\r\n"
+                "Sec-WebSocket-Accept: %s\r\n"
+                "\r\n", // empty line
+                settings.server_name.c_str(), PiWebSocket::acceptKey(key[0]).c_str());
+
+        int status;
+        if ((status = sendString(responseHeader.toString(), settings)) != 0) {
+            fprintf(stderr, "Error in sendString() of sendWebSocket() status=%d\n", status);
+            return status;
+        }
+
+        // The message header and the metadata are written in front of the JPEG,
+        // so a frame goes out with a single send().
+        StaticBuffer tmp_buffer;
+        if ((status = tmp_buffer.realloc(prefix_size + manager.frameSizeHint(scale_denom))) != 0) {
+            fprintf(stderr, "failed to allocate tmp_buffer status=%d\n", status);
+            return ENOMEM;
+        }
+
+        PiWebSocket ws;
+        std::deque<uint64_t> in_flight;
+        bool paced = false;
+        bool closed = false;
+
+        PiFrame* frame = manager.attach(max_fps, scale_denom, credits);
+        if (frame) {
+            uint64_t seen = 0;
+            while (true) {
+                bool ready = false;
+                if (frame->isCreditMode() && frame->addCredits(0) <= 0) {
+                    // Wait for a credit message instead of a frame which never comes.
+                    pollfd pfd;
+                    pfd.fd = socket;
+                    pfd.events = POLLIN;
+                    poll(&pfd, 1, CREDIT_POLL_MSEC);
+                } else {
+                    status = frame->waitForReady(&seen, 3);
+                    if (status == ETIMEDOUT && frame->isCreditMode()) {
+                        status = 0; // No frame was due yet, read the messages
+                    } else if (status) {
+                        sendWebSocketClose(1011, settings); // internal error
+                        PI_LOG(PILOG_ERROR, status, "Error in waitForReady");
+                        break; // Error (or timeout)
+                    } else {
+                        ready = true;
+                    }
+                }
+
+                // The parser and the messages allocate, the frame is detached below in any case.
+                TRAP1(catched, msg, status = recvWebSocket(ws, in_flight, &paced, &closed, frame, settings););
+                if (catched) {
+                    sendWebSocketClose(1011, settings); // internal error
+                    PI_LOG(PILOG_ERROR, ENOMEM, "Exception in recvWebSocket");
+                    status = ENOMEM;
+                    break;
+                } else if (status != 0) {
+                    sendWebSocketClose(1002, settings); // protocol error
+                    break;
+                }
+
+                if (closed) {
+                    sendWebSocketClose(1000, settings);
+                    break;
+                }
+
+                if (!gSelf->mIsRunning) {
+                    status = sendWebSocketClose(1001, settings); // going away
+                    break;
+                }
+
+                if (!ready) {
+                    continue; // Only the credit messages were read
+                }
+
+                // Skip the frame while the browser hasn't rendered the previous ones.
+                // Credits already pace the client in credit mode.
+                if (!frame->isCreditMode() && paced && in_flight.size() >= window) {
+                    continue;
+                }
+
+                status = frame->lock(3);
+                if (status) {
+                    sendWebSocketClose(1011, settings);
+                    PI_LOG(PILOG_ERROR, status, "Error in PiFrame#lock");
+                    break; // Error (or timeout)
+                }
+
+                // The credit is taken with the frame, a frame written before the last one was taken is dropped.
+                if (!frame->takeCredit()) {
+                    frame->unlock();
+                    continue;
+                }
+
+                size_t frame_size = frame->length;
+                if (tmp_buffer.alloc_size < prefix_size + frame_size) {
+                    if ((status = tmp_buffer.realloc(prefix_size + frame_size)) != 0) {
+                        frame->unlock();
+                        sendWebSocketClose(1011, settings);
+                        fprintf(stderr, "tmp_buffer#realloc err=%d\n", status);
+                        break;
+                    }
+                    memory.update(MEMORY_SEND, tmp_buffer.alloc_size);
+                }
+                memory.update(MEMORY_FRAME, frame->requiredMemSize());
+
+                memcpy(tmp_buffer.values + prefix_size, frame->buffer, frame_size);
+                uint64_t sequence = frame->sequence;
+                int64_t timestamp_us = frame->timestamp_us;
+
+                frame->unlock();
+
+                uint8_t header[PiWebSocket::MAX_HEADER_SIZE];
+                size_t header_length = PiWebSocket::makeHeader(PiWebSocket::OP_BINARY,
+                        PiWebSocket::METADATA_SIZE + frame_size, header);
+                uint8_t* message = tmp_buffer.values + PiWebSocket::MAX_HEADER_SIZE - header_length;
+                memcpy(message, header, header_length);
+                PiWebSocket::makeMetadata(sequence, timestamp_us, tmp_buffer.values + PiWebSocket::MAX_HEADER_SIZE);
+
+                if ((status = sendBuffer(message, header_length + PiWebSocket::METADATA_SIZE + frame_size, settings)) != 0) {
+                    PI_LOG(PILOG_ERROR, status, "Error in sendBuffer() of sendWebSocket()");
+                    break;
+                }
+
+                if (paced) {
+                    TRAP_IGN(in_flight.push_back(sequence););
+                }
+            }
+            manager.detach(frame);
+        }
+
+        printf("finish sendWebSocket()\n");
+        return status;
+    }
 };
 
-PiServerSettings::PiServerSettings() : ip_addr(0), port_number(8080), max_connections(5), server_name("test server") {
+PiServerSettings::PiServerSettings() : ip_addr(0), port_number(8080), max_connections(5), server_name("test server"),
+        send_backend(SEND_BACKEND_THREAD), fanout_workers(2), zerocopy_threshold(0), memory_budget(0),
+        log_sink(LOG_SINK_STDERR), trace(false), trace_file("/tmp/pimjpg_srv.trace.json"), export_slots(4),
+        export_raw(false) {
 
     timeout_sending.tv_sec = 10; // 10 seconds
     timeout_sending.tv_usec = 0;
     timeout_recving.tv_sec = 10; // 10 seconds
     timeout_recving.tv_usec = 0;
+    timeout_draining.tv_sec = 5; // 5 seconds
+    timeout_draining.tv_usec = 0;
 
 }
 
 PiMjpgServer::PiMjpgServer(const PiServerSettings& settings)
-        : mSettings(settings), mManager(settings.cam_settings), mIsRunning(true)  {
+        : mSettings(settings), mManager(settings.cam_settings), mBroadcaster(NULL), mFanout(NULL), mExport(NULL),
+          mIsRunning(true)  {
+    gSelf = this;
+
+    mWakeFds[0] = mWakeFds[1] = -1;
+    if (pipe2(mWakeFds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        perror("Failed to create the wake pipe line=" STR(__LINE__));
+    }
+    gWakeFd = mWakeFds[1];
+
     // Please see following:
     // http://doi-t.hatenablog.com/entry/2014/06/10/033309
     signal(SIGPIPE, SIG_IGN);
     signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
 
-    gSelf = this;
+    PiThreads::configure(settings.thread_policies);
+    PiMemory::setBudget(settings.memory_budget);
 
     int status = pthread_mutex_init(&mMutex, NULL);
     if (status) fprintf(stderr, "Failed to create mMutex status=%d\n", status);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    status = pthread_cond_init(&mClientsCond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (status) fprintf(stderr, "Failed to create mClientsCond status=%d\n", status);
+
+    // Each source starts its capture when its first client comes, like the default one.
+    // The managers refer to the settings in mSettings, which isn't modified after this.
+    std::vector<PiSourceSettings>::iterator it = mSettings.sources.begin();
+    for (; it != mSettings.sources.end(); it++) {
+        PiCamSettings cam_settings(settings.cam_settings);
+        cam_settings.camera_num = it->cam_settings.camera_num;
+        cam_settings.relay_url = it->cam_settings.relay_url;
+        cam_settings.replay_path = it->cam_settings.replay_path;
+        it->cam_settings = cam_settings;
+        PiCameraManager* manager = NULL;
+        TRAP1(catched, msg, manager = new PiCameraManager(it->cam_settings); mSources[it->name] = manager;);
+        if (catched) {
+            fprintf(stderr, "Failed to add the source %s msg=%s\n", it->name.c_str(), msg.c_str());
+            delete manager;
+        }
+    }
+
+    if (settings.send_backend == SEND_BACKEND_URING) {
+        mBroadcaster = new PiBroadcaster(mManager, settings.cam_settings, BOUNDARY, settings.timeout_sending, &status);
+        if (mBroadcaster == NULL || status != 0) {
+            fprintf(stderr, "io_uring is not available status=%d, use the thread backend\n", status);
+            delete mBroadcaster;
+            mBroadcaster = NULL;
+        }
+    } else if (settings.send_backend == SEND_BACKEND_FANOUT) {
+        mFanout = new PiFanout(mManager, settings.fanout_workers, BOUNDARY, settings.timeout_sending, &status);
+        if (mFanout == NULL || status != 0) {
+            fprintf(stderr, "Failed to start the fanout workers status=%d, use the thread backend\n", status);
+            delete mFanout;
+            mFanout = NULL;
+        }
+    }
 }
 
 PiMjpgServer::~PiMjpgServer() {
-    gSelf = NULL;
     signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
     signal(SIGPIPE, SIG_DFL);
+    gWakeFd = -1;
+    gSelf = NULL;
 
+    delete mExport;
+    delete mBroadcaster;
+    delete mFanout;
+    std::map<std::string, PiCameraManager*>::iterator it = mSources.begin();
+    for (; it != mSources.end(); it++) {
+        delete it->second;
+    }
+    pthread_cond_destroy(&mClientsCond);
     pthread_mutex_destroy(&mMutex);
+    if (mWakeFds[0] != -1) close(mWakeFds[0]);
+    if (mWakeFds[1] != -1) close(mWakeFds[1]);
 }
 
 int PiMjpgServer::run() {
@@ -424,34 +1403,90 @@ int PiMjpgServer::run() {
 
     int status;
 
-    // Open the server socket
-    if ((status = openServerSocket(srv)) < 0) {
+    // Take over the listening socket of the running process, or open a new one.
+    if (!mSettings.upgrade_socket.empty()) {
+        PiUpgradeFrame frame;
+        int listen_fd = -1;
+        status = mUpgrade.takeOver(mSettings.upgrade_socket, &listen_fd, &frame);
+        if (status == 0) {
+            printf("Took over the listening socket from %s, frame %lu bytes\n",
+                    mSettings.upgrade_socket.c_str(), (unsigned long)frame.jpeg.size());
+            srv.accept_socket = listen_fd;
+            if (!frame.jpeg.empty()) {
+                mManager.setLatestFrame(frame.jpeg, frame.sequence, frame.timestamp_us);
+            }
+
+            // New connections wait in the backlog until the previous process releases the camera.
+            int timeout_ms = (mSettings.timeout_draining.tv_sec + FORCE_CLOSE_WAIT_SEC + 1) * 1000
+                    + mSettings.timeout_draining.tv_usec / 1000;
+            if (mUpgrade.waitPrevious(timeout_ms) != 0) {
+                fprintf(stderr, "The previous process hasn't exited in %dms, the camera may be busy\n", timeout_ms);
+            }
+        } else if (status != ENOENT && status != ECONNREFUSED) {
+            fprintf(stderr, "Failed to take over from %s err=%d, open a new socket\n",
+                    mSettings.upgrade_socket.c_str(), status);
+        }
+    }
+    if (srv.accept_socket == -1 && (status = openServerSocket(srv)) < 0) {
         return status; // Error
     }
+    if (!mSettings.upgrade_socket.empty()) {
+        mUpgrade.listen(mSettings.upgrade_socket);
+    }
+
+    // Created after the previous process has released the camera, which a consumer starts.
+    if (!mSettings.export_socket.empty()) {
+        // A slot fits an I420 frame with the padding of MMAL, a JPEG is smaller.
+        const PiCamSettings& cam = mSettings.cam_settings;
+        const size_t slot_size = (size_t)((cam.width + 31) & ~31) * ((cam.height + 15) & ~15) * 3 / 2;
+        mExport = new PiShmExport(mManager, mSettings.export_socket, mSettings.export_slots, slot_size,
+                mSettings.export_raw, &status);
+        if (mExport == NULL || status != 0) {
+            fprintf(stderr, "Failed to export frames on %s status=%d\n", mSettings.export_socket.c_str(), status);
+            delete mExport;
+            mExport = NULL;
+        }
+    }
+
+    // The client threads inherit the affinity of this thread until they enter().
+    PiThreads::enter(THREAD_NETWORK, "accept");
 
     ClientSockInfo* client = new ClientSockInfo();
     if (client) {
 
+        // Client threads have a small stack, which is accounted in the memory budget.
+        pthread_attr_t thread_attr;
+        pthread_attr_init(&thread_attr);
+        pthread_attr_setstacksize(&thread_attr, CLIENT_STACK_SIZE);
+
         // Start the main loop
         while (!wait(srv, *client)) {
 
+            // Counted without the budget, so the metrics and the control requests are served
+            // while the streams use up the budget.
+            client->memory.update(MEMORY_STACK, CLIENT_STACK_SIZE);
+
             pthread_mutex_lock(&mMutex);      // Lock
             TRAP1(exception, msg, mClients.push_back(client););
             pthread_mutex_unlock(&mMutex); // Unlock
             if (exception) {
                 // Remove client from gClient, and delete client
                 removeClient(client);
+                client = NULL;
                 fprintf(stderr, "Exception in mClients.push_back msg=%s\n", msg.c_str());
                 break; // Error
             }
 
             // Launch the thread communicate with host.
-            if ((status = pthread_create(&client->thread, NULL, ClientSockInfo::run_httpd, client)) < 0) {
+            if ((status = pthread_create(&client->thread, &thread_attr, ClientSockInfo::run_httpd, client)) != 0) {
                 fprintf(stderr, "Failed to create thread status=%d\n", status);
                 // Remove client from gClient, and delete client
                 removeClient(client);
+                client = NULL;
                 break;
             }
+            // The thread removes the client by itself, drain() waits for mClients instead of joining.
+            pthread_detach(client->thread);
 
             // Create new ClientSockInfo
             client = new ClientSockInfo();
@@ -460,19 +1495,12 @@ int PiMjpgServer::run() {
                 break; // Error
             }
         }
+        pthread_attr_destroy(&thread_attr);
     }
 
-    printf("Waitting children...\n");
-
-    // Repeat as long as the clients exist
-    while (true) {
-        pthread_mutex_lock(&mMutex);
-        int n = mClients.size();
-        pthread_mutex_unlock(&mMutex);
-
-        if (n <= 0) break;
-        usleep(100);
-    }
+    delete client; // not accepted
+    drain();
+    PiThreads::leave();
 
 
     printf("Finished MjpgServer\n");
@@ -493,6 +1521,9 @@ void PiMjpgServer::removeClient(ClientSockInfo* client) {
     );
 
     int n = mClients.size();
+    if (n == 0) {
+        pthread_cond_broadcast(&mClientsCond);
+    }
 
     pthread_mutex_unlock(&mMutex);
     if (!removed) fprintf(stderr, "Couldn't erase ClientSockInfo\n");
@@ -503,10 +1534,99 @@ void PiMjpgServer::removeClient(ClientSockInfo* client) {
     printf("removeClient: num=%d\n", n);
 }
 
+/**
+ * Stop accepting, and let the clients finish their streams. A streaming client sends
+ * the closing boundary (or a WebSocket close) on its next frame. The sockets of the
+ * clients remaining at the deadline are shut down, which fails their blocked sends, and
+ * the server returns only after all of the client threads have.
+ */
+void PiMjpgServer::drain() {
+    mIsRunning = false;
+    mSrv->close();
+
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_mutex_lock(&mMutex);
+    int clients = mClients.size();
+    pthread_mutex_unlock(&mMutex);
+    printf("Draining %d clients...\n", clients);
+
+    // The shared senders end the streams of their clients, which then send the closing boundary.
+    if (mBroadcaster) {
+        mBroadcaster->stop();
+    }
+    if (mFanout) {
+        mFanout->stop();
+    }
+
+    timespec deadline = start;
+    deadline.tv_sec += mSettings.timeout_draining.tv_sec;
+    deadline.tv_nsec += mSettings.timeout_draining.tv_usec * 1000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    int remaining = waitClients(deadline);
+
+    int forced = remaining;
+    if (remaining > 0) {
+        pthread_mutex_lock(&mMutex);
+        std::vector<ClientSockInfo*>::iterator it = mClients.begin();
+        for (; it != mClients.end(); it++) {
+            // The client thread still owns the descriptor, so it isn't closed here.
+            shutdown((*it)->socket, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&mMutex);
+
+        // The client threads use the server until they return, so they are waited for
+        // without a deadline. A thread which is stuck is reported, and waited for again.
+        for (;;) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += FORCE_CLOSE_WAIT_SEC;
+            remaining = waitClients(deadline);
+            if (remaining == 0) {
+                break;
+            }
+            fprintf(stderr, "%d clients didn't finish after their sockets were shut down, waiting for them\n",
+                    remaining);
+        }
+    }
+
+    timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    printf("Drained %d clients, force-closed %d in %ldms\n", clients - forced, forced, elapsed_ms);
+}
+
+/** Wait until mClients gets empty or the deadline passes. Return the number of the remaining clients. */
+int PiMjpgServer::waitClients(const timespec& deadline) {
+    pthread_mutex_lock(&mMutex);
+    while (!mClients.empty()) {
+        int ret = pthread_cond_timedwait(&mClientsCond, &mMutex, &deadline);
+        if (ret == ETIMEDOUT) {
+            break;
+        } else if (ret != 0) {
+            fprintf(stderr, "waitClients: cond timedwait err=%d\n", ret);
+            break;
+        }
+    }
+    int n = mClients.size();
+    pthread_mutex_unlock(&mMutex);
+    return n;
+}
+
 void PiMjpgServer::sig_handler(int signum) {
-    if (signum == SIGINT) {
-        gSelf->mIsRunning = false;
-        gSelf->mSrv->close();
+    // Only async-signal-safe calls here. The accept loop does the rest.
+    if (signum == SIGINT || signum == SIGTERM) {
+        int saved = errno;
+        int fd = gWakeFd;
+        if (fd != -1) {
+            char c = (char)signum;
+            ssize_t ret = write(fd, &c, 1); // a full pipe already has a wake-up
+            (void)ret;
+        }
+        errno = saved;
     }
 }
 
@@ -533,16 +1653,63 @@ int PiMjpgServer::openServerSocket(SrvSockInfo& srv) {
         return status;
     }
 
+    // wait() polls before accept(), and a connection reset in between must not block it.
+    fcntl(srv.accept_socket, F_SETFL, fcntl(srv.accept_socket, F_GETFL) | O_NONBLOCK);
+
     return 0;
 }
 
+/**
+ * Accept a client. Return ECANCELED when the server is asked to stop, or has handed
+ * the listening socket over to a new process.
+ */
 int PiMjpgServer::wait(SrvSockInfo& srv, ClientSockInfo& client) {
     for (;;) {
+        pollfd fds[3];
+        fds[0].fd = srv.accept_socket;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = mWakeFds[0];
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        fds[2].fd = mUpgrade.fd(); // ignored by poll() if -1
+        fds[2].events = POLLIN;
+        fds[2].revents = 0;
+        if (poll(fds, 3, -1) < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            perror("poll() line=" STR(__LINE__));
+            return err;
+        }
+        if (fds[1].revents) {
+            char c;
+            ssize_t ret = read(mWakeFds[0], &c, 1);
+            (void)ret;
+            printf("Got signal %d, stop accepting\n", (int)c);
+            return ECANCELED;
+        }
+        if (fds[2].revents) {
+            PiUpgradeFrame frame;
+            mManager.captureFrame(&frame.jpeg, &frame.sequence, &frame.timestamp_us, HANDOVER_FRAME_WAIT_SEC);
+            int status = mUpgrade.handOver(srv.accept_socket, frame);
+            if (status == 0) {
+                printf("Handed the listening socket over to a new process, stop accepting\n");
+                return ECANCELED;
+            }
+            fprintf(stderr, "Failed to hand over the listening socket err=%d, keep running\n", status);
+            continue;
+        }
+        if (fds[0].revents & (POLLERR | POLLNVAL)) {
+            return EBADF;
+        }
+
         socklen_t client_addr_len = sizeof(client.addr);
         client.socket = accept(srv.accept_socket, (sockaddr*)&client.addr, &client_addr_len);
         if (client.socket < 0) {
             int err = errno;
-            if (err == EINTR) {
+            if (err == EINTR || err == EAGAIN || err == EWOULDBLOCK || err == ECONNABORTED) {
                 continue; // Retry to call accept();
             }
             if (err != EBADF) perror("accept() line=" STR(__LINE__));
@@ -0,0 +1,105 @@
+#include "PiPacer.h"
+#include "PiLog.h"
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/prctl.h>
+
+#define NSEC_PER_SEC 1000000000LL
+
+// Timer slack of the pacing thread, the default of 50us is most of the jitter otherwise
+#define PACER_TIMER_SLACK_NSEC 1000UL
+
+namespace {
+
+int64_t monotonic_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+} // namespace
+
+PiPacer::PiPacer()
+        : mFps(1), mStart(0), mTick(0), mStop(false),
+          mTicks(0), mMissed(0), mLateMean(0), mLateM2(0), mLateMax(0) {
+    pthread_mutex_init(&mMutex, NULL);
+}
+
+PiPacer::~PiPacer() {
+    pthread_mutex_destroy(&mMutex);
+}
+
+void PiPacer::start(int fps) {
+    mFps = (fps > 0) ? fps : 1;
+    mStart = monotonic_ns();
+    mTick = 0;
+    prctl(PR_SET_TIMERSLACK, PACER_TIMER_SLACK_NSEC, 0, 0, 0);
+}
+
+/** Nsec of a deadline. mTick stays below mFps, so the product doesn't overflow. */
+int64_t PiPacer::deadline(int64_t tick) const {
+    return mStart + tick * NSEC_PER_SEC / mFps;
+}
+
+bool PiPacer::wait() {
+    const int64_t target = deadline(mTick + 1);
+    int64_t now;
+    for (;;) {
+        if (mStop) {
+            return false;
+        }
+        now = monotonic_ns();
+        if (now >= target) {
+            break;
+        }
+        const int64_t until = (target - now > STOP_CHECK_NSEC) ? now + STOP_CHECK_NSEC : target;
+        timespec ts;
+        ts.tv_sec = until / NSEC_PER_SEC;
+        ts.tv_nsec = until % NSEC_PER_SEC;
+        int status = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        if (status && status != EINTR) {
+            PI_LOG(PILOG_ERROR, status, "PiPacer: clock_nanosleep failed");
+            return false;
+        }
+    }
+    mTick++;
+
+    // Skip the deadlines which have passed, the next one is after 'now'.
+    const int64_t passed = (now - mStart) * mFps / NSEC_PER_SEC;
+    const uint64_t missed = (passed > mTick) ? passed - mTick : 0;
+    mTick += missed;
+    while (mTick >= mFps) {
+        mStart += NSEC_PER_SEC;
+        mTick -= mFps;
+    }
+
+    const int64_t late = now - target;
+    pthread_mutex_lock(&mMutex);
+    mTicks++;
+    mMissed += missed;
+    const double delta = late - mLateMean;
+    mLateMean += delta / mTicks;
+    mLateM2 += delta * (late - mLateMean);
+    if (late > mLateMax) {
+        mLateMax = late;
+    }
+    pthread_mutex_unlock(&mMutex);
+    return true;
+}
+
+void PiPacer::stop() {
+    mStop = true;
+}
+
+PiPacerStats PiPacer::stats() const {
+    PiPacerStats stats;
+    pthread_mutex_lock(&mMutex);
+    stats.ticks = mTicks;
+    stats.missed = mMissed;
+    stats.late_mean_ns = (int64_t)mLateMean;
+    stats.late_stddev_ns = (mTicks > 1) ? (int64_t)sqrt(mLateM2 / (mTicks - 1)) : 0;
+    stats.late_max_ns = mLateMax;
+    pthread_mutex_unlock(&mMutex);
+    return stats;
+}
@@ -0,0 +1,549 @@
+#include "PiRelaySource.h"
+#include "PiJpegScan.h"
+#include "PiThreads.h"
+#include "PiLog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+// Timeout of connecting to and receiving from the upstream
+#define RELAY_TIMEOUT_SEC 10
+
+// Reconnect after 0.5s, doubled up to 10s while the upstream fails
+#define BACKOFF_MIN_MSEC 500
+#define BACKOFF_MAX_MSEC 10000
+
+// Free space kept at the end of the frame while searching for the delimiter
+#define SCAN_READ_SIZE (64 * 1024)
+
+#define MAX_RESPONSE_HEADER_SIZE 4096
+
+namespace {
+
+/** Find the end of the headers ("\r\n\r\n"), return the offset after it or 0 if not found. */
+size_t find_headers_end(const char* data, size_t size) {
+    const void* p = memmem(data, size, "\r\n\r\n", 4);
+    return p ? (const char*)p - data + 4 : 0;
+}
+
+/** Find the value of the header 'name' (with ':') in the header lines, without copying */
+const char* find_header(const char* data, size_t size, const char* name, size_t* value_length) {
+    const size_t name_length = strlen(name);
+    const char* end = data + size;
+    const char* line = data;
+    while (line < end) {
+        const char* eol = (const char*)memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
+        }
+        if ((size_t)(eol - line) > name_length && !strncasecmp(line, name, name_length)) {
+            const char* value = line + name_length;
+            while (value < eol && (*value == ' ' || *value == '\t')) value++;
+            const char* value_end = eol;
+            while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ')) value_end--;
+            *value_length = value_end - value;
+            return value;
+        }
+        line = eol + 1;
+    }
+    return NULL;
+}
+
+} // namespace
+
+PiMultipartParser::PiMultipartParser()
+        : mState(STATE_HEADER), mHeaderLength(0), mLength(0), mScanned(0), mFrames(0), mInvalidFrames(0) {
+}
+
+int PiMultipartParser::reset(const char* boundary, size_t length) {
+    if (length == 0 || length > 70) { // RFC 2046
+        return EINVAL;
+    }
+    mDelimiter = "\r\n--";
+    mDelimiter.append(boundary, length);
+    mState = STATE_HEADER;
+    mHeaderLength = 0;
+    mFrame.resetOffset();
+    return 0;
+}
+
+uint8_t* PiMultipartParser::writePointer(size_t* available) {
+    switch (mState) {
+    case STATE_BODY:
+        // reserved by parseHeader()
+        *available = mLength - mFrame.offset;
+        return mFrame.values + mFrame.offset;
+    case STATE_SCAN:
+        if (mFrame.reserve(SCAN_READ_SIZE) != 0) {
+            *available = 0;
+            return NULL;
+        }
+        *available = mFrame.alloc_size - mFrame.offset;
+        return mFrame.values + mFrame.offset;
+    case STATE_HEADER:
+    default:
+        *available = MAX_HEADER_SIZE - mHeaderLength;
+        return (uint8_t*)mHeader + mHeaderLength;
+    }
+}
+
+int PiMultipartParser::commit(size_t size, PiCameraListener* listener) {
+    const uint8_t* rest;
+    size_t rest_length;
+    int status = parse(size, &rest, &rest_length, listener);
+    if (status || rest_length == 0) {
+        return status;
+    }
+
+    // The bytes after a header or a part begin the next one. They are copied once, and
+    // the parts which end within them leave the offset at the start of their rest.
+    if (mRest.alloc_size < rest_length && mRest.realloc(rest_length) != 0) {
+        return ENOMEM;
+    }
+    memcpy(mRest.values, rest, rest_length);
+    const size_t end = rest_length;
+    size_t pos = 0;
+    while (pos < end) {
+        size_t available;
+        uint8_t* p = writePointer(&available);
+        if (p == NULL) {
+            return ENOMEM;
+        } else if (available == 0) {
+            return EPROTO;
+        }
+        size_t n = (end - pos < available) ? end - pos : available;
+        memcpy(p, mRest.values + pos, n);
+        pos += n;
+        status = parse(n, &rest, &rest_length, listener);
+        if (status) {
+            return status;
+        }
+        pos -= rest_length;
+    }
+    return 0;
+}
+
+/**
+ * Parse 'size' bytes written at writePointer(). 'rest' is set to the bytes after the end
+ * of a header or a part, which belong to the next one, and are left in the parser buffers.
+ */
+int PiMultipartParser::parse(size_t size, const uint8_t** rest, size_t* rest_length, PiCameraListener* listener) {
+    *rest = NULL;
+    *rest_length = 0;
+    switch (mState) {
+    case STATE_BODY:
+        mFrame.offset += size;
+        if (mFrame.offset == mLength) {
+            publishFrame(listener);
+            mFrame.resetOffset();
+            mState = STATE_HEADER;
+            mHeaderLength = 0;
+        }
+        return 0;
+    case STATE_SCAN:
+        mFrame.offset += size;
+        return scanBody(rest, rest_length, listener);
+    case STATE_HEADER:
+    default:
+        mHeaderLength += size;
+        return parseHeader(rest, rest_length);
+    }
+}
+
+int PiMultipartParser::feed(const uint8_t* data, size_t size, PiCameraListener* listener) {
+    while (size > 0) {
+        size_t available;
+        uint8_t* p = writePointer(&available);
+        if (p == NULL) {
+            return ENOMEM;
+        } else if (available == 0) {
+            return EPROTO;
+        }
+        size_t n = (size < available) ? size : available;
+        memcpy(p, data, n);
+        data += n;
+        size -= n;
+        int status = commit(n, listener);
+        if (status) {
+            return status;
+        }
+    }
+    return 0;
+}
+
+/** Parse the delimiter and the headers of a part in mHeader */
+int PiMultipartParser::parseHeader(const uint8_t** rest, size_t* rest_length) {
+    // The CRLF before the first delimiter is optional, and the one after a Content-Length body is here.
+    size_t start = 0;
+    while (start < mHeaderLength && (mHeader[start] == '\r' || mHeader[start] == '\n')) {
+        start++;
+    }
+    const char* dash_boundary = mDelimiter.c_str() + 2; // "--" + boundary
+    const size_t dash_boundary_length = mDelimiter.length() - 2;
+    if (mHeaderLength - start < dash_boundary_length + 2) {
+        return (mHeaderLength == MAX_HEADER_SIZE) ? EPROTO : 0; // wait for more
+    }
+    if (memcmp(mHeader + start, dash_boundary, dash_boundary_length) != 0) {
+        return EPROTO;
+    }
+    const char* after = mHeader + start + dash_boundary_length;
+    if (after[0] == '-' && after[1] == '-') {
+        return ECONNRESET; // the closing delimiter
+    }
+
+    // Searched from the delimiter, the CRLFs before it aren't the end of the headers.
+    // A part without headers ends right after the delimiter line.
+    size_t end = find_headers_end(after, mHeader + mHeaderLength - after);
+    if (end == 0) {
+        return (mHeaderLength == MAX_HEADER_SIZE) ? EPROTO : 0;
+    }
+    end += after - mHeader;
+
+    size_t value_length = 0;
+    const char* value = find_header(after, mHeader + end - after, "Content-Length:", &value_length);
+    long length = -1;
+    if (value) {
+        char* value_end;
+        length = strtol(value, &value_end, 10);
+        if (value_end != value + value_length || length < 0 || (size_t)length > MAX_FRAME_SIZE) {
+            return EPROTO;
+        }
+    }
+
+    mFrame.resetOffset();
+    if (length >= 0) {
+        if (mFrame.reserve(length) != 0) {
+            return ENOMEM;
+        }
+        mLength = length;
+        mState = STATE_BODY;
+    } else {
+        mScanned = 0;
+        mState = STATE_SCAN;
+    }
+
+    // The rest of the read belongs to the body
+    *rest = (const uint8_t*)mHeader + end;
+    *rest_length = mHeaderLength - end;
+    mHeaderLength = 0;
+
+    if (mState == STATE_BODY && mLength == 0) {
+        // An empty part isn't a frame
+        mState = STATE_HEADER;
+    }
+    return 0;
+}
+
+/** Pass mFrame to 'listener' if it is a complete JPEG, without the bytes after its EOI */
+void PiMultipartParser::publishFrame(PiCameraListener* listener) {
+    PiJpegInfo info;
+    int status = PiJpegScan::validate(mFrame.values, mFrame.offset, &info);
+    if (status) {
+        PI_LOG(PILOG_WARN, status, "PiRelaySource: dropped an invalid frame of %lu bytes", (unsigned long)mFrame.offset);
+        mInvalidFrames++;
+        return;
+    }
+    mFrame.offset = info.length;
+    listener->onFrame(mFrame);
+    mFrames++;
+}
+
+/** Search mFrame for the next delimiter, for a part without Content-Length */
+int PiMultipartParser::scanBody(const uint8_t** rest, size_t* rest_length, PiCameraListener* listener) {
+    const size_t delimiter_length = mDelimiter.length();
+    size_t from = (mScanned >= delimiter_length) ? mScanned - delimiter_length + 1 : 0;
+    const void* found = memmem(mFrame.values + from, mFrame.offset - from, mDelimiter.data(), delimiter_length);
+    if (found == NULL) {
+        mScanned = mFrame.offset;
+        return (mFrame.offset > MAX_FRAME_SIZE) ? EPROTO : 0;
+    }
+
+    // The delimiter and the rest are kept in mFrame, which is only read by the listener.
+    size_t frame_length = (const uint8_t*)found - mFrame.values;
+    *rest = mFrame.values + frame_length;
+    *rest_length = mFrame.offset - frame_length;
+    mFrame.offset = frame_length;
+    if (frame_length > 0) {
+        publishFrame(listener);
+    }
+    mFrame.resetOffset();
+    mState = STATE_HEADER;
+    mHeaderLength = 0;
+    return 0;
+}
+
+PiRelaySource::PiRelaySource(const std::string& url, PiCameraListener* listener, int* status)
+        : mListener(listener), mStop(false), mSocket(-1), mFrames(0), mInvalidFrames(0), mConnects(0) {
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mCond, NULL);
+
+    *status = parseUrl(url, &mHost, &mPort, &mPath);
+    if (*status) {
+        fprintf(stderr, "Unsupported relay URL %s\n", url.c_str());
+        mThread = 0;
+        return;
+    }
+
+    *status = pthread_create(&mThread, NULL, run, this);
+    if (*status) {
+        fprintf(stderr, "Failed to create the relay thread status=%d\n", *status);
+        mThread = 0;
+    }
+}
+
+PiRelaySource::~PiRelaySource() {
+    pthread_mutex_lock(&mMutex);
+    mStop = true;
+    if (mSocket != -1) {
+        shutdown(mSocket, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&mCond);
+    pthread_mutex_unlock(&mMutex);
+
+    if (mThread) {
+        pthread_join(mThread, NULL);
+    }
+    pthread_cond_destroy(&mCond);
+    pthread_mutex_destroy(&mMutex);
+}
+
+PiCameraStats PiRelaySource::stats() const {
+    PiCameraStats stats;
+    stats.buffers = __atomic_load_n(&mFrames, __ATOMIC_RELAXED);
+    stats.invalid_frames = __atomic_load_n(&mInvalidFrames, __ATOMIC_RELAXED);
+    return stats;
+}
+
+int PiRelaySource::parseUrl(const std::string& url, std::string* host, std::string* port, std::string* path) {
+    const std::string scheme = "http://";
+    if (url.compare(0, scheme.length(), scheme) != 0) {
+        return EINVAL;
+    }
+    std::string::size_type begin = scheme.length();
+    std::string::size_type slash = url.find('/', begin);
+    std::string authority = url.substr(begin, slash == std::string::npos ? std::string::npos : slash - begin);
+    *path = (slash == std::string::npos) ? "/" : url.substr(slash);
+
+    std::string::size_type colon = authority.rfind(':');
+    if (colon == std::string::npos) {
+        *host = authority;
+        *port = "80";
+    } else {
+        *host = authority.substr(0, colon);
+        *port = authority.substr(colon + 1);
+        if (port->empty() || port->find_first_not_of("0123456789") != std::string::npos) {
+            return EINVAL;
+        }
+    }
+    return host->empty() ? EINVAL : 0;
+}
+
+void* PiRelaySource::run(void* arg) {
+    PiThreads::enter(THREAD_CAPTURE, "relay");
+    static_cast<PiRelaySource*>(arg)->loop();
+    PiThreads::leave();
+    return NULL;
+}
+
+void PiRelaySource::loop() {
+    int backoff = BACKOFF_MIN_MSEC;
+    PiMultipartParser parser;
+
+    for (;;) {
+        int fd = connectUpstream();
+        if (fd >= 0) {
+            uint64_t frames = parser.frames();
+            int status = readResponse(fd, &parser);
+            if (parser.frames() > frames) {
+                backoff = BACKOFF_MIN_MSEC; // it has worked
+            }
+
+            pthread_mutex_lock(&mMutex);
+            mSocket = -1;
+            pthread_mutex_unlock(&mMutex);
+            close(fd);
+
+            if (status && status != ECONNRESET) {
+                PI_LOG(PILOG_WARN, status, "PiRelaySource: lost the upstream, reconnect in %ldms", (long)backoff);
+            }
+        }
+
+        if (!sleepBackoff(backoff)) {
+            break; // stopped
+        }
+        backoff = (backoff * 2 > BACKOFF_MAX_MSEC) ? BACKOFF_MAX_MSEC : backoff * 2;
+    }
+}
+
+/** Connect, and send the request. Return the socket, or -1. */
+int PiRelaySource::connectUpstream() {
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = NULL;
+    int status = getaddrinfo(mHost.c_str(), mPort.c_str(), &hints, &result);
+    if (status) {
+        PI_LOG(PILOG_WARN, status, "PiRelaySource: getaddrinfo failed");
+        return -1;
+    }
+
+    int fd = -1;
+    for (addrinfo* ai = result; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        // Also the timeout of connect()
+        timeval t;
+        t.tv_sec = RELAY_TIMEOUT_SEC;
+        t.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &t, sizeof(t));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
+
+        pthread_mutex_lock(&mMutex);
+        bool stop = mStop;
+        if (!stop) mSocket = fd;
+        pthread_mutex_unlock(&mMutex);
+
+        if (stop || connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            pthread_mutex_lock(&mMutex);
+            mSocket = -1;
+            pthread_mutex_unlock(&mMutex);
+            close(fd);
+            fd = -1;
+            if (stop) break;
+        }
+    }
+    freeaddrinfo(result);
+    if (fd < 0) {
+        PI_LOG(PILOG_WARN, errno, "PiRelaySource: couldn't connect to the upstream");
+        return -1;
+    }
+
+    std::string request = "GET " + mPath + " HTTP/1.0\r\nHost: " + mHost + ":" + mPort +
+            "\r\nUser-Agent: pimjpg_srv-relay\r\n\r\n";
+    if (send(fd, request.c_str(), request.length(), MSG_NOSIGNAL) != (ssize_t)request.length()) {
+        PI_LOG(PILOG_WARN, errno, "PiRelaySource: failed to send the request");
+        pthread_mutex_lock(&mMutex);
+        mSocket = -1;
+        pthread_mutex_unlock(&mMutex);
+        close(fd);
+        return -1;
+    }
+    __sync_add_and_fetch(&mConnects, 1);
+    return fd;
+}
+
+/** Read the response header, then the parts until the stream ends. */
+int PiRelaySource::readResponse(int fd, PiMultipartParser* parser) {
+    char header[MAX_RESPONSE_HEADER_SIZE];
+    size_t length = 0;
+    size_t end = 0;
+    while (end == 0) {
+        if (length == sizeof(header)) {
+            return EPROTO;
+        }
+        ssize_t ret = recv(fd, header + length, sizeof(header) - length, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        } else if (ret == 0) {
+            return ECONNRESET;
+        }
+        length += ret;
+        end = find_headers_end(header, length);
+    }
+
+    // ex) HTTP/1.0 200 OK
+    if (end < 12 || strncmp(header, "HTTP/1.", 7) != 0 || atoi(header + 9) != 200) {
+        PI_LOG(PILOG_WARN, EPROTO, "PiRelaySource: the upstream responded %ld", (long)(end >= 12 ? atoi(header + 9) : 0));
+        return EPROTO;
+    }
+
+    size_t type_length = 0;
+    const char* type = find_header(header, end, "Content-Type:", &type_length);
+    const char* boundary = NULL;
+    size_t boundary_length = 0;
+    if (type) {
+        const char* type_end = type + type_length;
+        for (const char* p = type; p + 9 <= type_end; p++) {
+            if (!strncasecmp(p, "boundary=", 9)) {
+                boundary = p + 9;
+                const char* b_end = boundary;
+                while (b_end < type_end && *b_end != ';') b_end++;
+                if (b_end > boundary && *boundary == '"') {
+                    boundary++;
+                    if (b_end[-1] == '"') b_end--;
+                }
+                boundary_length = (b_end > boundary) ? b_end - boundary : 0;
+                break;
+            }
+        }
+    }
+    if (boundary == NULL || parser->reset(boundary, boundary_length) != 0) {
+        PI_LOG(PILOG_WARN, EPROTO, "PiRelaySource: the upstream isn't multipart/x-mixed-replace");
+        return EPROTO;
+    }
+
+    // The bytes received with the header may already hold frames, so count from before them.
+    uint64_t published = parser->frames();
+    uint64_t invalid = parser->invalidFrames();
+    int status = parser->feed((const uint8_t*)header + end, length - end, mListener);
+    for (;;) {
+        if (parser->frames() != published) {
+            __sync_add_and_fetch(&mFrames, parser->frames() - published);
+            published = parser->frames();
+        }
+        if (parser->invalidFrames() != invalid) {
+            __sync_add_and_fetch(&mInvalidFrames, parser->invalidFrames() - invalid);
+            invalid = parser->invalidFrames();
+        }
+        if (status != 0) {
+            break;
+        }
+
+        size_t available;
+        uint8_t* p = parser->writePointer(&available);
+        if (p == NULL) {
+            return ENOMEM;
+        }
+        ssize_t ret = recv(fd, p, available, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        } else if (ret == 0) {
+            return ECONNRESET;
+        }
+        status = parser->commit(ret, mListener);
+    }
+    return status;
+}
+
+/** Wait before reconnecting. Return false if the source is being stopped. */
+bool PiRelaySource::sleepBackoff(int msec) {
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += msec / 1000;
+    deadline.tv_nsec += (msec % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&mMutex);
+    while (!mStop) {
+        if (pthread_cond_timedwait(&mCond, &mMutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    bool running = !mStop;
+    pthread_mutex_unlock(&mMutex);
+    return running;
+}
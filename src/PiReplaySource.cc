@@ -0,0 +1,111 @@
+#include "PiReplaySource.h"
+#include "PiJpegScan.h"
+#include "PiThreads.h"
+#include "PiException.h"
+#include <stdio.h>
+#include <errno.h>
+
+// Larger files are refused, the frames are kept in memory.
+#define MAX_REPLAY_FILE_SIZE (256L * 1024 * 1024)
+
+PiReplaySource::PiReplaySource(const std::string& path, int fps, PiCameraListener* listener, int* status)
+        : mListener(listener), mFps(fps), mThread(0), mPublished(0) {
+    *status = load(path, &mFrames);
+    if (*status) {
+        fprintf(stderr, "Failed to load the frames of %s status=%d\n", path.c_str(), *status);
+        return;
+    }
+
+    *status = pthread_create(&mThread, NULL, run, this);
+    if (*status) {
+        fprintf(stderr, "Failed to create the replay thread status=%d\n", *status);
+        mThread = 0;
+    }
+}
+
+PiReplaySource::~PiReplaySource() {
+    mPacer.stop();
+    if (mThread) {
+        pthread_join(mThread, NULL);
+    }
+    for (size_t i = 0; i < mFrames.size(); i++) {
+        delete mFrames[i];
+    }
+}
+
+PiCameraStats PiReplaySource::stats() const {
+    PiCameraStats stats;
+    stats.buffers = __atomic_load_n(&mPublished, __ATOMIC_RELAXED);
+    stats.pacing = mPacer.stats();
+    return stats;
+}
+
+int PiReplaySource::load(const std::string& path, std::vector<DinamicBuffer*>* frames) {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == NULL) {
+        return errno;
+    }
+    int status = 0;
+    long size = -1;
+    if (fseek(fp, 0, SEEK_END) == 0) {
+        size = ftell(fp);
+        rewind(fp);
+    }
+    if (size < 0 || size > MAX_REPLAY_FILE_SIZE) {
+        fclose(fp);
+        return size < 0 ? EIO : EFBIG;
+    }
+
+    StaticBuffer data;
+    if (data.realloc(size + 1)) {
+        fclose(fp);
+        return ENOMEM;
+    }
+    if (fread(data.values, 1, size, fp) != (size_t)size) {
+        status = EIO;
+    }
+    fclose(fp);
+
+    size_t pos = 0;
+    while (status == 0) {
+        size_t begin, end;
+        if (PiJpegScan::findFrame(data.values + pos, size - pos, &begin, &end, NULL)) {
+            break; // ENOENT at the end, ENODATA for a truncated last frame
+        }
+        DinamicBuffer* frame = NULL;
+        TRAP1(catched, msg, frame = new DinamicBuffer(););
+        if (catched || frame->append(data.values + pos + begin, end - begin)) {
+            delete frame;
+            status = ENOMEM;
+            break;
+        }
+        TRAP2(catched, msg, frames->push_back(frame););
+        if (catched) {
+            delete frame;
+            status = ENOMEM;
+            break;
+        }
+        pos += end;
+    }
+    if (status == 0 && frames->empty()) {
+        status = ENOENT;
+    }
+    return status;
+}
+
+void* PiReplaySource::run(void* arg) {
+    PiThreads::enter(THREAD_CAPTURE, "replay");
+    static_cast<PiReplaySource*>(arg)->loop();
+    PiThreads::leave();
+    return NULL;
+}
+
+void PiReplaySource::loop() {
+    mPacer.start(mFps);
+    size_t next = 0;
+    while (mPacer.wait()) {
+        mListener->onFrame(*mFrames[next]);
+        __atomic_add_fetch(&mPublished, 1, __ATOMIC_RELAXED);
+        next = (next + 1) % mFrames.size();
+    }
+}
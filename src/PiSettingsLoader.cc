@@ -0,0 +1,673 @@
+#include "PiSettingsLoader.h"
+#include "PiRelaySource.h"
+#include "PiCamera.h"
+#include "PiException.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+
+#define MAX_LINE_LENGTH 1024
+
+namespace {
+
+enum OptionId {
+    OptConfig,
+    OptHelp,
+    OptBind,
+    OptPort,
+    OptMaxConnections,
+    OptSendTimeout,
+    OptRecvTimeout,
+    OptDrainTimeout,
+    OptServerName,
+    OptSendBackend,
+    OptFanoutWorkers,
+    OptZeroCopyThreshold,
+    OptMemoryBudget,
+    OptCaptureCpus,
+    OptCapturePriority,
+    OptDispatchCpus,
+    OptDispatchPriority,
+    OptNetworkCpus,
+    OptLogSink,
+    OptLogFile,
+    OptTrace,
+    OptTraceFile,
+    OptUpgradeSocket,
+    OptExportSocket,
+    OptExportSlots,
+    OptExportRaw,
+    OptWidth,
+    OptHeight,
+    OptFps,
+    OptQuality,
+    OptRotation,
+    OptThumbnailQuality,
+    OptWriteTimeout,
+    OptPreview,
+    OptRawDecimation,
+    OptRelay,
+    OptReplay,
+    OptSource,
+    OptVideoBuffers,
+    OptEncoderBuffers,
+    OptEncoderBuffersMax
+};
+
+// Same layout as the cmdline_commands of RaspiCamControl.c
+struct Option {
+    int id;
+    const char* command;
+    const char* abbrev;
+    const char* help;
+    int num_parameters;
+};
+
+const Option options[] = {
+    { OptConfig,           "-config",            "c",   "Load settings from a config file", 1 },
+    { OptHelp,             "-help",              "h",   "Display this help", 0 },
+    { OptBind,             "-bind",              "b",   "IPv4 address to listen on (def: 0.0.0.0)", 1 },
+    { OptPort,             "-port",              "p",   "Port number (def: 8080)", 1 },
+    { OptMaxConnections,   "-max-connections",   "mc",  "Backlog of the listening socket (def: 5)", 1 },
+    { OptSendTimeout,      "-send-timeout",      "sto", "Timeout of sending to a client in msec (def: 10000)", 1 },
+    { OptRecvTimeout,      "-recv-timeout",      "rto", "Timeout of receiving from a client in msec (def: 10000)", 1 },
+    { OptDrainTimeout,     "-drain-timeout",     "dto", "Time for the clients to finish their streams at shutdown in msec (def: 5000)", 1 },
+    { OptServerName,       "-server-name",       "sn",  "Value of the Server header", 1 },
+    { OptSendBackend,      "-send-backend",      "sb",  "How frames are sent: thread, uring or fanout (def: thread)", 1 },
+    { OptFanoutWorkers,    "-fanout-workers",    "fw",  "Worker threads of the fanout backend 1-64 (def: 2)", 1 },
+    { OptZeroCopyThreshold, "-zerocopy-threshold", "zc", "Send frames from this size in bytes with MSG_ZEROCOPY (def: 0 = off)", 1 },
+    { OptMemoryBudget,     "-memory-budget",     "mb",  "Memory of the connections in MB, over which streams are degraded or refused (def: 0 = unlimited)", 1 },
+    { OptCaptureCpus,      "-capture-cpus",      "cc",  "Pin the capture thread to cpus, ex) 3 or 2-3", 1 },
+    { OptCapturePriority,  "-capture-priority",  "cp",  "SCHED_FIFO priority of the capture thread 1-99 (def: 0 = off)", 1 },
+    { OptDispatchCpus,     "-dispatch-cpus",     "dc",  "Pin the publisher and thumbnail threads to cpus", 1 },
+    { OptDispatchPriority, "-dispatch-priority", "dp",  "SCHED_FIFO priority of the publisher and thumbnail threads (def: 0 = off)", 1 },
+    { OptNetworkCpus,      "-network-cpus",      "nc",  "Pin the accept, client and send threads to cpus", 1 },
+    { OptLogSink,          "-log-sink",          "ls",  "Where the log goes: stderr, file or syslog (def: stderr)", 1 },
+    { OptLogFile,          "-log-file",          "lf",  "Append the log to a file, implies -log-sink file", 1 },
+    { OptTrace,            "-trace",             "tr",  "Record trace spans from the start 0/1 (def: 0), see /bin-cgi/trace", 1 },
+    { OptTraceFile,        "-trace-file",        "tf",  "Where SIGUSR2 writes the trace (def: /tmp/pimjpg_srv.trace.json)", 1 },
+    { OptUpgradeSocket,    "-upgrade-socket",    "us",  "Unix socket to take over the running server from, and to hand over to the next", 1 },
+    { OptExportSocket,     "-export-socket",     "xs",  "Unix socket which hands the shared memory of the frames to local processes", 1 },
+    { OptExportSlots,      "-export-slots",      "xn",  "Frames kept in the shared memory 2-64 (def: 4)", 1 },
+    { OptExportRaw,        "-export-raw",        "xr",  "Also export the I420 frames of -raw-decimation 0/1 (def: 0)", 1 },
+    { OptWidth,            "-width",             "w",   "Frame width (def: 640)", 1 },
+    { OptHeight,           "-height",            "ht",  "Frame height (def: 480)", 1 },
+    { OptFps,              "-fps",               "fps", "Frames per second of the camera (def: 15)", 1 },
+    { OptQuality,          "-quality",           "q",   "JPEG quality 1-100 (def: 85)", 1 },
+    { OptRotation,         "-rotation",          "rot", "Image rotation 0-359 (def: 180)", 1 },
+    { OptThumbnailQuality, "-thumbnail-quality", "tq",  "JPEG quality of ?scale=N thumbnails 1-100 (def: 70)", 1 },
+    { OptWriteTimeout,     "-write-timeout",     "wt",  "Timeout of writing a frame in msec (def: 100)", 1 },
+    { OptPreview,          "-preview",           "pv",  "Preview sink: null, none or renderer (def: null)", 1 },
+    { OptRawDecimation,    "-raw-decimation",    "rd",  "Tap every Nth I420 frame before the encoder 0-1000 (def: 0 = off)", 1 },
+    { OptRelay,            "-relay",             "rl",  "Re-serve the MJPEG stream of http://host[:port]/path instead of the camera", 1 },
+    { OptReplay,           "-replay",            "rp",  "Replay the JPEG frames of a file (a JPEG or an MJPEG dump) at -fps instead of the camera", 1 },
+    { OptSource,           "-source",            "src", "Add a source at /cam/<name>/, name=<camera number>, name=<relay URL> or name=<file to replay>", 1 },
+    { OptVideoBuffers,     "-video-buffers",     "vb",  "Buffers of the camera video port 3-16 (def: 3)", 1 },
+    { OptEncoderBuffers,   "-encoder-buffers",   "eb",  "Buffers of the JPEG encoder output 1-16 (def: 0 = recommended)", 1 },
+    { OptEncoderBuffersMax,"-encoder-buffers-max","ebm","Grow the encoder buffers up to this when it starves (def: 0 = off)", 1 },
+};
+const int num_options = sizeof(options) / sizeof(options[0]);
+
+const Option* findOption(const char* arg) {
+    for (int i = 0; i < num_options; i++) {
+        if (!strcmp(arg, options[i].command) || !strcmp(arg, options[i].abbrev)) {
+            return &options[i];
+        }
+    }
+    return NULL;
+}
+
+int toLong(const char* str, long min, long max, long* value) {
+    char* end;
+    errno = 0;
+    long v = strtol(str, &end, 10);
+    if (errno || end == str || *end != '\0' || v < min || v > max) {
+        return EINVAL;
+    }
+    *value = v;
+    return 0;
+}
+
+int toBool(const char* str, bool* value) {
+    if (!strcmp(str, "1") || !strcasecmp(str, "true") || !strcasecmp(str, "yes") || !strcasecmp(str, "on")) {
+        *value = true;
+    } else if (!strcmp(str, "0") || !strcasecmp(str, "false") || !strcasecmp(str, "no") || !strcasecmp(str, "off")) {
+        *value = false;
+    } else {
+        return EINVAL;
+    }
+    return 0;
+}
+
+void toTimeval(long msec, timeval& tv) {
+    tv.tv_sec = msec / 1000;
+    tv.tv_usec = (msec % 1000) * 1000;
+}
+
+std::string trim(const std::string& s) {
+    const char* spaces = " \t\r\n";
+    std::string::size_type begin = s.find_first_not_of(spaces);
+    if (begin == std::string::npos) {
+        return "";
+    }
+    std::string::size_type end = s.find_last_not_of(spaces);
+    return s.substr(begin, end - begin + 1);
+}
+
+} // namespace
+
+PiSettingsLoader::PiSettingsLoader(PiServerSettings& settings) : mSettings(settings) {
+}
+
+/**
+ * Apply one option. 'name' is an argument without its first '-', ex) "p" or "-port".
+ * 'used' returns the number of consumed arguments including 'name'.
+ */
+int PiSettingsLoader::set(const char* name, const char* value, int* used) {
+    *used = 0;
+
+    const Option* opt = findOption(name);
+    if (opt == NULL) {
+        // Not a server option, try the camera parameters.
+        *used = raspicamcontrol_parse_cmdline(&*mSettings.cam_settings.camera_params, name, value);
+        if (*used == 0) {
+            fprintf(stderr, "Unknown option or invalid value: -%s %s\n", name, value ? value : "");
+            return EINVAL;
+        }
+        return 0;
+    }
+
+    if (opt->num_parameters > 0 && value == NULL) {
+        fprintf(stderr, "Option -%s needs a value\n", name);
+        return EINVAL;
+    }
+
+    PiCamSettings& cam = mSettings.cam_settings;
+    long v = 0;
+    int status = 0;
+    switch (opt->id) {
+    case OptConfig:
+        status = loadFile(value);
+        break;
+    case OptHelp:
+        break;
+    case OptBind: {
+        in_addr addr;
+        if (inet_pton(AF_INET, value, &addr) != 1) {
+            status = EINVAL;
+        } else {
+            mSettings.ip_addr = ntohl(addr.s_addr);
+        }
+        break;
+    }
+    case OptPort:
+        if ((status = toLong(value, 1, 65535, &v)) == 0) mSettings.port_number = v;
+        break;
+    case OptMaxConnections:
+        if ((status = toLong(value, 1, 4096, &v)) == 0) mSettings.max_connections = v;
+        break;
+    case OptSendTimeout:
+        if ((status = toLong(value, 1, 3600000, &v)) == 0) toTimeval(v, mSettings.timeout_sending);
+        break;
+    case OptRecvTimeout:
+        if ((status = toLong(value, 1, 3600000, &v)) == 0) toTimeval(v, mSettings.timeout_recving);
+        break;
+    case OptDrainTimeout:
+        if ((status = toLong(value, 0, 3600000, &v)) == 0) toTimeval(v, mSettings.timeout_draining);
+        break;
+    case OptServerName:
+        if (*value == '\0' || strpbrk(value, "\r\n")) {
+            status = EINVAL;
+        } else {
+            mSettings.server_name = value;
+        }
+        break;
+    case OptSendBackend:
+        if (!strcmp(value, "thread")) {
+            mSettings.send_backend = SEND_BACKEND_THREAD;
+        } else if (!strcmp(value, "uring")) {
+            mSettings.send_backend = SEND_BACKEND_URING;
+        } else if (!strcmp(value, "fanout")) {
+            mSettings.send_backend = SEND_BACKEND_FANOUT;
+        } else {
+            status = EINVAL;
+        }
+        break;
+    case OptFanoutWorkers:
+        if ((status = toLong(value, 1, 64, &v)) == 0) mSettings.fanout_workers = v;
+        break;
+    case OptZeroCopyThreshold:
+        if ((status = toLong(value, 0, 64 * 1024 * 1024, &v)) == 0) mSettings.zerocopy_threshold = v;
+        break;
+    case OptMemoryBudget:
+        if ((status = toLong(value, 0, 4096, &v)) == 0) mSettings.memory_budget = (size_t)v * 1024 * 1024;
+        break;
+    case OptCaptureCpus:
+    case OptDispatchCpus:
+    case OptNetworkCpus: {
+        PiThreadRole role = (opt->id == OptCaptureCpus) ? THREAD_CAPTURE :
+                (opt->id == OptDispatchCpus) ? THREAD_DISPATCH : THREAD_NETWORK;
+        cpu_set_t set;
+        if ((status = PiThreads::parseCpuList(value, &set)) == 0) mSettings.thread_policies[role].cpus = value;
+        break;
+    }
+    case OptCapturePriority:
+    case OptDispatchPriority: {
+        PiThreadRole role = (opt->id == OptCapturePriority) ? THREAD_CAPTURE : THREAD_DISPATCH;
+        if ((status = toLong(value, 0, 99, &v)) == 0) mSettings.thread_policies[role].rt_priority = v;
+        break;
+    }
+    case OptLogSink:
+        if (!strcmp(value, "stderr")) {
+            mSettings.log_sink = LOG_SINK_STDERR;
+        } else if (!strcmp(value, "file")) {
+            mSettings.log_sink = LOG_SINK_FILE;
+        } else if (!strcmp(value, "syslog")) {
+            mSettings.log_sink = LOG_SINK_SYSLOG;
+        } else {
+            status = EINVAL;
+        }
+        break;
+    case OptLogFile:
+        if (*value == '\0') {
+            status = EINVAL;
+        } else {
+            mSettings.log_file = value;
+            mSettings.log_sink = LOG_SINK_FILE;
+        }
+        break;
+    case OptTrace:
+        status = toBool(value, &mSettings.trace);
+        break;
+    case OptTraceFile:
+        if (*value == '\0') {
+            status = EINVAL;
+        } else {
+            mSettings.trace_file = value;
+        }
+        break;
+    case OptUpgradeSocket:
+        if (*value == '\0' || strlen(value) >= sizeof(((sockaddr_un*)0)->sun_path)) {
+            status = EINVAL;
+        } else {
+            mSettings.upgrade_socket = value;
+        }
+        break;
+    case OptExportSocket:
+        if (*value == '\0' || strlen(value) >= sizeof(((sockaddr_un*)0)->sun_path)) {
+            status = EINVAL;
+        } else {
+            mSettings.export_socket = value;
+        }
+        break;
+    case OptExportSlots:
+        if ((status = toLong(value, 2, 64, &v)) == 0) mSettings.export_slots = v;
+        break;
+    case OptExportRaw:
+        status = toBool(value, &mSettings.export_raw);
+        break;
+    case OptWidth:
+        if ((status = toLong(value, 32, 2592, &v)) == 0) cam.width = v;
+        break;
+    case OptHeight:
+        if ((status = toLong(value, 16, 1944, &v)) == 0) cam.height = v;
+        break;
+    case OptFps:
+        if ((status = toLong(value, 1, 90, &v)) == 0) cam.fps = v;
+        break;
+    case OptQuality:
+        if ((status = toLong(value, 1, 100, &v)) == 0) cam.quality = v;
+        break;
+    case OptRotation:
+        if ((status = toLong(value, 0, 359, &v)) == 0) cam.rotation = v;
+        break;
+    case OptThumbnailQuality:
+        if ((status = toLong(value, 1, 100, &v)) == 0) cam.thumbnail_quality = v;
+        break;
+    case OptWriteTimeout:
+        if ((status = toLong(value, 1, 10000, &v)) == 0) cam.timeout_writing_frame = v * 1000000L;
+        break;
+    case OptVideoBuffers:
+        if ((status = toLong(value, 3, 16, &v)) == 0) cam.video_buffers = v;
+        break;
+    case OptEncoderBuffers:
+        if ((status = toLong(value, 0, 16, &v)) == 0) cam.encoder_buffers = v;
+        break;
+    case OptEncoderBuffersMax:
+        if ((status = toLong(value, 0, 32, &v)) == 0) cam.encoder_buffers_max = v;
+        break;
+    case OptPreview:
+        if (!strcmp(value, "null")) {
+            cam.preview_mode = PREVIEW_NULL_SINK;
+        } else if (!strcmp(value, "none")) {
+            cam.preview_mode = PREVIEW_NONE;
+        } else if (!strcmp(value, "renderer")) {
+            cam.preview_mode = PREVIEW_RENDERER;
+        } else {
+            status = EINVAL;
+        }
+        break;
+    case OptRawDecimation:
+        if ((status = toLong(value, 0, 1000, &v)) == 0) cam.raw_decimation = v;
+        break;
+    case OptSource: {
+        // ex) front=0, lobby=http://10.0.0.5:8080/bin-cgi/stream, test=/var/lib/pimjpg/lobby.mjpg
+        const char* eq = strchr(value, '=');
+        PiSourceSettings source;
+        if (eq == NULL || eq == value) {
+            status = EINVAL;
+            break;
+        }
+        source.name.assign(value, eq - value);
+        if (source.name.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-")
+                != std::string::npos) {
+            status = EINVAL;
+            break;
+        }
+        for (size_t i = 0; i < mSettings.sources.size(); i++) {
+            if (mSettings.sources[i].name == source.name) status = EEXIST;
+        }
+        if (status) break;
+
+        if (!strncmp(eq + 1, "http://", 7)) {
+            std::string host, port, path;
+            if ((status = PiRelaySource::parseUrl(eq + 1, &host, &port, &path)) == 0) {
+                source.cam_settings.relay_url = eq + 1;
+            }
+        } else if (eq[1] == '/' || eq[1] == '.') {
+            source.cam_settings.replay_path = eq + 1;
+        } else if ((status = toLong(eq + 1, 0, 15, &v)) == 0) {
+            source.cam_settings.camera_num = v;
+        }
+        if (status == 0) {
+            TRAP1(catched, msg, mSettings.sources.push_back(source););
+            if (catched) status = ENOMEM;
+        }
+        break;
+    }
+    case OptRelay: {
+        std::string host, port, path;
+        status = PiRelaySource::parseUrl(value, &host, &port, &path);
+        if (status == 0) cam.relay_url = value;
+        break;
+    }
+    case OptReplay:
+        if (*value == '\0') {
+            status = EINVAL;
+        } else {
+            cam.replay_path = value;
+        }
+        break;
+    default:
+        status = EINVAL;
+        break;
+    }
+
+    if (status) {
+        fprintf(stderr, "Invalid value for -%s: %s\n", name, value);
+        return status;
+    }
+    *used = 1 + opt->num_parameters;
+    return 0;
+}
+
+int PiSettingsLoader::parseArgs(int argc, char** argv) {
+    int status;
+
+    // The config file is the base, wherever it is on the command line.
+    for (int i = 1; i < argc; i++) {
+        const Option* opt = (argv[i][0] == '-') ? findOption(argv[i] + 1) : NULL;
+        if (opt && opt->id == OptHelp) {
+            displayHelp(argv[0]);
+            return HELP_REQUESTED;
+        }
+        if (opt && opt->id == OptConfig) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Option %s needs a value\n", argv[i]);
+                return EINVAL;
+            }
+            if ((status = loadFile(argv[++i])) != 0) {
+                return status;
+            }
+        }
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || argv[i][1] == '\0') {
+            fprintf(stderr, "Invalid argument: %s\n", argv[i]);
+            return EINVAL;
+        }
+
+        const Option* opt = findOption(argv[i] + 1);
+        if (opt && opt->id == OptConfig) {
+            i++; // already loaded
+            continue;
+        }
+
+        // A value never starts with '-' except negative numbers, ex) -ev -3
+        const char* value = NULL;
+        if (i + 1 < argc && (argv[i + 1][0] != '-' || (argv[i + 1][1] >= '0' && argv[i + 1][1] <= '9'))) {
+            value = argv[i + 1];
+        }
+
+        int used = 0;
+        if ((status = set(argv[i] + 1, value, &used)) != 0) {
+            return status;
+        }
+        i += used - 1;
+    }
+
+    return validate();
+}
+
+int PiSettingsLoader::loadFile(const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open the config file %s errno=%d\n", path, errno);
+        return errno;
+    }
+
+    int status = 0;
+    int line_number = 0;
+    char line[MAX_LINE_LENGTH];
+    while (status == 0 && fgets(line, sizeof(line), fp)) {
+        line_number++;
+
+        std::string s(line);
+        std::string::size_type comment = s.find('#');
+        if (comment != std::string::npos) {
+            s.erase(comment);
+        }
+        s = trim(s);
+        if (s.empty()) {
+            continue;
+        }
+
+        std::string::size_type eq = s.find('=');
+        if (eq == std::string::npos) {
+            fprintf(stderr, "%s:%d: expected \"name = value\"\n", path, line_number);
+            status = EINVAL;
+            break;
+        }
+
+        if ((status = setFromFile(trim(s.substr(0, eq)), trim(s.substr(eq + 1)))) != 0) {
+            fprintf(stderr, "%s:%d: invalid setting\n", path, line_number);
+        }
+    }
+
+    fclose(fp);
+    return status;
+}
+
+/** Apply a "name = value" line of a config file */
+int PiSettingsLoader::setFromFile(const std::string& name, const std::string& value) {
+    // Same names as the long options, without the leading dashes.
+    std::string arg = "-" + name;
+
+    const Option* opt = findOption(arg.c_str());
+    if (opt && (opt->id == OptConfig || opt->id == OptHelp)) {
+        return EINVAL;
+    }
+
+    // Camera flags (ex. vstab, hflip) take a boolean in a file.
+    RASPICAM_CAMERA_PARAMETERS scratch = *mSettings.cam_settings.camera_params;
+    if (opt == NULL && raspicamcontrol_parse_cmdline(&scratch, arg.c_str(), NULL) == 1) {
+        bool enabled = false;
+        if (toBool(value.c_str(), &enabled) != 0) {
+            fprintf(stderr, "%s takes 1 or 0\n", name.c_str());
+            return EINVAL;
+        }
+        if (enabled) {
+            *mSettings.cam_settings.camera_params = scratch;
+        }
+        return 0;
+    }
+
+    int used = 0;
+    return set(arg.c_str(), value.c_str(), &used);
+}
+
+int PiSettingsLoader::validate() const {
+    const PiCamSettings& cam = mSettings.cam_settings;
+
+    // Sensor modes of the camera: 1080p up to 30 fps, 720p up to 49 fps, VGA up to 90 fps.
+    int max_fps = 90;
+    if (cam.width > 1920 || cam.height > 1080) {
+        max_fps = 15;
+    } else if (cam.width > 1296 || cam.height > 730) {
+        max_fps = 30;
+    } else if (cam.width > 640 || cam.height > 480) {
+        max_fps = 49;
+    }
+    if (cam.fps > max_fps) {
+        fprintf(stderr, "%dx%d supports up to %d fps: fps=%d\n", cam.width, cam.height, max_fps, cam.fps);
+        return EINVAL;
+    }
+
+    if (cam.camera_params->shutter_speed > 0 && cam.camera_params->shutter_speed > 1000000 / cam.fps) {
+        fprintf(stderr, "shutter %dus is longer than the frame period of %d fps\n",
+                cam.camera_params->shutter_speed, cam.fps);
+        return EINVAL;
+    }
+
+    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (int i = 0; i < NUM_THREAD_ROLES; i++) {
+        const PiThreadPolicy& policy = mSettings.thread_policies[i];
+        cpu_set_t set;
+        if (policy.cpus.empty() || PiThreads::parseCpuList(policy.cpus.c_str(), &set) != 0) {
+            continue;
+        }
+        for (int cpu = num_cpus; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                fprintf(stderr, "cpu %d of %s threads doesn't exist, %ld cpus\n",
+                        cpu, PiThreads::roleName((PiThreadRole)i), num_cpus);
+                return EINVAL;
+            }
+        }
+    }
+
+    if (mSettings.log_sink == LOG_SINK_FILE && mSettings.log_file.empty()) {
+        fprintf(stderr, "-log-sink file needs -log-file\n");
+        return EINVAL;
+    }
+
+    if (!cam.relay_url.empty() && !cam.replay_path.empty()) {
+        fprintf(stderr, "-relay and -replay are exclusive\n");
+        return EINVAL;
+    }
+
+    if (mSettings.export_raw && (mSettings.export_socket.empty() || cam.raw_decimation == 0)) {
+        fprintf(stderr, "-export-raw needs -export-socket and -raw-decimation\n");
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+void PiSettingsLoader::dump() const {
+    const PiCamSettings& cam = mSettings.cam_settings;
+    in_addr addr;
+    addr.s_addr = htonl(mSettings.ip_addr);
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+
+    fprintf(stderr, "Server %s:%u, max connections %u, send backend %s, timeout send %ldms recv %ldms drain %ldms\n",
+            ip, mSettings.port_number, mSettings.max_connections,
+            mSettings.send_backend == SEND_BACKEND_URING ? "uring" :
+            mSettings.send_backend == SEND_BACKEND_FANOUT ? "fanout" : "thread",
+            mSettings.timeout_sending.tv_sec * 1000 + mSettings.timeout_sending.tv_usec / 1000,
+            mSettings.timeout_recving.tv_sec * 1000 + mSettings.timeout_recving.tv_usec / 1000,
+            mSettings.timeout_draining.tv_sec * 1000 + mSettings.timeout_draining.tv_usec / 1000);
+    if (mSettings.send_backend == SEND_BACKEND_FANOUT) {
+        fprintf(stderr, "Fanout workers %d\n", mSettings.fanout_workers);
+    }
+    for (int i = 0; i < NUM_THREAD_ROLES; i++) {
+        const PiThreadPolicy& policy = mSettings.thread_policies[i];
+        if (!policy.cpus.empty() || policy.rt_priority > 0) {
+            fprintf(stderr, "Threads %s: cpus %s, SCHED_FIFO %d\n", PiThreads::roleName((PiThreadRole)i),
+                    policy.cpus.empty() ? "any" : policy.cpus.c_str(), policy.rt_priority);
+        }
+    }
+    if (mSettings.log_sink != LOG_SINK_STDERR) {
+        fprintf(stderr, "Log to %s\n", mSettings.log_sink == LOG_SINK_SYSLOG ? "syslog" : mSettings.log_file.c_str());
+    }
+    fprintf(stderr, "Tracing %s, kill -USR2 writes %s\n", mSettings.trace ? "on" : "off", mSettings.trace_file.c_str());
+    if (!mSettings.upgrade_socket.empty()) {
+        fprintf(stderr, "Hot upgrade on %s\n", mSettings.upgrade_socket.c_str());
+    }
+    if (!mSettings.export_socket.empty()) {
+        fprintf(stderr, "Shared memory export on %s, %d slots%s\n", mSettings.export_socket.c_str(),
+                mSettings.export_slots, mSettings.export_raw ? ", with I420 frames" : "");
+    }
+    if (mSettings.zerocopy_threshold) {
+        fprintf(stderr, "MSG_ZEROCOPY for frames from %lu bytes\n", (unsigned long)mSettings.zerocopy_threshold);
+    }
+    if (mSettings.memory_budget) {
+        fprintf(stderr, "Memory budget of the connections %luMB\n", (unsigned long)(mSettings.memory_budget >> 20));
+    }
+    if (!cam.relay_url.empty()) {
+        fprintf(stderr, "Relay of %s instead of the camera\n", cam.relay_url.c_str());
+    }
+    if (!cam.replay_path.empty()) {
+        fprintf(stderr, "Replay of %s at %d fps instead of the camera\n", cam.replay_path.c_str(), cam.fps);
+    }
+    for (size_t i = 0; i < mSettings.sources.size(); i++) {
+        const PiSourceSettings& source = mSettings.sources[i];
+        if (!source.cam_settings.replay_path.empty()) {
+            fprintf(stderr, "Source /cam/%s/: replay of %s\n", source.name.c_str(),
+                    source.cam_settings.replay_path.c_str());
+        } else if (source.cam_settings.relay_url.empty()) {
+            fprintf(stderr, "Source /cam/%s/: camera %d\n", source.name.c_str(), source.cam_settings.camera_num);
+        } else {
+            fprintf(stderr, "Source /cam/%s/: relay of %s\n", source.name.c_str(),
+                    source.cam_settings.relay_url.c_str());
+        }
+    }
+    fprintf(stderr, "Camera %dx%d %dfps, quality %d, thumbnail quality %d, rotation %d, preview %s\n",
+            cam.width, cam.height, cam.fps, cam.quality, cam.thumbnail_quality, cam.rotation,
+            cam.preview_mode == PREVIEW_NONE ? "none" : cam.preview_mode == PREVIEW_RENDERER ? "renderer" : "null");
+    fprintf(stderr, "Buffers video port %d, encoder output %d (0 = recommended), grow up to %d\n",
+            cam.video_buffers, cam.encoder_buffers, cam.encoder_buffers_max);
+    if (cam.raw_decimation > 0) {
+        fprintf(stderr, "Raw I420 tap every %d frames\n", cam.raw_decimation);
+    }
+
+    // PiCamera applies 'rotation' over the camera parameters.
+    RASPICAM_CAMERA_PARAMETERS params = *cam.camera_params;
+    params.rotation = cam.rotation;
+    raspicamcontrol_dump_parameters(&params);
+}
+
+void PiSettingsLoader::displayHelp(const char* program) {
+    fprintf(stdout, "Usage: %s [options]\n\nServer parameter commands\n\n", program);
+    for (int i = 0; i < num_options; i++) {
+        fprintf(stdout, "-%s, -%s\t: %s\n", options[i].abbrev, options[i].command, options[i].help);
+    }
+    fprintf(stdout, "\nIn a config file, write \"name = value\" with the long name, ex) port = 8080, vstab = 1\n");
+    raspicamcontrol_display_help();
+}
@@ -0,0 +1,358 @@
+#include "PiShmExport.h"
+#include "PiThreads.h"
+#include "PiLog.h"
+#include "PiTrace.h"
+#include "PiException.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Linux 5.1, older C libraries don't define it
+#if !defined(F_SEAL_FUTURE_WRITE)
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+#define PAGE_ALIGN(n) (((n) + 4095) & ~(size_t)4095)
+
+PiShmExport::PiShmExport(PiCameraManager& manager, const std::string& path, int slot_count, size_t slot_size,
+        bool raw, int* status)
+        : mManager(manager), mPath(path), mMemFd(-1), mReadOnlyFd(-1), mMap(NULL), mMapSize(0), mHeader(NULL), mNextSlot(0),
+          mRaw(raw), mListenFd(-1), mThread(0), mSinkAdded(false) {
+    mWakeFds[0] = mWakeFds[1] = -1;
+    pthread_mutex_init(&mMutex, NULL);
+    *status = 0;
+
+    if (slot_count < 2 || slot_size == 0) {
+        *status = EINVAL;
+        return;
+    }
+
+    const size_t header_size = PAGE_ALIGN(sizeof(PiShmHeader));
+    const size_t stride = PAGE_ALIGN(PISHM_SLOT_DATA_OFFSET + slot_size);
+    mMapSize = header_size + stride * slot_count;
+
+    // The size is sealed, so a consumer can't truncate the file under the writer.
+    mMemFd = memfd_create("pimjpg_frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (mMemFd < 0 || ftruncate(mMemFd, mMapSize) != 0 ||
+            fcntl(mMemFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0) {
+        *status = errno;
+        fprintf(stderr, "Failed to create the shared memory of %lu bytes err=%d\n", (unsigned long)mMapSize, *status);
+        return;
+    }
+
+    // Consumers get a read-only descriptor of the same memory, never the writable one.
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", mMemFd);
+    mReadOnlyFd = open(proc_path, O_RDONLY | O_CLOEXEC);
+    if (mReadOnlyFd < 0) {
+        *status = errno;
+        fprintf(stderr, "Failed to reopen the shared memory read-only err=%d\n", *status);
+        return;
+    }
+
+    void* map = mmap(NULL, mMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, mMemFd, 0);
+    if (map == MAP_FAILED) {
+        *status = errno;
+        fprintf(stderr, "Failed to map the shared memory err=%d\n", *status);
+        return;
+    }
+    mMap = static_cast<uint8_t*>(map);
+
+    // The inode of a memfd is 0777, so a consumer could reopen /proc/<pid>/fd/<n> for writing.
+    // Only the mapping above stays writable after F_SEAL_FUTURE_WRITE.
+    if (fcntl(mMemFd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) != 0) {
+        *status = errno;
+        fprintf(stderr, "Failed to seal the shared memory for writes err=%d\n", *status);
+        return;
+    }
+    mHeader = reinterpret_cast<PiShmHeader*>(mMap);
+    mHeader->magic = PISHM_MAGIC;
+    mHeader->version = PISHM_VERSION;
+    mHeader->slot_count = slot_count;
+    mHeader->slot_stride = stride;
+    mHeader->slot_size = slot_size;
+    mHeader->header_size = header_size;
+    mHeader->sequence = 0;
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.length() >= sizeof(addr.sun_path)) {
+        *status = ENAMETOOLONG;
+        return;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.length());
+
+    mListenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (mListenFd < 0) {
+        *status = errno;
+        return;
+    }
+    unlink(path.c_str());
+    if (bind(mListenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(mListenFd, 8) != 0) {
+        *status = errno;
+        fprintf(stderr, "Failed to listen on %s err=%d\n", path.c_str(), *status);
+        return;
+    }
+
+    if (pipe2(mWakeFds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        *status = errno;
+        return;
+    }
+
+    *status = pthread_create(&mThread, NULL, run, this);
+    if (*status) {
+        fprintf(stderr, "Failed to create the export thread status=%d\n", *status);
+        mThread = 0;
+    }
+}
+
+PiShmExport::~PiShmExport() {
+    if (mThread) {
+        const char c = 'q';
+        if (write(mWakeFds[1], &c, 1) < 0) {
+            perror("PiShmExport: write to the wake pipe");
+        }
+        pthread_join(mThread, NULL);
+    }
+
+    // No onFrame() comes after this
+    if (mSinkAdded) {
+        mManager.removeSink(this);
+    }
+
+    std::vector<int>::iterator it = mConsumers.begin();
+    for (; it != mConsumers.end(); it++) {
+        close(*it);
+    }
+    if (mListenFd != -1) {
+        close(mListenFd);
+        unlink(mPath.c_str());
+    }
+    if (mWakeFds[0] != -1) close(mWakeFds[0]);
+    if (mWakeFds[1] != -1) close(mWakeFds[1]);
+    if (mMap) munmap(mMap, mMapSize);
+    if (mReadOnlyFd != -1) close(mReadOnlyFd);
+    if (mMemFd != -1) close(mMemFd);
+    pthread_mutex_destroy(&mMutex);
+}
+
+void PiShmExport::onFrame(const DinamicBuffer& buffer, uint64_t sequence, int64_t timestamp_us) {
+    PiShmSlot info;
+    memset(&info, 0, sizeof(info));
+    info.sequence = sequence;
+    info.timestamp_us = timestamp_us;
+    info.format = PISHM_FORMAT_JPEG;
+    info.size = buffer.offset;
+    publish(info, buffer.values);
+}
+
+void PiShmExport::onRawFrame(const PiRawFrame& frame) {
+    if (!mRaw) {
+        return;
+    }
+    PiShmSlot info;
+    memset(&info, 0, sizeof(info));
+    info.sequence = frame.sequence;
+    info.timestamp_us = frame.timestamp_us;
+    info.format = PISHM_FORMAT_I420;
+    info.size = frame.size;
+    info.width = frame.width;
+    info.height = frame.height;
+    info.stride = frame.stride;
+    info.slice_height = frame.slice_height;
+    publish(info, frame.data);
+}
+
+void PiShmExport::publish(const PiShmSlot& info, const uint8_t* data) {
+    PI_TRACE("shm_publish", info.size);
+
+    pthread_mutex_lock(&mMutex);
+    if (info.size > mHeader->slot_size) {
+        mStats.too_large++;
+        pthread_mutex_unlock(&mMutex);
+        PI_LOG(PILOG_WARN, EMSGSIZE, "PiShmExport: a frame of %ld bytes doesn't fit in a slot", (long)info.size);
+        return;
+    }
+
+    const uint32_t index = mNextSlot;
+    mNextSlot = (mNextSlot + 1) % mHeader->slot_count;
+    PiShmSlot* slot = reinterpret_cast<PiShmSlot*>(mMap + mHeader->header_size + (size_t)index * mHeader->slot_stride);
+
+    // Odd while written
+    __atomic_store_n(&slot->lock, slot->lock + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(reinterpret_cast<uint8_t*>(slot) + PISHM_SLOT_DATA_OFFSET, data, info.size);
+    // The lock is only written by the seqlock above and below.
+    slot->sequence = info.sequence;
+    slot->timestamp_us = info.timestamp_us;
+    slot->format = info.format;
+    slot->size = info.size;
+    slot->width = info.width;
+    slot->height = info.height;
+    slot->stride = info.stride;
+    slot->slice_height = info.slice_height;
+    __atomic_store_n(&slot->lock, slot->lock + 1, __ATOMIC_RELEASE);
+    if (info.format == PISHM_FORMAT_JPEG) {
+        __atomic_store_n(&mHeader->sequence, info.sequence, __ATOMIC_RELEASE);
+    }
+    mStats.frames++;
+
+    PiShmNotice notice;
+    memset(&notice, 0, sizeof(notice));
+    notice.sequence = info.sequence;
+    notice.timestamp_us = info.timestamp_us;
+    notice.slot = index;
+    notice.format = info.format;
+    notice.size = info.size;
+
+    // A closed consumer is removed by the export thread.
+    std::vector<int>::iterator it = mConsumers.begin();
+    for (; it != mConsumers.end(); it++) {
+        if (send(*it, &notice, sizeof(notice), MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno == EAGAIN) {
+            mStats.notices_dropped++;
+        }
+    }
+    pthread_mutex_unlock(&mMutex);
+}
+
+PiShmExportStats PiShmExport::stats() {
+    pthread_mutex_lock(&mMutex);
+    PiShmExportStats stats = mStats;
+    stats.consumers = mConsumers.size();
+    pthread_mutex_unlock(&mMutex);
+    return stats;
+}
+
+void* PiShmExport::run(void* arg) {
+    PiThreads::enter(THREAD_DISPATCH, "shm_export");
+    static_cast<PiShmExport*>(arg)->loop();
+    PiThreads::leave();
+    return NULL;
+}
+
+/** Accept the consumers, and remove the closed ones */
+void PiShmExport::loop() {
+    std::vector<pollfd> fds;
+    for (;;) {
+        fds.clear();
+        pollfd pfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        pfd.fd = mWakeFds[0];
+        fds.push_back(pfd);
+        pfd.fd = mListenFd;
+        fds.push_back(pfd);
+        pthread_mutex_lock(&mMutex);
+        TRAP1(catched, msg,
+            for (size_t i = 0; i < mConsumers.size(); i++) {
+                pfd.fd = mConsumers[i];
+                fds.push_back(pfd);
+            }
+        );
+        pthread_mutex_unlock(&mMutex);
+        if (catched) {
+            // The consumers left out are polled again after the next wakeup.
+            PI_LOG(PILOG_WARN, ENOMEM, "PiShmExport: failed to poll the consumers");
+        }
+
+        if (poll(&fds[0], fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("PiShmExport: poll");
+            return;
+        }
+        if (fds[0].revents) {
+            return; // stopped
+        }
+        if (fds[1].revents & POLLIN) {
+            accept();
+        }
+
+        // Consumers don't send anything, so a readable socket is a closed one.
+        for (size_t i = 2; i < fds.size(); i++) {
+            if (fds[i].revents) {
+                char c;
+                if (recv(fds[i].fd, &c, 1, MSG_DONTWAIT) <= 0 || (fds[i].revents & (POLLHUP | POLLERR))) {
+                    removeConsumer(fds[i].fd);
+                }
+            }
+        }
+    }
+}
+
+/** Accept a consumer, and send the header and the memfd to it */
+void PiShmExport::accept() {
+    int fd = accept4(mListenFd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) {
+        return;
+    }
+
+    PiShmHeader header = *mHeader;
+    iovec iov;
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &mReadOnlyFd, sizeof(int));
+
+    ssize_t ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (ret != (ssize_t)sizeof(header)) {
+        fprintf(stderr, "Failed to send the shared memory to a consumer err=%d\n", errno);
+        close(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&mMutex);
+    TRAP1(catched, msg_, mConsumers.push_back(fd););
+    pthread_mutex_unlock(&mMutex);
+    if (catched) {
+        close(fd);
+        return;
+    }
+
+    // The first consumer starts the camera, outside mMutex which onFrame() takes.
+    if (!mSinkAdded) {
+        int status = mManager.addSink(this);
+        if (status) {
+            fprintf(stderr, "Failed to start the source for the export status=%d\n", status);
+            removeConsumer(fd);
+            return;
+        }
+        mSinkAdded = true;
+    }
+    printf("shm export: consumer connected\n");
+}
+
+void PiShmExport::removeConsumer(int fd) {
+    bool last = false;
+    pthread_mutex_lock(&mMutex);
+    std::vector<int>::iterator it = std::find(mConsumers.begin(), mConsumers.end(), fd);
+    if (it != mConsumers.end()) {
+        mConsumers.erase(it);
+        close(fd);
+    }
+    last = mConsumers.empty();
+    pthread_mutex_unlock(&mMutex);
+
+    if (last && mSinkAdded) {
+        mManager.removeSink(this);
+        mSinkAdded = false;
+    }
+}
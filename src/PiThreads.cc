@@ -0,0 +1,275 @@
+#include "PiThreads.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <list>
+
+namespace {
+
+struct Entry {
+    std::string name;
+    PiThreadRole role;
+    pid_t tid;
+    clockid_t clock;
+    std::string policy;      // what was applied, ex) "cpus=2 fifo=10"
+    uint64_t last_cpu_nsec;  // cpu time at the last metrics(), for threads which exit without leave()
+};
+
+pthread_mutex_t gMutex = PTHREAD_MUTEX_INITIALIZER;
+PiThreadPolicy gPolicies[NUM_THREAD_ROLES];
+cpu_set_t gDefaultCpus;      // affinity of the process when configured, for the roles without a pin
+bool gHasDefaultCpus = false;
+std::list<Entry> gEntries;
+uint64_t gExitedCpuNsec[NUM_THREAD_ROLES];
+
+__thread bool tRegistered = false;
+
+pid_t current_tid() {
+    return (pid_t)syscall(SYS_gettid);
+}
+
+uint64_t to_nsec(const timespec& t) {
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/** Read the cpu which the thread last ran on. Return -1 if the thread doesn't exist. */
+int last_cpu(pid_t tid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", (int)tid);
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    char line[1024];
+    char* p = fgets(line, sizeof(line), fp);
+    fclose(fp);
+    if (p == NULL || (p = strrchr(line, ')')) == NULL) {
+        return -1;
+    }
+
+    // "processor" is the 39th field, and the fields after the command name start from the 3rd.
+    int field = 2;
+    char* save = NULL;
+    for (char* s = strtok_r(p + 1, " ", &save); s != NULL; s = strtok_r(NULL, " ", &save)) {
+        if (++field == 39) {
+            return atoi(s);
+        }
+    }
+    return -1;
+}
+
+/** Apply the policy to the calling thread, and describe what was applied */
+int apply(const PiThreadPolicy& policy, const char* name, std::string* applied) {
+    int status = 0;
+    char buf[64];
+
+    if (!policy.cpus.empty()) {
+        cpu_set_t set;
+        int ret = PiThreads::parseCpuList(policy.cpus.c_str(), &set);
+        if (ret == 0) {
+            ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+        if (ret) {
+            fprintf(stderr, "Failed to pin %s to cpus %s err=%d\n", name, policy.cpus.c_str(), ret);
+            status = ret;
+        } else {
+            *applied += "cpus=" + policy.cpus;
+        }
+    } else if (gHasDefaultCpus) {
+        // A thread inherits the mask of its creator, ex) the network cpus of the accept thread.
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(gDefaultCpus), &gDefaultCpus);
+        if (ret) {
+            fprintf(stderr, "Failed to reset the cpus of %s err=%d\n", name, ret);
+            status = ret;
+        }
+    }
+
+    if (policy.rt_priority > 0) {
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = policy.rt_priority;
+        int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (ret) {
+            // EPERM without CAP_SYS_NICE or RLIMIT_RTPRIO
+            fprintf(stderr, "Failed to set SCHED_FIFO %d to %s err=%d\n", policy.rt_priority, name, ret);
+            status = ret;
+        } else {
+            snprintf(buf, sizeof(buf), "%sfifo=%d", applied->empty() ? "" : " ", policy.rt_priority);
+            *applied += buf;
+        }
+    }
+
+    if (applied->empty()) {
+        *applied = "default";
+    }
+    return status;
+}
+
+} // namespace
+
+void PiThreads::configure(const PiThreadPolicy* policies) {
+    pthread_mutex_lock(&gMutex);
+    for (int i = 0; i < NUM_THREAD_ROLES; i++) {
+        gPolicies[i] = policies[i];
+    }
+    if (!gHasDefaultCpus) {
+        gHasDefaultCpus = (sched_getaffinity(0, sizeof(gDefaultCpus), &gDefaultCpus) == 0);
+    }
+    pthread_mutex_unlock(&gMutex);
+}
+
+int PiThreads::enter(PiThreadRole role, const char* name) {
+    if (tRegistered) {
+        return 0;
+    }
+    tRegistered = true;
+
+    Entry entry;
+    entry.name = name;
+    entry.role = role;
+    entry.tid = current_tid();
+    entry.last_cpu_nsec = 0;
+    if (pthread_getcpuclockid(pthread_self(), &entry.clock) != 0) {
+        entry.clock = CLOCK_THREAD_CPUTIME_ID;
+    }
+
+    pthread_mutex_lock(&gMutex);
+    PiThreadPolicy policy = gPolicies[role];
+    pthread_mutex_unlock(&gMutex);
+
+    int status = apply(policy, name, &entry.policy);
+
+    // For the traces and top -H. The name is up to 15 characters.
+    char short_name[16];
+    snprintf(short_name, sizeof(short_name), "%s", name);
+    pthread_setname_np(pthread_self(), short_name);
+
+    pthread_mutex_lock(&gMutex);
+    gEntries.push_back(entry);
+    pthread_mutex_unlock(&gMutex);
+    return status;
+}
+
+void PiThreads::leave() {
+    if (!tRegistered) {
+        return;
+    }
+    tRegistered = false;
+
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    pid_t tid = current_tid();
+
+    pthread_mutex_lock(&gMutex);
+    std::list<Entry>::iterator it = gEntries.begin();
+    for (; it != gEntries.end(); it++) {
+        if (it->tid == tid) {
+            gExitedCpuNsec[it->role] += to_nsec(t);
+            gEntries.erase(it);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gMutex);
+}
+
+std::string PiThreads::metrics() {
+    std::string out;
+    char line[256];
+    uint64_t role_nsec[NUM_THREAD_ROLES];
+    int role_threads[NUM_THREAD_ROLES];
+
+    out += "# HELP pimjpg_thread_cpu_seconds_total CPU time of a running thread\n";
+    out += "# TYPE pimjpg_thread_cpu_seconds_total counter\n";
+
+    pthread_mutex_lock(&gMutex);
+    std::list<Entry>::iterator it = gEntries.begin();
+    while (it != gEntries.end()) {
+        // Threads of MMAL exit without leave() when the camera is closed.
+        int cpu = last_cpu(it->tid);
+        timespec t;
+        if (cpu < 0 || clock_gettime(it->clock, &t) != 0) {
+            gExitedCpuNsec[it->role] += it->last_cpu_nsec;
+            it = gEntries.erase(it);
+            continue;
+        }
+        it->last_cpu_nsec = to_nsec(t);
+
+        snprintf(line, sizeof(line),
+                "pimjpg_thread_cpu_seconds_total{name=\"%s\",role=\"%s\",tid=\"%d\",cpu=\"%d\",policy=\"%s\"} %.6f\n",
+                it->name.c_str(), roleName(it->role), (int)it->tid, cpu, it->policy.c_str(),
+                it->last_cpu_nsec / 1e9);
+        out += line;
+        it++;
+    }
+
+    for (int i = 0; i < NUM_THREAD_ROLES; i++) {
+        role_nsec[i] = gExitedCpuNsec[i];
+        role_threads[i] = 0;
+    }
+    for (it = gEntries.begin(); it != gEntries.end(); it++) {
+        role_nsec[it->role] += it->last_cpu_nsec;
+        role_threads[it->role]++;
+    }
+    pthread_mutex_unlock(&gMutex);
+
+    out += "# HELP pimjpg_role_cpu_seconds_total CPU time of the threads of a role, including exited ones\n";
+    out += "# TYPE pimjpg_role_cpu_seconds_total counter\n";
+    for (int i = 0; i < NUM_THREAD_ROLES; i++) {
+        snprintf(line, sizeof(line), "pimjpg_role_cpu_seconds_total{role=\"%s\"} %.6f\n",
+                roleName((PiThreadRole)i), role_nsec[i] / 1e9);
+        out += line;
+    }
+
+    out += "# HELP pimjpg_role_threads Running threads of a role\n";
+    out += "# TYPE pimjpg_role_threads gauge\n";
+    for (int i = 0; i < NUM_THREAD_ROLES; i++) {
+        snprintf(line, sizeof(line), "pimjpg_role_threads{role=\"%s\"} %d\n", roleName((PiThreadRole)i), role_threads[i]);
+        out += line;
+    }
+    return out;
+}
+
+int PiThreads::parseCpuList(const char* list, cpu_set_t* set) {
+    CPU_ZERO(set);
+    const char* p = list;
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE) {
+            return EINVAL;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first || last >= CPU_SETSIZE) {
+                return EINVAL;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*p == ',') {
+            p++;
+            if (*p == '\0') return EINVAL;
+        } else if (*p != '\0') {
+            return EINVAL;
+        }
+    }
+    return CPU_COUNT(set) > 0 ? 0 : EINVAL;
+}
+
+const char* PiThreads::roleName(PiThreadRole role) {
+    switch (role) {
+    case THREAD_CAPTURE:  return "capture";
+    case THREAD_DISPATCH: return "dispatch";
+    case THREAD_NETWORK:  return "network";
+    default:              return "unknown";
+    }
+}
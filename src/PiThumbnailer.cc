@@ -0,0 +1,441 @@
+#include "PiThumbnailer.h"
+#include "PiFrame.h"
+#include "PiThreads.h"
+#include "PiException.h"
+#include "PiLog.h"
+#include "PiClock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <algorithm>
+#include <jpeglib.h>
+
+#define WORKER_WAIT_SEC 3
+
+namespace {
+
+struct ErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+void error_exit(j_common_ptr cinfo) {
+    ErrorManager* err = (ErrorManager*)cinfo->err;
+    longjmp(err->jump, 1);
+}
+
+void output_message(j_common_ptr cinfo) {
+    char msg[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, msg);
+    fprintf(stderr, "PiThumbnailer: %s\n", msg);
+}
+
+// Destination manager writing into a StaticBuffer which grows on demand.
+struct BufferDestination {
+    jpeg_destination_mgr pub;
+    StaticBuffer* buffer;
+    bool failed;
+};
+
+void init_destination(j_compress_ptr cinfo) {
+    BufferDestination* dest = (BufferDestination*)cinfo->dest;
+    dest->pub.next_output_byte = dest->buffer->values;
+    dest->pub.free_in_buffer = dest->buffer->alloc_size;
+}
+
+boolean empty_output_buffer(j_compress_ptr cinfo) {
+    BufferDestination* dest = (BufferDestination*)cinfo->dest;
+    size_t used = dest->buffer->alloc_size;
+    size_t new_size = used * 2;
+    uint8_t* tmp = (uint8_t*)realloc(dest->buffer->values, new_size);
+    if (tmp == NULL) {
+        // Rewind the buffer and keep going, the result is discarded by transcode()
+        dest->failed = true;
+        dest->pub.next_output_byte = dest->buffer->values;
+        dest->pub.free_in_buffer = dest->buffer->alloc_size;
+        return TRUE;
+    }
+    dest->buffer->values = tmp;
+    dest->buffer->alloc_size = new_size;
+    dest->pub.next_output_byte = tmp + used;
+    dest->pub.free_in_buffer = new_size - used;
+    return TRUE;
+}
+
+void term_destination(j_compress_ptr) {
+}
+
+} // namespace
+
+/** Constructor */
+PiThumbnailer::PiThumbnailer(int scale_denom, int quality, int* status)
+        : mScaleDenom(scale_denom), mQuality(quality), mInitialized(false), mThread(0),
+        mThreadRunning(false), mStopRequested(false),
+        mPendingLength(0), mPendingSequence(0), mPendingTimestamp(0), mHasPending(false),
+        mCachedLength(0), mCachedSequence(0), mCachedTimestamp(0) {
+
+    if (status) *status = 0;
+
+    if (!isSupportedScale(scale_denom)) {
+        if (status) *status = EINVAL;
+        return;
+    }
+
+    int ret = pthread_mutex_init(&mMutex, NULL);
+    if (ret) {
+        fprintf(stderr, "PiThumbnailer() mutex init err=%d\n", ret);
+        if (status) *status = ret;
+        return;
+    }
+
+    ret = pthread_cond_init(&mCond, NULL);
+    if (ret) {
+        fprintf(stderr, "PiThumbnailer() cond init err=%d\n", ret);
+        pthread_mutex_destroy(&mMutex);
+        if (status) *status = ret;
+        return;
+    }
+    mInitialized = true;
+}
+
+/** Destructor */
+PiThumbnailer::~PiThumbnailer() {
+    if (!mInitialized) {
+        return; // The constructor has failed, nothing was started
+    }
+    stopWorker();
+
+    if (mSubscribers.size()) {
+        fprintf(stderr, "warn: PiThumbnailer has subscribers when called Destructor. size=%lu\n",
+                (unsigned long)mSubscribers.size());
+    }
+
+    pthread_cond_destroy(&mCond);
+    pthread_mutex_destroy(&mMutex);
+}
+
+bool PiThumbnailer::isSupportedScale(int scale_denom) {
+    return scale_denom == 2 || scale_denom == 4 || scale_denom == 8;
+}
+
+/** Add a subscriber, and start the worker if it is the first one */
+int PiThumbnailer::attach(PiFrame* frame) {
+    int status = pthread_mutex_lock(&mMutex);
+    if (status) {
+        fprintf(stderr, "PiThumbnailer::attach lock err=%d\n", status);
+        return status;
+    }
+
+    TRAP1(catched, msg, mSubscribers.push_back(frame););
+    if (catched) {
+        fprintf(stderr, "Error in mSubscribers.push_back msg=%s\n", msg.c_str());
+        status = ENOMEM;
+    }
+
+    if (!status && !mThreadRunning) {
+        mStopRequested = false;
+        status = pthread_create(&mThread, NULL, run_worker, this);
+        if (status) {
+            fprintf(stderr, "Failed to create thumbnail worker status=%d\n", status);
+            mSubscribers.pop_back();
+        } else {
+            mThreadRunning = true;
+        }
+    }
+
+    pthread_mutex_unlock(&mMutex);
+    return status;
+}
+
+/**
+ * Remove a subscriber. The worker keeps running until the thumbnailer is deleted, which
+ * its owner does without holding its own locks, since it waits for a transcode to end.
+ */
+bool PiThumbnailer::detach(PiFrame* frame) {
+    bool removed = false;
+
+    pthread_mutex_lock(&mMutex);
+    std::vector<PiFrame*>::iterator it = std::find(mSubscribers.begin(), mSubscribers.end(), frame);
+    if (it != mSubscribers.end()) {
+        mSubscribers.erase(it);
+        removed = true;
+    }
+    pthread_mutex_unlock(&mMutex);
+    return removed;
+}
+
+size_t PiThumbnailer::numSubscribers() {
+    pthread_mutex_lock(&mMutex);
+    size_t n = mSubscribers.size();
+    pthread_mutex_unlock(&mMutex);
+    return n;
+}
+
+PiThumbnailStats PiThumbnailer::stats() {
+    pthread_mutex_lock(&mMutex);
+    PiThumbnailStats s = mStats;
+    pthread_mutex_unlock(&mMutex);
+    return s;
+}
+
+/** Hand the latest source frame to the worker. An unprocessed older frame is replaced. */
+void PiThumbnailer::submit(const DinamicBuffer& buffer, uint64_t sequence, int64_t timestamp_us,
+        const timespec& now, long slack_nsec) {
+    int status = pthread_mutex_lock(&mMutex);
+    if (status) {
+        fprintf(stderr, "PiThumbnailer::submit lock err=%d\n", status);
+        return;
+    }
+
+    // Skip the copy when no subscriber takes this frame because of its rate limit.
+    bool due = false;
+    std::vector<PiFrame*>::iterator it = mSubscribers.begin();
+    for (; it != mSubscribers.end(); it++) {
+        if ((*it)->isDue(now, slack_nsec)) {
+            // A target of a replaced pending frame still gets this one.
+            if (std::find(mPendingTargets.begin(), mPendingTargets.end(), *it) == mPendingTargets.end()) {
+                TRAP_IGN(mPendingTargets.push_back(*it););
+            }
+            due = true;
+        }
+    }
+
+    if (due && mThreadRunning) {
+        if (mPending.alloc_size < buffer.offset) {
+            status = mPending.realloc(buffer.offset);
+        }
+
+        if (status == 0) {
+            if (mHasPending) mStats.dropped++;
+            memcpy(mPending.values, buffer.values, buffer.offset);
+            mPendingLength = buffer.offset;
+            mPendingSequence = sequence;
+            mPendingTimestamp = timestamp_us;
+            mHasPending = true;
+            pthread_cond_signal(&mCond);
+        } else {
+            fprintf(stderr, "PiThumbnailer::submit realloc err=%d\n", status);
+        }
+    }
+
+    pthread_mutex_unlock(&mMutex);
+}
+
+void* PiThumbnailer::run_worker(void* arg) {
+    PiThumbnailer* self = static_cast<PiThumbnailer*>(arg);
+    PiThreads::enter(THREAD_DISPATCH, "thumbnailer");
+    TRAP_LOG(self->doWork(););
+    PiThreads::leave();
+    return NULL;
+}
+
+void PiThumbnailer::stopWorker() {
+    pthread_mutex_lock(&mMutex);
+    bool running = mThreadRunning;
+    mStopRequested = true;
+    pthread_cond_signal(&mCond);
+    pthread_mutex_unlock(&mMutex);
+
+    if (running) {
+        pthread_join(mThread, NULL);
+
+        pthread_mutex_lock(&mMutex);
+        mThreadRunning = false;
+        mHasPending = false;
+        mPendingTargets.clear();
+        PiThumbnailStats s = mStats;
+        pthread_mutex_unlock(&mMutex);
+
+        if (s.transcoded) {
+            PI_LOG(PILOG_INFO, 0, "thumbnail 1/%ld: frames=%lu dropped=%lu avg_cpu=%luus",
+                    (long)mScaleDenom, (long)s.transcoded, (long)s.dropped, (long)(s.cpu_nsec / s.transcoded / 1000));
+        }
+    }
+}
+
+void PiThumbnailer::doWork() {
+    StaticBuffer input;
+    size_t input_length = 0;
+    uint64_t input_sequence = 0;
+    int64_t input_timestamp = 0;
+    std::vector<PiFrame*> targets;
+
+    pthread_mutex_lock(&mMutex);
+    while (!mStopRequested) {
+        if (!mHasPending) {
+            timespec t;
+            t.tv_sec = time(NULL) + WORKER_WAIT_SEC;
+            t.tv_nsec = 0;
+            pthread_cond_timedwait(&mCond, &mMutex, &t);
+            continue;
+        }
+
+        // Take over the pending frame without copying it.
+        std::swap(input.values, mPending.values);
+        std::swap(input.alloc_size, mPending.alloc_size);
+        input_length = mPendingLength;
+        input_sequence = mPendingSequence;
+        input_timestamp = mPendingTimestamp;
+        targets.swap(mPendingTargets);
+        mPendingTargets.clear();
+        mHasPending = false;
+
+        // The cache is keyed by the source frame, so a frame is never transcoded twice.
+        if (input_sequence != mCachedSequence || mCachedLength == 0) {
+            pthread_mutex_unlock(&mMutex);
+
+            size_t out_length = 0;
+            uint64_t cpu_start = PiClock::threadCpuNsec();
+            int status = transcode(input.values, input_length, mScaleDenom, mQuality, mCached, &out_length);
+            uint64_t cpu_end = PiClock::threadCpuNsec();
+
+            pthread_mutex_lock(&mMutex);
+            if (status) {
+                fprintf(stderr, "PiThumbnailer: failed to transcode frame=%llu err=%d\n",
+                        (unsigned long long)input_sequence, status);
+                mCachedLength = 0;
+                continue;
+            }
+            mCachedLength = out_length;
+            mCachedSequence = input_sequence;
+            mCachedTimestamp = input_timestamp;
+            mStats.transcoded++;
+            mStats.cpu_nsec += cpu_end - cpu_start;
+            mStats.out_bytes += out_length;
+        }
+
+        // Deliver the cached thumbnail to the subscribers which are due.
+        // A target may have been detached while the frame was transcoded.
+        PiSharedFrame* shared = NULL;
+        std::vector<PiFrame*>::iterator it = targets.begin();
+        for (; it != targets.end(); it++) {
+            PiFrame* frame = *it;
+            if (std::find(mSubscribers.begin(), mSubscribers.end(), frame) == mSubscribers.end()) {
+                continue;
+            }
+            if (frame->lock(3) != 0) {
+                continue;
+            }
+            // The client may have used the credit checked in submit() since.
+            if (!frame->hasCredit()) {
+                frame->unlock();
+                continue;
+            }
+            size_t wrote_size = 0;
+            if (frame->isSharing()) {
+                if (shared == NULL) {
+                    shared = PiSharedFrame::create(mCached.values, mCachedLength);
+                }
+                wrote_size = frame->share(shared);
+            } else {
+                TRAP1(catched, msg, wrote_size = frame->write(mCached.values, mCachedLength););
+                if (catched) {
+                    fprintf(stderr, "Exception in PiFrame#write %s\n", msg.c_str());
+                }
+            }
+            frame->sequence = mCachedSequence;
+            frame->timestamp_us = mCachedTimestamp;
+            frame->unlock();
+
+            if (wrote_size == mCachedLength) {
+                frame->sendReadySignal();
+            }
+        }
+        if (shared) {
+            shared->release();
+        }
+    }
+    pthread_mutex_unlock(&mMutex);
+}
+
+/** Decode 'src' at 1/scale_denom in the DCT domain and encode it again */
+int PiThumbnailer::transcode(const uint8_t* src, size_t length, int scale_denom, int quality,
+        StaticBuffer& dst, size_t* dst_length) {
+    if (src == NULL || length == 0 || dst_length == NULL) {
+        return EINVAL;
+    }
+    *dst_length = 0;
+
+    jpeg_decompress_struct dinfo;
+    jpeg_compress_struct cinfo;
+    ErrorManager err;
+    BufferDestination dest;
+    JSAMPARRAY rows = NULL;
+    volatile bool compress_created = false;
+
+    // Both objects share the error manager, so a failure anywhere jumps back here.
+    dinfo.err = jpeg_std_error(&err.pub);
+    cinfo.err = &err.pub;
+    err.pub.error_exit = error_exit;
+    err.pub.output_message = output_message;
+
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&dinfo);
+        if (compress_created) jpeg_destroy_compress(&cinfo);
+        return EIO;
+    }
+
+    jpeg_create_decompress(&dinfo);
+    jpeg_mem_src(&dinfo, (unsigned char*)src, length);
+    jpeg_read_header(&dinfo, TRUE);
+
+    // Let the IDCT produce the reduced size directly, and stay in YCbCr.
+    dinfo.scale_num = 1;
+    dinfo.scale_denom = scale_denom;
+    dinfo.dct_method = JDCT_IFAST;
+    dinfo.do_fancy_upsampling = FALSE;
+    dinfo.do_block_smoothing = FALSE;
+    dinfo.out_color_space = JCS_YCbCr;
+    jpeg_start_decompress(&dinfo);
+
+    jpeg_create_compress(&cinfo);
+    compress_created = true;
+
+    // Start with the size of the source, which is always large enough.
+    if (dst.alloc_size < length) {
+        if (dst.realloc(length) != 0) {
+            jpeg_destroy_decompress(&dinfo);
+            jpeg_destroy_compress(&cinfo);
+            return ENOMEM;
+        }
+    }
+    dest.pub.init_destination = init_destination;
+    dest.pub.empty_output_buffer = empty_output_buffer;
+    dest.pub.term_destination = term_destination;
+    dest.buffer = &dst;
+    dest.failed = false;
+    cinfo.dest = &dest.pub;
+
+    cinfo.image_width = dinfo.output_width;
+    cinfo.image_height = dinfo.output_height;
+    cinfo.input_components = dinfo.output_components;
+    cinfo.in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.dct_method = JDCT_IFAST;
+    jpeg_start_compress(&cinfo, TRUE);
+
+    rows = (*dinfo.mem->alloc_sarray)((j_common_ptr)&dinfo, JPOOL_IMAGE,
+            dinfo.output_width * dinfo.output_components, dinfo.rec_outbuf_height);
+
+    while (dinfo.output_scanline < dinfo.output_height) {
+        JDIMENSION n = jpeg_read_scanlines(&dinfo, rows, dinfo.rec_outbuf_height);
+        jpeg_write_scanlines(&cinfo, rows, n);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_finish_decompress(&dinfo);
+
+    *dst_length = dst.alloc_size - dest.pub.free_in_buffer;
+
+    jpeg_destroy_compress(&cinfo);
+    jpeg_destroy_decompress(&dinfo);
+
+    if (dest.failed) {
+        *dst_length = 0;
+        return ENOMEM;
+    }
+    return 0;
+}
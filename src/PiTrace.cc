@@ -0,0 +1,255 @@
+#include "PiTrace.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <vector>
+#include <new>
+
+namespace {
+
+struct Event {
+    const char* name;
+    uint64_t begin_ns;
+    uint64_t dur_ns;
+    long arg;
+    int tid;
+};
+
+/** Written only by the owner thread. 'head' is the number of the recorded events. */
+struct Ring {
+    Event events[PiTrace::EVENTS_PER_THREAD];
+    uint32_t head;
+    int tid;        // the current owner
+    char name[16];  // of the current owner
+};
+
+pthread_mutex_t gMutex = PTHREAD_MUTEX_INITIALIZER;
+std::vector<Ring*> gRings; // all of the rings, including free ones
+std::vector<Ring*> gFree;  // rings of the exited threads
+
+pthread_once_t gKeyOnce = PTHREAD_ONCE_INIT;
+pthread_key_t gKey;
+
+__thread Ring* tRing = NULL;
+
+int gSignal = 0;
+std::string gSignalPath;
+
+/** Called when the owner thread exits. Its events stay until they are overwritten. */
+void release_ring(void* arg) {
+    pthread_mutex_lock(&gMutex);
+    gFree.push_back(static_cast<Ring*>(arg));
+    pthread_mutex_unlock(&gMutex);
+}
+
+void create_key() {
+    pthread_key_create(&gKey, release_ring);
+}
+
+Ring* acquire_ring() {
+    pthread_once(&gKeyOnce, create_key);
+
+    Ring* ring = NULL;
+    pthread_mutex_lock(&gMutex);
+    if (!gFree.empty()) {
+        ring = gFree.back();
+        gFree.pop_back();
+    } else {
+        ring = new (std::nothrow) Ring;
+        if (ring) {
+            ring->head = 0;
+            gRings.push_back(ring);
+        }
+    }
+    if (ring) {
+        ring->tid = (int)syscall(SYS_gettid);
+        if (pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name)) != 0) {
+            ring->name[0] = '\0';
+        }
+    }
+    pthread_mutex_unlock(&gMutex);
+
+    if (ring) {
+        pthread_setspecific(gKey, ring);
+    }
+    return ring;
+}
+
+/**
+ * Copy the events of a ring, which its owner may be writing to. The events overwritten
+ * while copying are dropped by reading the head again. The slot of the head itself may
+ * be half written by then, so it's dropped too.
+ */
+void copy_events(const Ring* ring, std::vector<Event>* events) {
+    const uint32_t N = PiTrace::EVENTS_PER_THREAD;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t first = (head > N) ? head - N : 0;
+
+    std::vector<Event> copied;
+    copied.reserve(head - first);
+    for (uint32_t i = first; i < head; i++) {
+        copied.push_back(ring->events[i & (N - 1)]);
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint32_t head_after = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t valid = (head_after + 1 > N) ? head_after + 1 - N : 0;
+    for (uint32_t i = first; i < head; i++) {
+        if (i >= valid) {
+            events->push_back(copied[i - first]);
+        }
+    }
+}
+
+void append_escaped(std::string& out, const char* s) {
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            out += '\\';
+        }
+        if ((unsigned char)*s >= 0x20) {
+            out += *s;
+        }
+    }
+}
+
+void* run_signal(void*) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, gSignal);
+    for (;;) {
+        int signum;
+        if (sigwait(&set, &signum) != 0) {
+            continue;
+        }
+        int status = PiTrace::dumpToFile(gSignalPath);
+        if (status) {
+            fprintf(stderr, "Failed to write the trace to %s err=%d\n", gSignalPath.c_str(), status);
+        } else {
+            fprintf(stderr, "Wrote the trace to %s\n", gSignalPath.c_str());
+        }
+    }
+    return NULL;
+}
+
+} // namespace
+
+bool PiTrace::sEnabled = false;
+
+void PiTrace::enable(bool enabled) {
+    __atomic_store_n(&sEnabled, enabled, __ATOMIC_RELAXED);
+}
+
+uint64_t PiTrace::now() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+void PiTrace::record(const char* name, uint64_t begin_ns, uint64_t end_ns, long arg) {
+    Ring* ring = tRing;
+    if (ring == NULL) {
+        ring = tRing = acquire_ring();
+        if (ring == NULL) {
+            return;
+        }
+    }
+
+    uint32_t head = ring->head;
+    Event& e = ring->events[head & (EVENTS_PER_THREAD - 1)];
+    e.name = name;
+    e.begin_ns = begin_ns;
+    e.dur_ns = end_ns - begin_ns;
+    e.arg = arg;
+    e.tid = ring->tid;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+std::string PiTrace::dumpJson() {
+    std::string out("{\"traceEvents\":[");
+    char line[256];
+    const int pid = (int)getpid();
+    bool first = true;
+
+    pthread_mutex_lock(&gMutex);
+    std::vector<Ring*>::const_iterator it = gRings.begin();
+    for (; it != gRings.end(); it++) {
+        const Ring* ring = *it;
+        snprintf(line, sizeof(line),
+                "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"",
+                first ? "" : ",", pid, ring->tid);
+        out += line;
+        append_escaped(out, ring->name[0] ? ring->name : "thread");
+        out += "\"}}";
+        first = false;
+
+        std::vector<Event> events;
+        copy_events(ring, &events);
+        std::vector<Event>::const_iterator e = events.begin();
+        for (; e != events.end(); e++) {
+            snprintf(line, sizeof(line),
+                    ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"args\":{\"arg\":%ld}}",
+                    e->name, pid, e->tid,
+                    (unsigned long long)(e->begin_ns / 1000), (unsigned)(e->begin_ns % 1000),
+                    (unsigned long long)(e->dur_ns / 1000), (unsigned)(e->dur_ns % 1000), e->arg);
+            out += line;
+        }
+    }
+    pthread_mutex_unlock(&gMutex);
+
+    out += "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return out;
+}
+
+int PiTrace::dumpToFile(const std::string& path) {
+    std::string json = dumpJson();
+
+    // Readers never see a partial file
+    std::string tmp = path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "w");
+    if (fp == NULL) {
+        return errno;
+    }
+    size_t written = fwrite(json.data(), 1, json.length(), fp);
+    int status = (written == json.length()) ? 0 : EIO;
+    if (fclose(fp) != 0 && status == 0) {
+        status = errno;
+    }
+    if (status == 0 && rename(tmp.c_str(), path.c_str()) != 0) {
+        status = errno;
+    }
+    if (status) {
+        unlink(tmp.c_str());
+    }
+    return status;
+}
+
+int PiTrace::dumpOnSignal(int signum, const std::string& path) {
+    if (gSignal) {
+        return EBUSY;
+    }
+    gSignal = signum;
+    gSignalPath = path;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, signum);
+    int status = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (status) {
+        fprintf(stderr, "Failed to block signal %d err=%d\n", signum, status);
+        return status;
+    }
+
+    pthread_t thread;
+    status = pthread_create(&thread, NULL, run_signal, NULL);
+    if (status) {
+        fprintf(stderr, "Failed to create the trace signal thread status=%d\n", status);
+        return status;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,298 @@
+#include "PiUpgrade.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define UPGRADE_MAGIC 0x50495550 // "PIUP"
+#define UPGRADE_VERSION 1
+
+// Limit of the frame accepted from the previous process
+#define MAX_FRAME_SIZE (16 * 1024 * 1024)
+
+// Timeout of each step of the hand-over
+#define HANDOVER_TIMEOUT_SEC 5
+
+namespace {
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t frame_size;
+    uint32_t reserved;
+    uint64_t sequence;
+    int64_t timestamp_us;
+};
+
+int make_address(const std::string& path, sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path.empty() || path.length() >= sizeof(addr->sun_path)) {
+        return ENAMETOOLONG;
+    }
+    memcpy(addr->sun_path, path.c_str(), path.length());
+    return 0;
+}
+
+void set_timeout(int fd) {
+    timeval t;
+    t.tv_sec = HANDOVER_TIMEOUT_SEC;
+    t.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &t, sizeof(t));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
+}
+
+int send_all(int fd, const void* data, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        ssize_t ret = send(fd, p, size, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        p += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+int recv_all(int fd, void* data, size_t size) {
+    uint8_t* p = static_cast<uint8_t*>(data);
+    while (size > 0) {
+        ssize_t ret = recv(fd, p, size, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        } else if (ret == 0) {
+            return ECONNRESET;
+        }
+        p += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+} // namespace
+
+PiUpgrade::PiUpgrade() : mListenFd(-1), mPeerFd(-1) {
+}
+
+PiUpgrade::~PiUpgrade() {
+    closeListener(true);
+    if (mPeerFd != -1) {
+        close(mPeerFd);
+    }
+}
+
+int PiUpgrade::takeOver(const std::string& path, int* listen_fd, PiUpgradeFrame* frame) {
+    sockaddr_un addr;
+    int status = make_address(path, &addr);
+    if (status) {
+        return status;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return errno;
+    }
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        status = errno;
+        close(fd);
+        return status; // ENOENT or ECONNREFUSED if no process is running
+    }
+    set_timeout(fd);
+
+    // The header comes with the descriptor
+    Header header;
+    iovec iov;
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    char control[CMSG_SPACE(sizeof(int))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t ret;
+    do {
+        ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (ret < 0 && errno == EINTR);
+
+    int received = -1;
+    cmsghdr* cmsg = (ret > 0) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (ret != (ssize_t)sizeof(header) || received < 0 ||
+            header.magic != UPGRADE_MAGIC || header.version != UPGRADE_VERSION ||
+            header.frame_size > MAX_FRAME_SIZE) {
+        fprintf(stderr, "Invalid hand-over from %s\n", path.c_str());
+        status = (ret < 0) ? errno : EPROTO;
+    } else {
+        frame->sequence = header.sequence;
+        frame->timestamp_us = header.timestamp_us;
+        frame->jpeg.resize(header.frame_size);
+        if (header.frame_size) {
+            status = recv_all(fd, &frame->jpeg[0], header.frame_size);
+        }
+    }
+
+    // Tell the previous process to stop accepting.
+    if (status == 0) {
+        const char ack = 'A';
+        status = send_all(fd, &ack, 1);
+    }
+
+    if (status) {
+        if (received >= 0) close(received);
+        close(fd);
+        return status;
+    }
+
+    *listen_fd = received;
+    mPeerFd = fd;
+    return 0;
+}
+
+int PiUpgrade::waitPrevious(int timeout_ms) {
+    if (mPeerFd == -1) {
+        return 0;
+    }
+
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = ETIMEDOUT;
+    for (;;) {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int remaining = timeout_ms - (int)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+        if (remaining <= 0) {
+            break;
+        }
+
+        pollfd pfd;
+        pfd.fd = mPeerFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int ret = poll(&pfd, 1, remaining);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            break;
+        }
+
+        char c;
+        ssize_t n = recv(mPeerFd, &c, 1, MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            status = 0; // closed at the exit of the process
+            break;
+        }
+    }
+
+    close(mPeerFd);
+    mPeerFd = -1;
+    return status;
+}
+
+int PiUpgrade::listen(const std::string& path) {
+    sockaddr_un addr;
+    int status = make_address(path, &addr);
+    if (status) {
+        return status;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return errno;
+    }
+
+    // A file left by the previous process, which has handed over or exited
+    unlink(path.c_str());
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(fd, 1) != 0) {
+        status = errno;
+        close(fd);
+        fprintf(stderr, "Failed to listen on %s err=%d\n", path.c_str(), status);
+        return status;
+    }
+
+    mPath = path;
+    mListenFd = fd;
+    return 0;
+}
+
+int PiUpgrade::handOver(int listen_fd, const PiUpgradeFrame& frame) {
+    int fd = accept4(mListenFd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return errno;
+    }
+    set_timeout(fd);
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = UPGRADE_MAGIC;
+    header.version = UPGRADE_VERSION;
+    header.frame_size = frame.jpeg.size();
+    header.sequence = frame.sequence;
+    header.timestamp_us = frame.timestamp_us;
+
+    iovec iov;
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+
+    int status = 0;
+    ssize_t ret;
+    do {
+        ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+    if (ret != (ssize_t)sizeof(header)) {
+        status = (ret < 0) ? errno : EIO;
+    }
+    if (status == 0 && !frame.jpeg.empty()) {
+        status = send_all(fd, &frame.jpeg[0], frame.jpeg.size());
+    }
+
+    // Keep accepting until the new process has the socket.
+    char ack = 0;
+    if (status == 0 && (status = recv_all(fd, &ack, 1)) == 0 && ack != 'A') {
+        status = EPROTO;
+    }
+    if (status) {
+        close(fd);
+        return status;
+    }
+
+    // The path belongs to the new process from here.
+    closeListener(false);
+    mPeerFd = fd;
+    return 0;
+}
+
+void PiUpgrade::closeListener(bool unlink_path) {
+    if (mListenFd != -1) {
+        close(mListenFd);
+        mListenFd = -1;
+        if (unlink_path) {
+            unlink(mPath.c_str());
+        }
+    }
+}
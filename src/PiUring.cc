@@ -0,0 +1,215 @@
+#include "PiUring.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+PiUring::PiUring(unsigned entries, int* status)
+        : mFd(-1), mRing(MAP_FAILED), mRingSize(0), mSqes(MAP_FAILED), mSqesSize(0),
+        mSqHead(NULL), mSqTail(NULL), mSqMask(0), mSqEntries(0), mSqArray(NULL),
+        mCqHead(NULL), mCqTail(NULL), mCqMask(0), mCqes(NULL), mToSubmit(0) {
+
+    if (status) *status = 0;
+
+#ifdef __NR_io_uring_setup
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    mFd = syscall(__NR_io_uring_setup, entries, &params);
+    if (mFd < 0) {
+        if (status) *status = errno;
+        return;
+    }
+
+    // Old kernels map the SQ and CQ rings separately, so require the single mmap.
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        if (status) *status = ENOSYS;
+        return;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    mRingSize = (sq_size > cq_size) ? sq_size : cq_size;
+    mRing = mmap(NULL, mRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+    if (mRing == MAP_FAILED) {
+        if (status) *status = errno;
+        return;
+    }
+
+    mSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    mSqes = mmap(NULL, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQES);
+    if (mSqes == MAP_FAILED) {
+        if (status) *status = errno;
+        return;
+    }
+
+    uint8_t* ring = static_cast<uint8_t*>(mRing);
+    mSqHead = (unsigned*)(ring + params.sq_off.head);
+    mSqTail = (unsigned*)(ring + params.sq_off.tail);
+    mSqMask = *(unsigned*)(ring + params.sq_off.ring_mask);
+    mSqEntries = params.sq_entries;
+    mSqArray = (unsigned*)(ring + params.sq_off.array);
+    mCqHead = (unsigned*)(ring + params.cq_off.head);
+    mCqTail = (unsigned*)(ring + params.cq_off.tail);
+    mCqMask = *(unsigned*)(ring + params.cq_off.ring_mask);
+    mCqes = ring + params.cq_off.cqes;
+#else
+    if (status) *status = ENOSYS;
+#endif
+}
+
+PiUring::~PiUring() {
+    if (mSqes != MAP_FAILED) munmap(mSqes, mSqesSize);
+    if (mRing != MAP_FAILED) munmap(mRing, mRingSize);
+    if (mFd >= 0) close(mFd);
+}
+
+int PiUring::registerBuffers(const iovec* buffers, unsigned num) {
+#ifdef __NR_io_uring_setup
+    // Drop the previous registration, if any.
+    syscall(__NR_io_uring_register, mFd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    if (syscall(__NR_io_uring_register, mFd, IORING_REGISTER_BUFFERS, buffers, num) < 0) {
+        return errno;
+    }
+    return 0;
+#else
+    return ENOSYS;
+#endif
+}
+
+/** Get a free SQE, or NULL if the submission queue is full */
+void* PiUring::getSqe() {
+#ifdef __NR_io_uring_setup
+    unsigned tail = *mSqTail;
+    unsigned head = __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+    if (tail - head >= mSqEntries) {
+        return NULL;
+    }
+
+    unsigned index = tail & mSqMask;
+    io_uring_sqe* sqe = static_cast<io_uring_sqe*>(mSqes) + index;
+    memset(sqe, 0, sizeof(*sqe));
+    mSqArray[index] = index;
+
+    // The kernel sees the SQE at the next submit()
+    __atomic_store_n(mSqTail, tail + 1, __ATOMIC_RELEASE);
+    mToSubmit++;
+    return sqe;
+#else
+    return NULL;
+#endif
+}
+
+int PiUring::prepareWriteFixed(int fd, const void* buf, size_t length, int buf_index, uint64_t user_data) {
+#ifdef __NR_io_uring_setup
+    io_uring_sqe* sqe = static_cast<io_uring_sqe*>(getSqe());
+    if (sqe == NULL) {
+        return ENOSPC;
+    }
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = length;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+    return 0;
+#else
+    return ENOSYS;
+#endif
+}
+
+int PiUring::prepareSend(int fd, const void* buf, size_t length, uint64_t user_data) {
+#ifdef __NR_io_uring_setup
+    io_uring_sqe* sqe = static_cast<io_uring_sqe*>(getSqe());
+    if (sqe == NULL) {
+        return ENOSPC;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = length;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+    return 0;
+#else
+    return ENOSYS;
+#endif
+}
+
+int PiUring::prepareNop(uint64_t user_data) {
+#ifdef __NR_io_uring_setup
+    io_uring_sqe* sqe = static_cast<io_uring_sqe*>(getSqe());
+    if (sqe == NULL) {
+        return ENOSPC;
+    }
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = user_data;
+    return 0;
+#else
+    return ENOSYS;
+#endif
+}
+
+int PiUring::submit(unsigned wait_nr) {
+#ifdef __NR_io_uring_setup
+    if (mToSubmit == 0 && wait_nr == 0) {
+        return 0;
+    }
+
+    unsigned flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+    for (;;) {
+        __sync_fetch_and_add(&mStats.enter_calls, 1);
+        int ret = syscall(__NR_io_uring_enter, mFd, mToSubmit, wait_nr, flags, NULL, 0);
+        if (ret >= 0) {
+            mStats.submitted += ret;
+            mToSubmit -= (ret < (int)mToSubmit) ? ret : mToSubmit;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return errno;
+        }
+    }
+#else
+    return ENOSYS;
+#endif
+}
+
+int PiUring::waitCompletions() {
+#ifdef __NR_io_uring_setup
+    __sync_fetch_and_add(&mStats.enter_calls, 1);
+    if (syscall(__NR_io_uring_enter, mFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        return errno;
+    }
+    return 0;
+#else
+    return ENOSYS;
+#endif
+}
+
+size_t PiUring::reap(std::vector<Completion>& completions) {
+#ifdef __NR_io_uring_setup
+    unsigned head = *mCqHead;
+    unsigned tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+
+    for (; head != tail; head++, n++) {
+        const io_uring_cqe* cqe = static_cast<const io_uring_cqe*>(mCqes) + (head & mCqMask);
+        Completion c;
+        c.user_data = cqe->user_data;
+        c.result = cqe->res;
+        completions.push_back(c);
+    }
+
+    __atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+    mStats.completed += n;
+    return n;
+#else
+    return 0;
+#endif
+}
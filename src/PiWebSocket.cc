@@ -0,0 +1,208 @@
+#include "PiWebSocket.h"
+#include <string.h>
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+namespace {
+
+inline uint32_t rol(uint32_t value, int bits) {
+    return (value << bits) | (value >> (32 - bits));
+}
+
+void sha1_block(uint32_t* h, const uint8_t* block) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d); k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d; k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d; k = 0xCA62C1D6;
+        }
+        uint32_t tmp = rol(a, 5) + f + e + k + w[i];
+        e = d; d = c; c = rol(b, 30); b = a; a = tmp;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+// The handshake is the only user, so the input is always short.
+void sha1(const std::string& s, uint8_t* digest) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+    std::string msg(s);
+    uint64_t bit_length = (uint64_t)s.length() * 8;
+    msg += (char)0x80;
+    while (msg.length() % 64 != 56) {
+        msg += (char)0x00;
+    }
+    for (int i = 7; i >= 0; i--) {
+        msg += (char)((bit_length >> (i * 8)) & 0xff);
+    }
+
+    for (size_t i = 0; i < msg.length(); i += 64) {
+        sha1_block(h, (const uint8_t*)msg.data() + i);
+    }
+
+    for (int i = 0; i < 5; i++) {
+        digest[i * 4] = (uint8_t)(h[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(h[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(h[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)h[i];
+    }
+}
+
+std::string base64(const uint8_t* data, size_t length) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < length; i += 3) {
+        uint32_t v = (uint32_t)data[i] << 16;
+        if (i + 1 < length) v |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < length) v |= data[i + 2];
+        out += table[(v >> 18) & 0x3f];
+        out += table[(v >> 12) & 0x3f];
+        out += (i + 1 < length) ? table[(v >> 6) & 0x3f] : '=';
+        out += (i + 2 < length) ? table[v & 0x3f] : '=';
+    }
+    return out;
+}
+
+} // namespace
+
+PiWebSocket::PiWebSocket() : mFragmentOpcode(OP_CONTINUATION) {
+}
+
+std::string PiWebSocket::acceptKey(const std::string& key) {
+    uint8_t digest[20];
+    sha1(key + WEBSOCKET_GUID, digest);
+    return base64(digest, sizeof(digest));
+}
+
+size_t PiWebSocket::makeHeader(Opcode opcode, uint64_t payload_length, uint8_t* out) {
+    out[0] = 0x80 | (uint8_t)opcode; // FIN
+    if (payload_length < 126) {
+        out[1] = (uint8_t)payload_length;
+        return 2;
+    } else if (payload_length <= 0xffff) {
+        out[1] = 126;
+        out[2] = (uint8_t)(payload_length >> 8);
+        out[3] = (uint8_t)payload_length;
+        return 4;
+    }
+
+    out[1] = 127;
+    for (int i = 0; i < 8; i++) {
+        out[2 + i] = (uint8_t)(payload_length >> ((7 - i) * 8));
+    }
+    return 10;
+}
+
+void PiWebSocket::makeMetadata(uint64_t sequence, int64_t timestamp_us, uint8_t* out) {
+    for (int i = 0; i < 8; i++) {
+        out[i] = (uint8_t)(sequence >> ((7 - i) * 8));
+        out[8 + i] = (uint8_t)((uint64_t)timestamp_us >> ((7 - i) * 8));
+    }
+}
+
+int PiWebSocket::feed(const uint8_t* data, size_t length, std::vector<Message>& messages) {
+    mPending.insert(mPending.end(), data, data + length);
+
+    size_t pos = 0;
+    while (mPending.size() - pos >= 2) {
+        const uint8_t* p = &mPending[pos];
+        size_t avail = mPending.size() - pos;
+
+        bool fin = (p[0] & 0x80) != 0;
+        Opcode opcode = (Opcode)(p[0] & 0x0f);
+        bool masked = (p[1] & 0x80) != 0;
+        uint64_t payload_length = p[1] & 0x7f;
+        size_t header_length = 2;
+
+        if (!masked) {
+            return -1; // Client messages must be masked
+        }
+        if (p[0] & 0x70) {
+            return -1; // No extension is negotiated, so the RSV bits must be 0
+        }
+        if (opcode != OP_CONTINUATION && opcode != OP_TEXT && opcode != OP_BINARY &&
+                opcode != OP_CLOSE && opcode != OP_PING && opcode != OP_PONG) {
+            return -1; // Reserved opcode
+        }
+        if (opcode == OP_CONTINUATION && mFragmentOpcode == OP_CONTINUATION) {
+            return -1; // No message to continue
+        }
+        if ((opcode == OP_TEXT || opcode == OP_BINARY) && mFragmentOpcode != OP_CONTINUATION) {
+            return -1; // A new message before the fragmented one has finished
+        }
+
+        if (payload_length == 126) {
+            if (avail < 4) break;
+            payload_length = ((uint64_t)p[2] << 8) | p[3];
+            header_length = 4;
+        } else if (payload_length == 127) {
+            if (avail < 10) break;
+            payload_length = 0;
+            for (int i = 0; i < 8; i++) {
+                payload_length = (payload_length << 8) | p[2 + i];
+            }
+            if (payload_length >> 63) {
+                return -1; // The most significant bit must be 0
+            }
+            header_length = 10;
+        }
+
+        if (opcode >= OP_CLOSE && (!fin || payload_length > 125)) {
+            return -1; // Control frames are short and never fragmented
+        }
+        if (payload_length > MAX_MESSAGE_SIZE - mFragments.length()) {
+            return -1;
+        }
+
+        header_length += 4; // masking key
+        if (avail < header_length + payload_length) break;
+
+        const uint8_t* mask = p + header_length - 4;
+        std::string payload((const char*)p + header_length, (size_t)payload_length);
+        for (size_t i = 0; i < payload.length(); i++) {
+            payload[i] ^= mask[i % 4];
+        }
+        pos += header_length + (size_t)payload_length;
+
+        if (opcode >= OP_CLOSE) {
+            // Control frames may be interleaved with fragments
+            Message m;
+            m.opcode = opcode;
+            m.payload = payload;
+            messages.push_back(m);
+            continue;
+        }
+
+        if (opcode != OP_CONTINUATION) {
+            mFragmentOpcode = opcode;
+        }
+        mFragments += payload;
+
+        if (fin) {
+            Message m;
+            m.opcode = mFragmentOpcode;
+            m.payload.swap(mFragments);
+            messages.push_back(m);
+            mFragments.clear();
+            mFragmentOpcode = OP_CONTINUATION;
+        }
+    }
+
+    mPending.erase(mPending.begin(), mPending.begin() + pos);
+    return 0;
+}
@@ -0,0 +1,202 @@
+#include "PiZeroCopy.h"
+#include "PiFrame.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+// Completions copied by the kernel in a row before giving up zerocopy (ex. loopback)
+#define MAX_COPIED_IN_ROW 32
+
+// How long the destructor waits for the kernel to release the frames
+#define RELEASE_TIMEOUT_MS 1000
+
+/** Constructor */
+PiZeroCopy::PiZeroCopy(int socket, size_t threshold)
+        : mSocket(socket), mThreshold(threshold), mEnabled(false), mCurrent(-1), mNextId(0), mCopiedInRow(0) {
+
+    for (int i = 0; i < MAX_IN_FLIGHT; i++) {
+        mInFlight[i].frame = NULL;
+        mInFlight[i].first_id = 0;
+        mInFlight[i].count = 0;
+        mInFlight[i].completed = 0;
+    }
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    if (threshold > 0) {
+        int one = 1;
+        if (setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+            mEnabled = true;
+        } else {
+            fprintf(stderr, "SO_ZEROCOPY is not supported err=%d\n", errno);
+        }
+    }
+#endif
+}
+
+/** Destructor */
+PiZeroCopy::~PiZeroCopy() {
+    // Don't free the pages which the kernel may still send.
+    for (int i = 0; i < MAX_IN_FLIGHT; i++) {
+        while (mInFlight[i].frame != NULL) {
+            if (readCompletions(RELEASE_TIMEOUT_MS) != 0) {
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < MAX_IN_FLIGHT; i++) {
+        if (mInFlight[i].frame != NULL) {
+            mInFlight[i].frame->release();
+        }
+    }
+}
+
+int PiZeroCopy::send(PiSharedFrame* frame, int timeout_ms) {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    mCurrent = (mCurrent + 1) % MAX_IN_FLIGHT;
+    InFlight& entry = mInFlight[mCurrent];
+
+    // Pick up the completions which have arrived, and wait for the rest.
+    if (entry.frame != NULL) {
+        readCompletions(0);
+    }
+    if (entry.frame != NULL) {
+        mStats.waits++;
+        while (entry.frame != NULL) {
+            int status = readCompletions(timeout_ms);
+            if (status != 0) {
+                fprintf(stderr, "PiZeroCopy: frame wasn't released err=%d\n", status);
+                frame->release();
+                return status;
+            }
+        }
+    }
+
+    entry.first_id = mNextId;
+    entry.count = 0;
+    entry.completed = 0;
+
+    size_t sent = 0;
+    int flags = MSG_ZEROCOPY | MSG_NOSIGNAL;
+    int status = 0;
+    while (sent < frame->length) {
+        ssize_t ret = ::send(mSocket, frame->values + sent, frame->length - sent, flags);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                // Out of optmem for the notifications, copy the rest.
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+            fprintf(stderr, "Error in send() of PiZeroCopy: err=%d\n", errno);
+            status = errno;
+            break;
+        }
+
+        sent += ret;
+        if (flags & MSG_ZEROCOPY) {
+            // Each successful call gets the next notification id.
+            entry.count++;
+            mNextId++;
+            mStats.sends++;
+        }
+    }
+
+    // Pinned until the completions of its sends, if any
+    if (entry.count > 0) {
+        entry.frame = frame;
+    } else {
+        frame->release();
+    }
+
+    // Keep the error queue short.
+    readCompletions(0);
+    return status;
+#else
+    frame->release();
+    return ENOSYS;
+#endif
+}
+
+/** Read the completions in the error queue. Wait for one up to 'timeout_ms' if > 0. */
+int PiZeroCopy::readCompletions(int timeout_ms) {
+    short revents = 0;
+    if (timeout_ms > 0) {
+        pollfd pfd;
+        pfd.fd = mSocket;
+        pfd.events = 0; // POLLERR is always reported
+        pfd.revents = 0;
+        int ret = poll(&pfd, 1, timeout_ms);
+        if (ret == 0) {
+            return ETIMEDOUT;
+        } else if (ret < 0) {
+            return (errno == EINTR) ? 0 : errno;
+        }
+        revents = pfd.revents;
+    }
+
+    for (int n = 0;; n++) {
+        char control[128];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(mSocket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return errno;
+            }
+            // Woken up by a socket error or hangup rather than a completion
+            return (n == 0 && (revents & (POLLERR | POLLHUP))) ? EPIPE : 0;
+        }
+
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                    !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+
+            const sock_extended_err* err = (const sock_extended_err*)CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            complete(err->ee_info, err->ee_data, (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+        }
+    }
+}
+
+/** The sends [lo, hi] have completed. Release the frames whose sends have all completed. */
+void PiZeroCopy::complete(uint32_t lo, uint32_t hi, bool copied) {
+    for (int i = 0; i < MAX_IN_FLIGHT; i++) {
+        InFlight& entry = mInFlight[i];
+        if (entry.frame == NULL) {
+            continue;
+        }
+        uint32_t first = entry.first_id;
+        uint32_t last = entry.first_id + entry.count - 1;
+        uint32_t from = (lo > first) ? lo : first;
+        uint32_t to = (hi < last) ? hi : last;
+        if (from <= to) {
+            entry.completed += to - from + 1;
+        }
+        if (entry.completed >= entry.count) {
+            entry.frame->release();
+            entry.frame = NULL;
+        }
+    }
+
+    if (copied) {
+        mStats.copied += hi - lo + 1;
+        // The kernel copied anyway, so the notifications are pure overhead.
+        if (++mCopiedInRow >= MAX_COPIED_IN_ROW && mEnabled) {
+            fprintf(stderr, "PiZeroCopy: the kernel copies the sends, disable zerocopy\n");
+            mEnabled = false;
+        }
+    } else {
+        mCopiedInRow = 0;
+    }
+}
@@ -27,7 +27,11 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <memory.h>
+#include <time.h>
 
 #include "interface/vcos/vcos.h"
 
@@ -573,12 +577,311 @@ static MMAL_STEREOSCOPIC_MODE_T stereo_mode_from_string(const char *str)
    return MMAL_STEREOSCOPIC_MODE_NONE;
 }
 
+/**
+ * Find the command of the argument in a command list
+ * @param commands Command list
+ * @param num_commands Number of commands in the list
+ * @param arg Argument without its leading '-', so "sh" or "-sharpness"
+ * @param num_parameters Returns the number of parameters the command takes
+ * @return The command id, or -1 if no match
+ */
+static int get_command_id(const COMMAND_LIST *commands, const int num_commands, const char *arg, int *num_parameters)
+{
+   int j;
+
+   if (!commands || !arg)
+      return -1;
+
+   for (j = 0; j < num_commands; j++)
+   {
+      if (!strcmp(arg, commands[j].command) || !strcmp(arg, commands[j].abbrev))
+      {
+         *num_parameters = commands[j].num_parameters;
+         return commands[j].id;
+      }
+   }
+
+   return -1;
+}
+
+/**
+ * Parse a whole integer in the range [min, max]
+ * @return 0 if successful, non-zero if not a number or out of range
+ */
+static int parse_int(const char *str, int min, int max, int *value)
+{
+   char *end;
+   long v = strtol(str, &end, 10);
+
+   if (end == str || *end != '\0' || v < min || v > max)
+      return 1;
+
+   *value = (int)v;
+   return 0;
+}
+
+/**
+ * Parse a command line parameter of the camera
+ * @param params Parameter block to update
+ * @param arg1 Command without its leading '-', ex) "sh" for "-sh 10"
+ * @param arg2 Parameter of the command, or NULL
+ * @return The number of arguments used (0 if the command is unknown or the parameter is invalid)
+ */
+int raspicamcontrol_parse_cmdline(RASPICAM_CAMERA_PARAMETERS *params, const char *arg1, const char *arg2)
+{
+   int command_id, used = 0, num_parameters = 0;
+
+   if (!arg1)
+      return 0;
+
+   command_id = get_command_id(cmdline_commands, cmdline_commands_size, arg1, &num_parameters);
+
+   // If invalid command, or we are missing a parameter, drop out
+   if (command_id == -1 || (num_parameters > 0 && arg2 == NULL))
+      return 0;
+
+   switch (command_id)
+   {
+   case CommandSharpness : // sharpness - needs single number parameter
+      if (parse_int(arg2, -100, 100, &params->sharpness))
+         return 0;
+      used = 2;
+      break;
+
+   case CommandContrast : // contrast - needs single number parameter
+      if (parse_int(arg2, -100, 100, &params->contrast))
+         return 0;
+      used = 2;
+      break;
+
+   case CommandBrightness : // brightness - needs single number parameter
+      if (parse_int(arg2, 0, 100, &params->brightness))
+         return 0;
+      used = 2;
+      break;
+
+   case CommandSaturation : // saturation - needs single number parameter
+      if (parse_int(arg2, -100, 100, &params->saturation))
+         return 0;
+      used = 2;
+      break;
+
+   case CommandISO : // ISO - needs single number parameter, 0 = auto
+      if (parse_int(arg2, 0, 1600, &params->ISO))
+         return 0;
+      used = 2;
+      break;
+
+   case CommandVideoStab : // video stabilisation - if here, its on
+      params->videoStabilisation = 1;
+      used = 1;
+      break;
+
+   case CommandEVComp : // EV - needs single number parameter
+      if (parse_int(arg2, -10, 10, &params->exposureCompensation))
+         return 0;
+      used = 2;
+      break;
+
+   case CommandExposure : // exposure mode - needs string
+      if (map_xref(arg2, exposure_map, exposure_map_size) == -1)
+         return 0;
+      params->exposureMode = exposure_mode_from_string(arg2);
+      used = 2;
+      break;
+
+   case CommandAWB : // AWB mode - needs single number parameter
+      if (map_xref(arg2, awb_map, awb_map_size) == -1)
+         return 0;
+      params->awbMode = awb_mode_from_string(arg2);
+      used = 2;
+      break;
+
+   case CommandImageFX : // Image FX - needs string
+      if (map_xref(arg2, imagefx_map, imagefx_map_size) == -1)
+         return 0;
+      params->imageEffect = imagefx_mode_from_string(arg2);
+      used = 2;
+      break;
+
+   case CommandColourFX : // Colour FX - needs string "u:v"
+   {
+      int u, v;
+      if (sscanf(arg2, "%d:%d", &u, &v) != 2 || u < 0 || u > 255 || v < 0 || v > 255)
+         return 0;
+      params->colourEffects.u = u;
+      params->colourEffects.v = v;
+      params->colourEffects.enable = 1;
+      used = 2;
+      break;
+   }
+
+   case CommandMeterMode :
+      if (map_xref(arg2, metering_mode_map, metering_mode_map_size) == -1)
+         return 0;
+      params->exposureMeterMode = metering_mode_from_string(arg2);
+      used = 2;
+      break;
+
+   case CommandRotation : // Rotation - degree
+      if (parse_int(arg2, 0, 359, &params->rotation))
+         return 0;
+      used = 2;
+      break;
+
+   case CommandHFlip :
+      params->hflip = 1;
+      used = 1;
+      break;
+
+   case CommandVFlip :
+      params->vflip = 1;
+      used = 1;
+      break;
+
+   case CommandROI : // region of interest
+   {
+      double x, y, w, h;
+      if (sscanf(arg2, "%lf,%lf,%lf,%lf", &x, &y, &w, &h) != 4 ||
+          x < 0.0 || y < 0.0 || w <= 0.0 || h <= 0.0 || x > 1.0 || y > 1.0 || w > 1.0 || h > 1.0)
+         return 0;
+
+      // Make sure we stay within bounds
+      if (x + w > 1.0)
+         w = 1 - x;
+      if (y + h > 1.0)
+         h = 1 - y;
+
+      params->roi.x = x;
+      params->roi.y = y;
+      params->roi.w = w;
+      params->roi.h = h;
+      used = 2;
+      break;
+   }
+
+   case CommandShutterSpeed : // Shutter speed needs single number parameter, 0 = auto
+      if (parse_int(arg2, 0, 6000000, &params->shutter_speed))
+         return 0;
+      used = 2;
+      break;
+
+   case CommandAwbGains :
+   {
+      double r, b;
+      if (sscanf(arg2, "%lf,%lf", &r, &b) != 2 || r < 0.0 || b < 0.0 || r > 8.0 || b > 8.0)
+         return 0;
+      params->awb_gains_r = r;
+      params->awb_gains_b = b;
+      used = 2;
+      break;
+   }
 
+   case CommandDRCLevel:
+      if (map_xref(arg2, drc_mode_map, drc_mode_map_size) == -1)
+         return 0;
+      params->drc_level = drc_mode_from_string(arg2);
+      used = 2;
+      break;
 
+   case CommandStatsPass:
+      params->stats_pass = MMAL_TRUE;
+      used = 1;
+      break;
 
+   case CommandAnnotate:
+   {
+      char dummy;
+      unsigned int bitmask;
+      // If parameter is a number, assume its a bitmask, otherwise a string
+      if (sscanf(arg2, "%u%c", &bitmask, &dummy) == 1)
+      {
+         params->enable_annotate |= bitmask;
+      }
+      else
+      {
+         params->enable_annotate |= ANNOTATE_USER_TEXT;
+         strncpy(params->annotate_string, arg2, MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V2);
+         params->annotate_string[MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V2 - 1] = '\0';
+      }
+      used = 2;
+      break;
+   }
 
+   case CommandAnnotateExtras:
+   {
+      // 3 parameters - text size (6-80), text colour (Hex VVUUYY) and background colour (Hex VVUUYY)
+      unsigned int size, text_colour, bg_colour;
+      int args = sscanf(arg2, "%u,%X,%X", &size, &text_colour, &bg_colour);
+      if (args < 1 || size < 6 || size > 80)
+         return 0;
+      params->annotate_text_size = size;
+      if (args > 1)
+         params->annotate_text_colour = text_colour;
+      if (args > 2)
+         params->annotate_bg_colour = bg_colour;
+      used = 2;
+      break;
+   }
 
+   case CommandStereoMode:
+      if (map_xref(arg2, stereo_mode_map, stereo_mode_map_size) == -1)
+         return 0;
+      params->stereo_mode.mode = stereo_mode_from_string(arg2);
+      used = 2;
+      break;
+
+   case CommandStereoDecimate:
+      params->stereo_mode.decimate = MMAL_TRUE;
+      used = 1;
+      break;
+
+   case CommandStereoSwap:
+      params->stereo_mode.swap_eyes = MMAL_TRUE;
+      used = 1;
+      break;
+   }
 
+   return used;
+}
+
+/**
+ * Display help for command line options
+ */
+void raspicamcontrol_display_help()
+{
+   int i;
+
+   fprintf(stdout, "\nImage parameter commands\n\n");
+
+   for (i = 0; i < cmdline_commands_size; i++)
+   {
+      fprintf(stdout, "-%s, -%s\t: %s\n", cmdline_commands[i].abbrev,
+              cmdline_commands[i].command, cmdline_commands[i].help);
+   }
+
+   fprintf(stdout, "\n\nNotes\n\nExposure mode options :\n%s", exposure_map[0].mode );
+   for (i = 1; i < exposure_map_size; i++)
+      fprintf(stdout, ",%s", exposure_map[i].mode);
+
+   fprintf(stdout, "\n\nAWB mode options :\n%s", awb_map[0].mode );
+   for (i = 1; i < awb_map_size; i++)
+      fprintf(stdout, ",%s", awb_map[i].mode);
+
+   fprintf(stdout, "\n\nImage Effect mode options :\n%s", imagefx_map[0].mode );
+   for (i = 1; i < imagefx_map_size; i++)
+      fprintf(stdout, ",%s", imagefx_map[i].mode);
+
+   fprintf(stdout, "\n\nMetering Mode options :\n%s", metering_mode_map[0].mode );
+   for (i = 1; i < metering_mode_map_size; i++)
+      fprintf(stdout, ",%s", metering_mode_map[i].mode);
+
+   fprintf(stdout, "\n\nDynamic Range Compression (DRC) options :\n%s", drc_mode_map[0].mode );
+   for (i = 1; i < drc_mode_map_size; i++)
+      fprintf(stdout, ",%s", drc_mode_map[i].mode);
+
+   fprintf(stdout, "\n");
+}
 
 /**
  * Dump contents of camera parameter structure to stderr for debugging/verbose logging
@@ -598,6 +901,8 @@ void raspicamcontrol_dump_parameters(const RASPICAM_CAMERA_PARAMETERS *params)
    fprintf(stderr, "Metering Mode '%s', Colour Effect Enabled %s with U = %d, V = %d\n", metering_mode, params->colourEffects.enable ? "Yes":"No", params->colourEffects.u, params->colourEffects.v);
    fprintf(stderr, "Rotation %d, hflip %s, vflip %s\n", params->rotation, params->hflip ? "Yes":"No",params->vflip ? "Yes":"No");
    fprintf(stderr, "ROI x %lf, y %f, w %f h %f\n", params->roi.x, params->roi.y, params->roi.w, params->roi.h);
+   if (params->enable_annotate)
+      fprintf(stderr, "Annotate flags %d, text '%s', size %d\n", params->enable_annotate, params->annotate_string, params->annotate_text_size);
 }
 
 /**
@@ -739,6 +1044,10 @@ int raspicamcontrol_set_all_parameters(MMAL_COMPONENT_T *camera, const RASPICAM_
    result += raspicamcontrol_set_shutter_speed(camera, params->shutter_speed);
    result += raspicamcontrol_set_DRC(camera, params->drc_level);
    result += raspicamcontrol_set_stats_pass(camera, params->stats_pass);
+   result += raspicamcontrol_set_annotate(camera, params->enable_annotate, params->annotate_string,
+                       params->annotate_text_size,
+                       params->annotate_text_colour,
+                       params->annotate_bg_colour);
 
    return result;
 }
@@ -1160,7 +1469,101 @@ int raspicamcontrol_set_stats_pass(MMAL_COMPONENT_T *camera, int stats_pass)
    return mmal_status_to_int(mmal_port_parameter_set_boolean(camera->control, MMAL_PARAMETER_CAPTURE_STATS_PASS, stats_pass));
 }
 
+/**
+ * Set the annotate data, drawn over the frames by the firmware
+ * @param camera Pointer to camera component
+ * @param settings Bitmask of ANNOTATE_*, 0 to disable the annotation
+ * @param string Text for ANNOTATE_USER_TEXT or ANNOTATE_APP_TEXT. With the time or the date,
+ *        a string with '%' is formatted by strftime instead of appending them.
+ * @param text_size Text size (6-80), 0 for the firmware default
+ * @param text_colour Text colour (0xVVUUYY), -1 for the firmware default
+ * @param bg_colour Background colour (0xVVUUYY), -1 for the firmware default
+ *
+ * The time and the date are formatted here, so call this again to update them.
+ *
+ * @return 0 if successful, non-zero if any parameters out of range
+ */
+int raspicamcontrol_set_annotate(MMAL_COMPONENT_T *camera, const int settings, const char *string,
+                                 const int text_size, const int text_colour, const int bg_colour)
+{
+   MMAL_PARAMETER_CAMERA_ANNOTATE_V3_T annotate =
+      {{MMAL_PARAMETER_ANNOTATE, sizeof(MMAL_PARAMETER_CAMERA_ANNOTATE_V3_T)}};
+
+   if (!camera)
+      return 1;
 
+   if (settings)
+   {
+      time_t t = time(NULL);
+      struct tm tm;
+      char tmp[MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3];
+      int process_datetime = 1;
+
+      localtime_r(&t, &tm);
+      annotate.enable = 1;
+
+      if ((settings & (ANNOTATE_APP_TEXT | ANNOTATE_USER_TEXT)) && string)
+      {
+         if ((settings & (ANNOTATE_TIME_TEXT | ANNOTATE_DATE_TEXT)) && strchr(string, '%') != NULL)
+         {
+            // The string has strftime conversions
+            strftime(annotate.text, MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3, string, &tm);
+            process_datetime = 0;
+         }
+         else
+         {
+            strncpy(annotate.text, string, MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3);
+         }
+         annotate.text[MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3 - 1] = '\0';
+      }
+
+      if (process_datetime && (settings & ANNOTATE_TIME_TEXT))
+      {
+         strftime(tmp, 32, strlen(annotate.text) ? " %X" : "%X", &tm);
+         strncat(annotate.text, tmp, MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3 - strlen(annotate.text) - 1);
+      }
+
+      if (process_datetime && (settings & ANNOTATE_DATE_TEXT))
+      {
+         strftime(tmp, 32, strlen(annotate.text) ? " %x" : "%x", &tm);
+         strncat(annotate.text, tmp, MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3 - strlen(annotate.text) - 1);
+      }
+
+      annotate.show_shutter = (settings & ANNOTATE_SHUTTER_SETTINGS) ? MMAL_TRUE : MMAL_FALSE;
+      annotate.show_analog_gain = (settings & ANNOTATE_GAIN_SETTINGS) ? MMAL_TRUE : MMAL_FALSE;
+      annotate.show_lens = (settings & ANNOTATE_LENS_SETTINGS) ? MMAL_TRUE : MMAL_FALSE;
+      annotate.show_caf = (settings & ANNOTATE_CAF_SETTINGS) ? MMAL_TRUE : MMAL_FALSE;
+      annotate.show_motion = (settings & ANNOTATE_MOTION_SETTINGS) ? MMAL_TRUE : MMAL_FALSE;
+      annotate.show_frame_num = (settings & ANNOTATE_FRAME_NUMBER) ? MMAL_TRUE : MMAL_FALSE;
+      annotate.enable_text_background = (settings & ANNOTATE_BLACK_BACKGROUND) ? MMAL_TRUE : MMAL_FALSE;
+
+      annotate.text_size = text_size;
+
+      if (text_colour != -1)
+      {
+         annotate.custom_text_colour = MMAL_TRUE;
+         annotate.custom_text_Y = text_colour & 0xff;
+         annotate.custom_text_U = (text_colour >> 8) & 0xff;
+         annotate.custom_text_V = (text_colour >> 16) & 0xff;
+      }
+      else
+         annotate.custom_text_colour = MMAL_FALSE;
+
+      if (bg_colour != -1)
+      {
+         annotate.custom_background_colour = MMAL_TRUE;
+         annotate.custom_background_Y = bg_colour & 0xff;
+         annotate.custom_background_U = (bg_colour >> 8) & 0xff;
+         annotate.custom_background_V = (bg_colour >> 16) & 0xff;
+      }
+      else
+         annotate.custom_background_colour = MMAL_FALSE;
+   }
+   else
+      annotate.enable = 0;
+
+   return mmal_status_to_int(mmal_port_parameter_set(camera->control, &annotate.hdr));
+}
 
 int raspicamcontrol_set_stereo_mode(MMAL_PORT_T *port, MMAL_PARAMETER_STEREOSCOPIC_MODE_T *stereo_mode)
 {
@@ -1,11 +1,37 @@
 #include "PiFrame.h"
 #include "PiCamera.h"
 #include "PiMjpgServer.h"
+#include "PiSettingsLoader.h"
+#include "PiLog.h"
+#include "PiTrace.h"
 #include <stdio.h>
 #include <signal.h>
 
-int main() {
+int main(int argc, char** argv) {
     PiServerSettings settings;
-    PiMjpgServer srv(settings);
-    return srv.run();
+    PiSettingsLoader loader(settings);
+
+    int status = loader.parseArgs(argc, argv);
+    if (status == PiSettingsLoader::HELP_REQUESTED) {
+        return 0;
+    } else if (status) {
+        fprintf(stderr, "Invalid settings, see %s --help\n", argv[0]);
+        return 1;
+    }
+    loader.dump();
+
+    // Before any thread is created, so that only the trace thread takes SIGUSR2.
+    PiTrace::dumpOnSignal(SIGUSR2, settings.trace_file);
+    PiTrace::enable(settings.trace);
+
+    // The camera and client threads log through the ring from here.
+    PiLog::start(settings.log_sink, settings.log_file);
+
+    int ret;
+    {
+        PiMjpgServer srv(settings);
+        ret = srv.run();
+    }
+    PiLog::stop();
+    return ret;
 }